@@ -16,18 +16,33 @@
 
 #define LOG_TAG "fsverity_init"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <future>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <log/log.h>
 #include <mini_keyctl_utils.h>
 
+#include "key_bundle.h"
+
 bool LoadKeyToKeyring(key_serial_t keyring_id, const char* desc, const char* data, size_t size) {
     key_serial_t key = add_key("asymmetric", desc, data, size, keyring_id);
     if (key < 0) {
@@ -48,36 +63,151 @@ void LoadKeyFromStdin(key_serial_t keyring_id, const char* keyname) {
     }
 }
 
-void LoadKeyFromFile(key_serial_t keyring_id, const char* keyname, const std::string& path) {
-    LOG(INFO) << "LoadKeyFromFile path=" << path << " keyname=" << keyname;
-    std::string content;
-    if (!android::base::ReadFileToString(path, &content)) {
-        LOG(ERROR) << "Failed to read key from " << path;
-        return;
+// A read-only mapping of a whole file.
+class MappedFile {
+  public:
+    static std::unique_ptr<MappedFile> Map(const std::string& path) {
+        android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+            return nullptr;
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            PLOG(ERROR) << "Failed to map " << path;
+            return nullptr;
+        }
+        return std::unique_ptr<MappedFile>(new MappedFile(data, st.st_size));
     }
-    if (!LoadKeyToKeyring(keyring_id, keyname, content.c_str(), content.size())) {
-        LOG(ERROR) << "Failed to load key from " << path;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { munmap(data_, size_); }
+
+    std::string_view contents() const {
+        return std::string_view(static_cast<const char*>(data_), size_);
     }
-}
 
-void LoadKeyFromDirectory(key_serial_t keyring_id, const char* keyname_prefix, const char* dir) {
-    if (!std::filesystem::exists(dir)) {
-        return;
+  private:
+    MappedFile(void* data, size_t size) : data_(data), size_(size) {}
+
+    void* data_;
+    size_t size_;
+};
+
+// Key directories only hold a handful of certificates, so a few readers are enough.
+constexpr size_t kMaxKeyReaders = 4;
+
+// The certificates of a key directory, as read by ReadKeysFromDirectory().
+struct DirectoryKeys {
+    // One per .der file, in the order of their names. Files that could not be read are empty,
+    // but keep their place so that the other keys keep their names.
+    std::vector<std::optional<std::string>> keys;
+    // Holds all the keys instead, if the directory has a bundle.
+    std::unique_ptr<MappedFile> bundle;
+    std::vector<std::string_view> bundle_keys;  // Pointing into |bundle|.
+};
+
+// Reads the keys in |dir|: from its bundle if it has a valid one that matches the number of .der
+// files, otherwise from all of its .der files, which are read by up to kMaxKeyReaders threads
+// and returned in the order of their names.
+DirectoryKeys ReadKeysFromDirectory(const std::string& dir) {
+    DirectoryKeys result;
+    std::error_code ec;
+    if (!std::filesystem::exists(dir, ec)) {
+        return result;
     }
-    int counter = 0;
-    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
         if (!android::base::EndsWithIgnoreCase(entry.path().c_str(), ".der")) continue;
+        paths.push_back(entry.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    // The bundle is built from the .der files next to it, if there are any. If their number
+    // differs, a certificate was added or removed without regenerating the bundle, and the .der
+    // files are the ones to load.
+    std::string bundle_path = dir + "/" + kKeyBundleName;
+    result.bundle = MappedFile::Map(bundle_path);
+    if (result.bundle) {
+        if (!ParseKeyBundle(result.bundle->contents(), &result.bundle_keys)) {
+            LOG(ERROR) << "Malformed key bundle " << bundle_path << ", reading .der files instead";
+        } else if (!paths.empty() && result.bundle_keys.size() != paths.size()) {
+            LOG(WARNING) << "Key bundle " << bundle_path << " has " << result.bundle_keys.size()
+                         << " keys but " << dir << " has " << paths.size()
+                         << " .der files, reading .der files instead";
+        } else {
+            return result;
+        }
+        result.bundle.reset();
+        result.bundle_keys.clear();
+    }
+
+    result.keys.resize(paths.size());
+    std::atomic<size_t> next = 0;
+    auto reader = [&]() {
+        for (size_t i = next++; i < paths.size(); i = next++) {
+            std::string content;
+            if (!android::base::ReadFileToString(paths[i], &content)) {
+                LOG(ERROR) << "Failed to read key from " << paths[i];
+                continue;
+            }
+            result.keys[i] = std::move(content);
+        }
+    };
+    std::vector<std::thread> readers;
+    for (size_t n = 1; n < std::min(paths.size(), kMaxKeyReaders); n++) {
+        readers.emplace_back(reader);
+    }
+    reader();
+    for (auto& thread : readers) {
+        thread.join();
+    }
+    return result;
+}
+
+// Returns the number of keys that were loaded.
+size_t LoadKeysToKeyring(key_serial_t keyring_id, const char* keyname_prefix,
+                         const DirectoryKeys& directory_keys) {
+    std::vector<std::optional<std::string_view>> keys(directory_keys.keys.begin(),
+                                                      directory_keys.keys.end());
+    keys.insert(keys.end(), directory_keys.bundle_keys.begin(), directory_keys.bundle_keys.end());
+    int counter = 0;
+    size_t num_loaded = 0;
+    for (const auto& key : keys) {
         std::string keyname = keyname_prefix + std::to_string(counter);
         counter++;
-        LoadKeyFromFile(keyring_id, keyname.c_str(), entry.path());
+        if (!key) continue;  // Already logged by ReadKeysFromDirectory().
+        if (LoadKeyToKeyring(keyring_id, keyname.c_str(), key->data(), key->size())) {
+            num_loaded++;
+        } else {
+            LOG(ERROR) << "Failed to load key " << keyname;
+        }
     }
+    return num_loaded;
 }
 
 void LoadKeyFromVerifiedPartitions(key_serial_t keyring_id) {
+    auto start = std::chrono::steady_clock::now();
     // NB: Directories need to be synced with FileIntegrityService.java in
     // frameworks/base.
-    LoadKeyFromDirectory(keyring_id, "fsv_system_", "/system/etc/security/fsverity");
-    LoadKeyFromDirectory(keyring_id, "fsv_product_", "/product/etc/security/fsverity");
+    auto system_keys =
+        std::async(std::launch::async, ReadKeysFromDirectory, "/system/etc/security/fsverity");
+    auto product_keys = ReadKeysFromDirectory("/product/etc/security/fsverity");
+    auto system = system_keys.get();
+    auto read_done = std::chrono::steady_clock::now();
+
+    // Keys are added in the same order every boot, so that they get the same names.
+    size_t num_keys = LoadKeysToKeyring(keyring_id, "fsv_system_", system);
+    num_keys += LoadKeysToKeyring(keyring_id, "fsv_product_", product_keys);
+    auto done = std::chrono::steady_clock::now();
+
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    LOG(INFO) << "Loaded " << num_keys << " keys from verified partitions: reading took "
+              << duration_cast<microseconds>(read_done - start).count() << "us, adding took "
+              << duration_cast<microseconds>(done - read_done).count() << "us";
 }
 
 int main(int argc, const char** argv) {
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "key_bundle.h"
+
+#include <endian.h>
+#include <string.h>
+
+namespace {
+
+constexpr size_t kHeaderSize = sizeof(kKeyBundleMagic) + 2 * sizeof(uint32_t);
+constexpr size_t kIndexEntrySize = 2 * sizeof(uint32_t);
+
+void AppendUint32(std::string* out, uint32_t value) {
+    value = htole32(value);
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t ReadUint32(std::string_view data, size_t offset) {
+    uint32_t value;
+    memcpy(&value, data.data() + offset, sizeof(value));
+    return le32toh(value);
+}
+
+}  // namespace
+
+std::string BuildKeyBundle(const std::vector<std::string>& keys) {
+    std::string bundle(kKeyBundleMagic, sizeof(kKeyBundleMagic));
+    AppendUint32(&bundle, kKeyBundleVersion);
+    AppendUint32(&bundle, keys.size());
+    size_t offset = kHeaderSize + keys.size() * kIndexEntrySize;
+    for (const auto& key : keys) {
+        AppendUint32(&bundle, offset);
+        AppendUint32(&bundle, key.size());
+        offset += key.size();
+    }
+    for (const auto& key : keys) {
+        bundle += key;
+    }
+    return bundle;
+}
+
+bool ParseKeyBundle(std::string_view bundle, std::vector<std::string_view>* keys) {
+    if (bundle.size() < kHeaderSize ||
+        memcmp(bundle.data(), kKeyBundleMagic, sizeof(kKeyBundleMagic)) != 0 ||
+        ReadUint32(bundle, sizeof(kKeyBundleMagic)) != kKeyBundleVersion) {
+        return false;
+    }
+    uint64_t num_keys = ReadUint32(bundle, sizeof(kKeyBundleMagic) + sizeof(uint32_t));
+    if (num_keys > (bundle.size() - kHeaderSize) / kIndexEntrySize) {
+        return false;
+    }
+    keys->clear();
+    keys->reserve(num_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+        uint64_t offset = ReadUint32(bundle, kHeaderSize + i * kIndexEntrySize);
+        uint64_t size = ReadUint32(bundle, kHeaderSize + i * kIndexEntrySize + sizeof(uint32_t));
+        if (size == 0 || offset + size > bundle.size()) {
+            return false;
+        }
+        keys->push_back(bundle.substr(offset, size));
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A key bundle holds all the fs-verity certificates of a partition in one file, so that they
+// can be loaded with a single mmap instead of reading one file per certificate. It is
+// generated at build time by fsverity_key_bundle, and laid out as (all integers little
+// endian):
+//
+//   char     magic[8];     // kKeyBundleMagic
+//   uint32_t version;      // kKeyBundleVersion
+//   uint32_t num_keys;
+//   struct {
+//       uint32_t offset;   // From the start of the file.
+//       uint32_t size;
+//   } index[num_keys];
+//   uint8_t  keys[];       // The DER encoded certificates, in index order.
+
+// Name of the bundle in a key directory.
+constexpr const char* kKeyBundleName = "fsverity_keys.bundle";
+
+constexpr char kKeyBundleMagic[8] = {'F', 'S', 'V', 'K', 'B', 'N', 'D', 'L'};
+constexpr uint32_t kKeyBundleVersion = 1;
+
+// Returns the bundle holding |keys|, in that order.
+std::string BuildKeyBundle(const std::vector<std::string>& keys);
+
+// Sets |keys| to the certificates in |bundle|, pointing into it. Returns false if |bundle| is
+// malformed.
+bool ParseKeyBundle(std::string_view bundle, std::vector<std::string_view>* keys);
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Builds the key bundle that fsverity_init --load-verified-keys loads for a partition:
+//
+//   fsverity_key_bundle <output> <certificate.der>...
+//
+// The certificates are put in the bundle in the order given.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+
+#include "key_bundle.h"
+
+int main(int argc, const char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <output> <certificate.der>..." << std::endl;
+        return 1;
+    }
+    std::vector<std::string> keys;
+    for (int i = 2; i < argc; i++) {
+        std::string key;
+        if (!android::base::ReadFileToString(argv[i], &key)) {
+            std::cerr << "Failed to read " << argv[i] << std::endl;
+            return 1;
+        }
+        if (key.empty()) {
+            std::cerr << argv[i] << " is empty" << std::endl;
+            return 1;
+        }
+        keys.push_back(std::move(key));
+    }
+    if (!android::base::WriteStringToFile(BuildKeyBundle(keys), argv[1])) {
+        std::cerr << "Failed to write " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "credstore"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <android-base/logging.h>
+
+#include <openssl/sha.h>
+
+#include <android/hardware/identity/support/IdentityCredentialSupport.h>
+
+#include "CertificateStore.h"
+#include "Util.h"
+
+namespace android {
+namespace security {
+namespace identity {
+
+namespace {
+
+vector<uint8_t> sha256(const vector<uint8_t>& data) {
+    vector<uint8_t> hash(SHA256_DIGEST_LENGTH);
+    SHA256(data.data(), data.size(), hash.data());
+    return hash;
+}
+
+}  // namespace
+
+std::shared_ptr<CertificateStore> CertificateStore::get(const string& dataPath) {
+    static std::mutex* storesMutex = new std::mutex();
+    static map<string, std::shared_ptr<CertificateStore>>* stores =
+        new map<string, std::shared_ptr<CertificateStore>>();
+
+    std::lock_guard<std::mutex> lock(*storesMutex);
+    std::shared_ptr<CertificateStore>& store = (*stores)[dataPath];
+    if (store == nullptr) {
+        store = std::make_shared<CertificateStore>(dataPath);
+    }
+    return store;
+}
+
+CertificateStore::CertificateStore(const string& dataPath) : certsPath_(dataPath + "/certs") {}
+
+string CertificateStore::fileNameForHash_(const vector<uint8_t>& hash) const {
+    return certsPath_ + "/" + android::hardware::identity::support::encodeHex(hash);
+}
+
+optional<vector<uint8_t>> CertificateStore::add(const vector<uint8_t>& certificate) {
+    vector<uint8_t> hash = sha256(certificate);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (certificates_.count(hash) != 0) {
+        return hash;
+    }
+
+    // The directory is made the first time a certificate is added. Its own entry in the data
+    // path is synced along with the credential file which refers to the certificate.
+    string fileName = fileNameForHash_(hash);
+    struct stat statbuf;
+    if (stat(fileName.c_str(), &statbuf) != 0) {
+        if (mkdir(certsPath_.c_str(), 0700) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Error creating " << certsPath_;
+            return {};
+        }
+        if (!fileSetContents(fileName, certificate) || !fileSyncDirectory(fileName)) {
+            LOG(ERROR) << "Error writing " << fileName;
+            return {};
+        }
+    }
+    certificates_[hash] = std::make_shared<const vector<uint8_t>>(certificate);
+    return hash;
+}
+
+std::shared_ptr<const vector<uint8_t>> CertificateStore::find(const vector<uint8_t>& hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = certificates_.find(hash);
+    if (iter != certificates_.end()) {
+        return iter->second;
+    }
+
+    string fileName = fileNameForHash_(hash);
+    optional<vector<uint8_t>> certificate = fileGetContents(fileName);
+    if (!certificate) {
+        LOG(ERROR) << "Error reading " << fileName;
+        return nullptr;
+    }
+    if (sha256(certificate.value()) != hash) {
+        LOG(ERROR) << "The contents of " << fileName << " do not match its name";
+        return nullptr;
+    }
+    auto shared = std::make_shared<const vector<uint8_t>>(std::move(certificate.value()));
+    certificates_[hash] = shared;
+    return shared;
+}
+
+}  // namespace identity
+}  // namespace security
+}  // namespace android
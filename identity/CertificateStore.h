@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_SECURITY_IDENTITY_CERTIFICATE_STORE_H_
+#define SYSTEM_SECURITY_IDENTITY_CERTIFICATE_STORE_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace security {
+namespace identity {
+
+using ::std::map;
+using ::std::optional;
+using ::std::string;
+using ::std::vector;
+
+// A content-addressed store for the certificates of attestation chains. The intermediate and
+// root certificates are the same for every credential on a device, so credential files refer
+// to them by their SHA-256 instead of holding a copy each. Every certificate is a file in the
+// "certs" directory below the data path, named by the hex encoded hash, and is kept in memory
+// once it has been read or written, so each one is loaded at most once per process, and the
+// loaded credentials hold handles to that copy.
+//
+// This is a one-way change of the credential file format. Older builds do not know about the
+// store and would see only the credential's own certificate, so downgrading is not supported.
+//
+// Certificates are never removed: there are only a few distinct ones, and a credential which
+// is saved concurrently with the removal could otherwise lose one it refers to.
+//
+class CertificateStore {
+  public:
+    // Returns the store for the given data path. Safe to call from any thread.
+    static std::shared_ptr<CertificateStore> get(const string& dataPath);
+
+    explicit CertificateStore(const string& dataPath);
+
+    // Adds |certificate| to the store unless it is there already, and returns its hash. The
+    // file of a new certificate is synced before this returns, so credential files written
+    // afterwards can refer to it.
+    //
+    // Returns nothing on error.
+    //
+    optional<vector<uint8_t>> add(const vector<uint8_t>& certificate);
+
+    // Returns the certificate with the given hash, or nullptr if it is not in the store or
+    // its file is damaged.
+    //
+    std::shared_ptr<const vector<uint8_t>> find(const vector<uint8_t>& hash);
+
+  private:
+    string fileNameForHash_(const vector<uint8_t>& hash) const;
+
+    string certsPath_;
+
+    std::mutex mutex_;
+    map<vector<uint8_t>, std::shared_ptr<const vector<uint8_t>>> certificates_;
+};
+
+}  // namespace identity
+}  // namespace security
+}  // namespace android
+
+#endif  // SYSTEM_SECURITY_IDENTITY_CERTIFICATE_STORE_H_
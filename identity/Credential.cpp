@@ -17,6 +17,7 @@
 #define LOG_TAG "credstore"
 
 #include <android-base/logging.h>
+#include <android/binder_ibinder.h>
 #include <android/binder_manager.h>
 #include <android/hardware/identity/support/IdentityCredentialSupport.h>
 
@@ -28,7 +29,14 @@
 
 #include <cppbor.h>
 #include <cppbor_parse.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <tuple>
 
 #include <aidl/android/hardware/security/keymint/HardwareAuthToken.h>
@@ -38,6 +46,7 @@
 
 #include "Credential.h"
 #include "CredentialData.h"
+#include "PresentationStats.h"
 #include "Util.h"
 #include "WritableCredential.h"
 
@@ -67,15 +76,234 @@ using ::aidl::android::hardware::security::secureclock::TimeStampToken;
 using ::aidl::android::security::authorization::AuthorizationTokens;
 using ::aidl::android::security::authorization::IKeystoreAuthorization;
 
+namespace {
+
+// HAL credential binders which were instantiated but never used, for example because the
+// application only looked at the certificate chain or the usage counts, are kept here and handed
+// to the next Credential for the same credential. A binder which was used for anything may
+// carry presentation state and is never reused; the HAL has no way to reset it.
+constexpr size_t kMaxIdleHalBinders = 4;
+
+// How often a HAL credential binder is taken from the pool and how often one has to be
+// instantiated by the TA, which decrypts and validates the credential data again.
+std::atomic<uint64_t> halBinderReuses;
+std::atomic<uint64_t> halBinderInstantiations;
+constexpr uint64_t kHalBinderStatsInterval = 64;
+
+struct IdleHalBinder {
+    uid_t callingUid;
+    string credentialName;
+    CipherSuite cipherSuite;
+    vector<uint8_t> credentialData;
+    sp<IIdentityCredential> halBinder;
+};
+
+std::mutex& idleHalBindersMutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+}
+
+std::list<IdleHalBinder>& idleHalBinders() {
+    static std::list<IdleHalBinder>* binders = new std::list<IdleHalBinder>();
+    return *binders;
+}
+
+sp<IIdentityCredential> takeIdleHalBinder(uid_t callingUid, const string& credentialName,
+                                          CipherSuite cipherSuite,
+                                          const vector<uint8_t>& credentialData) {
+    std::lock_guard<std::mutex> lock(idleHalBindersMutex());
+    auto& binders = idleHalBinders();
+    for (auto iter = binders.begin(); iter != binders.end(); iter++) {
+        if (iter->callingUid == callingUid && iter->credentialName == credentialName &&
+            iter->cipherSuite == cipherSuite) {
+            // A binder for older credential data, from before an update, is of no use.
+            sp<IIdentityCredential> halBinder;
+            if (iter->credentialData == credentialData) {
+                halBinder = std::move(iter->halBinder);
+            }
+            binders.erase(iter);
+            return halBinder;
+        }
+    }
+    return nullptr;
+}
+
+void putIdleHalBinder(IdleHalBinder idle) {
+    std::lock_guard<std::mutex> lock(idleHalBindersMutex());
+    auto& binders = idleHalBinders();
+    if (binders.size() >= kMaxIdleHalBinders) {
+        binders.pop_front();
+    }
+    binders.push_back(std::move(idle));
+}
+
+// HAL credential binders on which an ephemeral key pair has already been created, together
+// with that key pair in the PKCS#12 form createEphemeralKeyPair() returns. The HAL only
+// remembers the last key pair created on a binder, so a pre-generated key pair is of use only
+// together with its binder, which then replaces the unused binder of a Credential. Each entry
+// is handed out once. The pool is refilled in the background and is off unless
+// setEphemeralKeysPerCredential() is called.
+constexpr size_t kMaxKeyedHalBinders = 8;
+
+size_t ephemeralKeysPerCredential = 0;
+
+struct KeyedHalBinder {
+    uid_t callingUid;
+    string credentialName;
+    CipherSuite cipherSuite;
+    vector<uint8_t> credentialData;
+    sp<IIdentityCredential> halBinder;
+    vector<uint8_t> pkcs12;
+};
+
+using KeyedHalBinderOwner = tuple<uid_t, string, CipherSuite>;
+
+std::mutex& keyedHalBindersMutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+}
+
+std::list<KeyedHalBinder>& keyedHalBinders() {
+    static std::list<KeyedHalBinder>* binders = new std::list<KeyedHalBinder>();
+    return *binders;
+}
+
+// Number of key pairs being generated in the background for each credential.
+std::map<KeyedHalBinderOwner, size_t>& pendingKeyedHalBinders() {
+    static std::map<KeyedHalBinderOwner, size_t>* pending =
+        new std::map<KeyedHalBinderOwner, size_t>();
+    return *pending;
+}
+
+optional<vector<uint8_t>> ephemeralKeyPairToPkcs12(const vector<uint8_t>& keyPair) {
+    return ecKeyPairGetPkcs12(keyPair,
+                              "ephemeralKey",   // Alias for key
+                              "0",              // Serial, as a decimal number
+                              "Credstore",      // Issuer
+                              "Ephemeral Key",  // Subject
+                              0,                // Validity Not Before
+                              24 * 60 * 60);    // Validity Not After
+}
+
+optional<KeyedHalBinder> takeKeyedHalBinder(uid_t callingUid, const string& credentialName,
+                                            CipherSuite cipherSuite,
+                                            const vector<uint8_t>& credentialData) {
+    std::lock_guard<std::mutex> lock(keyedHalBindersMutex());
+    auto& binders = keyedHalBinders();
+    optional<KeyedHalBinder> keyed;
+    for (auto iter = binders.begin(); iter != binders.end();) {
+        if (iter->callingUid != callingUid || iter->credentialName != credentialName ||
+            iter->cipherSuite != cipherSuite) {
+            iter++;
+            continue;
+        }
+        // Binders for older credential data, from before an update, are of no use.
+        if (iter->credentialData != credentialData) {
+            iter = binders.erase(iter);
+        } else if (!keyed) {
+            keyed = std::move(*iter);
+            iter = binders.erase(iter);
+        } else {
+            iter++;
+        }
+    }
+    return keyed;
+}
+
+// Starts generating key pairs in the background until there are |ephemeralKeysPerCredential|
+// for the credential.
+void refillKeyedHalBinders(uid_t callingUid, const string& credentialName,
+                           CipherSuite cipherSuite, const vector<uint8_t>& credentialData,
+                           const sp<IIdentityCredentialStore>& halStoreBinder) {
+    KeyedHalBinderOwner owner(callingUid, credentialName, cipherSuite);
+    size_t missing;
+    {
+        std::lock_guard<std::mutex> lock(keyedHalBindersMutex());
+        auto pending = pendingKeyedHalBinders().find(owner);
+        size_t have = pending != pendingKeyedHalBinders().end() ? pending->second : 0;
+        for (const KeyedHalBinder& keyed : keyedHalBinders()) {
+            if (keyed.callingUid == callingUid && keyed.credentialName == credentialName &&
+                keyed.cipherSuite == cipherSuite) {
+                have++;
+            }
+        }
+        missing = have < ephemeralKeysPerCredential ? ephemeralKeysPerCredential - have : 0;
+        // Only owners with generation in progress have an entry, the last thread to finish
+        // erases it.
+        if (missing > 0) {
+            pendingKeyedHalBinders()[owner] += missing;
+        }
+    }
+
+    for (size_t n = 0; n < missing; n++) {
+        std::thread([owner, credentialData, halStoreBinder] {
+            auto [callingUid, credentialName, cipherSuite] = owner;
+            optional<KeyedHalBinder> keyed;
+            {
+                InFlightHalCall halCall;
+                sp<IIdentityCredential> halBinder;
+                vector<uint8_t> keyPair;
+                Status status =
+                    halStoreBinder->getCredential(cipherSuite, credentialData, &halBinder);
+                if (status.isOk()) {
+                    status = halBinder->createEphemeralKeyPair(&keyPair);
+                }
+                optional<vector<uint8_t>> pkcs12Bytes;
+                if (status.isOk()) {
+                    pkcs12Bytes = ephemeralKeyPairToPkcs12(keyPair);
+                }
+                if (pkcs12Bytes) {
+                    keyed = KeyedHalBinder{callingUid, credentialName, cipherSuite,
+                                           credentialData, halBinder, pkcs12Bytes.value()};
+                } else {
+                    LOG(WARNING) << "Error pre-generating ephemeral key pair: "
+                                 << status.exceptionMessage();
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(keyedHalBindersMutex());
+            auto pending = pendingKeyedHalBinders().find(owner);
+            if (--pending->second == 0) {
+                pendingKeyedHalBinders().erase(pending);
+            }
+            if (keyed) {
+                auto& binders = keyedHalBinders();
+                if (binders.size() >= kMaxKeyedHalBinders) {
+                    binders.pop_front();
+                }
+                binders.push_back(std::move(*keyed));
+            }
+        }).detach();
+    }
+}
+
+}  // namespace
+
+void setEphemeralKeysPerCredential(size_t count) {
+    std::lock_guard<std::mutex> lock(keyedHalBindersMutex());
+    ephemeralKeysPerCredential = count;
+}
+
 Credential::Credential(CipherSuite cipherSuite, const std::string& dataPath,
                        const std::string& credentialName, uid_t callingUid,
                        HardwareInformation hwInfo, sp<IIdentityCredentialStore> halStoreBinder,
                        int halApiVersion)
     : cipherSuite_(cipherSuite), dataPath_(dataPath), credentialName_(credentialName),
       callingUid_(callingUid), hwInfo_(std::move(hwInfo)), halStoreBinder_(halStoreBinder),
-      halApiVersion_(halApiVersion) {}
+      halApiVersion_(halApiVersion),
+      mutex_(CredentialData::getCredentialMutex(dataPath, callingUid, credentialName)) {}
+
+Credential::~Credential() {
+    if (halBinder_ != nullptr && !halBinderUsed_) {
+        putIdleHalBinder({callingUid_, credentialName_, cipherSuite_,
+                          std::move(halBinderCredentialData_), std::move(halBinder_)});
+    }
+}
 
-Credential::~Credential() {}
+const sp<IIdentityCredential>& Credential::useHalBinder() {
+    halBinderUsed_ = true;
+    return halBinder_;
+}
 
 Status Credential::ensureOrReplaceHalBinder() {
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
@@ -85,7 +313,21 @@ Status Credential::ensureOrReplaceHalBinder() {
                                                 "Error loading data for credential");
     }
 
-    sp<IIdentityCredential> halBinder;
+    sp<IIdentityCredential> halBinder = takeIdleHalBinder(
+        callingUid_, credentialName_, cipherSuite_, data->getCredentialData());
+    if (halBinder != nullptr) {
+        halBinderReuses++;
+        halBinder_ = halBinder;
+        halBinderCredentialData_ = data->getCredentialData();
+        halBinderUsed_ = false;
+        return Status::ok();
+    }
+
+    uint64_t instantiations = ++halBinderInstantiations;
+    if (instantiations % kHalBinderStatsInterval == 0) {
+        LOG(INFO) << "HAL credential binders: " << instantiations << " instantiated, "
+                  << halBinderReuses << " reused";
+    }
     Status status =
         halStoreBinder_->getCredential(cipherSuite_, data->getCredentialData(), &halBinder);
     if (!status.isOk() && status.exceptionCode() == binder::Status::EX_SERVICE_SPECIFIC) {
@@ -99,11 +341,15 @@ Status Credential::ensureOrReplaceHalBinder() {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC);
     }
     halBinder_ = halBinder;
+    halBinderCredentialData_ = data->getCredentialData();
+    halBinderUsed_ = false;
 
     return Status::ok();
 }
 
 Status Credential::getCredentialKeyCertificateChain(std::vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -117,6 +363,9 @@ Status Credential::getCredentialKeyCertificateChain(std::vector<uint8_t>* _aidl_
 // Returns operation handle
 Status Credential::selectAuthKey(bool allowUsingExhaustedKeys, bool allowUsingExpiredKeys,
                                  int64_t* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -148,7 +397,7 @@ bool Credential::ensureChallenge() {
     }
 
     int64_t challenge;
-    Status status = halBinder_->createAuthChallenge(&challenge);
+    Status status = useHalBinder()->createAuthChallenge(&challenge);
     if (!status.isOk()) {
         LOG(ERROR) << "Error getting challenge: " << status.exceptionMessage();
         return false;
@@ -162,6 +411,54 @@ bool Credential::ensureChallenge() {
     return true;
 }
 
+namespace {
+
+// The connection to keystore2's authorization service is kept from one presentation to the
+// next and dropped when keystore2 dies or a call on it fails.
+std::mutex& authorizationServiceMutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+}
+
+std::shared_ptr<IKeystoreAuthorization>& cachedAuthorizationService() {
+    static std::shared_ptr<IKeystoreAuthorization>* service =
+        new std::shared_ptr<IKeystoreAuthorization>();
+    return *service;
+}
+
+void dropAuthorizationService() {
+    std::lock_guard<std::mutex> lock(authorizationServiceMutex());
+    cachedAuthorizationService().reset();
+}
+
+void onAuthorizationServiceDied(void* /* cookie */) {
+    dropAuthorizationService();
+}
+
+std::shared_ptr<IKeystoreAuthorization> getAuthorizationService() {
+    std::lock_guard<std::mutex> lock(authorizationServiceMutex());
+    std::shared_ptr<IKeystoreAuthorization>& service = cachedAuthorizationService();
+    if (service) {
+        return service;
+    }
+    ::ndk::SpAIBinder binder(AServiceManager_checkService("android.security.authorization"));
+    std::shared_ptr<IKeystoreAuthorization> newService = IKeystoreAuthorization::fromBinder(binder);
+    if (!newService) {
+        return nullptr;
+    }
+    static AIBinder_DeathRecipient* deathRecipient =
+        AIBinder_DeathRecipient_new(onAuthorizationServiceDied);
+    if (AIBinder_linkToDeath(binder.get(), deathRecipient, nullptr) != STATUS_OK) {
+        // Without a death notification we can't tell when the connection goes stale.
+        LOG(WARNING) << "Error linking to death of IKeystoreAuthorization service";
+        return newService;
+    }
+    service = newService;
+    return service;
+}
+
+}  // namespace
+
 // Returns false if an error occurred communicating with keystore.
 //
 bool getTokensFromKeystore2(uint64_t challenge, uint64_t secureUserId,
@@ -169,9 +466,7 @@ bool getTokensFromKeystore2(uint64_t challenge, uint64_t secureUserId,
                             AidlHardwareAuthToken& aidlAuthToken,
                             AidlVerificationToken& aidlVerificationToken) {
     // try to connect to IKeystoreAuthorization AIDL service first.
-    AIBinder* authzAIBinder = AServiceManager_checkService("android.security.authorization");
-    ::ndk::SpAIBinder authzBinder(authzAIBinder);
-    auto authzService = IKeystoreAuthorization::fromBinder(authzBinder);
+    auto authzService = getAuthorizationService();
     if (authzService) {
         AuthorizationTokens authzTokens;
         auto result = authzService->getAuthTokensForCredStore(challenge, secureUserId,
@@ -201,6 +496,7 @@ bool getTokensFromKeystore2(uint64_t challenge, uint64_t secureUserId,
                 // Here we differentiate the errors occurred during communication
                 // from the service specific errors.
                 LOG(ERROR) << "Error getting tokens from keystore2: " << result.getDescription();
+                dropAuthorizationService();
                 return false;
             } else {
                 // Log the reason for not receiving auth tokens from keystore2.
@@ -219,10 +515,23 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
                               const vector<uint8_t>& sessionTranscript,
                               const vector<uint8_t>& readerSignature, bool allowUsingExhaustedKeys,
                               bool allowUsingExpiredKeys, GetEntriesResultParcel* _aidl_return) {
+    ScopedPresentationStep totalStep(PresentationStep::TOTAL);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    optional<InFlightHalCall> halCall;
+    {
+        ScopedPresentationStep step(PresentationStep::WAIT_FOR_HAL);
+        halCall.emplace();
+    }
+
     GetEntriesResultParcel ret;
 
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
-    if (!data->loadFromDisk()) {
+    bool loaded;
+    {
+        ScopedPresentationStep step(PresentationStep::LOAD_FROM_DISK);
+        loaded = data->loadFromDisk();
+    }
+    if (!loaded) {
         LOG(ERROR) << "Error loading data for credential";
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Error loading data for credential");
@@ -253,13 +562,10 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
     for (const RequestNamespaceParcel& rns : requestNamespaces) {
         size_t numEntriesInNsToRequest = 0;
         for (const RequestEntryParcel& rep : rns.entries) {
-            if (data->hasEntryData(rns.namespaceName, rep.name)) {
+            const EntryData* eData = data->findEntryData(rns.namespaceName, rep.name);
+            if (eData != nullptr) {
                 numEntriesInNsToRequest++;
-            }
-
-            optional<EntryData> eData = data->getEntryData(rns.namespaceName, rep.name);
-            if (eData) {
-                for (int32_t id : eData.value().accessControlProfileIds) {
+                for (int32_t id : eData->accessControlProfileIds) {
                     if (id < 0 || id >= 32) {
                         LOG(ERROR) << "Invalid accessControlProfileId " << id << " for "
                                    << rns.namespaceName << ": " << rep.name;
@@ -323,11 +629,20 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
     aidlVerificationToken.timestamp.milliSeconds = 0;
     aidlVerificationToken.securityLevel = ::android::hardware::keymaster::SecurityLevel::SOFTWARE;
     aidlVerificationToken.mac.clear();
+    // The tokens are only needed for startRetrieval(), so they are fetched from keystore2 while
+    // the rest of the request is prepared. Declared after the tokens, so that returning early
+    // waits for the fetch before the tokens go away.
+    std::future<bool> tokensFetched;
     if (userAuthNeeded) {
         // If user authentication is needed, always get a challenge from the
         // HAL/TA since it'll need it to check the returned VerificationToken
         // for freshness.
-        if (!ensureChallenge()) {
+        bool haveChallenge;
+        {
+            ScopedPresentationStep step(PresentationStep::ENSURE_CHALLENGE);
+            haveChallenge = ensureChallenge();
+        }
+        if (!haveChallenge) {
             return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                     "Error getting challenge (bug in HAL or TA)");
         }
@@ -346,12 +661,14 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
         // not a guarantee and it's also not required.
         //
 
-        if (!getTokensFromKeystore2(selectedChallenge_, data->getSecureUserId(),
-                                    authTokenMaxAgeMillis, aidlAuthToken, aidlVerificationToken)) {
-            LOG(ERROR) << "Error getting tokens from keystore2";
-            return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
-                                                    "Error getting tokens from keystore2");
-        }
+        tokensFetched = std::async(
+            std::launch::async,
+            [&aidlAuthToken, &aidlVerificationToken, challenge = selectedChallenge_,
+             secureUserId = data->getSecureUserId(), authTokenMaxAgeMillis] {
+                ScopedPresentationStep step(PresentationStep::GET_TOKENS_FROM_KEYSTORE2);
+                return getTokensFromKeystore2(challenge, secureUserId, authTokenMaxAgeMillis,
+                                              aidlAuthToken, aidlVerificationToken);
+            });
     }
 
     // Note that the selectAuthKey() method is only called if a CryptoObject is involved at
@@ -390,12 +707,12 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
         RequestNamespace ns;
         ns.namespaceName = rns.namespaceName;
         for (const RequestEntryParcel& rep : rns.entries) {
-            optional<EntryData> entryData = data->getEntryData(rns.namespaceName, rep.name);
-            if (entryData) {
+            const EntryData* entryData = data->findEntryData(rns.namespaceName, rep.name);
+            if (entryData != nullptr) {
                 RequestDataItem di;
                 di.name = rep.name;
-                di.size = entryData.value().size;
-                di.accessControlProfileIds = entryData.value().accessControlProfileIds;
+                di.size = entryData->size;
+                di.accessControlProfileIds = entryData->accessControlProfileIds;
                 ns.items.push_back(di);
             }
         }
@@ -405,22 +722,43 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
     }
     // This is not catastrophic, we might be dealing with a version 1 implementation which
     // doesn't have this method.
-    Status status = halBinder_->setRequestedNamespaces(halRequestNamespaces);
+    Status status;
+    {
+        ScopedPresentationStep step(PresentationStep::SET_REQUESTED_NAMESPACES);
+        status = useHalBinder()->setRequestedNamespaces(halRequestNamespaces);
+    }
     if (!status.isOk()) {
         LOG(INFO) << "Failed setting expected requested namespaces, assuming V1 HAL "
                   << "and continuing";
     }
 
+    bool tokensOk = true;
+    if (tokensFetched.valid()) {
+        ScopedPresentationStep step(PresentationStep::WAIT_FOR_TOKENS);
+        tokensOk = tokensFetched.get();
+    }
+    if (!tokensOk) {
+        LOG(ERROR) << "Error getting tokens from keystore2";
+        return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                "Error getting tokens from keystore2");
+    }
+
     // Pass the verification token. Failure is OK, this method isn't in the V1 HAL.
-    status = halBinder_->setVerificationToken(aidlVerificationToken);
+    {
+        ScopedPresentationStep step(PresentationStep::SET_VERIFICATION_TOKEN);
+        status = useHalBinder()->setVerificationToken(aidlVerificationToken);
+    }
     if (!status.isOk()) {
         LOG(INFO) << "Failed setting verification token, assuming V1 HAL "
                   << "and continuing";
     }
 
-    status =
-        halBinder_->startRetrieval(selectedProfiles, aidlAuthToken, requestMessage, signingKeyBlob,
-                                   sessionTranscript, readerSignature, requestCounts);
+    {
+        ScopedPresentationStep step(PresentationStep::START_RETRIEVAL);
+        status = useHalBinder()->startRetrieval(selectedProfiles, aidlAuthToken, requestMessage,
+                                                signingKeyBlob, sessionTranscript,
+                                                readerSignature, requestCounts);
+    }
     if (!status.isOk() && status.exceptionCode() == binder::Status::EX_SERVICE_SPECIFIC) {
         int code = status.serviceSpecificErrorCode();
         if (code == IIdentityCredentialStore::STATUS_EPHEMERAL_PUBLIC_KEY_NOT_FOUND) {
@@ -437,6 +775,9 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
         return halStatusToGenericError(status);
     }
 
+    // The entry steps are recorded once per presentation, for all entries together.
+    std::chrono::nanoseconds startRetrieveEntryValueTime(0);
+    std::chrono::nanoseconds retrieveEntryValueTime(0);
     for (const RequestNamespaceParcel& rns : requestNamespaces) {
         ResultNamespaceParcel resultNamespaceParcel;
         resultNamespaceParcel.namespaceName = rns.namespaceName;
@@ -445,16 +786,19 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
             ResultEntryParcel resultEntryParcel;
             resultEntryParcel.name = rep.name;
 
-            optional<EntryData> eData = data->getEntryData(rns.namespaceName, rep.name);
-            if (!eData) {
+            const EntryData* eData = data->findEntryData(rns.namespaceName, rep.name);
+            if (eData == nullptr) {
                 resultEntryParcel.status = STATUS_NO_SUCH_ENTRY;
                 resultNamespaceParcel.entries.push_back(resultEntryParcel);
                 continue;
             }
 
-            status =
-                halBinder_->startRetrieveEntryValue(rns.namespaceName, rep.name, eData.value().size,
-                                                    eData.value().accessControlProfileIds);
+            {
+                ScopedPresentationStep step(PresentationStep::START_RETRIEVE_ENTRY_VALUE,
+                                            &startRetrieveEntryValueTime);
+                status = useHalBinder()->startRetrieveEntryValue(
+                    rns.namespaceName, rep.name, eData->size, eData->accessControlProfileIds);
+            }
             if (!status.isOk() && status.exceptionCode() == binder::Status::EX_SERVICE_SPECIFIC) {
                 int code = status.serviceSpecificErrorCode();
                 if (code == IIdentityCredentialStore::STATUS_USER_AUTHENTICATION_FAILED) {
@@ -479,10 +823,18 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
                 return halStatusToGenericError(status);
             }
 
-            vector<uint8_t> value;
-            for (const auto& encryptedChunk : eData.value().encryptedChunks) {
-                vector<uint8_t> chunk;
-                status = halBinder_->retrieveEntryValue(encryptedChunk, &chunk);
+            // The HAL decrypts one chunk per call, at every API version, so the best we can do
+            // is to collect the chunks into a value which already has the final size.
+            vector<uint8_t>& value = resultEntryParcel.value;
+            value.reserve(eData->size);
+            vector<uint8_t> chunk;
+            for (const auto& encryptedChunk : eData->encryptedChunks) {
+                chunk.clear();
+                {
+                    ScopedPresentationStep step(PresentationStep::RETRIEVE_ENTRY_VALUE,
+                                                &retrieveEntryValueTime);
+                    status = useHalBinder()->retrieveEntryValue(encryptedChunk, &chunk);
+                }
                 if (!status.isOk()) {
                     return halStatusToGenericError(status);
                 }
@@ -490,13 +842,18 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
             }
 
             resultEntryParcel.status = STATUS_OK;
-            resultEntryParcel.value = value;
-            resultNamespaceParcel.entries.push_back(resultEntryParcel);
+            resultNamespaceParcel.entries.push_back(std::move(resultEntryParcel));
         }
-        ret.resultNamespaces.push_back(resultNamespaceParcel);
+        ret.resultNamespaces.push_back(std::move(resultNamespaceParcel));
     }
+    recordPresentationStep(PresentationStep::START_RETRIEVE_ENTRY_VALUE,
+                           startRetrieveEntryValueTime);
+    recordPresentationStep(PresentationStep::RETRIEVE_ENTRY_VALUE, retrieveEntryValueTime);
 
-    status = halBinder_->finishRetrieval(&ret.mac, &ret.deviceNameSpaces);
+    {
+        ScopedPresentationStep step(PresentationStep::FINISH_RETRIEVAL);
+        status = useHalBinder()->finishRetrieval(&ret.mac, &ret.deviceNameSpaces);
+    }
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -506,7 +863,8 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
 
     // Ensure useCount is updated on disk.
     if (authKey != nullptr) {
-        if (!data->saveToDisk()) {
+        ScopedPresentationStep step(PresentationStep::SAVE_TO_DISK);
+        if (!data->saveAuthKeyUseCount(authKey)) {
             return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                     "Error saving data");
         }
@@ -517,6 +875,9 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
 }
 
 Status Credential::deleteCredential(vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     vector<uint8_t> proofOfDeletionSignature;
 
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
@@ -526,7 +887,7 @@ Status Credential::deleteCredential(vector<uint8_t>* _aidl_return) {
                                                 "Error loading data for credential");
     }
 
-    Status status = halBinder_->deleteCredential(&proofOfDeletionSignature);
+    Status status = useHalBinder()->deleteCredential(&proofOfDeletionSignature);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -540,6 +901,9 @@ Status Credential::deleteCredential(vector<uint8_t>* _aidl_return) {
 
 Status Credential::deleteWithChallenge(const vector<uint8_t>& challenge,
                                        vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     if (halApiVersion_ < 3) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_NOT_SUPPORTED,
                                                 "Not implemented by HAL");
@@ -553,7 +917,8 @@ Status Credential::deleteWithChallenge(const vector<uint8_t>& challenge,
                                                 "Error loading data for credential");
     }
 
-    Status status = halBinder_->deleteCredentialWithChallenge(challenge, &proofOfDeletionSignature);
+    Status status =
+        useHalBinder()->deleteCredentialWithChallenge(challenge, &proofOfDeletionSignature);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -566,12 +931,15 @@ Status Credential::deleteWithChallenge(const vector<uint8_t>& challenge,
 }
 
 Status Credential::proveOwnership(const vector<uint8_t>& challenge, vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     if (halApiVersion_ < 3) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_NOT_SUPPORTED,
                                                 "Not implemented by HAL");
     }
     vector<uint8_t> proofOfOwnershipSignature;
-    Status status = halBinder_->proveOwnership(challenge, &proofOfOwnershipSignature);
+    Status status = useHalBinder()->proveOwnership(challenge, &proofOfOwnershipSignature);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -580,19 +948,36 @@ Status Credential::proveOwnership(const vector<uint8_t>& challenge, vector<uint8
 }
 
 Status Credential::createEphemeralKeyPair(vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
+    optional<KeyedHalBinder> keyed;
+    if (halBinder_ != nullptr) {
+        if (!halBinderUsed_) {
+            keyed = takeKeyedHalBinder(callingUid_, credentialName_, cipherSuite_,
+                                       halBinderCredentialData_);
+        }
+        // Top up the pool for the next presentation, whether or not it served this one.
+        refillKeyedHalBinders(callingUid_, credentialName_, cipherSuite_,
+                              halBinderCredentialData_, halStoreBinder_);
+    }
+    if (keyed) {
+        // Our own binder is still unused, so the next Credential can have it.
+        putIdleHalBinder({callingUid_, credentialName_, cipherSuite_, halBinderCredentialData_,
+                          std::move(halBinder_)});
+        halBinder_ = std::move(keyed->halBinder);
+        halBinderUsed_ = true;
+        *_aidl_return = std::move(keyed->pkcs12);
+        return Status::ok();
+    }
+
+    InFlightHalCall halCall;
     vector<uint8_t> keyPair;
-    Status status = halBinder_->createEphemeralKeyPair(&keyPair);
+    Status status = useHalBinder()->createEphemeralKeyPair(&keyPair);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
 
-    optional<vector<uint8_t>> pkcs12Bytes = ecKeyPairGetPkcs12(keyPair,
-                                                               "ephemeralKey",  // Alias for key
-                                                               "0",  // Serial, as a decimal number
-                                                               "Credstore",      // Issuer
-                                                               "Ephemeral Key",  // Subject
-                                                               0,  // Validity Not Before
-                                                               24 * 60 * 60);  // Validity Not After
+    optional<vector<uint8_t>> pkcs12Bytes = ephemeralKeyPairToPkcs12(keyPair);
     if (!pkcs12Bytes) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Error creating PKCS#12 structure for key pair");
@@ -602,7 +987,10 @@ Status Credential::createEphemeralKeyPair(vector<uint8_t>* _aidl_return) {
 }
 
 Status Credential::setReaderEphemeralPublicKey(const vector<uint8_t>& publicKey) {
-    Status status = halBinder_->setReaderEphemeralPublicKey(publicKey);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
+    Status status = useHalBinder()->setReaderEphemeralPublicKey(publicKey);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -610,6 +998,8 @@ Status Credential::setReaderEphemeralPublicKey(const vector<uint8_t>& publicKey)
 }
 
 Status Credential::setAvailableAuthenticationKeys(int32_t keyCount, int32_t maxUsesPerKey) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -625,6 +1015,9 @@ Status Credential::setAvailableAuthenticationKeys(int32_t keyCount, int32_t maxU
 }
 
 Status Credential::getAuthKeysNeedingCertification(vector<AuthKeyParcel>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -632,7 +1025,7 @@ Status Credential::getAuthKeysNeedingCertification(vector<AuthKeyParcel>* _aidl_
                                                 "Error loading data for credential");
     }
     optional<vector<vector<uint8_t>>> keysNeedingCert =
-        data->getAuthKeysNeedingCertification(halBinder_);
+        data->getAuthKeysNeedingCertification(useHalBinder());
     if (!keysNeedingCert) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Error getting auth keys neededing certification");
@@ -653,6 +1046,8 @@ Status Credential::getAuthKeysNeedingCertification(vector<AuthKeyParcel>* _aidl_
 
 Status Credential::storeStaticAuthenticationData(const AuthKeyParcel& authenticationKey,
                                                  const vector<uint8_t>& staticAuthData) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -677,6 +1072,8 @@ Status
 Credential::storeStaticAuthenticationDataWithExpiration(const AuthKeyParcel& authenticationKey,
                                                         int64_t expirationDateMillisSinceEpoch,
                                                         const vector<uint8_t>& staticAuthData) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
     if (halApiVersion_ < 3) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_NOT_SUPPORTED,
                                                 "Not implemented by HAL");
@@ -701,7 +1098,41 @@ Credential::storeStaticAuthenticationDataWithExpiration(const AuthKeyParcel& aut
     return Status::ok();
 }
 
+Status
+Credential::storeStaticAuthenticationDataBatch(const vector<StaticAuthDataParcel>& staticAuthData) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
+    if (halApiVersion_ < 3) {
+        return Status::fromServiceSpecificError(ICredentialStore::ERROR_NOT_SUPPORTED,
+                                                "Not implemented by HAL");
+    }
+    sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
+    if (!data->loadFromDisk()) {
+        LOG(ERROR) << "Error loading data for credential";
+        return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                "Error loading data for credential");
+    }
+    // Nothing is saved unless every key is found, so a failed batch can just be retried.
+    for (const StaticAuthDataParcel& parcel : staticAuthData) {
+        if (!data->storeStaticAuthenticationData(parcel.authenticationKey.x509cert,
+                                                 parcel.expirationDateMillisSinceEpoch,
+                                                 parcel.staticAuthData)) {
+            return Status::fromServiceSpecificError(
+                ICredentialStore::ERROR_AUTHENTICATION_KEY_NOT_FOUND,
+                "Error finding authentication key to store static "
+                "authentication data for");
+        }
+    }
+    if (!data->saveToDisk()) {
+        return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                "Error saving data");
+    }
+    return Status::ok();
+}
+
 Status Credential::getAuthenticationDataUsageCount(vector<int32_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+
     sp<CredentialData> data = new CredentialData(dataPath_, callingUid_, credentialName_);
     if (!data->loadFromDisk()) {
         LOG(ERROR) << "Error loading data for credential";
@@ -717,26 +1148,10 @@ Status Credential::getAuthenticationDataUsageCount(vector<int32_t>* _aidl_return
     return Status::ok();
 }
 
-optional<string> extractDocType(const vector<uint8_t>& credentialData) {
-    auto [item, _ /* newPos */, message] = cppbor::parse(credentialData);
-    if (item == nullptr) {
-        LOG(ERROR) << "CredentialData is not valid CBOR: " << message;
-        return {};
-    }
-    const cppbor::Array* array = item->asArray();
-    if (array == nullptr || array->size() < 1) {
-        LOG(ERROR) << "CredentialData array with at least one element";
-        return {};
-    }
-    const cppbor::Tstr* tstr = ((*array)[0])->asTstr();
-    if (tstr == nullptr) {
-        LOG(ERROR) << "First item in CredentialData is not a string";
-        return {};
-    }
-    return tstr->value();
-}
-
 Status Credential::update(sp<IWritableCredential>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     if (halApiVersion_ < 3) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_NOT_SUPPORTED,
                                                 "Not implemented by HAL");
@@ -749,7 +1164,7 @@ Status Credential::update(sp<IWritableCredential>* _aidl_return) {
     }
 
     sp<IWritableIdentityCredential> halWritableCredential;
-    Status status = halBinder_->updateCredential(&halWritableCredential);
+    Status status = useHalBinder()->updateCredential(&halWritableCredential);
     if (!status.isOk()) {
         return halStatusToGenericError(status);
     }
@@ -790,6 +1205,9 @@ Status Credential::update(sp<IWritableCredential>* _aidl_return) {
 }
 
 void Credential::writableCredentialPersonalized() {
+    std::lock_guard<std::mutex> lock(*mutex_);
+    InFlightHalCall halCall;
+
     Status status = ensureOrReplaceHalBinder();
     if (!status.isOk()) {
         LOG(ERROR) << "Error reloading credential";
@@ -17,6 +17,8 @@
 #ifndef SYSTEM_SECURITY_CREDENTIAL_H_
 #define SYSTEM_SECURITY_CREDENTIAL_H_
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -42,6 +44,10 @@ using ::android::hardware::identity::IIdentityCredentialStore;
 using ::android::hardware::identity::RequestDataItem;
 using ::android::hardware::identity::RequestNamespace;
 
+// Sets how many ephemeral key pairs are kept ready for each credential so that
+// createEphemeralKeyPair() does not have to wait for the HAL. Zero, the default, turns this off.
+void setEphemeralKeysPerCredential(size_t count);
+
 class Credential : public BnCredential {
   public:
     Credential(CipherSuite cipherSuite, const string& dataPath, const string& credentialName,
@@ -83,6 +89,8 @@ class Credential : public BnCredential {
     storeStaticAuthenticationDataWithExpiration(const AuthKeyParcel& authenticationKey,
                                                 int64_t expirationDateMillisSinceEpoch,
                                                 const vector<uint8_t>& staticAuthData) override;
+    Status
+    storeStaticAuthenticationDataBatch(const vector<StaticAuthDataParcel>& staticAuthData) override;
     Status getAuthenticationDataUsageCount(vector<int32_t>* _aidl_return) override;
 
     Status update(sp<IWritableCredential>* _aidl_return) override;
@@ -100,6 +108,17 @@ class Credential : public BnCredential {
     sp<IIdentityCredential> halBinder_;
     int halApiVersion_;
 
+    // Held by every ICredential call, see CredentialData::getCredentialMutex().
+    std::shared_ptr<std::mutex> mutex_;
+
+    // The credential data |halBinder_| was instantiated from, and whether it has been used
+    // since. An unused binder is handed to the next Credential when this one goes away.
+    vector<uint8_t> halBinderCredentialData_;
+    bool halBinderUsed_ = false;
+
+    // Returns |halBinder_| for making a call on it.
+    const sp<IIdentityCredential>& useHalBinder();
+
     bool ensureChallenge();
 
     ssize_t
@@ -16,22 +16,31 @@
 
 #define LOG_TAG "credstore"
 
+#include <algorithm>
 #include <chrono>
+#include <list>
+#include <mutex>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 
 #include <cppbor.h>
 #include <cppbor_parse.h>
 
+#include <openssl/rand.h>
+
 #include <android/hardware/identity/support/IdentityCredentialSupport.h>
 
+#include "CertificateStore.h"
 #include "CredentialData.h"
 #include "Util.h"
 
@@ -41,6 +50,213 @@ namespace identity {
 
 using std::optional;
 
+namespace {
+
+// Credentials recently loaded or saved, keyed by file name, so that consecutive presentations
+// don't read and parse the credential file every time. The cached objects are snapshots which
+// are never handed out; loadFromDisk() copies from them, and saveToDisk() and deleteCredential()
+// keep them in sync with the files. When the cache is full, the least recently used credential
+// is dropped.
+constexpr size_t kMaxCachedCredentials = 16;
+
+class CredentialCache {
+  public:
+    sp<CredentialData> find(const string& fileName) {
+        auto iter = entries_.find(fileName);
+        if (iter == entries_.end()) {
+            return nullptr;
+        }
+        recency_.splice(recency_.begin(), recency_, iter->second.second);
+        return iter->second.first;
+    }
+
+    void put(const string& fileName, const sp<CredentialData>& data) {
+        auto iter = entries_.find(fileName);
+        if (iter != entries_.end()) {
+            iter->second.first = data;
+            recency_.splice(recency_.begin(), recency_, iter->second.second);
+            return;
+        }
+        if (entries_.size() >= kMaxCachedCredentials) {
+            entries_.erase(recency_.back());
+            recency_.pop_back();
+        }
+        recency_.push_front(fileName);
+        entries_[fileName] = {data, recency_.begin()};
+    }
+
+    void erase(const string& fileName) {
+        auto iter = entries_.find(fileName);
+        if (iter != entries_.end()) {
+            recency_.erase(iter->second.second);
+            entries_.erase(iter);
+        }
+    }
+
+  private:
+    // File names, most recently used first.
+    std::list<string> recency_;
+    map<string, pair<sp<CredentialData>, std::list<string>::iterator>> entries_;
+};
+
+std::mutex& cacheMutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+}
+
+CredentialCache& cache() {
+    static CredentialCache* cache = new CredentialCache();
+    return *cache;
+}
+
+// Auth key use counts are updated on every presentation. Rather than rewriting the credential
+// file each time, they are appended to a journal which holds the id of the credential file it
+// goes with followed by one fixed-size record per update.
+constexpr size_t kMaxUseCountJournalRecords = 64;
+
+struct UseCountJournalHeader {
+    uint64_t journalId;
+};
+
+struct UseCountJournalRecord {
+    uint32_t authKeyIndex;
+    int32_t useCount;
+};
+
+bool writeFully(int fd, const uint8_t* p, size_t remaining, off_t offset) {
+    while (remaining > 0) {
+        ssize_t numWritten = TEMP_FAILURE_RETRY(pwrite(fd, p, remaining, offset));
+        if (numWritten <= 0) {
+            return false;
+        }
+        p += numWritten;
+        offset += numWritten;
+        remaining -= numWritten;
+    }
+    return true;
+}
+
+// The metadata index of a uid is a CBOR map from credential name to
+// [docType, authKeyCount, maxUsesPerAuthKey, [* expirationDateMillisSinceEpoch]].
+std::mutex& metadataIndexMutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+}
+
+string metadataIndexFileName(const string& dataPath, uid_t ownerUid) {
+    // Credential file names are "<uid>-<hex>", so this can't clash with one of them.
+    return android::base::StringPrintf("%s/%d-index", dataPath.c_str(), (int)ownerUid);
+}
+
+optional<map<string, CredentialMetadata>> parseMetadataIndex(const vector<uint8_t>& data) {
+    auto [item, _ /* newPos */, message] = cppbor::parse(data);
+    const cppbor::Map* indexMap = item != nullptr ? item->asMap() : nullptr;
+    if (indexMap == nullptr) {
+        return {};
+    }
+    map<string, CredentialMetadata> index;
+    for (size_t n = 0; n < indexMap->size(); n++) {
+        auto& [nameItem, valueItem] = (*indexMap)[n];
+        const cppbor::Tstr* name = nameItem->asTstr();
+        const cppbor::Array* array = valueItem->asArray();
+        if (name == nullptr || array == nullptr || array->size() < 4) {
+            return {};
+        }
+        const cppbor::Tstr* docType = (*array)[0]->asTstr();
+        const cppbor::Int* keyCount = (*array)[1]->asInt();
+        const cppbor::Int* maxUses = (*array)[2]->asInt();
+        const cppbor::Array* expirations = (*array)[3]->asArray();
+        if (docType == nullptr || keyCount == nullptr || maxUses == nullptr ||
+            expirations == nullptr) {
+            return {};
+        }
+        CredentialMetadata metadata;
+        metadata.name = name->value();
+        metadata.docType = docType->value();
+        metadata.authKeyCount = keyCount->value();
+        metadata.maxUsesPerAuthKey = maxUses->value();
+        for (size_t m = 0; m < expirations->size(); m++) {
+            const cppbor::Int* expiration = (*expirations)[m]->asInt();
+            if (expiration == nullptr) {
+                return {};
+            }
+            metadata.authKeyExpirationDatesMillisSinceEpoch.push_back(expiration->value());
+        }
+        index[metadata.name] = std::move(metadata);
+    }
+    return index;
+}
+
+vector<uint8_t> encodeMetadataIndex(const map<string, CredentialMetadata>& index) {
+    cppbor::Map indexMap;
+    for (auto const& [name, metadata] : index) {
+        cppbor::Array expirations;
+        for (int64_t expiration : metadata.authKeyExpirationDatesMillisSinceEpoch) {
+            expirations.add(expiration);
+        }
+        cppbor::Array array;
+        array.add(metadata.docType);
+        array.add(metadata.authKeyCount);
+        array.add(metadata.maxUsesPerAuthKey);
+        array.add(std::move(expirations));
+        indexMap.add(name, std::move(array));
+    }
+    return indexMap.encode();
+}
+
+optional<string> decodeHexName(const string& hex) {
+    if (hex.empty() || hex.size() % 2 != 0) {
+        return {};
+    }
+    string name;
+    for (size_t n = 0; n < hex.size(); n += 2) {
+        int value = 0;
+        for (char c : {hex[n], hex[n + 1]}) {
+            int nibble;
+            if (c >= '0' && c <= '9') {
+                nibble = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                nibble = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                nibble = c - 'A' + 10;
+            } else {
+                return {};
+            }
+            value = value * 16 + nibble;
+        }
+        name.push_back(char(value));
+    }
+    return name;
+}
+
+// Splits |chain| into the credential's own certificate, which is returned in |leaf|, and the
+// certificates above it, which are put into the certificate store and returned as their
+// hashes. If the chain cannot be split or stored, |leaf| is the whole chain and no hashes are
+// returned.
+cppbor::Array storeAttestationChain(const string& dataPath, const vector<uint8_t>& chain,
+                                    vector<uint8_t>* leaf) {
+    *leaf = chain;
+    optional<vector<vector<uint8_t>>> certificates =
+        android::hardware::identity::support::certificateChainSplit(chain);
+    if (!certificates || certificates.value().size() < 2) {
+        return cppbor::Array();
+    }
+    std::shared_ptr<CertificateStore> store = CertificateStore::get(dataPath);
+    cppbor::Array hashes;
+    for (size_t n = 1; n < certificates.value().size(); n++) {
+        optional<vector<uint8_t>> hash = store->add(certificates.value()[n]);
+        if (!hash) {
+            LOG(ERROR) << "Error storing attestation certificate, keeping the chain inline";
+            return cppbor::Array();
+        }
+        hashes.add(std::move(hash.value()));
+    }
+    *leaf = std::move(certificates.value()[0]);
+    return hashes;
+}
+
+}  // namespace
+
 string CredentialData::calculateCredentialFileName(const string& dataPath, uid_t ownerUid,
                                                    const string& name) {
     return android::base::StringPrintf(
@@ -51,6 +267,7 @@ string CredentialData::calculateCredentialFileName(const string& dataPath, uid_t
 CredentialData::CredentialData(const string& dataPath, uid_t ownerUid, const string& name)
     : dataPath_(dataPath), ownerUid_(ownerUid), name_(name), secureUserId_(0) {
     fileName_ = calculateCredentialFileName(dataPath_, ownerUid_, name_);
+    journalFileName_ = fileName_ + ".usecounts";
 }
 
 void CredentialData::setSecureUserId(int64_t secureUserId) {
@@ -63,6 +280,7 @@ void CredentialData::setCredentialData(const vector<uint8_t>& credentialData) {
 
 void CredentialData::setAttestationCertificate(const vector<uint8_t>& attestationCertificate) {
     attestationCertificate_ = attestationCertificate;
+    attestationCertificateChain_.clear();
 }
 
 void CredentialData::addSecureAccessControlProfile(
@@ -71,8 +289,8 @@ void CredentialData::addSecureAccessControlProfile(
 }
 
 void CredentialData::addEntryData(const string& namespaceName, const string& entryName,
-                                  const EntryData& data) {
-    idToEncryptedChunks_[namespaceName + ":" + entryName] = data;
+                                  EntryData data) {
+    idToEncryptedChunks_[namespaceName + ":" + entryName] = std::move(data);
 }
 
 bool CredentialData::saveToDisk() const {
@@ -82,7 +300,28 @@ bool CredentialData::saveToDisk() const {
 
     map.add("credentialData", credentialData_);
 
-    map.add("attestationCertificate", attestationCertificate_);
+    // Only the credential's own certificate is kept in the file, the rest of the chain is
+    // shared with the other credentials through the certificate store.
+    vector<uint8_t> leafCertificate = attestationCertificate_;
+    cppbor::Array certificateHashes;
+    if (attestationCertificateChain_.empty()) {
+        certificateHashes =
+            storeAttestationChain(dataPath_, attestationCertificate_, &leafCertificate);
+    } else {
+        std::shared_ptr<CertificateStore> store = CertificateStore::get(dataPath_);
+        for (const auto& certificate : attestationCertificateChain_) {
+            optional<vector<uint8_t>> hash = store->add(*certificate);
+            if (!hash) {
+                LOG(ERROR) << "Error storing attestation certificate";
+                return false;
+            }
+            certificateHashes.add(std::move(hash.value()));
+        }
+    }
+    map.add("attestationCertificate", std::move(leafCertificate));
+    if (certificateHashes.size() > 0) {
+        map.add("attestationCertificateHashes", std::move(certificateHashes));
+    }
 
     cppbor::Array sacpArray;
     for (const SecureAccessControlProfile& sacp : secureAccessControlProfiles_) {
@@ -98,7 +337,18 @@ bool CredentialData::saveToDisk() const {
     }
     map.add("secureAccessControlProfiles", std::move(sacpArray));
 
-    cppbor::Map encryptedBlobsMap;
+    // Entries are stored after the top-level map, each as its own CBOR item, and the map only
+    // holds their locations, relative to the end of the map. This way loading the credential
+    // only decodes the entries which are actually requested.
+    vector<uint8_t> entryRegion;
+    cppbor::Map entryIndexMap;
+    auto addEntry = [&](const string& nsAndName, const uint8_t* data, size_t size) {
+        cppbor::Array location;
+        location.add(entryRegion.size());
+        location.add(size);
+        entryIndexMap.add(nsAndName, std::move(location));
+        entryRegion.insert(entryRegion.end(), data, data + size);
+    };
     for (auto const& [nsAndName, entryData] : idToEncryptedChunks_) {
         cppbor::Array encryptedChunkArray;
         for (const vector<uint8_t>& encryptedChunk : entryData.encryptedChunks) {
@@ -112,31 +362,193 @@ bool CredentialData::saveToDisk() const {
         }
         entryDataArray.add(std::move(idsArray));
         entryDataArray.add(std::move(encryptedChunkArray));
-        encryptedBlobsMap.add(nsAndName, std::move(entryDataArray));
+        vector<uint8_t> encoded = entryDataArray.encode();
+        addEntry(nsAndName, encoded.data(), encoded.size());
+    }
+    // Entries which were never decoded are copied over from the loaded file unchanged.
+    for (auto const& [nsAndName, location] : entryIndex_) {
+        if (idToEncryptedChunks_.count(nsAndName) == 0) {
+            addEntry(nsAndName, mappedFile_->data() + location.first, location.second);
+        }
     }
-    map.add("entryData", std::move(encryptedBlobsMap));
+    map.add("entryIndex", std::move(entryIndexMap));
     map.add("authKeyCount", keyCount_);
     map.add("maxUsesPerAuthKey", maxUsesPerKey_);
 
-    cppbor::Array authKeyDatasArray;
-    for (const AuthKeyData& data : authKeyDatas_) {
-        cppbor::Array array;
-        // Fields 0-6 was in the original version in Android 11
-        array.add(data.certificate);
-        array.add(data.keyBlob);
-        array.add(data.staticAuthenticationData);
-        array.add(data.pendingCertificate);
-        array.add(data.pendingKeyBlob);
-        array.add(data.useCount);
-        // Field 7 was added in Android 12
-        array.add(data.expirationDateMillisSinceEpoch);
-        authKeyDatasArray.add(std::move(array));
-    }
-    map.add("authKeyData", std::move(authKeyDatasArray));
+    // Auth keys follow the entries in the same way, so that a presentation only decodes the
+    // key it uses. The index holds what is needed to pick one, as
+    // [useCount, expirationDateMillisSinceEpoch, certified, offset, size] per key.
+    //
+    // This is a one-way format change: builds which only know the authKeyData array find no
+    // auth keys in a file written this way and fail to load it, so downgrading is not
+    // supported.
+    cppbor::Array authKeyIndexArray;
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        const AuthKeyData& data = authKeyDatas_[n];
+        size_t offset = entryRegion.size();
+        if (authKeyLocations_[n]) {
+            // Copied over from the loaded file unchanged, like the entries.
+            const uint8_t* begin = mappedFile_->data() + authKeyLocations_[n].value().offset;
+            entryRegion.insert(entryRegion.end(), begin,
+                               begin + authKeyLocations_[n].value().size);
+        } else {
+            cppbor::Array array;
+            array.add(data.certificate);
+            array.add(data.keyBlob);
+            array.add(data.staticAuthenticationData);
+            array.add(data.pendingCertificate);
+            array.add(data.pendingKeyBlob);
+            vector<uint8_t> encoded = array.encode();
+            entryRegion.insert(entryRegion.end(), encoded.begin(), encoded.end());
+        }
+        cppbor::Array location;
+        location.add(data.useCount);
+        location.add(data.expirationDateMillisSinceEpoch);
+        location.add(isAuthKeyCertified_(n));
+        location.add(offset);
+        location.add(entryRegion.size() - offset);
+        authKeyIndexArray.add(std::move(location));
+    }
+    map.add("authKeyIndex", std::move(authKeyIndexArray));
+
+    uint64_t journalId = 0;
+    while (journalId == 0) {
+        RAND_bytes(reinterpret_cast<uint8_t*>(&journalId), sizeof(journalId));
+    }
+    map.add("useCountJournalId", journalId);
 
     vector<uint8_t> credentialData = map.encode();
+    credentialData.insert(credentialData.end(), entryRegion.begin(), entryRegion.end());
+
+    if (!fileSetContents(fileName_, credentialData)) {
+        std::lock_guard<std::mutex> lock(cacheMutex());
+        cache().erase(fileName_);
+        return false;
+    }
+    // The new file already has all use counts, and the id change makes any journal left behind
+    // stale.
+    journalId_ = journalId;
+    journalRecords_ = 0;
+    if (unlink(journalFileName_.c_str()) != 0 && errno != ENOENT) {
+        PLOG(ERROR) << "Error deleting " << journalFileName_;
+    }
+    updateCache_();
+    updateMetadataIndex_(false /* deleted */);
+    // One directory sync covers the credential file, the index and the journal's removal.
+    return fileSyncDirectory(fileName_);
+}
+
+bool CredentialData::saveAuthKeyUseCount(const AuthKeyData* authKey) {
+    size_t authKeyIndex = 0;
+    while (authKeyIndex < authKeyDatas_.size() && &authKeyDatas_[authKeyIndex] != authKey) {
+        authKeyIndex++;
+    }
+    if (authKeyIndex == authKeyDatas_.size()) {
+        LOG(ERROR) << "Auth key does not belong to this credential";
+        return false;
+    }
+    if (journalId_ == 0 || journalRecords_ >= kMaxUseCountJournalRecords) {
+        return saveToDisk();
+    }
+
+    // The first record replaces whatever journal is there. Later ones are written right after
+    // the last complete record, which also overwrites a partial one left by a crash.
+    vector<uint8_t> data;
+    UseCountJournalRecord record = {uint32_t(authKeyIndex), authKey->useCount};
+    off_t offset = sizeof(UseCountJournalHeader) + journalRecords_ * sizeof(record);
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (journalRecords_ == 0) {
+        UseCountJournalHeader header = {journalId_};
+        const uint8_t* headerBytes = reinterpret_cast<const uint8_t*>(&header);
+        data.insert(data.end(), headerBytes, headerBytes + sizeof(header));
+        offset = 0;
+        flags |= O_TRUNC;
+    }
+    const uint8_t* recordBytes = reinterpret_cast<const uint8_t*>(&record);
+    data.insert(data.end(), recordBytes, recordBytes + sizeof(record));
+
+    int fd = TEMP_FAILURE_RETRY(open(journalFileName_.c_str(), flags, 0600));
+    if (fd == -1) {
+        PLOG(ERROR) << "Error opening " << journalFileName_;
+        return false;
+    }
+    if (!writeFully(fd, data.data(), data.size(), offset)) {
+        PLOG(ERROR) << "Error writing into " << journalFileName_;
+        close(fd);
+        return false;
+    }
+    if (TEMP_FAILURE_RETRY(fdatasync(fd))) {
+        PLOG(ERROR) << "Error fsyncing " << journalFileName_;
+        close(fd);
+        return false;
+    }
+    close(fd);
+    // Only the first record creates the journal, later ones just need their data synced.
+    if (journalRecords_ == 0 && !fileSyncDirectory(journalFileName_)) {
+        return false;
+    }
+    journalRecords_++;
+    updateCache_();
+    return true;
+}
 
-    return fileSetContents(fileName_, credentialData);
+void CredentialData::loadUseCountJournal_() {
+    journalRecords_ = 0;
+    string journal;
+    if (!android::base::ReadFileToString(journalFileName_, &journal)) {
+        if (errno != ENOENT) {
+            PLOG(ERROR) << "Error reading " << journalFileName_;
+        }
+        return;
+    }
+    UseCountJournalHeader header;
+    if (journalId_ == 0 || journal.size() < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, journal.data(), sizeof(header));
+    if (header.journalId != journalId_) {
+        // Left behind by a saveToDisk() which could not delete it.
+        return;
+    }
+    size_t numRecords = (journal.size() - sizeof(header)) / sizeof(UseCountJournalRecord);
+    for (size_t n = 0; n < numRecords; n++) {
+        UseCountJournalRecord record;
+        memcpy(&record, journal.data() + sizeof(header) + n * sizeof(record), sizeof(record));
+        if (record.authKeyIndex >= authKeyDatas_.size()) {
+            LOG(ERROR) << "Ignoring use count for auth key " << record.authKeyIndex << " of "
+                       << authKeyDatas_.size() << " in " << journalFileName_;
+            continue;
+        }
+        authKeyDatas_[record.authKeyIndex].useCount = record.useCount;
+    }
+    journalRecords_ = numRecords;
+}
+
+void CredentialData::updateCache_() const {
+    sp<CredentialData> snapshot = new CredentialData(dataPath_, ownerUid_, name_);
+    snapshot->copyPersistentDataFrom_(*this);
+
+    std::lock_guard<std::mutex> lock(cacheMutex());
+    cache().put(fileName_, snapshot);
+}
+
+void CredentialData::copyPersistentDataFrom_(const CredentialData& other) {
+    secureUserId_ = other.secureUserId_;
+    credentialData_ = other.credentialData_;
+    attestationCertificate_ = other.attestationCertificate_;
+    attestationCertificateChain_ = other.attestationCertificateChain_;
+    secureAccessControlProfiles_ = other.secureAccessControlProfiles_;
+    idToEncryptedChunks_ = other.idToEncryptedChunks_;
+    mappedFile_ = other.mappedFile_;
+    entryIndex_ = other.entryIndex_;
+    decodedEntries_.clear();
+    keyCount_ = other.keyCount_;
+    maxUsesPerKey_ = other.maxUsesPerKey_;
+    authKeyDatas_ = other.authKeyDatas_;
+    authKeyLocations_ = other.authKeyLocations_;
+    authKeysByUseCountValid_ = false;
+    journalId_ = other.journalId_;
+    journalRecords_ = other.journalRecords_;
 }
 
 optional<SecureAccessControlProfile> parseSacp(const cppbor::Item& item) {
@@ -170,6 +582,33 @@ optional<SecureAccessControlProfile> parseSacp(const cppbor::Item& item) {
     return sacp;
 }
 
+// Parses an auth key stored after the top-level map, which holds the fields that are not in
+// the auth key index, into |authKeyData|.
+bool parseAuthKeyRecord(const cppbor::Item& item, AuthKeyData* authKeyData) {
+    const cppbor::Array* array = item.asArray();
+    if (array == nullptr || array->size() < 5) {
+        LOG(ERROR) << "The auth key CBOR is not an array with at least five elements";
+        return false;
+    }
+    const cppbor::Bstr* itemCertificate = ((*array)[0])->asBstr();
+    const cppbor::Bstr* itemKeyBlob = ((*array)[1])->asBstr();
+    const cppbor::Bstr* itemStaticAuthenticationData = ((*array)[2])->asBstr();
+    const cppbor::Bstr* itemPendingCertificate = ((*array)[3])->asBstr();
+    const cppbor::Bstr* itemPendingKeyBlob = ((*array)[4])->asBstr();
+    if (itemCertificate == nullptr || itemKeyBlob == nullptr ||
+        itemStaticAuthenticationData == nullptr || itemPendingCertificate == nullptr ||
+        itemPendingKeyBlob == nullptr) {
+        LOG(ERROR) << "One or more items in auth key array in CBOR is of wrong type";
+        return false;
+    }
+    authKeyData->certificate = itemCertificate->value();
+    authKeyData->keyBlob = itemKeyBlob->value();
+    authKeyData->staticAuthenticationData = itemStaticAuthenticationData->value();
+    authKeyData->pendingCertificate = itemPendingCertificate->value();
+    authKeyData->pendingKeyBlob = itemPendingKeyBlob->value();
+    return true;
+}
+
 optional<AuthKeyData> parseAuthKeyData(const cppbor::Item& item) {
     const cppbor::Array* array = item.asArray();
     if (array == nullptr || array->size() < 6) {
@@ -244,33 +683,95 @@ optional<vector<vector<uint8_t>>> parseEncryptedChunks(const cppbor::Item& item)
     return encryptedChunks;
 }
 
+optional<EntryData> parseEntryData(const cppbor::Item& item) {
+    const cppbor::Array* ecEntryArrayItem = item.asArray();
+    if (ecEntryArrayItem == nullptr || ecEntryArrayItem->size() < 3) {
+        LOG(ERROR) << "Value item in encryptedChunks map is an array with at least two "
+                      "elements";
+        return {};
+    }
+    const cppbor::Int* ecEntrySizeItem = (*ecEntryArrayItem)[0]->asInt();
+    if (ecEntrySizeItem == nullptr) {
+        LOG(ERROR) << "Entry size not a number";
+        return {};
+    }
+    uint64_t entrySize = ecEntrySizeItem->value();
+
+    optional<vector<int32_t>> accessControlProfileIds =
+        parseAccessControlProfileIds(*(*ecEntryArrayItem)[1]);
+    if (!accessControlProfileIds) {
+        LOG(ERROR) << "Error parsing access control profile ids";
+        return {};
+    }
+
+    optional<vector<vector<uint8_t>>> encryptedChunks =
+        parseEncryptedChunks(*(*ecEntryArrayItem)[2]);
+    if (!encryptedChunks) {
+        LOG(ERROR) << "Error parsing encrypted chunks";
+        return {};
+    }
+
+    EntryData data;
+    data.size = entrySize;
+    data.accessControlProfileIds = accessControlProfileIds.value();
+    data.encryptedChunks = encryptedChunks.value();
+    return data;
+}
+
 bool CredentialData::loadFromDisk() {
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex());
+        sp<CredentialData> cached = cache().find(fileName_);
+        if (cached != nullptr) {
+            copyPersistentDataFrom_(*cached);
+            return true;
+        }
+    }
+    if (!loadFromDiskUncached_()) {
+        return false;
+    }
+    updateCache_();
+    return true;
+}
+
+bool CredentialData::loadFromDiskUncached_() {
     // Reset all data.
     credentialData_.clear();
     attestationCertificate_.clear();
+    attestationCertificateChain_.clear();
     secureAccessControlProfiles_.clear();
     idToEncryptedChunks_.clear();
+    mappedFile_.reset();
+    entryIndex_.clear();
+    decodedEntries_.clear();
     authKeyDatas_.clear();
+    authKeyLocations_.clear();
+    authKeysByUseCountValid_ = false;
     keyCount_ = 0;
     maxUsesPerKey_ = 1;
+    journalId_ = 0;
 
-    optional<vector<uint8_t>> data = fileGetContents(fileName_);
-    if (!data) {
+    std::shared_ptr<const MappedFile> mappedFile = fileMap(fileName_);
+    if (!mappedFile) {
         LOG(ERROR) << "Error loading data";
         return false;
     }
 
-    auto [item, _ /* newPos */, message] = cppbor::parse(data.value());
+    const uint8_t* fileEnd = mappedFile->data() + mappedFile->size();
+    auto [item, entryRegion, message] = cppbor::parse(mappedFile->data(), fileEnd);
     if (item == nullptr) {
         LOG(ERROR) << "Data loaded from " << fileName_ << " is not valid CBOR: " << message;
         return false;
     }
+    size_t entryRegionOffset = entryRegion - mappedFile->data();
+    size_t entryRegionSize = fileEnd - entryRegion;
 
     const cppbor::Map* map = item->asMap();
     if (map == nullptr) {
         LOG(ERROR) << "Top-level item is not a map";
         return false;
     }
+    const cppbor::Array* certificateHashes = nullptr;
 
     for (size_t n = 0; n < map->size(); n++) {
         auto& [keyItem, valueItem] = (*map)[n];
@@ -302,6 +803,12 @@ bool CredentialData::loadFromDisk() {
                 return false;
             }
             attestationCertificate_ = valueBstr->value();
+        } else if (key == "attestationCertificateHashes") {
+            certificateHashes = valueItem->asArray();
+            if (certificateHashes == nullptr) {
+                LOG(ERROR) << "Value for attestationCertificateHashes is not an array";
+                return false;
+            }
         } else if (key == "secureAccessControlProfiles") {
             const cppbor::Array* array = valueItem->asArray();
             if (array == nullptr) {
@@ -331,40 +838,37 @@ bool CredentialData::loadFromDisk() {
                     LOG(ERROR) << "Key item in encryptedChunks map is not a tstr";
                     return false;
                 }
-                const string& ecId = ecTstr->value();
-
-                const cppbor::Array* ecEntryArrayItem = ecValueItem->asArray();
-                if (ecEntryArrayItem == nullptr || ecEntryArrayItem->size() < 3) {
-                    LOG(ERROR) << "Value item in encryptedChunks map is an array with at least two "
-                                  "elements";
-                    return false;
-                }
-                const cppbor::Int* ecEntrySizeItem = (*ecEntryArrayItem)[0]->asInt();
-                if (ecEntrySizeItem == nullptr) {
-                    LOG(ERROR) << "Entry size not a number";
+                optional<EntryData> data = parseEntryData(*ecValueItem);
+                if (!data) {
                     return false;
                 }
-                uint64_t entrySize = ecEntrySizeItem->value();
+                idToEncryptedChunks_[ecTstr->value()] = data.value();
+            }
 
-                optional<vector<int32_t>> accessControlProfileIds =
-                    parseAccessControlProfileIds(*(*ecEntryArrayItem)[1]);
-                if (!accessControlProfileIds) {
-                    LOG(ERROR) << "Error parsing access control profile ids";
+        } else if (key == "entryIndex") {
+            const cppbor::Map* map = valueItem->asMap();
+            if (map == nullptr) {
+                LOG(ERROR) << "Value for entryIndex is not an map";
+                return false;
+            }
+            for (size_t m = 0; m < map->size(); m++) {
+                auto& [idKeyItem, idValueItem] = (*map)[m];
+                const cppbor::Tstr* idTstr = idKeyItem->asTstr();
+                const cppbor::Array* location = idValueItem->asArray();
+                if (idTstr == nullptr || location == nullptr || location->size() < 2) {
+                    LOG(ERROR) << "Item in entryIndex map is not a tstr and location array";
                     return false;
                 }
-
-                optional<vector<vector<uint8_t>>> encryptedChunks =
-                    parseEncryptedChunks(*(*ecEntryArrayItem)[2]);
-                if (!encryptedChunks) {
-                    LOG(ERROR) << "Error parsing encrypted chunks";
+                const cppbor::Int* offset = (*location)[0]->asInt();
+                const cppbor::Int* size = (*location)[1]->asInt();
+                if (offset == nullptr || size == nullptr || offset->value() < 0 ||
+                    size->value() < 0 || uint64_t(offset->value()) > entryRegionSize ||
+                    uint64_t(size->value()) > entryRegionSize - offset->value()) {
+                    LOG(ERROR) << "Location of entry " << idTstr->value() << " is invalid";
                     return false;
                 }
-
-                EntryData data;
-                data.size = entrySize;
-                data.accessControlProfileIds = accessControlProfileIds.value();
-                data.encryptedChunks = encryptedChunks.value();
-                idToEncryptedChunks_[ecId] = data;
+                entryIndex_[idTstr->value()] = {entryRegionOffset + offset->value(),
+                                                size->value()};
             }
 
         } else if (key == "authKeyData") {
@@ -381,6 +885,41 @@ bool CredentialData::loadFromDisk() {
                     return false;
                 }
                 authKeyDatas_.push_back(authKeyData.value());
+                authKeyLocations_.push_back({});
+            }
+
+        } else if (key == "authKeyIndex") {
+            const cppbor::Array* array = valueItem->asArray();
+            if (array == nullptr) {
+                LOG(ERROR) << "Value for authKeyIndex is not an array";
+                return false;
+            }
+            for (size_t m = 0; m < array->size(); m++) {
+                const cppbor::Array* location = (*array)[m]->asArray();
+                if (location == nullptr || location->size() < 5) {
+                    LOG(ERROR) << "Item in authKeyIndex is not an array with five elements";
+                    return false;
+                }
+                const cppbor::Int* useCount = (*location)[0]->asInt();
+                const cppbor::Int* expiration = (*location)[1]->asInt();
+                const cppbor::Simple* simple = (*location)[2]->asSimple();
+                const cppbor::Bool* certified = simple != nullptr ? simple->asBool() : nullptr;
+                const cppbor::Int* offset = (*location)[3]->asInt();
+                const cppbor::Int* size = (*location)[4]->asInt();
+                if (useCount == nullptr || expiration == nullptr || certified == nullptr ||
+                    offset == nullptr || size == nullptr || offset->value() < 0 ||
+                    size->value() < 0 || uint64_t(offset->value()) > entryRegionSize ||
+                    uint64_t(size->value()) > entryRegionSize - offset->value()) {
+                    LOG(ERROR) << "Auth key " << m << " in authKeyIndex is invalid";
+                    return false;
+                }
+                AuthKeyData authKeyData;
+                authKeyData.useCount = useCount->value();
+                authKeyData.expirationDateMillisSinceEpoch = expiration->value();
+                authKeyDatas_.push_back(std::move(authKeyData));
+                authKeyLocations_.push_back(AuthKeyLocation{
+                    entryRegionOffset + size_t(offset->value()), size_t(size->value()),
+                    certified->value()});
             }
 
         } else if (key == "authKeyCount") {
@@ -398,6 +937,14 @@ bool CredentialData::loadFromDisk() {
                 return false;
             }
             maxUsesPerKey_ = number->value();
+
+        } else if (key == "useCountJournalId") {
+            const cppbor::Uint* number = valueItem->asUint();
+            if (number == nullptr) {
+                LOG(ERROR) << "Value for useCountJournalId is not an unsigned number";
+                return false;
+            }
+            journalId_ = number->value();
         }
     }
 
@@ -411,12 +958,39 @@ bool CredentialData::loadFromDisk() {
         return false;
     }
 
+    // Files written before the certificate store existed hold the whole chain in
+    // attestationCertificate.
+    if (certificateHashes != nullptr) {
+        std::shared_ptr<CertificateStore> store = CertificateStore::get(dataPath_);
+        for (size_t n = 0; n < certificateHashes->size(); n++) {
+            const cppbor::Bstr* hash = (*certificateHashes)[n]->asBstr();
+            std::shared_ptr<const vector<uint8_t>> certificate =
+                hash != nullptr ? store->find(hash->value()) : nullptr;
+            if (certificate == nullptr) {
+                LOG(ERROR) << "Attestation certificate " << n << " of " << fileName_
+                           << " is missing from the certificate store";
+                return false;
+            }
+            attestationCertificateChain_.push_back(std::move(certificate));
+        }
+    }
+
     if (size_t(keyCount_) != authKeyDatas_.size()) {
         LOG(ERROR) << "keyCount_=" << keyCount_
                    << " != authKeyDatas_.size()=" << authKeyDatas_.size();
         return false;
     }
 
+    // Files written before the entry index existed have all entries in an "entryData" map,
+    // which was decoded above, and likewise all auth keys in an "authKeyData" array. They are
+    // converted by the next saveToDisk().
+    bool hasAuthKeyLocations =
+        std::any_of(authKeyLocations_.begin(), authKeyLocations_.end(),
+                    [](const auto& location) { return location.has_value(); });
+    if (!entryIndex_.empty() || hasAuthKeyLocations) {
+        mappedFile_ = std::move(mappedFile);
+    }
+    loadUseCountJournal_();
     return true;
 }
 
@@ -428,38 +1002,89 @@ int64_t CredentialData::getSecureUserId() {
     return secureUserId_;
 }
 
-const vector<uint8_t>& CredentialData::getAttestationCertificate() const {
-    return attestationCertificate_;
+vector<uint8_t> CredentialData::getAttestationCertificate() const {
+    vector<uint8_t> chain = attestationCertificate_;
+    for (const auto& certificate : attestationCertificateChain_) {
+        chain.insert(chain.end(), certificate->begin(), certificate->end());
+    }
+    return chain;
 }
 
 const vector<SecureAccessControlProfile>& CredentialData::getSecureAccessControlProfiles() const {
     return secureAccessControlProfiles_;
 }
 
-bool CredentialData::hasEntryData(const string& namespaceName, const string& entryName) const {
-    string id = namespaceName + ":" + entryName;
-    auto iter = idToEncryptedChunks_.find(id);
-    if (iter == idToEncryptedChunks_.end()) {
-        return false;
+int EntryIdLess::compare(std::string_view id, const NamespaceAndName& nsAndName) {
+    // Compares |id| with the concatenation of the namespace, ":" and the name, piece by piece.
+    for (std::string_view part : {nsAndName.first, std::string_view(":"), nsAndName.second}) {
+        std::string_view head = id.substr(0, part.size());
+        int result = head.compare(part);
+        if (result != 0) {
+            return result;
+        }
+        id.remove_prefix(head.size());
     }
-    return true;
+    return id.empty() ? 0 : 1;
+}
+
+bool CredentialData::hasEntryData(const string& namespaceName, const string& entryName) const {
+    EntryIdLess::NamespaceAndName id(namespaceName, entryName);
+    return idToEncryptedChunks_.find(id) != idToEncryptedChunks_.end() ||
+           entryIndex_.find(id) != entryIndex_.end();
 }
 
 optional<EntryData> CredentialData::getEntryData(const string& namespaceName,
                                                  const string& entryName) const {
-    string id = namespaceName + ":" + entryName;
-    auto iter = idToEncryptedChunks_.find(id);
-    if (iter == idToEncryptedChunks_.end()) {
+    const EntryData* data = findEntryData(namespaceName, entryName);
+    if (data == nullptr) {
         return {};
     }
-    return iter->second;
+    return *data;
+}
+
+const EntryData* CredentialData::findEntryData(const string& namespaceName,
+                                               const string& entryName) const {
+    EntryIdLess::NamespaceAndName id(namespaceName, entryName);
+    auto iter = idToEncryptedChunks_.find(id);
+    if (iter != idToEncryptedChunks_.end()) {
+        return &iter->second;
+    }
+
+    auto indexIter = entryIndex_.find(id);
+    if (indexIter == entryIndex_.end()) {
+        return nullptr;
+    }
+    auto decodedIter = decodedEntries_.find(id);
+    if (decodedIter != decodedEntries_.end()) {
+        return &decodedIter->second;
+    }
+    const uint8_t* begin = mappedFile_->data() + indexIter->second.first;
+    auto [item, _ /* newPos */, message] = cppbor::parse(begin, begin + indexIter->second.second);
+    if (item == nullptr) {
+        LOG(ERROR) << "Entry " << indexIter->first << " in " << fileName_
+                   << " is not valid CBOR: " << message;
+        return nullptr;
+    }
+    optional<EntryData> data = parseEntryData(*item);
+    if (!data) {
+        return nullptr;
+    }
+    return &decodedEntries_.emplace(indexIter->first, std::move(data.value())).first->second;
 }
 
 bool CredentialData::deleteCredential() {
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex());
+        cache().erase(fileName_);
+    }
     if (unlink(fileName_.c_str()) != 0) {
         PLOG(ERROR) << "Error deleting " << fileName_;
         return false;
     }
+    if (unlink(journalFileName_.c_str()) != 0 && errno != ENOENT) {
+        PLOG(ERROR) << "Error deleting " << journalFileName_;
+    }
+    updateMetadataIndex_(true /* deleted */);
     return true;
 }
 
@@ -477,6 +1102,123 @@ optional<bool> CredentialData::credentialExists(const string& dataPath, uid_t ow
     return true;
 }
 
+std::shared_ptr<std::mutex> CredentialData::getCredentialMutex(const string& dataPath,
+                                                               uid_t ownerUid,
+                                                               const string& name) {
+    static std::mutex* registryMutex = new std::mutex();
+    static map<string, std::weak_ptr<std::mutex>>* registry =
+        new map<string, std::weak_ptr<std::mutex>>();
+
+    string fileName = calculateCredentialFileName(dataPath, ownerUid, name);
+    std::lock_guard<std::mutex> lock(*registryMutex);
+    std::shared_ptr<std::mutex> mutex = (*registry)[fileName].lock();
+    if (mutex == nullptr) {
+        // Drop the entries of credentials nobody is working on anymore.
+        for (auto iter = registry->begin(); iter != registry->end();) {
+            iter = iter->second.expired() ? registry->erase(iter) : std::next(iter);
+        }
+        mutex = std::make_shared<std::mutex>();
+        (*registry)[fileName] = mutex;
+    }
+    return mutex;
+}
+
+optional<vector<CredentialMetadata>> CredentialData::listCredentials(const string& dataPath,
+                                                                    uid_t ownerUid) {
+    std::lock_guard<std::mutex> lock(metadataIndexMutex());
+    optional<map<string, CredentialMetadata>> index = loadMetadataIndex_(dataPath, ownerUid);
+    if (!index) {
+        return {};
+    }
+    vector<CredentialMetadata> credentials;
+    for (auto& [name, metadata] : index.value()) {
+        credentials.push_back(std::move(metadata));
+    }
+    return credentials;
+}
+
+optional<map<string, CredentialMetadata>>
+CredentialData::loadMetadataIndex_(const string& dataPath, uid_t ownerUid) {
+    string indexFileName = metadataIndexFileName(dataPath, ownerUid);
+    string contents;
+    if (android::base::ReadFileToString(indexFileName, &contents)) {
+        optional<map<string, CredentialMetadata>> index =
+            parseMetadataIndex(vector<uint8_t>(contents.begin(), contents.end()));
+        if (index) {
+            return index;
+        }
+        LOG(ERROR) << indexFileName << " is not a valid metadata index, rebuilding it";
+    } else if (errno != ENOENT) {
+        PLOG(ERROR) << "Error reading " << indexFileName;
+        return {};
+    }
+
+    // Credentials saved before the index existed, or while it was broken, are found by
+    // their file names.
+    map<string, CredentialMetadata> index;
+    DIR* dir = opendir(dataPath.c_str());
+    if (dir == nullptr) {
+        PLOG(ERROR) << "Error opening " << dataPath;
+        return {};
+    }
+    string prefix = android::base::StringPrintf("%d-", (int)ownerUid);
+    while (struct dirent* dirEntry = readdir(dir)) {
+        string fileName = dirEntry->d_name;
+        if (fileName.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        optional<string> name = decodeHexName(fileName.substr(prefix.size()));
+        if (!name) {
+            continue;
+        }
+        sp<CredentialData> data = new CredentialData(dataPath, ownerUid, name.value());
+        if (!data->loadFromDisk()) {
+            LOG(ERROR) << "Error loading " << fileName << ", leaving it out of the index";
+            continue;
+        }
+        index[name.value()] = data->getMetadata_();
+    }
+    closedir(dir);
+    if (!fileSetContents(indexFileName, encodeMetadataIndex(index))) {
+        LOG(ERROR) << "Error writing " << indexFileName;
+    }
+    return index;
+}
+
+CredentialMetadata CredentialData::getMetadata_() const {
+    CredentialMetadata metadata;
+    metadata.name = name_;
+    metadata.docType = extractDocType(credentialData_).value_or("");
+    metadata.authKeyCount = keyCount_;
+    metadata.maxUsesPerAuthKey = maxUsesPerKey_;
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        if (isAuthKeyCertified_(n)) {
+            metadata.authKeyExpirationDatesMillisSinceEpoch.push_back(
+                authKeyDatas_[n].expirationDateMillisSinceEpoch);
+        }
+    }
+    return metadata;
+}
+
+void CredentialData::updateMetadataIndex_(bool deleted) const {
+    std::lock_guard<std::mutex> lock(metadataIndexMutex());
+    string indexFileName = metadataIndexFileName(dataPath_, ownerUid_);
+    optional<map<string, CredentialMetadata>> index = loadMetadataIndex_(dataPath_, ownerUid_);
+    if (!index) {
+        return;
+    }
+    if (deleted) {
+        index.value().erase(name_);
+    } else {
+        index.value()[name_] = getMetadata_();
+    }
+    if (!fileSetContents(indexFileName, encodeMetadataIndex(index.value()))) {
+        // A stale index would stay stale, so make sure it gets rebuilt instead.
+        LOG(ERROR) << "Error writing " << indexFileName;
+        unlink(indexFileName.c_str());
+    }
+}
+
 // ---
 
 void CredentialData::setAvailableAuthenticationKeys(int keyCount, int maxUsesPerKey) {
@@ -493,6 +1235,8 @@ void CredentialData::setAvailableAuthenticationKeys(int keyCount, int maxUsesPer
     //
     // Therefore, in either case it's as simple as just resizing the vector.
     authKeyDatas_.resize(keyCount_);
+    authKeyLocations_.resize(keyCount_);
+    authKeysByUseCountValid_ = false;
 }
 
 const vector<AuthKeyData>& CredentialData::getAuthKeyDatas() const {
@@ -503,38 +1247,72 @@ pair<int /* keyCount */, int /*maxUsersPerKey */> CredentialData::getAvailableAu
     return std::make_pair(keyCount_, maxUsesPerKey_);
 }
 
+void CredentialData::ensureAuthKeysByUseCount_() {
+    if (authKeysByUseCountValid_) {
+        return;
+    }
+    authKeysByUseCount_.clear();
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        if (isAuthKeyCertified_(n)) {
+            authKeysByUseCount_.insert({authKeyDatas_[n].useCount, n});
+        }
+    }
+    authKeysByUseCountValid_ = true;
+}
+
+bool CredentialData::isAuthKeyCertified_(size_t index) const {
+    if (authKeyLocations_[index]) {
+        return authKeyLocations_[index].value().certified;
+    }
+    return authKeyDatas_[index].certificate.size() != 0;
+}
+
+bool CredentialData::decodeAuthKey_(size_t index) {
+    if (!authKeyLocations_[index]) {
+        return true;
+    }
+    const AuthKeyLocation& location = authKeyLocations_[index].value();
+    const uint8_t* begin = mappedFile_->data() + location.offset;
+    auto [item, _ /* newPos */, message] = cppbor::parse(begin, begin + location.size);
+    if (item == nullptr) {
+        LOG(ERROR) << "Auth key " << index << " in " << fileName_
+                   << " is not valid CBOR: " << message;
+        return false;
+    }
+    if (!parseAuthKeyRecord(*item, &authKeyDatas_[index])) {
+        return false;
+    }
+    authKeyLocations_[index].reset();
+    return true;
+}
+
+bool CredentialData::decodeAllAuthKeys_() {
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        if (!decodeAuthKey_(n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 AuthKeyData* CredentialData::findAuthKey_(bool allowUsingExhaustedKeys,
                                           bool allowUsingExpiredKeys) {
-    AuthKeyData* candidate = nullptr;
-
     int64_t nowMilliSeconds =
         std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()) * 1000;
 
-    int n = 0;
-    for (AuthKeyData& data : authKeyDatas_) {
-        if (nowMilliSeconds > data.expirationDateMillisSinceEpoch) {
-            if (!allowUsingExpiredKeys) {
-                continue;
-            }
+    // The first usable key is the least used one, and ties go to the lowest index.
+    ensureAuthKeysByUseCount_();
+    for (auto [useCount, index] : authKeysByUseCount_) {
+        AuthKeyData& data = authKeyDatas_[index];
+        if (nowMilliSeconds > data.expirationDateMillisSinceEpoch && !allowUsingExpiredKeys) {
+            continue;
         }
-        if (data.certificate.size() != 0) {
-            // Not expired, include in normal check
-            if (candidate == nullptr || data.useCount < candidate->useCount) {
-                candidate = &data;
-            }
+        if (useCount >= maxUsesPerKey_ && !allowUsingExhaustedKeys) {
+            return nullptr;
         }
-        n++;
+        return &data;
     }
-
-    if (candidate == nullptr) {
-        return nullptr;
-    }
-
-    if (candidate->useCount >= maxUsesPerKey_ && !allowUsingExhaustedKeys) {
-        return nullptr;
-    }
-
-    return candidate;
+    return nullptr;
 }
 
 const AuthKeyData* CredentialData::selectAuthKey(bool allowUsingExhaustedKeys,
@@ -556,12 +1334,21 @@ const AuthKeyData* CredentialData::selectAuthKey(bool allowUsingExhaustedKeys,
         }
     }
 
+    size_t index = candidate - authKeyDatas_.data();
+    if (!decodeAuthKey_(index)) {
+        return nullptr;
+    }
+    authKeysByUseCount_.erase({candidate->useCount, index});
     candidate->useCount += 1;
+    authKeysByUseCount_.insert({candidate->useCount, index});
     return candidate;
 }
 
 optional<vector<vector<uint8_t>>>
 CredentialData::getAuthKeysNeedingCertification(const sp<IIdentityCredential>& halBinder) {
+    if (!decodeAllAuthKeys_()) {
+        return {};
+    }
 
     vector<vector<uint8_t>> keysNeedingCert;
 
@@ -597,8 +1384,16 @@ CredentialData::getAuthKeysNeedingCertification(const sp<IIdentityCredential>& h
 bool CredentialData::storeStaticAuthenticationData(const vector<uint8_t>& authenticationKey,
                                                    int64_t expirationDateMillisSinceEpoch,
                                                    const vector<uint8_t>& staticAuthData) {
-    for (AuthKeyData& data : authKeyDatas_) {
+    if (!decodeAllAuthKeys_()) {
+        return false;
+    }
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        AuthKeyData& data = authKeyDatas_[n];
         if (data.pendingCertificate == authenticationKey) {
+            if (authKeysByUseCountValid_) {
+                authKeysByUseCount_.erase({data.useCount, n});
+                authKeysByUseCount_.insert({0, n});
+            }
             data.certificate = data.pendingCertificate;
             data.keyBlob = data.pendingKeyBlob;
             data.expirationDateMillisSinceEpoch = expirationDateMillisSinceEpoch;
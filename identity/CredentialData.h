@@ -21,7 +21,11 @@
 #include <unistd.h>
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -42,6 +46,8 @@ using ::std::string;
 using ::std::tuple;
 using ::std::vector;
 
+class MappedFile;
+
 struct EntryData {
     EntryData() {}
 
@@ -50,6 +56,20 @@ struct EntryData {
     vector<vector<uint8_t>> encryptedChunks;
 };
 
+// Entries are keyed by "<namespace>:<name>". This comparator also orders such keys against a
+// (namespace, name) pair of string_views, so lookups don't have to build the key.
+struct EntryIdLess {
+    using is_transparent = void;
+    using NamespaceAndName = pair<std::string_view, std::string_view>;
+
+    bool operator()(const string& a, const string& b) const { return a < b; }
+    bool operator()(const string& a, const NamespaceAndName& b) const { return compare(a, b) < 0; }
+    bool operator()(const NamespaceAndName& a, const string& b) const { return compare(b, a) > 0; }
+
+  private:
+    static int compare(std::string_view id, const NamespaceAndName& nsAndName);
+};
+
 struct AuthKeyData {
     AuthKeyData() {}
 
@@ -62,6 +82,16 @@ struct AuthKeyData {
     int useCount = 0;
 };
 
+// What the per-uid metadata index records about a credential, so credentials can be listed
+// without loading each of them.
+struct CredentialMetadata {
+    string name;
+    string docType;
+    int authKeyCount = 0;
+    int maxUsesPerAuthKey = 0;
+    vector<int64_t> authKeyExpirationDatesMillisSinceEpoch;  // Of the certified keys.
+};
+
 class CredentialData : public RefBase {
   public:
     CredentialData(const string& dataPath, uid_t ownerUid, const string& name);
@@ -72,6 +102,16 @@ class CredentialData : public RefBase {
     static optional<bool> credentialExists(const string& dataPath, uid_t ownerUid,
                                            const string& name);
 
+    // Returns the mutex which serializes binder calls that work on the given credential, so
+    // calls on different credentials can be served in parallel.
+    static std::shared_ptr<std::mutex> getCredentialMutex(const string& dataPath, uid_t ownerUid,
+                                                          const string& name);
+
+    // Lists the credentials of |ownerUid|, ordered by name, from the metadata index which
+    // saveToDisk() and deleteCredential() keep up to date. Returns nothing on error.
+    static optional<vector<CredentialMetadata>> listCredentials(const string& dataPath,
+                                                                uid_t ownerUid);
+
     void setSecureUserId(int64_t secureUserId);
 
     void setCredentialData(const vector<uint8_t>& credentialData);
@@ -81,10 +121,16 @@ class CredentialData : public RefBase {
     void
     addSecureAccessControlProfile(const SecureAccessControlProfile& secureAccessControlProfile);
 
-    void addEntryData(const string& namespaceName, const string& entryName, const EntryData& data);
+    void addEntryData(const string& namespaceName, const string& entryName, EntryData data);
 
     bool saveToDisk() const;
 
+    // Persists the use count of |authKey|, which must have been returned by selectAuthKey(),
+    // by appending it to a small journal next to the credential file instead of rewriting the
+    // whole file. The journal is folded back into the file by saveToDisk(), which this also
+    // calls once the journal has grown long.
+    bool saveAuthKeyUseCount(const AuthKeyData* authKey);
+
     bool loadFromDisk();
 
     bool deleteCredential();
@@ -97,7 +143,9 @@ class CredentialData : public RefBase {
 
     const vector<uint8_t>& getCredentialData() const;
 
-    const vector<uint8_t>& getAttestationCertificate() const;
+    // Returns the whole attestation certificate chain, with the certificates from the
+    // certificate store appended to the credential's own certificate.
+    vector<uint8_t> getAttestationCertificate() const;
 
     const vector<SecureAccessControlProfile>& getSecureAccessControlProfiles() const;
 
@@ -105,6 +153,12 @@ class CredentialData : public RefBase {
 
     optional<EntryData> getEntryData(const string& namespaceName, const string& entryName) const;
 
+    // Like getEntryData() but without copying the entry. Returns |nullptr| if there is no such
+    // entry. The pointer is valid until this object is modified.
+    const EntryData* findEntryData(const string& namespaceName, const string& entryName) const;
+
+    // Keys which were loaded from disk and have not been used since only have their use count
+    // and expiration date set. The other fields are decoded when selectAuthKey() picks a key.
     const vector<AuthKeyData>& getAuthKeyDatas() const;
 
     pair<int /* keyCount */, int /*maxUsersPerKey */> getAvailableAuthenticationKeys();
@@ -123,6 +177,36 @@ class CredentialData : public RefBase {
   private:
     AuthKeyData* findAuthKey_(bool allowUsingExhaustedKeys, bool allowUsingExpiredKeys);
 
+    void ensureAuthKeysByUseCount_();
+
+    // Returns whether the key at |index| has a certificate, without decoding the key.
+    bool isAuthKeyCertified_(size_t index) const;
+
+    // Decodes the key at |index| if it is still in |mappedFile_|. Returns false on error.
+    bool decodeAuthKey_(size_t index);
+
+    bool decodeAllAuthKeys_();
+
+    bool loadFromDiskUncached_();
+
+    // Applies the use counts recorded in the journal, if it belongs to the loaded file.
+    void loadUseCountJournal_();
+
+    // Stores a copy of the data serialized to disk in the process-wide credential cache.
+    void updateCache_() const;
+
+    void copyPersistentDataFrom_(const CredentialData& other);
+
+    CredentialMetadata getMetadata_() const;
+
+    // Adds, replaces or (if |deleted|) removes this credential in the metadata index.
+    void updateMetadataIndex_(bool deleted) const;
+
+    // Reads the metadata index of |ownerUid|, rebuilding it from the credential files if it
+    // is missing. The caller must hold the index lock.
+    static optional<map<string, CredentialMetadata>> loadMetadataIndex_(const string& dataPath,
+                                                                        uid_t ownerUid);
+
     // Set by constructor.
     //
     string dataPath_;
@@ -131,18 +215,53 @@ class CredentialData : public RefBase {
 
     // Calculated at construction time, from |dataPath_|, |ownerUid_|, |name_|.
     string fileName_;
+    string journalFileName_;
 
     // Data serialized in CBOR from here:
     //
     int64_t secureUserId_;
     vector<uint8_t> credentialData_;
     vector<uint8_t> attestationCertificate_;
+    // The certificates above |attestationCertificate_| in its chain, if they came from the
+    // certificate store. They are shared with every other credential using the same chain.
+    // When this is empty |attestationCertificate_| holds the whole chain.
+    vector<std::shared_ptr<const vector<uint8_t>>> attestationCertificateChain_;
     vector<SecureAccessControlProfile> secureAccessControlProfiles_;
-    map<string, EntryData> idToEncryptedChunks_;
+    map<string, EntryData, EntryIdLess> idToEncryptedChunks_;
+
+    // Entries which are still in the loaded file, with their offset and size within
+    // |mappedFile_|. They are decoded by findEntryData() when needed and kept in
+    // |decodedEntries_|. Entries added with addEntryData() take precedence.
+    std::shared_ptr<const MappedFile> mappedFile_;
+    map<string, pair<size_t /* offset */, size_t /* size */>, EntryIdLess> entryIndex_;
+    mutable map<string, EntryData, EntryIdLess> decodedEntries_;
 
     int keyCount_ = 0;
     int maxUsesPerKey_ = 1;
     vector<AuthKeyData> authKeyDatas_;  // Always |keyCount_| long.
+
+    // Like |entryIndex_|, the location of each key in |authKeyDatas_| which is still in the
+    // loaded file, and whether it has a certificate. Only the use counts and expiration dates
+    // of these keys are loaded up front. Always |keyCount_| long, with no value for keys which
+    // have been decoded or were added since.
+    struct AuthKeyLocation {
+        size_t offset;
+        size_t size;
+        bool certified;
+    };
+    vector<optional<AuthKeyLocation>> authKeyLocations_;
+
+    // The certified keys in |authKeyDatas_| as (use count, index) pairs, least used first.
+    // Built when first needed, kept up to date by selectAuthKey() and
+    // storeStaticAuthenticationData(), and dropped whenever |authKeyDatas_| is replaced.
+    std::set<pair<int /* useCount */, size_t /* index */>> authKeysByUseCount_;
+    bool authKeysByUseCountValid_ = false;
+
+    // Identifies the use count journal which goes with the file as last saved; every
+    // saveToDisk() picks a new one so that older journals are ignored. Zero means there is no
+    // journal yet.
+    mutable uint64_t journalId_ = 0;
+    mutable size_t journalRecords_ = 0;
 };
 
 }  // namespace identity
@@ -83,6 +83,7 @@ Status CredentialStore::createCredential(const std::string& credentialName,
         }
     }
 
+    InFlightHalCall halCall;
     sp<IWritableIdentityCredential> halWritableCredential;
     Status status = hal_->createCredential(docType, false, &halWritableCredential);
     if (!status.isOk()) {
@@ -116,6 +117,7 @@ Status CredentialStore::getCredentialByName(const std::string& credentialName, i
     sp<Credential> credential = new Credential(CipherSuite(cipherSuite), dataPath_, credentialName,
                                                callingUid, hwInfo_, hal_, halApiVersion_);
 
+    InFlightHalCall halCall;
     Status loadStatus = credential->ensureOrReplaceHalBinder();
     if (!loadStatus.isOk()) {
         LOG(ERROR) << "Error loading credential";
@@ -125,6 +127,28 @@ Status CredentialStore::getCredentialByName(const std::string& credentialName, i
     return loadStatus;
 }
 
+Status CredentialStore::listCredentials(vector<CredentialMetadataParcel>* _aidl_return) {
+    uid_t callingUid = android::IPCThreadState::self()->getCallingUid();
+    optional<vector<CredentialMetadata>> credentials =
+        CredentialData::listCredentials(dataPath_, callingUid);
+    if (!credentials) {
+        return Status::fromServiceSpecificError(ERROR_GENERIC, "Error listing credentials");
+    }
+    vector<CredentialMetadataParcel> ret;
+    for (CredentialMetadata& metadata : credentials.value()) {
+        CredentialMetadataParcel parcel;
+        parcel.credentialName = std::move(metadata.name);
+        parcel.docType = std::move(metadata.docType);
+        parcel.authKeyCount = metadata.authKeyCount;
+        parcel.maxUsesPerAuthKey = metadata.maxUsesPerAuthKey;
+        parcel.authKeyExpirationDatesMillisSinceEpoch =
+            std::move(metadata.authKeyExpirationDatesMillisSinceEpoch);
+        ret.push_back(std::move(parcel));
+    }
+    *_aidl_return = std::move(ret);
+    return Status::ok();
+}
+
 }  // namespace identity
 }  // namespace security
 }  // namespace android
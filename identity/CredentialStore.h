@@ -53,6 +53,8 @@ class CredentialStore : public BnCredentialStore {
     Status getCredentialByName(const string& credentialName, int32_t cipherSuite,
                                sp<ICredential>* _aidl_return) override;
 
+    Status listCredentials(vector<CredentialMetadataParcel>* _aidl_return) override;
+
   private:
     string dataPath_;
 
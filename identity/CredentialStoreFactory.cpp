@@ -16,6 +16,11 @@
 
 #define LOG_TAG "credstore"
 
+#include <chrono>
+#include <thread>
+#include <utility>
+
+#include <android-base/file.h>
 #include <android-base/logging.h>
 
 #include <binder/IPCThreadState.h>
@@ -23,6 +28,7 @@
 
 //#include "CredentialStore.h"
 #include "CredentialStoreFactory.h"
+#include "PresentationStats.h"
 
 namespace android {
 namespace security {
@@ -55,29 +61,35 @@ CredentialStore* CredentialStoreFactory::createCredentialStore(const string& ins
     return store;
 }
 
+sp<CredentialStore> CredentialStoreFactory::getOrCreateStore(LazyStore* lazyStore,
+                                                              const string& instanceName) {
+    std::lock_guard<std::mutex> lock(lazyStore->mutex);
+    if (lazyStore->store.get() == nullptr) {
+        lazyStore->store = createCredentialStore(instanceName);
+    }
+    return lazyStore->store;
+}
+
 Status CredentialStoreFactory::getCredentialStore(int32_t credentialStoreType,
                                                   sp<ICredentialStore>* _aidl_return) {
+    sp<CredentialStore> store;
     switch (credentialStoreType) {
     case CREDENTIAL_STORE_TYPE_DEFAULT:
-        if (defaultStore_.get() == nullptr) {
-            defaultStore_ = createCredentialStore("default");
-        }
-        if (defaultStore_.get() == nullptr) {
+        store = getOrCreateStore(&defaultStore_, "default");
+        if (store.get() == nullptr) {
             return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                     "Error creating default store");
         }
-        *_aidl_return = defaultStore_.get();
+        *_aidl_return = store.get();
         return Status::ok();
 
     case CREDENTIAL_STORE_TYPE_DIRECT_ACCESS:
-        if (directAccessStore_.get() == nullptr) {
-            directAccessStore_ = createCredentialStore("directAccess");
-        }
-        if (directAccessStore_.get() == nullptr) {
+        store = getOrCreateStore(&directAccessStore_, "directAccess");
+        if (store.get() == nullptr) {
             return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                     "Error creating direct access store");
         }
-        *_aidl_return = directAccessStore_.get();
+        *_aidl_return = store.get();
         return Status::ok();
         break;
     }
@@ -86,6 +98,34 @@ Status CredentialStoreFactory::getCredentialStore(int32_t credentialStoreType,
                                             "Unknown credential store type");
 }
 
+void CredentialStoreFactory::warmUp() {
+    for (auto [lazyStore, instanceName] : {std::make_pair(&defaultStore_, "default"),
+                                           std::make_pair(&directAccessStore_, "directAccess")}) {
+        // The threads keep the factory alive until they are done.
+        std::thread([self = sp<CredentialStoreFactory>(this), lazyStore = lazyStore,
+                     instanceName = string(instanceName)] {
+            auto start = std::chrono::steady_clock::now();
+            bool created = self->getOrCreateStore(lazyStore, instanceName).get() != nullptr;
+            auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            LOG(INFO) << "Warming up the " << instanceName << " store "
+                      << (created ? "succeeded" : "failed") << " after " << elapsedMs << " ms";
+        }).detach();
+    }
+}
+
+status_t CredentialStoreFactory::dump(int fd, const Vector<String16>& /* args */) {
+    if (!checkCallingPermission(String16("android.permission.DUMP"))) {
+        return PERMISSION_DENIED;
+    }
+    string stats = "getEntries latency:\n" + formatPresentationStats();
+    if (!::android::base::WriteStringToFd(stats, fd)) {
+        return UNKNOWN_ERROR;
+    }
+    return OK;
+}
+
 }  // namespace identity
 }  // namespace security
 }  // namespace android
@@ -17,6 +17,8 @@
 #ifndef SYSTEM_SECURITY_CREDENTIAL_STORE_FACTORY_H_
 #define SYSTEM_SECURITY_CREDENTIAL_STORE_FACTORY_H_
 
+#include <mutex>
+
 #include <android/security/identity/BnCredentialStoreFactory.h>
 
 #include "CredentialStore.h"
@@ -37,13 +39,31 @@ class CredentialStoreFactory : public BnCredentialStoreFactory {
     Status getCredentialStore(int32_t credentialStoreType,
                               sp<ICredentialStore>* _aidl_return) override;
 
+    // Creates the default and direct access stores concurrently on background threads, so that
+    // the first getCredentialStore() call does not wait for the HALs to start. Returns right
+    // away.
+    void warmUp();
+
+    // Writes the per-step getEntries() latency statistics, for dumpsys.
+    status_t dump(int fd, const Vector<String16>& args) override;
+
   private:
+    // A lazily created store. Each has its own lock, so creating one does not hold up
+    // requests for the other.
+    struct LazyStore {
+        std::mutex mutex;
+        sp<CredentialStore> store;
+    };
+
     CredentialStore* createCredentialStore(const string& instanceName);
 
+    // Returns the store, creating it first if needed. Returns nullptr if that fails.
+    sp<CredentialStore> getOrCreateStore(LazyStore* lazyStore, const string& instanceName);
+
     string dataPath_;
 
-    sp<CredentialStore> defaultStore_;
-    sp<CredentialStore> directAccessStore_;
+    LazyStore defaultStore_;
+    LazyStore directAccessStore_;
 };
 
 }  // namespace identity
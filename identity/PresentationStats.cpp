@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Most of a presentation is spent in the Identity Credential HAL.
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include <atomic>
+#include <sstream>
+
+#include <utils/Trace.h>
+
+#include "PresentationStats.h"
+
+namespace android {
+namespace security {
+namespace identity {
+
+namespace {
+
+constexpr size_t kNumSteps = static_cast<size_t>(PresentationStep::COUNT);
+
+const char* const kStepNames[kNumSteps] = {
+    "wait_for_hal",
+    "load_from_disk",
+    "ensure_challenge",
+    "get_tokens_from_keystore2",
+    "wait_for_tokens",
+    "set_requested_namespaces",
+    "set_verification_token",
+    "start_retrieval",
+    "start_retrieve_entry_value",
+    "retrieve_entry_value",
+    "finish_retrieval",
+    "save_to_disk",
+    "total",
+};
+
+// The trace sections carry a prefix so that they are easy to find among the HAL's own.
+const char* const kTraceNames[kNumSteps] = {
+    "credstore:wait_for_hal",
+    "credstore:load_from_disk",
+    "credstore:ensure_challenge",
+    "credstore:get_tokens_from_keystore2",
+    "credstore:wait_for_tokens",
+    "credstore:set_requested_namespaces",
+    "credstore:set_verification_token",
+    "credstore:start_retrieval",
+    "credstore:start_retrieve_entry_value",
+    "credstore:retrieve_entry_value",
+    "credstore:finish_retrieval",
+    "credstore:save_to_disk",
+    "credstore:get_entries",
+};
+
+struct StepStats {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> totalUs;
+    std::atomic<uint64_t> maxUs;
+};
+
+StepStats stepStats[kNumSteps];
+
+}  // namespace
+
+void recordPresentationStep(PresentationStep step, std::chrono::nanoseconds duration) {
+    StepStats& stats = stepStats[static_cast<size_t>(step)];
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    stats.count++;
+    stats.totalUs += us;
+    uint64_t maxUs = stats.maxUs.load(std::memory_order_relaxed);
+    while (us > maxUs && !stats.maxUs.compare_exchange_weak(maxUs, us)) {
+    }
+}
+
+ScopedPresentationStep::ScopedPresentationStep(PresentationStep step,
+                                               std::chrono::nanoseconds* sum)
+    : step_(step), sum_(sum), start_(std::chrono::steady_clock::now()) {
+    ATRACE_BEGIN(kTraceNames[static_cast<size_t>(step)]);
+}
+
+ScopedPresentationStep::~ScopedPresentationStep() {
+    ATRACE_END();
+    auto duration = std::chrono::steady_clock::now() - start_;
+    if (sum_ != nullptr) {
+        *sum_ += duration;
+    } else {
+        recordPresentationStep(step_, duration);
+    }
+}
+
+string formatPresentationStats() {
+    std::stringstream ss;
+    for (size_t n = 0; n < kNumSteps; n++) {
+        const StepStats& stats = stepStats[n];
+        ss << "step=" << kStepNames[n] << " count=" << stats.count
+           << " total_us=" << stats.totalUs << " max_us=" << stats.maxUs << "\n";
+    }
+    return ss.str();
+}
+
+}  // namespace identity
+}  // namespace security
+}  // namespace android
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_SECURITY_IDENTITY_PRESENTATION_STATS_H_
+#define SYSTEM_SECURITY_IDENTITY_PRESENTATION_STATS_H_
+
+#include <chrono>
+#include <string>
+
+namespace android {
+namespace security {
+namespace identity {
+
+using ::std::string;
+
+// The steps of ICredential.getEntries() which are timed separately. The entry steps add up
+// every call made for the entries of one presentation.
+enum class PresentationStep {
+    WAIT_FOR_HAL,
+    LOAD_FROM_DISK,
+    ENSURE_CHALLENGE,
+    GET_TOKENS_FROM_KEYSTORE2,
+    WAIT_FOR_TOKENS,
+    SET_REQUESTED_NAMESPACES,
+    SET_VERIFICATION_TOKEN,
+    START_RETRIEVAL,
+    START_RETRIEVE_ENTRY_VALUE,
+    RETRIEVE_ENTRY_VALUE,
+    FINISH_RETRIEVAL,
+    SAVE_TO_DISK,
+    TOTAL,
+    COUNT,
+};
+
+// Adds |duration| to the statistics of |step|. Safe to call from any thread.
+void recordPresentationStep(PresentationStep step, std::chrono::nanoseconds duration);
+
+// Times a step for recordPresentationStep() and emits a matching trace section. If |sum| is
+// given the time is added to it instead, for steps which are recorded once for many calls.
+//
+class ScopedPresentationStep {
+  public:
+    explicit ScopedPresentationStep(PresentationStep step,
+                                    std::chrono::nanoseconds* sum = nullptr);
+    ~ScopedPresentationStep();
+
+    ScopedPresentationStep(const ScopedPresentationStep&) = delete;
+    ScopedPresentationStep& operator=(const ScopedPresentationStep&) = delete;
+
+  private:
+    PresentationStep step_;
+    std::chrono::nanoseconds* sum_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Returns one line of key=value pairs per step with the number of presentations which went
+// through it and their total and largest time spent in it.
+string formatPresentationStats();
+
+}  // namespace identity
+}  // namespace security
+}  // namespace android
+
+#endif  // SYSTEM_SECURITY_IDENTITY_PRESENTATION_STATS_H_
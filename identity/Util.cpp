@@ -18,15 +18,23 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 
 #include <android/security/identity/ICredentialStore.h>
 
+#include <cppbor.h>
+#include <cppbor_parse.h>
+
 #include "Util.h"
 
 namespace android {
@@ -80,22 +88,101 @@ optional<vector<uint8_t>> fileGetContents(const string& path) {
     return data;
 }
 
-bool fileSetContents(const string& path, const vector<uint8_t>& data) {
-    char tempName[4096];
-    int fd;
+MappedFile::~MappedFile() {
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
 
-    string tempNameStr = path + ".XXXXXX";
-    if (tempNameStr.size() >= sizeof tempName - 1) {
-        LOG(ERROR) << "Path name too long";
-        return false;
+std::shared_ptr<const MappedFile> fileMap(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        PLOG(ERROR) << "Error opening " << path;
+        return nullptr;
     }
-    strncpy(tempName, tempNameStr.c_str(), sizeof tempName);
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0) {
+        PLOG(ERROR) << "Error statting " << path;
+        close(fd);
+        return nullptr;
+    }
+    if (statbuf.st_size == 0) {
+        LOG(ERROR) << path << " is empty";
+        close(fd);
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Error mapping " << path;
+        return nullptr;
+    }
+    return std::make_shared<const MappedFile>(static_cast<const uint8_t*>(addr),
+                                              statbuf.st_size);
+}
 
-    fd = mkstemp(tempName);
+namespace {
+
+string dirName(const string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+// Creates the temp file which fileSetContents() writes and then renames over |path|. Where the
+// file system supports it, the file is created without a name and only linked in once it has
+// been written, so a crash never leaves partial temp files behind. Returns the file
+// descriptor, or -1 on error. On success |tempName| is empty if the file has no name yet.
+int createTempFile(const string& path, string* tempName) {
+    int fd =
+        TEMP_FAILURE_RETRY(open(dirName(path).c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600));
+    if (fd != -1) {
+        tempName->clear();
+        return fd;
+    }
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        PLOG(ERROR) << "Error creating temp file for '" << path << "'";
+        return -1;
+    }
+
+    *tempName = path + ".XXXXXX";
+    fd = mkstemp(tempName->data());
     if (fd == -1) {
         PLOG(ERROR) << "Error creating temp file for '" << path << "'";
+    }
+    return fd;
+}
+
+// Gives the unnamed temp file |fd| a name next to |path|, which it is then renamed from.
+bool linkTempFile(int fd, const string& path, string* tempName) {
+    static std::atomic<uint32_t> counter = 0;
+    string procPath = StringPrintf("/proc/self/fd/%d", fd);
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        *tempName = StringPrintf("%s.%d.%u", path.c_str(), getpid(), counter.fetch_add(1));
+        if (linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, tempName->c_str(), AT_SYMLINK_FOLLOW) ==
+            0) {
+            return true;
+        }
+        if (errno != EEXIST) break;
+        // Left behind by an earlier process with the same pid.
+        unlink(tempName->c_str());
+    }
+    PLOG(ERROR) << "Error linking temp file for '" << path << "'";
+    return false;
+}
+
+}  // namespace
+
+bool fileSetContents(const string& path, const vector<uint8_t>& data) {
+    string tempName;
+    int fd = createTempFile(path, &tempName);
+    if (fd == -1) {
         return false;
     }
+    auto fail = [&] {
+        close(fd);
+        if (!tempName.empty()) unlink(tempName.c_str());
+        return false;
+    };
 
     const uint8_t* p = data.data();
     size_t remaining = data.size();
@@ -103,29 +190,94 @@ bool fileSetContents(const string& path, const vector<uint8_t>& data) {
         ssize_t numWritten = TEMP_FAILURE_RETRY(write(fd, p, remaining));
         if (numWritten <= 0) {
             PLOG(ERROR) << "Failed writing into temp file for '" << path << "'";
-            close(fd);
-            return false;
+            return fail();
         }
         p += numWritten;
         remaining -= numWritten;
     }
 
-    if (TEMP_FAILURE_RETRY(fsync(fd))) {
+    // fdatasync is enough: the rename makes the file's metadata reachable, and the size is
+    // part of what fdatasync flushes.
+    if (TEMP_FAILURE_RETRY(fdatasync(fd))) {
         PLOG(ERROR) << "Failed fsyncing temp file for '" << path << "'";
-        close(fd);
-        return false;
+        return fail();
+    }
+    if (tempName.empty() && !linkTempFile(fd, path, &tempName)) {
+        return fail();
     }
     close(fd);
 
-    if (rename(tempName, path.c_str()) != 0) {
+    if (rename(tempName.c_str(), path.c_str()) != 0) {
         PLOG(ERROR) << "Error renaming temp file for '" << path << "'";
-        close(fd);
+        unlink(tempName.c_str());
         return false;
     }
 
     return true;
 }
 
+bool fileSyncDirectory(const string& path) {
+    string dir = dirName(path);
+    int fd = TEMP_FAILURE_RETRY(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(ERROR) << "Error opening directory '" << dir << "'";
+        return false;
+    }
+    bool ok = TEMP_FAILURE_RETRY(fsync(fd)) == 0;
+    if (!ok) {
+        PLOG(ERROR) << "Error fsyncing directory '" << dir << "'";
+    }
+    close(fd);
+    return ok;
+}
+
+namespace {
+
+std::mutex inFlightHalCallsMutex;
+std::condition_variable inFlightHalCallsChanged;
+size_t maxInFlightHalCalls = 1;
+size_t inFlightHalCalls = 0;
+
+}  // namespace
+
+void setMaxInFlightHalCalls(size_t maxCalls) {
+    std::lock_guard<std::mutex> lock(inFlightHalCallsMutex);
+    maxInFlightHalCalls = maxCalls > 0 ? maxCalls : 1;
+}
+
+InFlightHalCall::InFlightHalCall() {
+    std::unique_lock<std::mutex> lock(inFlightHalCallsMutex);
+    inFlightHalCallsChanged.wait(lock, [] { return inFlightHalCalls < maxInFlightHalCalls; });
+    inFlightHalCalls++;
+}
+
+InFlightHalCall::~InFlightHalCall() {
+    {
+        std::lock_guard<std::mutex> lock(inFlightHalCallsMutex);
+        inFlightHalCalls--;
+    }
+    inFlightHalCallsChanged.notify_one();
+}
+
+optional<string> extractDocType(const vector<uint8_t>& credentialData) {
+    auto [item, _ /* newPos */, message] = cppbor::parse(credentialData);
+    if (item == nullptr) {
+        LOG(ERROR) << "CredentialData is not valid CBOR: " << message;
+        return {};
+    }
+    const cppbor::Array* array = item->asArray();
+    if (array == nullptr || array->size() < 1) {
+        LOG(ERROR) << "CredentialData array with at least one element";
+        return {};
+    }
+    const cppbor::Tstr* tstr = ((*array)[0])->asTstr();
+    if (tstr == nullptr) {
+        LOG(ERROR) << "First item in CredentialData is not a string";
+        return {};
+    }
+    return tstr->value();
+}
+
 }  // namespace identity
 }  // namespace security
 }  // namespace android
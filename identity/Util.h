@@ -17,6 +17,9 @@
 #ifndef SYSTEM_SECURITY_IDENTITY_UTIL_H_
 #define SYSTEM_SECURITY_IDENTITY_UTIL_H_
 
+#include <stddef.h>
+
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -39,18 +42,77 @@ Status halStatusToGenericError(const Status& halStatus);
 // Converts a HAL status to a credstore service-specific error of a given value
 Status halStatusToError(const Status& halStatus, int credStoreError);
 
-// Helper function to atomically write |data| into file at |path|.
+// Helper function to atomically write |data| into file at |path|. The rename which puts the
+// new file in place is made durable by fileSyncDirectory(), which callers writing several files
+// to the same directory call once, after the last of them.
 //
 // Returns true on success, false on error.
 //
 bool fileSetContents(const string& path, const vector<uint8_t>& data);
 
+// Helper function which fsyncs the directory containing |path|, so that files renamed into it
+// by fileSetContents() survive a crash.
+//
+// Returns true on success, false on error.
+//
+bool fileSyncDirectory(const string& path);
+
 // Helper function which reads contents offile at |path| into |data|.
 //
 // Returns nothing on error, the content on success.
 //
 optional<vector<uint8_t>> fileGetContents(const string& path);
 
+// A file mapped read-only into memory, see fileMap().
+//
+class MappedFile {
+  public:
+    MappedFile(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    const uint8_t* begin() const { return data_; }
+    const uint8_t* end() const { return data_ + size_; }
+
+  private:
+    const uint8_t* data_;
+    size_t size_;
+};
+
+// Helper function which maps the file at |path| into memory, so that it can be parsed in
+// place instead of being read into a copy first. The pages are only brought in as they are
+// touched, and the file is not held in memory twice while it is being parsed.
+//
+// Returns nullptr on error, which includes an empty file.
+//
+std::shared_ptr<const MappedFile> fileMap(const string& path);
+
+// Returns the DocType from the CredentialData returned by the HAL, or nothing if it
+// can't be found.
+//
+optional<string> extractDocType(const vector<uint8_t>& credentialData);
+
+// Sets how many binder calls may use the HAL at the same time. Set once, at startup, before
+// binder calls are served. The default is one.
+//
+void setMaxInFlightHalCalls(size_t maxCalls);
+
+// Held by a binder call for as long as it uses the HAL. Blocks until fewer than the
+// maximum number of calls set with setMaxInFlightHalCalls() hold one.
+//
+class InFlightHalCall {
+  public:
+    InFlightHalCall();
+    ~InFlightHalCall();
+
+    InFlightHalCall(const InFlightHalCall&) = delete;
+    InFlightHalCall& operator=(const InFlightHalCall&) = delete;
+};
+
 }  // namespace identity
 }  // namespace security
 }  // namespace android
@@ -16,6 +16,13 @@
 
 #define LOG_TAG "credstore"
 
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <optional>
+
 #include <android-base/logging.h>
 #include <android/hardware/identity/support/IdentityCredentialSupport.h>
 #include <android/security/identity/ICredentialStore.h>
@@ -36,8 +43,6 @@ using ::std::pair;
 
 using ::android::hardware::identity::SecureAccessControlProfile;
 
-using ::android::hardware::identity::support::chunkVector;
-
 WritableCredential::WritableCredential(const string& dataPath, const string& credentialName,
                                        const string& docType, bool isUpdate,
                                        HardwareInformation hwInfo,
@@ -84,6 +89,9 @@ Status WritableCredential::ensureAttestationCertificateExists(const vector<uint8
 
 Status WritableCredential::getCredentialKeyCertificateChain(const vector<uint8_t>& challenge,
                                                             vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    InFlightHalCall halCall;
+
     if (isUpdate_) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Cannot be called for an update");
@@ -106,66 +114,192 @@ void WritableCredential::setAvailableAuthenticationKeys(int keyCount, int maxUse
     maxUsesPerKey_ = maxUsesPerKey;
 }
 
+namespace {
+
+// Sizes of CBOR data items as cppbor encodes them, for adding up the size of a document
+// without building it.
+size_t cborHeaderSize(uint64_t argument) {
+    if (argument < 24) return 1;
+    if (argument <= 0xff) return 2;
+    if (argument <= 0xffff) return 3;
+    if (argument <= 0xffffffff) return 5;
+    return 9;
+}
+
+size_t cborIntSize(int64_t value) {
+    return cborHeaderSize(value < 0 ? uint64_t(-(value + 1)) : uint64_t(value));
+}
+
+size_t cborStringSize(size_t length) {
+    return cborHeaderSize(length) + length;
+}
+
+// Returns true if |data| is exactly one CBOR data item which cppbor re-encodes to the same
+// bytes: definite lengths, shortest-form arguments, and only the simple values false, true
+// and null. Values outside of this are still handled, by calcCborValueSize() re-encoding them.
+bool isSingleShortestFormItem(const vector<uint8_t>& data) {
+    const uint8_t* pos = data.data();
+    const uint8_t* end = pos + data.size();
+    uint64_t pendingItems = 1;
+    while (pendingItems > 0) {
+        pendingItems--;
+        if (pos == end) {
+            return false;
+        }
+        uint8_t majorType = *pos >> 5;
+        uint8_t additionalInfo = *pos & 0x1f;
+        pos++;
+        uint64_t argument = additionalInfo;
+        if (additionalInfo >= 24) {
+            if (additionalInfo > 27) {
+                return false;
+            }
+            size_t argumentSize = size_t(1) << (additionalInfo - 24);
+            if (size_t(end - pos) < argumentSize) {
+                return false;
+            }
+            argument = 0;
+            for (size_t n = 0; n < argumentSize; n++) {
+                argument = (argument << 8) | *pos++;
+            }
+            if (cborHeaderSize(argument) != 1 + argumentSize) {
+                return false;
+            }
+        }
+        // Every pending item takes at least one byte, which bounds |pendingItems|.
+        uint64_t remaining = end - pos;
+        switch (majorType) {
+            case 0:  // Unsigned integer
+                break;
+            case 1:  // Negative integer
+                // cppbor holds negative integers as int64_t, so it can't keep -1 - argument
+                // beyond that.
+                if (argument > uint64_t(std::numeric_limits<int64_t>::max())) {
+                    return false;
+                }
+                break;
+            case 2:  // Byte string
+            case 3:  // Text string
+                if (argument > remaining) {
+                    return false;
+                }
+                pos += argument;
+                break;
+            case 4:  // Array
+                if (argument > remaining) {
+                    return false;
+                }
+                pendingItems += argument;
+                break;
+            case 5:  // Map
+                if (argument > remaining / 2) {
+                    return false;
+                }
+                pendingItems += 2 * argument;
+                break;
+            case 7:  // Simple values
+                if (argument < 20 || argument > 22 || additionalInfo >= 24) {
+                    return false;
+                }
+                break;
+            default:  // Tags
+                return false;
+        }
+        if (pendingItems > remaining) {
+            return false;
+        }
+    }
+    return pos == end;
+}
+
+// Returns the size of |value| once added to a cppbor document, or -1 if it isn't valid CBOR.
+ssize_t calcCborValueSize(const vector<uint8_t>& value) {
+    if (isSingleShortestFormItem(value)) {
+        return value.size();
+    }
+    auto [item, _, _2] = cppbor::parse(value);
+    if (item == nullptr) {
+        return -1;
+    }
+    return item->encode().size();
+}
+
+}  // namespace
+
 ssize_t WritableCredential::calcExpectedProofOfProvisioningSize(
     const vector<AccessControlProfileParcel>& accessControlProfiles,
     const vector<EntryNamespaceParcel>& entryNamespaces) {
-
-    // Right now, we calculate the size by simply just calculating the
-    // CBOR. There's a little bit of overhead associated with this (as compared
-    // to just adding up sizes) but it's a lot simpler and robust. In the future
-    // if this turns out to be a problem, we can optimize it.
+    // This adds up the encoded size of
+    //
+    //   ProofOfProvisioning = [
+    //       "ProofOfProvisioning",
+    //       tstr,                    ; DocType
+    //       [ * AccessControlProfile ],
+    //       { * tstr => [ * Entry ] },
+    //       bool                     ; true if this is a test credential
+    //   ]
+    //
+    // in the same form as the HAL will build it, without building it.
     //
+    size_t size = cborHeaderSize(5);
+    size += cborStringSize(strlen("ProofOfProvisioning"));
+    size += cborStringSize(docType_.size());
 
-    cppbor::Array acpArray;
+    size += cborHeaderSize(accessControlProfiles.size());
     for (const AccessControlProfileParcel& profile : accessControlProfiles) {
-        cppbor::Map map;
-        map.add("id", profile.id);
+        size_t numPairs = 1;
+        size += cborStringSize(strlen("id")) + cborIntSize(profile.id);
         if (profile.readerCertificate.size() > 0) {
-            map.add("readerCertificate", cppbor::Bstr(profile.readerCertificate));
+            numPairs++;
+            size += cborStringSize(strlen("readerCertificate"));
+            size += cborStringSize(profile.readerCertificate.size());
         }
         if (profile.userAuthenticationRequired) {
-            map.add("userAuthenticationRequired", profile.userAuthenticationRequired);
-            map.add("timeoutMillis", profile.userAuthenticationTimeoutMillis);
+            numPairs += 2;
+            size += cborStringSize(strlen("userAuthenticationRequired")) + 1;
+            size += cborStringSize(strlen("timeoutMillis"));
+            size += cborIntSize(profile.userAuthenticationTimeoutMillis);
         }
-        acpArray.add(std::move(map));
+        size += cborHeaderSize(numPairs);
     }
 
-    cppbor::Map dataMap;
+    size += cborHeaderSize(entryNamespaces.size());
     for (const EntryNamespaceParcel& ensParcel : entryNamespaces) {
-        cppbor::Array entriesArray;
+        size += cborStringSize(ensParcel.namespaceName.size());
+        size += cborHeaderSize(ensParcel.entries.size());
         for (const EntryParcel& eParcel : ensParcel.entries) {
-            // TODO: ideally do do this without parsing the data (but still validate data is valid
-            // CBOR).
-            auto [itemForValue, _, _2] = cppbor::parse(eParcel.value);
-            if (itemForValue == nullptr) {
+            ssize_t valueSize = calcCborValueSize(eParcel.value);
+            if (valueSize < 0) {
                 return -1;
             }
-            cppbor::Map entryMap;
-            entryMap.add("name", eParcel.name);
-            entryMap.add("value", std::move(itemForValue));
-            cppbor::Array acpIdsArray;
+            size += cborHeaderSize(3);
+            size += cborStringSize(strlen("name")) + cborStringSize(eParcel.name.size());
+            size += cborStringSize(strlen("value")) + valueSize;
+            size += cborStringSize(strlen("accessControlProfiles"));
+            size += cborHeaderSize(eParcel.accessControlProfileIds.size());
             for (int32_t id : eParcel.accessControlProfileIds) {
-                acpIdsArray.add(id);
+                size += cborIntSize(id);
             }
-            entryMap.add("accessControlProfiles", std::move(acpIdsArray));
-            entriesArray.add(std::move(entryMap));
         }
-        dataMap.add(ensParcel.namespaceName, std::move(entriesArray));
     }
 
-    cppbor::Array array;
-    array.add("ProofOfProvisioning");
-    array.add(docType_);
-    array.add(std::move(acpArray));
-    array.add(std::move(dataMap));
-    array.add(false);  // testCredential
-    return array.encode().size();
+    size += 1;  // testCredential
+    return size;
 }
 
 Status
 WritableCredential::personalize(const vector<AccessControlProfileParcel>& accessControlProfiles,
                                 const vector<EntryNamespaceParcel>& entryNamespaces,
                                 int64_t secureUserId, vector<uint8_t>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uid_t callingUid = android::IPCThreadState::self()->getCallingUid();
+    // Taken in the same order as Credential takes them, so the two can't deadlock.
+    std::shared_ptr<std::mutex> credentialMutex =
+        CredentialData::getCredentialMutex(dataPath_, callingUid, credentialName_);
+    std::unique_lock<std::mutex> credentialLock(*credentialMutex);
+    std::optional<InFlightHalCall> halCall;
+    halCall.emplace();
+
     if (!isUpdate_) {
         Status ensureStatus =
             ensureAttestationCertificateExists({0x00});  // Challenge cannot be empty.
@@ -174,7 +308,6 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
         }
     }
 
-    uid_t callingUid = android::IPCThreadState::self()->getCallingUid();
     CredentialData data = CredentialData(dataPath_, callingUid, credentialName_);
 
     // Note: The value 0 is used to convey that no user-authentication is needed for this
@@ -221,34 +354,51 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
         data.addSecureAccessControlProfile(profile);
     }
 
+    // All chunks are passed to the HAL through the same buffer, and the encrypted chunks it
+    // returns are moved, not copied, into the credential data.
+    size_t chunkSize = hwInfo_.dataChunkSize;
+    vector<uint8_t> chunk;
+    chunk.reserve(chunkSize);
     for (const EntryNamespaceParcel& ensParcel : entryNamespaces) {
         for (const EntryParcel& eParcel : ensParcel.entries) {
-            vector<vector<uint8_t>> chunks = chunkVector(eParcel.value, hwInfo_.dataChunkSize);
+            auto startTime = std::chrono::steady_clock::now();
+            const vector<uint8_t>& value = eParcel.value;
 
             vector<int32_t> ids;
             std::copy(eParcel.accessControlProfileIds.begin(),
                       eParcel.accessControlProfileIds.end(), std::back_inserter(ids));
 
             status = halBinder_->beginAddEntry(ids, ensParcel.namespaceName, eParcel.name,
-                                               eParcel.value.size());
+                                               value.size());
             if (!status.isOk()) {
                 return halStatusToGenericError(status);
             }
 
-            vector<vector<uint8_t>> encryptedChunks;
-            for (const auto& chunk : chunks) {
+            // Like chunkVector(), which this replaces, send an empty value as one empty chunk.
+            size_t numChunks = value.empty() ? 1 : (value.size() + chunkSize - 1) / chunkSize;
+            EntryData eData;
+            eData.encryptedChunks.reserve(numChunks);
+            size_t offset = 0;
+            do {
+                size_t length = std::min(chunkSize, value.size() - offset);
+                chunk.assign(value.begin() + offset, value.begin() + offset + length);
+                offset += length;
                 vector<uint8_t> encryptedChunk;
                 status = halBinder_->addEntryValue(chunk, &encryptedChunk);
                 if (!status.isOk()) {
                     return halStatusToGenericError(status);
                 }
-                encryptedChunks.push_back(encryptedChunk);
-            }
-            EntryData eData;
-            eData.size = eParcel.value.size();
+                eData.encryptedChunks.push_back(std::move(encryptedChunk));
+            } while (offset < value.size());
+            eData.size = value.size();
             eData.accessControlProfileIds = std::move(ids);
-            eData.encryptedChunks = std::move(encryptedChunks);
-            data.addEntryData(ensParcel.namespaceName, eParcel.name, eData);
+            data.addEntryData(ensParcel.namespaceName, eParcel.name, std::move(eData));
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startTime);
+            LOG(DEBUG) << "Added entry " << ensParcel.namespaceName << ":" << eParcel.name << " ("
+                       << value.size() << " bytes, " << numChunks << " chunks) in "
+                       << elapsed.count() << " us";
         }
     }
 
@@ -267,6 +417,9 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
                                                 "Error saving credential data to disk");
     }
 
+    // The Credential being updated takes both of these itself when it reloads.
+    halCall.reset();
+    credentialLock.unlock();
     if (credentialToReloadWhenUpdated_) {
         credentialToReloadWhenUpdated_->writableCredentialPersonalized();
         credentialToReloadWhenUpdated_.clear();
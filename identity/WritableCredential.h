@@ -17,6 +17,7 @@
 #ifndef SYSTEM_SECURITY_WRITABLE_CREDENTIAL_H_
 #define SYSTEM_SECURITY_WRITABLE_CREDENTIAL_H_
 
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -72,6 +73,9 @@ class WritableCredential : public BnWritableCredential {
 
     sp<Credential> credentialToReloadWhenUpdated_;
 
+    // Serializes the IWritableCredential calls on this object.
+    std::mutex mutex_;
+
     ssize_t calcExpectedProofOfProvisioningSize(
         const vector<AccessControlProfileParcel>& accessControlProfiles,
         const vector<EntryNamespaceParcel>& entryNamespaces);
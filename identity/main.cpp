@@ -21,10 +21,14 @@
 #include <unistd.h>
 
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 
+#include "Credential.h"
 #include "CredentialStoreFactory.h"
+#include "Util.h"
 
 #include <cppbor.h>
 
@@ -32,12 +36,17 @@ using ::std::string;
 
 using ::android::IPCThreadState;
 using ::android::IServiceManager;
+using ::android::ProcessState;
 using ::android::sp;
 using ::android::String16;
+using ::android::base::GetBoolProperty;
+using ::android::base::GetUintProperty;
 using ::android::base::InitLogging;
 using ::android::base::StderrLogger;
 
 using ::android::security::identity::CredentialStoreFactory;
+using ::android::security::identity::setEphemeralKeysPerCredential;
+using ::android::security::identity::setMaxInFlightHalCalls;
 
 int main(int argc, char* argv[]) {
     InitLogging(argv);
@@ -46,15 +55,35 @@ int main(int argc, char* argv[]) {
     string data_dir = string(argv[1]);
     CHECK(chdir(data_dir.c_str()) != -1) << "chdir: " << data_dir << ": " << strerror(errno);
 
+    // Binder calls on different credentials are served in parallel by up to this many threads,
+    // of which at most credstore.max_in_flight_hal_calls use the HAL at the same time.
+    size_t binderThreads = GetUintProperty<size_t>("credstore.binder_threads", 4);
+    size_t maxInFlightHalCalls = GetUintProperty<size_t>("credstore.max_in_flight_hal_calls", 2);
+    setMaxInFlightHalCalls(maxInFlightHalCalls);
+    if (binderThreads > 1) {
+        // The main thread joins the pool below.
+        ProcessState::self()->setThreadPoolMaxThreadCount(binderThreads - 1);
+        ProcessState::self()->startThreadPool();
+    }
+    LOG(INFO) << "Serving with " << binderThreads << " binder threads and at most "
+              << maxInFlightHalCalls << " HAL calls in flight";
+
+    // Each pre-generated ephemeral key pair holds on to a HAL credential, so this is off by
+    // default.
+    setEphemeralKeysPerCredential(
+        GetUintProperty<size_t>("credstore.ephemeral_keys_per_credential", 0, 4));
+
     sp<IServiceManager> sm = ::android::defaultServiceManager();
     sp<CredentialStoreFactory> factory = new CredentialStoreFactory(data_dir);
+    // Off by default: warming up starts the HALs at boot even if nobody uses credstore.
+    if (GetBoolProperty("credstore.warm_up", false)) {
+        factory->warmUp();
+    }
 
     auto ret = sm->addService(String16("android.security.identity"), factory);
     CHECK(ret == ::android::OK) << "Couldn't register binder service";
     LOG(INFO) << "Registered binder service";
 
-    // Credstore is a single-threaded process. So devote the main thread
-    // to handling binder messages.
     IPCThreadState::self()->joinThreadPool();
 
     return 0;
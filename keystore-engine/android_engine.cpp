@@ -29,6 +29,19 @@
 extern "C" {
 
 EVP_PKEY* EVP_PKEY_from_keystore(const char* key_id) __attribute__((visibility("default")));
+int EVP_PKEY_keystore_sign_batch(const EVP_PKEY* pkey, const uint8_t* const* inputs,
+                                 const size_t* input_lens, size_t count, uint8_t** outputs,
+                                 size_t* output_lens) __attribute__((visibility("default")));
+keystore2_sign_request* EVP_PKEY_keystore_sign_start(const EVP_PKEY* pkey, const uint8_t* in,
+                                                     size_t in_len, void (*on_done)(void* arg),
+                                                     void* arg)
+    __attribute__((visibility("default")));
+keystore2_sign_result_t EVP_PKEY_keystore_sign_complete(keystore2_sign_request* request,
+                                                        uint8_t* out, size_t* out_len,
+                                                        size_t max_out)
+    __attribute__((visibility("default")));
+void EVP_PKEY_keystore_sign_request_free(keystore2_sign_request* request)
+    __attribute__((visibility("default")));
 
 /* EVP_PKEY_from_keystore returns an |EVP_PKEY| that contains either an RSA or
  * ECDSA key where the public part of the key reflects the value of the key
@@ -40,4 +53,37 @@ EVP_PKEY* EVP_PKEY_from_keystore(const char* key_id) {
     return EVP_PKEY_from_keystore2(key_id);
 }
 
+/* EVP_PKEY_keystore_sign_batch runs the private key operation of the Keystore backed |pkey| on
+ * |count| inputs in one call. See EVP_PKEY_keystore2_sign_batch for the input and output
+ * conventions. */
+int EVP_PKEY_keystore_sign_batch(const EVP_PKEY* pkey, const uint8_t* const* inputs,
+                                 const size_t* input_lens, size_t count, uint8_t** outputs,
+                                 size_t* output_lens) {
+    ALOGV("EVP_PKEY_keystore_sign_batch(%zu)", count);
+
+    return EVP_PKEY_keystore2_sign_batch(pkey, inputs, input_lens, count, outputs, output_lens);
+}
+
+/* EVP_PKEY_keystore_sign_start, EVP_PKEY_keystore_sign_complete and
+ * EVP_PKEY_keystore_sign_request_free run the private key operation of the Keystore backed
+ * |pkey| without blocking the caller, so a TLS stack can drive them from an
+ * SSL_PRIVATE_KEY_METHOD. See the corresponding EVP_PKEY_keystore2_* functions. */
+keystore2_sign_request* EVP_PKEY_keystore_sign_start(const EVP_PKEY* pkey, const uint8_t* in,
+                                                     size_t in_len, void (*on_done)(void* arg),
+                                                     void* arg) {
+    ALOGV("EVP_PKEY_keystore_sign_start(%zu)", in_len);
+
+    return EVP_PKEY_keystore2_sign_start(pkey, in, in_len, on_done, arg);
+}
+
+keystore2_sign_result_t EVP_PKEY_keystore_sign_complete(keystore2_sign_request* request,
+                                                        uint8_t* out, size_t* out_len,
+                                                        size_t max_out) {
+    return EVP_PKEY_keystore2_sign_complete(request, out, out_len, max_out);
+}
+
+void EVP_PKEY_keystore_sign_request_free(keystore2_sign_request* request) {
+    EVP_PKEY_keystore2_sign_request_free(request);
+}
+
 }  // extern "C"
@@ -23,11 +23,22 @@
 
 #include <private/android_filesystem_config.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
 #include <openssl/bn.h>
 #include <openssl/ec.h>
 #include <openssl/ec_key.h>
 #include <openssl/ecdsa.h>
 #include <openssl/engine.h>
+#include <openssl/mem.h>
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
 
@@ -59,9 +70,34 @@ int64_t getNamespaceforCurrentUid() {
     }
 }
 
+/* make_sign_op_params returns the operation parameters used for every private key operation
+ * on a key of type |algorithm|. The engine always hands Keystore pre-padded, pre-hashed input,
+ * so these never change for the lifetime of a key. */
+std::vector<KMV1::KeyParameter> make_sign_op_params(KMV1::Algorithm algorithm) {
+    std::vector<KMV1::KeyParameter> op_params(4);
+    op_params[0] = KMV1::KeyParameter{
+        .tag = KMV1::Tag::PURPOSE,
+        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::keyPurpose>(
+            KMV1::KeyPurpose::SIGN)};
+    op_params[1] = KMV1::KeyParameter{
+        .tag = KMV1::Tag::ALGORITHM,
+        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::algorithm>(algorithm)};
+    op_params[2] = KMV1::KeyParameter{
+        .tag = KMV1::Tag::PADDING,
+        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::paddingMode>(
+            KMV1::PaddingMode::NONE)};
+    op_params[3] =
+        KMV1::KeyParameter{.tag = KMV1::Tag::DIGEST,
+                           .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::digest>(
+                               KMV1::Digest::NONE)};
+    return op_params;
+}
+
 struct Keystore2KeyBackend {
     ks2::KeyDescriptor descriptor_;
     std::shared_ptr<ks2::IKeystoreSecurityLevel> i_keystore_security_level_;
+    /* Built once when the key is loaded and reused by every signing operation. */
+    std::vector<KMV1::KeyParameter> op_params_;
 };
 
 /* key_backend_dup is called when one of the RSA or EC_KEY objects is duplicated. */
@@ -80,6 +116,97 @@ extern "C" void key_backend_free(void* /* parent */, void* ptr, CRYPTO_EX_DATA*
     delete reinterpret_cast<std::shared_ptr<Keystore2KeyBackend>*>(ptr);
 }
 
+/* KeyCache remembers the Keystore backend and public key of recently loaded keys so that
+ * reopening a key, e.g. on every TLS handshake, does not have to go back to Keystore. Entries
+ * expire after |kTtl| and are dropped as soon as an operation on their backend fails, so a key
+ * that was deleted or replaced is picked up again on the next load. */
+class KeyCache {
+  public:
+    using Key = std::pair<std::string /* key_id */, int64_t /* namespace */>;
+
+    struct Entry {
+        std::shared_ptr<Keystore2KeyBackend> key_backend;
+        bssl::UniquePtr<EVP_PKEY> public_key;
+    };
+
+    /* Leaked on purpose like SignWorkers: the detached sign workers may still use the cache
+     * while static destructors run at exit. */
+    static KeyCache& get() {
+        static KeyCache* cache = new KeyCache();
+        return *cache;
+    }
+
+    std::optional<Entry> lookup(const Key& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return std::nullopt;
+        }
+        if (std::chrono::steady_clock::now() >= it->second.expiry) {
+            entries_.erase(it);
+            return std::nullopt;
+        }
+        EVP_PKEY_up_ref(it->second.entry.public_key.get());
+        return Entry{it->second.entry.key_backend,
+                     bssl::UniquePtr<EVP_PKEY>(it->second.entry.public_key.get())};
+    }
+
+    void insert(const Key& key, const Entry& entry) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.size() >= kMaxEntries && entries_.find(key) == entries_.end()) {
+            evictLocked(now);
+        }
+        EVP_PKEY_up_ref(entry.public_key.get());
+        entries_[key] = TimedEntry{
+            Entry{entry.key_backend, bssl::UniquePtr<EVP_PKEY>(entry.public_key.get())},
+            now + kTtl};
+    }
+
+    /* Drops every entry that uses |key_backend|. */
+    void invalidate(const Keystore2KeyBackend* key_backend) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.entry.key_backend.get() == key_backend) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+  private:
+    static constexpr auto kTtl = std::chrono::seconds(60);
+    static constexpr size_t kMaxEntries = 32;
+
+    struct TimedEntry {
+        Entry entry;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    /* Removes expired entries, or the one closest to expiry if none have expired yet. */
+    void evictLocked(std::chrono::steady_clock::time_point now) {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (now >= it->second.expiry) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (entries_.size() < kMaxEntries) {
+            return;
+        }
+        auto oldest = std::min_element(entries_.begin(), entries_.end(),
+                                       [](const auto& a, const auto& b) {
+                                           return a.second.expiry < b.second.expiry;
+                                       });
+        entries_.erase(oldest);
+    }
+
+    std::mutex mutex_;
+    std::map<Key, TimedEntry> entries_;
+};
+
 extern "C" int rsa_private_transform(RSA* rsa, uint8_t* out, const uint8_t* in, size_t len);
 extern "C" int ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8_t* sig,
                           unsigned int* sig_len, EC_KEY* ec_key);
@@ -190,31 +317,24 @@ bssl::UniquePtr<EVP_PKEY> wrap_ecdsa(std::shared_ptr<Keystore2KeyBackend> key_ba
     return result;
 }
 
+/* sign_input_scratch returns this thread's buffer for the input of keystore2_sign. Reusing
+ * it means that a thread signing over and over, e.g. once per TLS handshake, stops allocating
+ * a new input parcelable for every operation once the buffer has grown to the key size. */
+std::optional<std::vector<uint8_t>>& sign_input_scratch() {
+    thread_local std::optional<std::vector<uint8_t>> scratch(std::in_place);
+    return scratch;
+}
+
+/* keystore2_sign performs a single private key operation on the |in_len| bytes at |in|.
+ * Keystore 2.0 has no single-shot signing call, so this always takes a createOperation and a
+ * finish transaction; everything else it needs is precomputed in |key_backend|. */
 std::optional<std::vector<uint8_t>> keystore2_sign(const Keystore2KeyBackend& key_backend,
-                                                   std::vector<uint8_t> input,
-                                                   KMV1::Algorithm algorithm) {
-    auto sec_level = key_backend.i_keystore_security_level_;
+                                                   const uint8_t* in, size_t in_len) {
+    const auto& sec_level = key_backend.i_keystore_security_level_;
     ks2::CreateOperationResponse response;
 
-    std::vector<KMV1::KeyParameter> op_params(4);
-    op_params[0] = KMV1::KeyParameter{
-        .tag = KMV1::Tag::PURPOSE,
-        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::keyPurpose>(
-            KMV1::KeyPurpose::SIGN)};
-    op_params[1] = KMV1::KeyParameter{
-        .tag = KMV1::Tag::ALGORITHM,
-        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::algorithm>(algorithm)};
-    op_params[2] = KMV1::KeyParameter{
-        .tag = KMV1::Tag::PADDING,
-        .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::paddingMode>(
-            KMV1::PaddingMode::NONE)};
-    op_params[3] =
-        KMV1::KeyParameter{.tag = KMV1::Tag::DIGEST,
-                           .value = KMV1::KeyParameterValue::make<KMV1::KeyParameterValue::digest>(
-                               KMV1::Digest::NONE)};
-
-    auto rc = sec_level->createOperation(key_backend.descriptor_, op_params, false /* forced */,
-                                         &response);
+    auto rc = sec_level->createOperation(key_backend.descriptor_, key_backend.op_params_,
+                                         false /* forced */, &response);
     if (!rc.isOk()) {
         auto exception_code = rc.getExceptionCode();
         if (exception_code == EX_SERVICE_SPECIFIC) {
@@ -224,13 +344,22 @@ std::optional<std::vector<uint8_t>> keystore2_sign(const Keystore2KeyBackend& ke
             LOG(ERROR) << AT << "Communication with Keystore createOperation failed error: "
                        << exception_code;
         }
+        // The key may have been deleted or Keystore may have restarted, so the next load of
+        // this key has to go back to Keystore.
+        KeyCache::get().invalidate(&key_backend);
         return std::nullopt;
     }
 
     auto op = response.iOperation;
 
+    auto& input = sign_input_scratch();
+    input->assign(in, in + in_len);
     std::optional<std::vector<uint8_t>> output = std::nullopt;
-    rc = op->finish(std::move(input), {}, &output);
+    rc = op->finish(input, std::nullopt, &output);
+    // The input may be a digest of secret data or an RSA plaintext, so it does not outlive the
+    // operation.
+    OPENSSL_cleanse(input->data(), input->size());
+    input->clear();
     if (!rc.isOk()) {
         auto exception_code = rc.getExceptionCode();
         if (exception_code == EX_SERVICE_SPECIFIC) {
@@ -250,6 +379,68 @@ std::optional<std::vector<uint8_t>> keystore2_sign(const Keystore2KeyBackend& ke
     return output;
 }
 
+/* copy_rsa_output writes the result of a Keystore RSA operation to the |len| byte buffer
+ * |out|, fixing up results that are not exactly the size of the modulus. */
+void copy_rsa_output(const std::vector<uint8_t>& output, uint8_t* out, size_t len) {
+    if (output.size() > len) {
+        /* The result of the RSA operation can never be larger than the size of
+         * the modulus so we assume that the result has extra zeros on the
+         * left. This provides attackers with an oracle, but there's nothing
+         * that we can do about it here. */
+        LOG(WARNING) << "Reply len " << output.size() << " greater than expected " << len;
+        memcpy(out, &output.data()[output.size() - len], len);
+    } else if (output.size() < len) {
+        /* If the Keystore implementation returns a short value we assume that
+         * it's because it removed leading zeros from the left side. This is
+         * bad because it provides attackers with an oracle but we cannot do
+         * anything about a broken Keystore implementation here. */
+        LOG(WARNING) << "Reply len " << output.size() << " less than expected " << len;
+        memset(out, 0, len);
+        memcpy(out + len - output.size(), output.data(), output.size());
+    } else {
+        memcpy(out, output.data(), len);
+    }
+}
+
+/* sign_raw performs the private key operation of |key_backend| on |in| and returns the output
+ * in the form the engine callbacks hand back to BoringSSL: exactly |max_output_size| bytes for
+ * RSA and an ASN.1 ECDSA signature of at most |max_output_size| bytes for EC. A result of the
+ * right size is returned as Keystore sent it, without a copy. */
+std::optional<std::vector<uint8_t>> sign_raw(const Keystore2KeyBackend& key_backend, bool is_rsa,
+                                             size_t max_output_size, const uint8_t* in,
+                                             size_t in_len) {
+    if (is_rsa && in_len != max_output_size) {
+        LOG(ERROR) << AT << "RSA input has length " << in_len << " but the modulus is "
+                   << max_output_size << " bytes.";
+        return std::nullopt;
+    }
+    auto output = keystore2_sign(key_backend, in, in_len);
+    if (!output || output->empty() || (!is_rsa && output->size() > max_output_size)) {
+        LOG(ERROR) << AT << "No valid signature returned.";
+        return std::nullopt;
+    }
+    if (is_rsa && output->size() != max_output_size) {
+        std::vector<uint8_t> fixed(max_output_size);
+        copy_rsa_output(*output, fixed.data(), max_output_size);
+        return fixed;
+    }
+    return output;
+}
+
+/* sign_into is sign_raw for callers which have a buffer for the output already. The output is
+ * copied to |out|, which must have room for |max_output_size| bytes. On success the length of
+ * the output is stored in |out_len| and true is returned. */
+bool sign_into(const Keystore2KeyBackend& key_backend, bool is_rsa, size_t max_output_size,
+               const uint8_t* in, size_t in_len, uint8_t* out, size_t* out_len) {
+    auto output = sign_raw(key_backend, is_rsa, max_output_size, in, in_len);
+    if (!output) {
+        return false;
+    }
+    memcpy(out, output->data(), output->size());
+    *out_len = output->size();
+    return true;
+}
+
 /* rsa_private_transform takes a big-endian integer from |in|, calculates the
  * d'th power of it, modulo the RSA modulus, and writes the result as a
  * big-endian integer to |out|. Both |in| and |out| are |len| bytes long. It
@@ -263,32 +454,8 @@ extern "C" int rsa_private_transform(RSA* rsa, uint8_t* out, const uint8_t* in,
         return 0;
     }
 
-    auto output =
-        keystore2_sign(**key_backend, std::vector<uint8_t>(in, in + len), KMV1::Algorithm::RSA);
-    if (!output) {
-        return 0;
-    }
-
-    if (output->size() > len) {
-        /* The result of the RSA operation can never be larger than the size of
-         * the modulus so we assume that the result has extra zeros on the
-         * left. This provides attackers with an oracle, but there's nothing
-         * that we can do about it here. */
-        LOG(WARNING) << "Reply len " << output->size() << " greater than expected " << len;
-        memcpy(out, &output->data()[output->size() - len], len);
-    } else if (output->size() < len) {
-        /* If the Keystore implementation returns a short value we assume that
-         * it's because it removed leading zeros from the left side. This is
-         * bad because it provides attackers with an oracle but we cannot do
-         * anything about a broken Keystore implementation here. */
-        LOG(WARNING) << "Reply len " << output->size() << " less than expected " << len;
-        memset(out, 0, len);
-        memcpy(out + len - output->size(), output->data(), output->size());
-    } else {
-        memcpy(out, output->data(), len);
-    }
-
-    return 1;
+    size_t out_len;
+    return sign_into(**key_backend, true /* is_rsa */, len, in, len, out, &out_len);
 }
 
 /* ecdsa_sign signs |digest_len| bytes from |digest| with |ec_key| and writes
@@ -304,42 +471,52 @@ extern "C" int ecdsa_sign(const uint8_t* digest, size_t digest_len, uint8_t* sig
         return 0;
     }
 
-    size_t ecdsa_size = ECDSA_size(ec_key);
-
-    auto output = keystore2_sign(**key_backend, std::vector<uint8_t>(digest, digest + digest_len),
-                                 KMV1::Algorithm::EC);
-    if (!output) {
+    size_t len;
+    if (!sign_into(**key_backend, false /* is_rsa */, ECDSA_size(ec_key), digest, digest_len, sig,
+                   &len)) {
         LOG(ERROR) << "There was an error during ecdsa_sign.";
         return 0;
     }
-
-    if (output->size() == 0) {
-        LOG(ERROR) << "No valid signature returned";
-        return 0;
-    } else if (output->size() > ecdsa_size) {
-        LOG(ERROR) << "Signature is too large";
-        return 0;
-    }
-
-    memcpy(sig, output->data(), output->size());
-    *sig_len = output->size();
+    *sig_len = len;
 
     return 1;
 }
 
-}  // namespace
+/* get_key_backend returns the Keystore backend of |pkey| or nullptr if |pkey| was not created
+ * by EVP_PKEY_from_keystore2. */
+const std::shared_ptr<Keystore2KeyBackend>* get_key_backend(const EVP_PKEY* pkey) {
+    std::shared_ptr<Keystore2KeyBackend>* key_backend = nullptr;
+    switch (EVP_PKEY_id(pkey)) {
+    case EVP_PKEY_RSA:
+        key_backend = reinterpret_cast<std::shared_ptr<Keystore2KeyBackend>*>(
+            RSA_get_ex_data(EVP_PKEY_get0_RSA(pkey), Keystore2Engine::get().rsa_ex_index()));
+        break;
+    case EVP_PKEY_EC:
+        key_backend = reinterpret_cast<std::shared_ptr<Keystore2KeyBackend>*>(EC_KEY_get_ex_data(
+            EVP_PKEY_get0_EC_KEY(pkey), Keystore2Engine::get().ec_key_ex_index()));
+        break;
+    default:
+        break;
+    }
+    return key_backend;
+}
 
-/* EVP_PKEY_from_keystore returns an |EVP_PKEY| that contains either an RSA or
- * ECDSA key where the public part of the key reflects the value of the key
- * named |key_id| in Keystore and the private operations are forwarded onto
- * KeyStore. */
-extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id) {
+/* max_sign_output_size returns the size of the largest output a private key operation on
+ * |pkey| can produce. */
+size_t max_sign_output_size(const EVP_PKEY* pkey) {
+    return EVP_PKEY_id(pkey) == EVP_PKEY_RSA ? RSA_size(EVP_PKEY_get0_RSA(pkey))
+                                             : ECDSA_size(EVP_PKEY_get0_EC_KEY(pkey));
+}
+
+/* load_key fetches the key named |key_id| in |nspace| from Keystore and returns its backend
+ * together with the public key from its certificate. */
+std::optional<KeyCache::Entry> load_key(const std::string& key_id, int64_t nspace) {
     ::ndk::SpAIBinder keystoreBinder(AServiceManager_checkService(keystore2_service_name));
     auto keystore2 = ks2::IKeystoreService::fromBinder(keystoreBinder);
 
     if (!keystore2) {
         LOG(ERROR) << AT << "Unable to connect to Keystore 2.0.";
-        return nullptr;
+        return std::nullopt;
     }
 
     std::string alias = key_id;
@@ -350,7 +527,7 @@ extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id) {
 
     ks2::KeyDescriptor descriptor = {
         .domain = ks2::Domain::SELINUX,
-        .nspace = getNamespaceforCurrentUid(),
+        .nspace = nspace,
         .alias = alias,
         .blob = std::nullopt,
     };
@@ -375,45 +552,262 @@ extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id) {
             LOG(ERROR) << AT << "Communication with Keystore getKeyEntry failed error: "
                        << exception_code;
         }
-        return nullptr;
+        return std::nullopt;
     }
 
     if (!response.metadata.certificate) {
         LOG(ERROR) << AT << "No public key found.";
-        return nullptr;
+        return std::nullopt;
     }
 
     const uint8_t* p = response.metadata.certificate->data();
     bssl::UniquePtr<X509> x509(d2i_X509(nullptr, &p, response.metadata.certificate->size()));
     if (!x509) {
         LOG(ERROR) << AT << "Failed to parse x509 certificate.";
-        return nullptr;
+        return std::nullopt;
     }
     bssl::UniquePtr<EVP_PKEY> pkey(X509_get_pubkey(x509.get()));
     if (!pkey) {
         LOG(ERROR) << AT << "Failed to extract public key.";
-        return nullptr;
+        return std::nullopt;
+    }
+
+    KMV1::Algorithm algorithm;
+    switch (EVP_PKEY_type(pkey->type)) {
+    case EVP_PKEY_RSA:
+        algorithm = KMV1::Algorithm::RSA;
+        break;
+    case EVP_PKEY_EC:
+        algorithm = KMV1::Algorithm::EC;
+        break;
+    default:
+        LOG(ERROR) << AT << "Unsupported key type " << EVP_PKEY_type(pkey->type);
+        return std::nullopt;
     }
 
-    auto key_backend = std::make_shared<Keystore2KeyBackend>(
-        Keystore2KeyBackend{response.metadata.key, response.iSecurityLevel});
+    auto key_backend = std::make_shared<Keystore2KeyBackend>(Keystore2KeyBackend{
+        response.metadata.key, response.iSecurityLevel, make_sign_op_params(algorithm)});
+    return KeyCache::Entry{std::move(key_backend), std::move(pkey)};
+}
+
+/* SignRequestState tracks one private key operation started with
+ * EVP_PKEY_keystore2_sign_start. It is shared between the caller's handle and the worker
+ * running the operation, so either side can go away first. */
+struct SignRequestState {
+    std::mutex mutex;
+    keystore2_sign_result_t result = keystore2_sign_retry;
+    std::vector<uint8_t> output;
+    void (*on_done)(void* arg) = nullptr;
+    void* arg = nullptr;
+};
+
+/* SignWorkers is a small pool of threads that run private key operations submitted through
+ * the asynchronous signing API. The threads are started on first use and live as long as the
+ * process. */
+class SignWorkers {
+  public:
+    static SignWorkers& get() {
+        static SignWorkers* workers = new SignWorkers();
+        return *workers;
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+    }
+
+  private:
+    static constexpr int kNumWorkers = 4;
+
+    SignWorkers() {
+        for (int i = 0; i < kNumWorkers; i++) {
+            std::thread([this] { run(); }).detach();
+        }
+    }
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return !tasks_.empty(); });
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+};
+
+}  // namespace
+
+/* EVP_PKEY_from_keystore returns an |EVP_PKEY| that contains either an RSA or
+ * ECDSA key where the public part of the key reflects the value of the key
+ * named |key_id| in Keystore and the private operations are forwarded onto
+ * KeyStore. */
+extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id) {
+    KeyCache::Key cache_key(key_id, getNamespaceforCurrentUid());
+    auto key = KeyCache::get().lookup(cache_key);
+    if (!key) {
+        key = load_key(cache_key.first, cache_key.second);
+        if (!key) {
+            return nullptr;
+        }
+        KeyCache::get().insert(cache_key, *key);
+    }
 
     bssl::UniquePtr<EVP_PKEY> result;
-    switch (EVP_PKEY_type(pkey->type)) {
+    switch (EVP_PKEY_type(key->public_key->type)) {
     case EVP_PKEY_RSA: {
-        bssl::UniquePtr<RSA> public_rsa(EVP_PKEY_get1_RSA(pkey.get()));
-        result = wrap_rsa(key_backend, public_rsa.get());
+        bssl::UniquePtr<RSA> public_rsa(EVP_PKEY_get1_RSA(key->public_key.get()));
+        result = wrap_rsa(key->key_backend, public_rsa.get());
         break;
     }
     case EVP_PKEY_EC: {
-        bssl::UniquePtr<EC_KEY> public_ecdsa(EVP_PKEY_get1_EC_KEY(pkey.get()));
-        result = wrap_ecdsa(key_backend, public_ecdsa.get());
+        bssl::UniquePtr<EC_KEY> public_ecdsa(EVP_PKEY_get1_EC_KEY(key->public_key.get()));
+        result = wrap_ecdsa(key->key_backend, public_ecdsa.get());
         break;
     }
     default:
-        LOG(ERROR) << AT << "Unsupported key type " << EVP_PKEY_type(pkey->type);
+        LOG(ERROR) << AT << "Unsupported key type " << EVP_PKEY_type(key->public_key->type);
         return nullptr;
     }
 
     return result.release();
 }
+
+/* EVP_PKEY_keystore2_sign_batch performs the private key operation of |pkey| on each of the
+ * |count| inputs. For RSA keys every input must be exactly |RSA_size| bytes and is transformed
+ * as by |rsa_private_transform|; for EC keys every input is a digest and the output is an
+ * ASN.1 encoded ECDSA signature. On success |outputs[i]| points to a buffer of
+ * |output_lens[i]| bytes that the caller must release with |OPENSSL_free| and one is returned.
+ * On failure no buffers are handed out and zero is returned. */
+extern "C" int EVP_PKEY_keystore2_sign_batch(const EVP_PKEY* pkey, const uint8_t* const* inputs,
+                                             const size_t* input_lens, size_t count,
+                                             uint8_t** outputs, size_t* output_lens) {
+    auto key_backend = get_key_backend(pkey);
+    if (key_backend == nullptr) {
+        LOG(ERROR) << AT << "Not a Keystore key.";
+        return 0;
+    }
+
+    const bool is_rsa = EVP_PKEY_id(pkey) == EVP_PKEY_RSA;
+    const size_t max_output_size = max_sign_output_size(pkey);
+
+    size_t i = 0;
+    for (; i < count; i++) {
+        outputs[i] = reinterpret_cast<uint8_t*>(OPENSSL_malloc(max_output_size));
+        if (outputs[i] == nullptr) {
+            break;
+        }
+        if (!sign_into(**key_backend, is_rsa, max_output_size, inputs[i], input_lens[i],
+                       outputs[i], &output_lens[i])) {
+            LOG(ERROR) << AT << "Signing input " << i << " of " << count << " failed.";
+            OPENSSL_free(outputs[i]);
+            outputs[i] = nullptr;
+            break;
+        }
+    }
+
+    if (i != count) {
+        for (size_t j = 0; j < i; j++) {
+            OPENSSL_free(outputs[j]);
+            outputs[j] = nullptr;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* keystore2_sign_request is the caller's handle to an operation started with
+ * EVP_PKEY_keystore2_sign_start. */
+struct keystore2_sign_request {
+    std::shared_ptr<SignRequestState> state;
+};
+
+/* EVP_PKEY_keystore2_sign_start queues the private key operation of |pkey| on |in| (see
+ * EVP_PKEY_keystore2_sign_batch for the input format) and returns without waiting for
+ * Keystore. When the operation has completed |on_done|, if not null, is called with |arg| on
+ * a worker thread; the caller then collects the result with EVP_PKEY_keystore2_sign_complete.
+ * Returns nullptr if the operation could not be queued. */
+extern "C" keystore2_sign_request* EVP_PKEY_keystore2_sign_start(const EVP_PKEY* pkey,
+                                                                const uint8_t* in, size_t in_len,
+                                                                void (*on_done)(void* arg),
+                                                                void* arg) {
+    auto key_backend = get_key_backend(pkey);
+    if (key_backend == nullptr) {
+        LOG(ERROR) << AT << "Not a Keystore key.";
+        return nullptr;
+    }
+
+    auto request = new keystore2_sign_request{std::make_shared<SignRequestState>()};
+    request->state->on_done = on_done;
+    request->state->arg = arg;
+
+    SignWorkers::get().submit([request = request->state, key_backend = *key_backend,
+                               is_rsa = EVP_PKEY_id(pkey) == EVP_PKEY_RSA,
+                               max_output_size = max_sign_output_size(pkey),
+                               input = std::vector<uint8_t>(in, in + in_len)] {
+        auto output = sign_raw(*key_backend, is_rsa, max_output_size, input.data(), input.size());
+        void (*on_done)(void*) = nullptr;
+        void* arg = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(request->mutex);
+            if (output) {
+                request->output = std::move(*output);
+                request->result = keystore2_sign_success;
+            } else {
+                request->result = keystore2_sign_failure;
+            }
+            on_done = request->on_done;
+            arg = request->arg;
+        }
+        if (on_done != nullptr) {
+            on_done(arg);
+        }
+    });
+
+    return request;
+}
+
+/* EVP_PKEY_keystore2_sign_complete returns keystore2_sign_retry while the operation behind
+ * |request| is still running. Once it has finished it returns keystore2_sign_success and
+ * writes the output to |out| and its length to |out_len|, or keystore2_sign_failure if the
+ * operation failed or the output does not fit into |max_out| bytes. This mirrors the retry
+ * semantics of SSL_PRIVATE_KEY_METHOD's complete callback. */
+extern "C" keystore2_sign_result_t EVP_PKEY_keystore2_sign_complete(
+    keystore2_sign_request* request, uint8_t* out, size_t* out_len, size_t max_out) {
+    auto& state = request->state;
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (state->result != keystore2_sign_success) {
+        return state->result;
+    }
+    if (state->output.size() > max_out) {
+        LOG(ERROR) << AT << "Output buffer too small.";
+        return keystore2_sign_failure;
+    }
+    memcpy(out, state->output.data(), state->output.size());
+    *out_len = state->output.size();
+    return keystore2_sign_success;
+}
+
+/* EVP_PKEY_keystore2_sign_request_free releases |request|. It may be called while the
+ * operation is still running. Its completion callback is then skipped unless the operation
+ * has already finished. */
+extern "C" void EVP_PKEY_keystore2_sign_request_free(keystore2_sign_request* request) {
+    if (request == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(request->state->mutex);
+        request->state->on_done = nullptr;
+    }
+    delete request;
+}
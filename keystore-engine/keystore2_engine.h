@@ -19,3 +19,27 @@
 #include <openssl/evp.h>
 
 extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id);
+
+extern "C" int EVP_PKEY_keystore2_sign_batch(const EVP_PKEY* pkey, const uint8_t* const* inputs,
+                                             const size_t* input_lens, size_t count,
+                                             uint8_t** outputs, size_t* output_lens);
+
+/* keystore2_sign_result_t matches the values of BoringSSL's ssl_private_key_result_t so that
+ * it can be returned straight from an SSL_PRIVATE_KEY_METHOD. */
+enum keystore2_sign_result_t {
+    keystore2_sign_success,
+    keystore2_sign_retry,
+    keystore2_sign_failure,
+};
+
+struct keystore2_sign_request;
+
+extern "C" keystore2_sign_request* EVP_PKEY_keystore2_sign_start(const EVP_PKEY* pkey,
+                                                                const uint8_t* in, size_t in_len,
+                                                                void (*on_done)(void* arg),
+                                                                void* arg);
+
+extern "C" keystore2_sign_result_t EVP_PKEY_keystore2_sign_complete(
+    keystore2_sign_request* request, uint8_t* out, size_t* out_len, size_t max_out);
+
+extern "C" void EVP_PKEY_keystore2_sign_request_free(keystore2_sign_request* request);
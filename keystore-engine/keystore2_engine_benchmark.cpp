@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <openssl/evp.h>
+#include <openssl/mem.h>
+
+extern "C" EVP_PKEY* EVP_PKEY_from_keystore(const char* key_id);
+
+// The benchmark signs with an existing Keystore key that the calling uid can use, e.g. a
+// Wi-Fi key when run as AID_WIFI. Its key id is taken from this environment variable.
+constexpr const char kKeyIdVariable[] = "KEYSTORE_ENGINE_BENCHMARK_KEY_ID";
+
+static EVP_PKEY* getKey() {
+    static EVP_PKEY* key = [] {
+        const char* key_id = getenv(kKeyIdVariable);
+        return key_id != nullptr ? EVP_PKEY_from_keystore(key_id) : nullptr;
+    }();
+    return key;
+}
+
+// Signs a SHA-256 sized digest through the engine from every benchmark thread, so that
+// running with more threads shows how private key operations scale with cores.
+static void BM_Sign(benchmark::State& state) {
+    EVP_PKEY* key = getKey();
+    if (key == nullptr) {
+        state.SkipWithError("Set KEYSTORE_ENGINE_BENCHMARK_KEY_ID to a usable Keystore key.");
+        return;
+    }
+
+    std::vector<uint8_t> digest(32, 0x5a);
+    std::vector<uint8_t> signature(EVP_PKEY_size(key));
+    for (auto _ : state) {
+        bssl::UniquePtr<EVP_PKEY_CTX> ctx(EVP_PKEY_CTX_new(key, nullptr /* engine */));
+        size_t signature_len = signature.size();
+        if (!ctx || !EVP_PKEY_sign_init(ctx.get()) ||
+            !EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_sha256()) ||
+            !EVP_PKEY_sign(ctx.get(), signature.data(), &signature_len, digest.data(),
+                           digest.size())) {
+            state.SkipWithError("Signing failed.");
+            break;
+        }
+        benchmark::DoNotOptimize(signature_len);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Sign)->ThreadRange(1, 16)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -18,17 +18,39 @@
 #include "include/keystore/Signature.h"
 
 #include <binder/Parcel.h>
+#include <openssl/sha.h>
 
 namespace android {
 namespace content {
 namespace pm {
 
+static_assert(sizeof(Signature::Digest) == SHA256_DIGEST_LENGTH);
+
 status_t Signature::writeToParcel(Parcel* parcel) const {
+    if (from_parcel_) return INVALID_OPERATION;
     return parcel->writeByteVector(sig_data_);
 }
 
+// Reads the byte vector the way Parcel::readByteVector does, but hashes it in place.
 status_t Signature::readFromParcel(const Parcel* parcel) {
-    return parcel->readByteVector(&sig_data_);
+    int32_t size;
+    auto rc = parcel->readInt32(&size);
+    if (rc != NO_ERROR) return rc;
+    if (size < 0) return UNEXPECTED_NULL;
+    const void* data = parcel->readInplace(size);
+    if (data == nullptr && size != 0) return BAD_VALUE;
+
+    sig_data_.clear();
+    SHA256(static_cast<const uint8_t*>(data), size, parcel_digest_.data());
+    from_parcel_ = true;
+    return NO_ERROR;
+}
+
+Signature::Digest Signature::sha256() const {
+    if (from_parcel_) return parcel_digest_;
+    Digest digest;
+    SHA256(sig_data_.data(), sig_data_.size(), digest.data());
+    return digest;
 }
 
 Signature::Signature(std::vector<uint8_t> signature_data) : sig_data_(std::move(signature_data)) {}
@@ -15,6 +15,7 @@
 #ifndef KEYSTORE_INCLUDE_KEYSTORE_SIGNATURE_H_
 #define KEYSTORE_INCLUDE_KEYSTORE_SIGNATURE_H_
 
+#include <array>
 #include <vector>
 
 #include <binder/Parcelable.h>
@@ -32,12 +33,23 @@ class Signature : public Parcelable {
     status_t writeToParcel(Parcel*) const override;
     status_t readFromParcel(const Parcel* parcel) override;
 
+    typedef std::array<uint8_t, 32> Digest;
+
+    // Signatures read from a parcel are hashed straight from the parcel buffer and keep only
+    // their digest, which is all that keystore needs, so their data is empty and they cannot
+    // be written to a parcel again.
     const std::vector<uint8_t>& data() const & { return sig_data_; }
     std::vector<uint8_t>& data() & { return sig_data_; }
     std::vector<uint8_t>&& data() && { return std::move(sig_data_); }
 
+    // Returns the SHA-256 digest of the signature data.
+    Digest sha256() const;
+
   private:
     std::vector<uint8_t> sig_data_;
+    // Set by readFromParcel.
+    bool from_parcel_ = false;
+    Digest parcel_digest_ = {};
 };
 
 }  // namespace pm
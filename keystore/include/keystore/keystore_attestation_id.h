@@ -66,11 +66,21 @@ template <typename T> class StatusOr {
  * application id may contain more than one package info followed by a set of digests of the
  * packages signing certificates.
  *
+ * Successful lookups are cached per uid for a short while, so package changes may take up to
+ * that long to show up in the attestation application id unless the entry is invalidated with
+ * invalidate_attestation_application_id.
+ *
  * @returns the asn.1 encoded attestation application id or an error code. Check the result with
  *          .isOk() before accessing.
  */
 StatusOr<std::vector<uint8_t>> gather_attestation_application_id(uid_t uid);
 
+/**
+ * Drops the cached attestation application id of uid, e.g., because its packages changed, so the
+ * next gather_attestation_application_id call asks the package manager again.
+ */
+void invalidate_attestation_application_id(uid_t uid);
+
 /**
  * Generates a DER-encoded vector containing information from KeyAttestationApplicationId.
  * The size of the returned vector will not exceed KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE.
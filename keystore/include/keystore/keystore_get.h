@@ -32,6 +32,16 @@ extern "C" {
  */
 ssize_t keystore_get(const char* key, size_t length, uint8_t** value);
 
+/* Like keystore_get() for |count| keys, which share a single lookup of the
+ * keystore service. keys[i] is the i-th key and keyLengths[i] its length. Its
+ * value is stored in values[i], which the caller must free(), and the length of
+ * the value in valueLengths[i]. Keys which cannot be retrieved get a NULL value
+ * and a length of -1. Returns the number of keys retrieved, or -1 if the
+ * arguments are invalid or keystore cannot be reached.
+ */
+ssize_t keystore_get_many(size_t count, const char* const* keys, const size_t* keyLengths,
+                          uint8_t** values, ssize_t* valueLengths);
+
 #ifdef __cplusplus
 }
 #endif
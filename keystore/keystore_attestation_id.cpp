@@ -20,7 +20,12 @@
 
 #include <log/log.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -37,8 +42,8 @@
 
 #include <private/android_filesystem_config.h> /* for AID_SYSTEM */
 
-#include <openssl/asn1t.h>
-#include <openssl/bn.h>
+#include <openssl/bytestring.h>
+#include <openssl/mem.h>
 #include <openssl/sha.h>
 
 #include <utils/String8.h>
@@ -50,10 +55,12 @@ namespace {
 constexpr const char* kAttestationSystemPackageName = "AndroidSystem";
 constexpr const char* kUnknownPackageName = "UnknownPackage";
 
-std::vector<uint8_t> signature2SHA256(const content::pm::Signature& sig) {
-    std::vector<uint8_t> digest_buffer(SHA256_DIGEST_LENGTH);
-    SHA256(sig.data().data(), sig.data().size(), digest_buffer.data());
-    return digest_buffer;
+// Returns the DER encoded SHA-256 digest of the signature.
+std::vector<uint8_t> signature2DerSHA256(const content::pm::Signature& sig) {
+    auto digest = sig.sha256();
+    std::vector<uint8_t> der = {CBS_ASN1_OCTETSTRING, SHA256_DIGEST_LENGTH};
+    der.insert(der.end(), digest.begin(), digest.end());
+    return der;
 }
 
 using ::android::security::keymaster::BpKeyAttestationApplicationIdProvider;
@@ -77,33 +84,15 @@ KeyAttestationApplicationIdProvider::KeyAttestationApplicationIdProvider()
     : BpKeyAttestationApplicationIdProvider(
           android::defaultServiceManager()->getService(String16("sec_key_att_app_id_provider"))) {}
 
-DECLARE_STACK_OF(ASN1_OCTET_STRING);
-
-typedef struct km_attestation_package_info {
-    ASN1_OCTET_STRING* package_name;
-    ASN1_INTEGER* version;
-} KM_ATTESTATION_PACKAGE_INFO;
-
 // Estimated size:
 // 4 bytes for the package name + package_name length
 // 11 bytes for the version (2 bytes header and up to 9 bytes of data).
 constexpr size_t AAID_PKG_INFO_OVERHEAD = 15;
-ASN1_SEQUENCE(KM_ATTESTATION_PACKAGE_INFO) = {
-    ASN1_SIMPLE(KM_ATTESTATION_PACKAGE_INFO, package_name, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(KM_ATTESTATION_PACKAGE_INFO, version, ASN1_INTEGER),
-} ASN1_SEQUENCE_END(KM_ATTESTATION_PACKAGE_INFO);
-IMPLEMENT_ASN1_FUNCTIONS(KM_ATTESTATION_PACKAGE_INFO);
-
-DECLARE_STACK_OF(KM_ATTESTATION_PACKAGE_INFO);
 
 // Estimated size:
-// See estimate above for the stack of package infos.
+// See estimate above for the set of package infos.
 // 34 (32 + 2) bytes for each signature digest.
 constexpr size_t AAID_SIGNATURE_SIZE = 34;
-typedef struct km_attestation_application_id {
-    STACK_OF(KM_ATTESTATION_PACKAGE_INFO) * package_infos;
-    STACK_OF(ASN1_OCTET_STRING) * signature_digests;
-} KM_ATTESTATION_APPLICATION_ID;
 
 // Estimated overhead:
 // 4 for the header of the octet string containing the fully-encoded data.
@@ -111,98 +100,93 @@ typedef struct km_attestation_application_id {
 // 4 for the header of the package info set.
 // 4 for the header of the signature set.
 constexpr size_t AAID_GENERAL_OVERHEAD = 16;
-ASN1_SEQUENCE(KM_ATTESTATION_APPLICATION_ID) = {
-    ASN1_SET_OF(KM_ATTESTATION_APPLICATION_ID, package_infos, KM_ATTESTATION_PACKAGE_INFO),
-    ASN1_SET_OF(KM_ATTESTATION_APPLICATION_ID, signature_digests, ASN1_OCTET_STRING),
-} ASN1_SEQUENCE_END(KM_ATTESTATION_APPLICATION_ID);
-IMPLEMENT_ASN1_FUNCTIONS(KM_ATTESTATION_APPLICATION_ID);
 
-}  // namespace
+// Encoded attestation application IDs are kept per uid for this long. Native code cannot
+// receive package change broadcasts, so entries expire unless a caller who learns of a change
+// invalidates them first.
+constexpr std::chrono::seconds kAaidCacheLifetime(30);
+constexpr size_t kAaidCacheMaxEntries = 32;
 
-}  // namespace android
-
-namespace std {
-template <> struct default_delete<android::KM_ATTESTATION_PACKAGE_INFO> {
-    void operator()(android::KM_ATTESTATION_PACKAGE_INFO* p) {
-        android::KM_ATTESTATION_PACKAGE_INFO_free(p);
-    }
+struct CachedAaid {
+    std::chrono::steady_clock::time_point expiry;
+    std::vector<uint8_t> encoded;
 };
-template <> struct default_delete<ASN1_OCTET_STRING> {
-    void operator()(ASN1_OCTET_STRING* p) { ASN1_OCTET_STRING_free(p); }
-};
-template <> struct default_delete<android::KM_ATTESTATION_APPLICATION_ID> {
-    void operator()(android::KM_ATTESTATION_APPLICATION_ID* p) {
-        android::KM_ATTESTATION_APPLICATION_ID_free(p);
-    }
-};
-}  // namespace std
 
-namespace android {
+std::mutex& aaid_cache_lock() {
+    static std::mutex* lock = new std::mutex();
+    return *lock;
+}
+
+std::map<uid_t, CachedAaid>& aaid_cache() {
+    static auto* cache = new std::map<uid_t, CachedAaid>();
+    return *cache;
+}
+
+}  // namespace
+
 namespace security {
 namespace {
 
 using ::android::security::keymaster::KeyAttestationApplicationId;
 using ::android::security::keymaster::KeyAttestationPackageInfo;
 
-status_t build_attestation_package_info(const KeyAttestationPackageInfo& pinfo,
-    std::unique_ptr<KM_ATTESTATION_PACKAGE_INFO>* attestation_package_info_ptr) {
-
-    if (!attestation_package_info_ptr) return BAD_VALUE;
-    auto& attestation_package_info = *attestation_package_info_ptr;
-
-    attestation_package_info.reset(KM_ATTESTATION_PACKAGE_INFO_new());
-    if (!attestation_package_info.get()) return NO_MEMORY;
-
-    if (!pinfo.package_name()) {
-        ALOGE("Key attestation package info lacks package name");
-        return BAD_VALUE;
-    }
-
-    std::string pkg_name(String8(*pinfo.package_name()).string());
-    if (!ASN1_OCTET_STRING_set(attestation_package_info->package_name,
-                               reinterpret_cast<const unsigned char*>(pkg_name.data()),
-                               pkg_name.size())) {
-        return UNKNOWN_ERROR;
-    }
+/* The attestation application ID is the DER encoding of
+ *
+ * AttestationApplicationId ::= SEQUENCE {
+ *     package_infos  SET OF AttestationPackageInfo,
+ *     signature_digests  SET OF OCTET_STRING,
+ * }
+ *
+ * AttestationPackageInfo ::= SEQUENCE {
+ *     package_name  OCTET_STRING,
+ *     version  INTEGER,
+ * }
+ */
 
-    BIGNUM* bn_version = BN_new();
-    if (bn_version == nullptr) {
+status_t encode_attestation_package_info(const std::string& package_name, int64_t version_code,
+                                         std::vector<uint8_t>* encoded) {
+    bssl::ScopedCBB cbb;
+    CBB seq, name;
+    uint8_t* data;
+    size_t len;
+    if (!CBB_init(cbb.get(), AAID_PKG_INFO_OVERHEAD + package_name.size()) ||
+        !CBB_add_asn1(cbb.get(), &seq, CBS_ASN1_SEQUENCE) ||
+        !CBB_add_asn1(&seq, &name, CBS_ASN1_OCTETSTRING) ||
+        !CBB_add_bytes(&name, reinterpret_cast<const uint8_t*>(package_name.data()),
+                       package_name.size()) ||
+        !CBB_add_asn1_uint64(&seq, static_cast<uint64_t>(version_code)) ||
+        !CBB_finish(cbb.get(), &data, &len)) {
         return NO_MEMORY;
     }
-    if (BN_set_u64(bn_version, static_cast<uint64_t>(pinfo.version_code())) != 1) {
-        BN_free(bn_version);
-        return UNKNOWN_ERROR;
-    }
-    status_t retval = NO_ERROR;
-    if (BN_to_ASN1_INTEGER(bn_version, attestation_package_info->version) == nullptr) {
-        retval = UNKNOWN_ERROR;
-    }
-    BN_free(bn_version);
-    return retval;
+    encoded->assign(data, data + len);
+    OPENSSL_free(data);
+    return NO_ERROR;
 }
 
-/* The following function are not used. They are mentioned here to silence
- * warnings about them not being used.
- */
-void unused_functions_silencer() __attribute__((unused));
-void unused_functions_silencer() {
-    i2d_KM_ATTESTATION_PACKAGE_INFO(nullptr, nullptr);
-    d2i_KM_ATTESTATION_APPLICATION_ID(nullptr, nullptr, 0);
-    d2i_KM_ATTESTATION_PACKAGE_INFO(nullptr, nullptr, 0);
+/* Adds a SET OF the already encoded |elements| to |parent|, sorting them as DER requires. */
+bool add_der_set_of(CBB* parent, std::vector<std::vector<uint8_t>>* elements) {
+    std::sort(elements->begin(), elements->end(),
+              [](const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+                  int cmp = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+                  return cmp != 0 ? cmp < 0 : a.size() < b.size();
+              });
+    CBB set;
+    if (!CBB_add_asn1(parent, &set, CBS_ASN1_SET)) return false;
+    for (const auto& element : *elements) {
+        if (!CBB_add_bytes(&set, element.data(), element.size())) return false;
+    }
+    return CBB_flush(parent);
 }
 
 }  // namespace
 
 StatusOr<std::vector<uint8_t>>
 build_attestation_application_id(const KeyAttestationApplicationId& key_attestation_id) {
-    auto attestation_id =
-        std::unique_ptr<KM_ATTESTATION_APPLICATION_ID>(KM_ATTESTATION_APPLICATION_ID_new());
     size_t estimated_encoded_size = AAID_GENERAL_OVERHEAD;
 
-    auto attestation_pinfo_stack = reinterpret_cast<_STACK*>(attestation_id->package_infos);
-
     if (key_attestation_id.pinfos_begin() == key_attestation_id.pinfos_end()) return BAD_VALUE;
 
+    std::vector<std::vector<uint8_t>> package_infos;
     for (auto pinfo = key_attestation_id.pinfos_begin(); pinfo != key_attestation_id.pinfos_end();
          ++pinfo) {
         if (!pinfo->package_name()) {
@@ -210,21 +194,18 @@ build_attestation_application_id(const KeyAttestationApplicationId& key_attestat
             return BAD_VALUE;
         }
         std::string package_name(String8(*pinfo->package_name()).string());
-        std::unique_ptr<KM_ATTESTATION_PACKAGE_INFO> attestation_package_info;
-        auto rc = build_attestation_package_info(*pinfo, &attestation_package_info);
-        if (rc != NO_ERROR) {
-            ALOGE("Building DER attestation package info failed %d", rc);
-            return rc;
-        }
         estimated_encoded_size += AAID_PKG_INFO_OVERHEAD + package_name.size();
         if (estimated_encoded_size > KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE) {
             break;
         }
-        if (!sk_push(attestation_pinfo_stack, attestation_package_info.get())) {
-            return NO_MEMORY;
+        std::vector<uint8_t> package_info;
+        auto rc = encode_attestation_package_info(package_name, pinfo->version_code(),
+                                                  &package_info);
+        if (rc != NO_ERROR) {
+            ALOGE("Building DER attestation package info failed %d", rc);
+            return rc;
         }
-        // if push succeeded, the stack takes ownership
-        attestation_package_info.release();
+        package_infos.push_back(std::move(package_info));
     }
 
     /** Apps can only share a uid iff they were signed with the same certificate(s). Because the
@@ -235,39 +216,32 @@ build_attestation_application_id(const KeyAttestationApplicationId& key_attestat
     std::vector<std::vector<uint8_t>> signature_digests;
 
     for (auto sig = pinfo.sigs_begin(); sig != pinfo.sigs_end(); ++sig) {
-        signature_digests.push_back(signature2SHA256(*sig));
-    }
-
-    auto signature_digest_stack = reinterpret_cast<_STACK*>(attestation_id->signature_digests);
-    for (auto si : signature_digests) {
         estimated_encoded_size += AAID_SIGNATURE_SIZE;
         if (estimated_encoded_size > KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE) {
             break;
         }
-        auto asn1_item = std::unique_ptr<ASN1_OCTET_STRING>(ASN1_OCTET_STRING_new());
-        if (!asn1_item) return NO_MEMORY;
-        if (!ASN1_OCTET_STRING_set(asn1_item.get(), si.data(), si.size())) {
-            return UNKNOWN_ERROR;
-        }
-        if (!sk_push(signature_digest_stack, asn1_item.get())) {
-            return NO_MEMORY;
-        }
-        asn1_item.release();  // if push succeeded, the stack takes ownership
+        signature_digests.push_back(signature2DerSHA256(*sig));
     }
 
-    int len = i2d_KM_ATTESTATION_APPLICATION_ID(attestation_id.get(), nullptr);
-    if (len < 0) return UNKNOWN_ERROR;
-
-    std::vector<uint8_t> result(len);
-    uint8_t* p = result.data();
-    len = i2d_KM_ATTESTATION_APPLICATION_ID(attestation_id.get(), &p);
-    if (len < 0) return UNKNOWN_ERROR;
-
+    bssl::ScopedCBB cbb;
+    CBB seq;
+    uint8_t* data;
+    size_t len;
+    if (!CBB_init(cbb.get(), estimated_encoded_size) ||
+        !CBB_add_asn1(cbb.get(), &seq, CBS_ASN1_SEQUENCE) ||
+        !add_der_set_of(&seq, &package_infos) || !add_der_set_of(&seq, &signature_digests) ||
+        !CBB_finish(cbb.get(), &data, &len)) {
+        return NO_MEMORY;
+    }
+    std::vector<uint8_t> result(data, data + len);
+    OPENSSL_free(data);
     return result;
 }
 
 StatusOr<std::vector<uint8_t>> gather_attestation_application_id(uid_t uid) {
     KeyAttestationApplicationId key_attestation_id;
+    // The fixed IDs are cheap to build; only results from the package manager are cached.
+    bool cacheable = uid != AID_SYSTEM;
 
     if (uid == AID_SYSTEM) {
         /* Use a fixed ID for system callers */
@@ -276,6 +250,16 @@ StatusOr<std::vector<uint8_t>> gather_attestation_application_id(uid_t uid) {
             std::make_shared<KeyAttestationPackageInfo::SignaturesVector>());
         key_attestation_id = KeyAttestationApplicationId(std::move(pinfo));
     } else {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(aaid_cache_lock());
+            auto cached = aaid_cache().find(uid);
+            if (cached != aaid_cache().end()) {
+                if (now < cached->second.expiry) return cached->second.encoded;
+                aaid_cache().erase(cached);
+            }
+        }
+
         /* Get the attestation application ID from package manager */
         auto& pm = KeyAttestationApplicationIdProvider::get();
         auto status = pm.getKeyAttestationApplicationId(uid, &key_attestation_id);
@@ -288,11 +272,33 @@ StatusOr<std::vector<uint8_t>> gather_attestation_application_id(uid_t uid) {
                 String16(kUnknownPackageName), 1 /* version code */,
                 std::make_shared<KeyAttestationPackageInfo::SignaturesVector>());
             key_attestation_id = KeyAttestationApplicationId(std::move(pinfo));
+            cacheable = false;
         }
     }
 
     /* DER encode the attestation application ID */
-    return build_attestation_application_id(key_attestation_id);
+    auto result = build_attestation_application_id(key_attestation_id);
+    if (cacheable && result.isOk()) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(aaid_cache_lock());
+        auto& cache = aaid_cache();
+        for (auto it = cache.begin(); it != cache.end();) {
+            it = now < it->second.expiry ? std::next(it) : cache.erase(it);
+        }
+        if (cache.size() >= kAaidCacheMaxEntries) {
+            cache.erase(std::min_element(cache.begin(), cache.end(),
+                                         [](const auto& a, const auto& b) {
+                                             return a.second.expiry < b.second.expiry;
+                                         }));
+        }
+        cache[uid] = CachedAaid{now + kAaidCacheLifetime, result.value()};
+    }
+    return result;
+}
+
+void invalidate_attestation_application_id(uid_t uid) {
+    std::lock_guard<std::mutex> lock(aaid_cache_lock());
+    aaid_cache().erase(uid);
 }
 
 }  // namespace security
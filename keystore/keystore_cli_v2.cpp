@@ -12,15 +12,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <variant>
 #include <vector>
 
+#include <sys/stat.h>
+
 #include <base/command_line.h>
 #include <base/files/file_util.h>
 #include <base/strings/string_number_conversions.h>
@@ -87,14 +95,19 @@ void PrintUsageAndExit() {
            "          delete --name=<key_name>\n"
            "          delete-all\n"
            "          exists --name=<key_name>\n"
-           "          list [--prefix=<key_name_prefix>]\n"
+           "          list [--prefix=<key_name_prefix>] [--with_chars]\n"
+           "               [--page_size=<count> [--page=<index>]]\n"
            "          list-apps-with-keys\n"
            "          sign-verify --name=<key_name>\n"
-           "          [en|de]crypt --name=<key_name> --in=<file> --out=<file>\n"
+           "          [en|de]crypt --name=<key_name> --in=<file> --out=<file> [--stream]\n"
            "                       [--seclevel=software|strongbox|tee(default)]\n"
            "          confirmation --prompt_text=<PromptText> --extra_data=<hex>\n"
            "                       --locale=<locale> [--ui_options=<list_of_ints>]\n"
-           "                       --cancel_after=<seconds>\n");
+           "                       --cancel_after=<seconds>\n"
+           "          bench [--op=generate|sign(default)|encrypt|get-entry[,...]]\n"
+           "                [--algorithm=rsa|ec|aes] [--key_size=<bits>[,...]]\n"
+           "                [--seclevel=strongbox|tee(default)[,...]]\n"
+           "                [--threads=<count>] [--iterations=<per_thread>] [--json]\n");
     exit(1);
 }
 
@@ -537,6 +550,311 @@ decryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& d
     return *optPlaintext;
 }
 
+// The streaming format written by encrypt --stream: kStreamMagic, the IV, the ciphertext and
+// finally the HMAC of IV and ciphertext. Unlike the EncryptedData protobuf it can be produced
+// and consumed a chunk at a time.
+constexpr char kStreamMagic[] = {'K', 'S', 'E', '1'};
+constexpr size_t kStreamIvSize = 16;
+constexpr size_t kStreamMacSize = kHMACOutputSize / 8;
+// keystore2 rejects update() calls with more input than this.
+constexpr size_t kStreamChunkSize = 0x8000;
+
+using UniqueFile = std::unique_ptr<FILE, decltype(&fclose)>;
+using StreamSink = std::function<int(const std::vector<uint8_t>&)>;
+
+UniqueFile OpenFile(const std::string& filename, const char* mode) {
+    UniqueFile file(fopen(filename.c_str(), mode), fclose);
+    if (!file) {
+        printf("Failed to open file: %s\n", filename.c_str());
+        exit(1);
+    }
+    return file;
+}
+
+// Returns fewer than |size| bytes only at the end of the file, nothing on error.
+std::optional<std::vector<uint8_t>> ReadChunk(FILE* file, size_t size) {
+    std::vector<uint8_t> chunk(size);
+    chunk.resize(fread(chunk.data(), 1, size, file));
+    if (ferror(file)) return std::nullopt;
+    return chunk;
+}
+
+int WriteChunk(FILE* file, const std::vector<uint8_t>& chunk) {
+    if (fwrite(chunk.data(), 1, chunk.size(), file) != chunk.size()) {
+        std::cerr << "Failed to write output file." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    return 0;
+}
+
+int BeginStreamOperation(const ks2::KeyEntryResponse& key, const keymint::AuthorizationSet& params,
+                         ks2::CreateOperationResponse* response) {
+    auto rc = key.iSecurityLevel->createOperation(key.metadata.key, params.vector_data(),
+                                                  false /* forced */, response);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to begin operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    return 0;
+}
+
+// Feeds |length| bytes of |in|, or everything up to the end of the file if |length| is not
+// given, through |operation| and finishes it with |signature|. The next chunk is read and the
+// output of the previous one is handed to |sink| while keystore works on the current one, so
+// file I/O overlaps with the binder calls. |sink| is called for one chunk at a time, in order.
+// If |copy| is not null, every chunk of the input is also written to it, exactly as it was fed
+// to |operation|.
+int StreamThroughOperation(FILE* in, std::optional<uint64_t> length,
+                           const std::shared_ptr<ks2::IKeystoreOperation>& operation,
+                           const std::optional<std::vector<uint8_t>>& signature,
+                           const StreamSink& sink, FILE* copy = nullptr) {
+    uint64_t remaining = length.value_or(UINT64_MAX);
+    size_t readSize = 0;
+    auto startRead = [&] {
+        readSize = std::min<uint64_t>(kStreamChunkSize, remaining);
+        remaining -= readSize;
+        return std::async(std::launch::async, ReadChunk, in, readSize);
+    };
+
+    std::future<int> pendingSink;
+    auto waitForSink = [&] { return pendingSink.valid() ? pendingSink.get() : 0; };
+
+    auto nextChunk = startRead();
+    for (bool last = false; !last;) {
+        auto chunk = nextChunk.get();
+        if (!chunk) {
+            waitForSink();
+            std::cerr << "Failed to read input file." << std::endl;
+            return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+        }
+        last = chunk->size() < readSize || remaining == 0;
+        if (!last) nextChunk = startRead();
+        if (copy != nullptr) {
+            if (int error = WriteChunk(copy, *chunk)) {
+                waitForSink();
+                return error;
+            }
+        }
+
+        std::optional<std::vector<uint8_t>> output;
+        auto rc = last ? operation->finish(*chunk, signature, &output)
+                       : operation->update(*chunk, &output);
+        if (int error = waitForSink()) return error;
+        if (!rc.isOk()) {
+            std::cerr << "Failed to " << (last ? "finish" : "update")
+                      << " operation: " << rc.getDescription() << std::endl;
+            return unwrapError(rc);
+        }
+        if (output && !output->empty()) {
+            pendingSink = std::async(std::launch::async,
+                                     [&sink, chunk = std::move(*output)] { return sink(chunk); });
+        }
+    }
+    return waitForSink();
+}
+
+void PrintStreamThroughput(const char* what, uint64_t bytes,
+                           std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << what << " " << bytes << " bytes in " << elapsed.count() << " s ("
+              << bytes / elapsed.count() / (1024 * 1024) << " MiB/s)" << std::endl;
+}
+
+int EncryptStreaming(const std::string& key_name, const std::string& input_filename,
+                     const std::string& output_filename, keymint::SecurityLevel securityLevel) {
+    auto start = std::chrono::steady_clock::now();
+    auto in = OpenFile(input_filename, "rb");
+    auto out = OpenFile(output_filename, "wb");
+
+    auto encryption_key_result = loadOrCreateAndVerifyEncryptionKey(
+        key_name + kEncryptSuffix, securityLevel, true /* create */);
+    if (auto error = std::get_if<int>(&encryption_key_result)) {
+        return *error;
+    }
+    auto authentication_key_result = loadOrCreateAndVerifyAuthenticationKey(
+        key_name + kAuthenticateSuffix, securityLevel, true /* create */);
+    if (auto error = std::get_if<int>(&authentication_key_result)) {
+        return *error;
+    }
+
+    ks2::CreateOperationResponse encOperationResponse;
+    int error = BeginStreamOperation(
+        std::get<ks2::KeyEntryResponse>(encryption_key_result),
+        keymint::AuthorizationSetBuilder()
+            .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::ENCRYPT)
+            .Padding(keymint::PaddingMode::PKCS7)
+            .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::CBC),
+        &encOperationResponse);
+    if (error) return error;
+
+    std::vector<uint8_t> initVector;
+    if (auto params = encOperationResponse.parameters) {
+        for (auto& p : params->keyParameter) {
+            if (auto iv = keymint::authorizationValue(keymint::TAG_NONCE, p)) {
+                initVector = std::move(iv->get());
+                break;
+            }
+        }
+    }
+    if (initVector.size() != kStreamIvSize) {
+        std::cerr << "Encryption operation did not return an IV." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    ks2::CreateOperationResponse signOperationResponse;
+    error = BeginStreamOperation(
+        std::get<ks2::KeyEntryResponse>(authentication_key_result),
+        keymint::AuthorizationSetBuilder()
+            .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::SIGN)
+            .Digest(keymint::Digest::SHA_2_256)
+            .Authorization(keymint::TAG_MAC_LENGTH, kHMACOutputSize),
+        &signOperationResponse);
+    if (error) return error;
+    auto& macOperation = signOperationResponse.iOperation;
+
+    std::vector<uint8_t> header(std::begin(kStreamMagic), std::end(kStreamMagic));
+    header.insert(header.end(), initVector.begin(), initVector.end());
+    std::optional<std::vector<uint8_t>> unused;
+    auto rc = macOperation->update(initVector, &unused);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to update signing operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    if ((error = WriteChunk(out.get(), header))) return error;
+
+    error = StreamThroughOperation(
+        in.get(), std::nullopt /* length */, encOperationResponse.iOperation,
+        std::nullopt /* signature */, [&](const std::vector<uint8_t>& ciphertext) {
+            std::optional<std::vector<uint8_t>> macOutput;
+            auto rc = macOperation->update(ciphertext, &macOutput);
+            if (!rc.isOk()) {
+                std::cerr << "Failed to update signing operation: " << rc.getDescription()
+                          << std::endl;
+                return unwrapError(rc);
+            }
+            return WriteChunk(out.get(), ciphertext);
+        });
+    if (error) return error;
+
+    std::optional<std::vector<uint8_t>> optMac;
+    rc = macOperation->finish({}, {}, &optMac);
+    if (!rc.isOk() || !optMac) {
+        std::cerr << "Failed to finish signing operation: " << rc.getDescription() << std::endl;
+        return rc.isOk() ? static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR) : unwrapError(rc);
+    }
+    if ((error = WriteChunk(out.get(), *optMac))) return error;
+    if (fflush(out.get()) != 0) {
+        std::cerr << "Failed to write output file." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    PrintStreamThroughput("Encrypted", ftello(in.get()), start);
+    return 0;
+}
+
+// The HMAC is checked in a first pass over the file, so no plaintext is written unless the
+// whole ciphertext is authentic. That pass also copies the ciphertext to a private temporary
+// file, and the second pass decrypts from the copy, so a change to the input file in between
+// can't slip unauthenticated ciphertext into the decryption.
+int DecryptStreaming(const std::string& key_name, const std::string& input_filename,
+                     const std::string& output_filename) {
+    auto start = std::chrono::steady_clock::now();
+    auto in = OpenFile(input_filename, "rb");
+
+    constexpr size_t kHeaderSize = sizeof(kStreamMagic) + kStreamIvSize;
+    struct stat st;
+    auto header = ReadChunk(in.get(), kHeaderSize);
+    if (fstat(fileno(in.get()), &st) != 0 || !header || header->size() != kHeaderSize ||
+        st.st_size < static_cast<off_t>(kHeaderSize + kStreamMacSize) ||
+        !std::equal(std::begin(kStreamMagic), std::end(kStreamMagic), header->begin())) {
+        std::cerr << "Decrypt: " << input_filename << " is not a streamed encrypted file."
+                  << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    std::vector<uint8_t> initVector(header->begin() + sizeof(kStreamMagic), header->end());
+    uint64_t ciphertextSize = st.st_size - kHeaderSize - kStreamMacSize;
+
+    std::optional<std::vector<uint8_t>> mac;
+    if (fseeko(in.get(), kHeaderSize + ciphertextSize, SEEK_SET) == 0) {
+        mac = ReadChunk(in.get(), kStreamMacSize);
+    }
+    if (!mac || mac->size() != kStreamMacSize) {
+        std::cerr << "Decrypt: Failed to read HMAC." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    auto encryption_key_result = loadOrCreateAndVerifyEncryptionKey(
+        key_name + kEncryptSuffix, keymint::SecurityLevel::KEYSTORE /* ignored */,
+        false /* create */);
+    if (auto error = std::get_if<int>(&encryption_key_result)) {
+        return *error;
+    }
+    auto authentication_key_result = loadOrCreateAndVerifyAuthenticationKey(
+        key_name + kAuthenticateSuffix, keymint::SecurityLevel::KEYSTORE /* ignored */,
+        false /* create */);
+    if (auto error = std::get_if<int>(&authentication_key_result)) {
+        return *error;
+    }
+
+    ks2::CreateOperationResponse verifyOperationResponse;
+    int error = BeginStreamOperation(
+        std::get<ks2::KeyEntryResponse>(authentication_key_result),
+        keymint::AuthorizationSetBuilder()
+            .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::VERIFY)
+            .Digest(keymint::Digest::SHA_2_256)
+            .Authorization(keymint::TAG_MAC_LENGTH, kHMACOutputSize),
+        &verifyOperationResponse);
+    if (error) return error;
+    std::optional<std::vector<uint8_t>> unused;
+    auto rc = verifyOperationResponse.iOperation->update(initVector, &unused);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to update verify operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    UniqueFile ciphertext(tmpfile(), fclose);
+    if (!ciphertext) {
+        std::cerr << "Decrypt: Failed to create temporary file." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    fseeko(in.get(), kHeaderSize, SEEK_SET);
+    error = StreamThroughOperation(in.get(), ciphertextSize, verifyOperationResponse.iOperation,
+                                   mac, [](const std::vector<uint8_t>&) { return 0; },
+                                   ciphertext.get());
+    if (error) {
+        std::cerr << "Decrypt: HMAC verification failed." << std::endl;
+        return error;
+    }
+    if (fflush(ciphertext.get()) != 0 || fseeko(ciphertext.get(), 0, SEEK_SET) != 0) {
+        std::cerr << "Decrypt: Failed to rewind temporary file." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    ks2::CreateOperationResponse decOperationResponse;
+    error = BeginStreamOperation(
+        std::get<ks2::KeyEntryResponse>(encryption_key_result),
+        keymint::AuthorizationSetBuilder()
+            .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::DECRYPT)
+            .Authorization(keymint::TAG_NONCE, initVector.data(), initVector.size())
+            .Padding(keymint::PaddingMode::PKCS7)
+            .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::CBC),
+        &decOperationResponse);
+    if (error) return error;
+
+    auto out = OpenFile(output_filename, "wb");
+    error = StreamThroughOperation(
+        ciphertext.get(), ciphertextSize, decOperationResponse.iOperation,
+        std::nullopt /* signature */,
+        [&](const std::vector<uint8_t>& plaintext) { return WriteChunk(out.get(), plaintext); });
+    if (error) return error;
+    if (fflush(out.get()) != 0) {
+        std::cerr << "Failed to write output file." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    PrintStreamThroughput("Decrypted", ciphertextSize, start);
+    return 0;
+}
+
 bool TestKey(const std::string& name, bool required,
              const std::vector<keymint::KeyParameter>& parameters) {
     auto keystore = CreateKeystoreInstance();
@@ -845,7 +1163,13 @@ int DoesKeyExist(const std::string& name) {
     return 0;
 }
 
-int List() {
+// getKeyEntry calls issued concurrently by list --with_chars.
+constexpr size_t kListCharsThreads = 8;
+
+// Lists the aliases starting with |prefix| in order. With |pageSize| set only page |page| of
+// them (counting from zero) is printed. With |withChars| the characteristics of the listed keys
+// are fetched too, by several threads, so the per-key round-trips overlap.
+int List(const std::string& prefix, size_t pageSize, size_t page, bool withChars) {
     auto keystore = CreateKeystoreInstance();
     std::vector<ks2::KeyDescriptor> key_list;
     auto rc = keystore->listEntries(ks2::Domain::APP, -1 /* nspace ignored */, &key_list);
@@ -853,13 +1177,64 @@ int List() {
         std::cerr << "ListKeys failed: " << rc.getDescription() << std::endl;
         return unwrapError(rc);
     }
-    std::cout << "Keys:\n";
+
+    std::vector<std::string> aliases;
     for (const auto& key : key_list) {
-        std::cout << "  "
-                  << (key.alias ? *key.alias : "Whoopsi - no alias, this should not happen.")
-                  << std::endl;
+        std::string alias = key.alias ? *key.alias : "Whoopsi - no alias, this should not happen.";
+        if (base::StartsWith(alias, prefix, base::CompareCase::SENSITIVE)) {
+            aliases.push_back(std::move(alias));
+        }
     }
-    return 0;
+    std::sort(aliases.begin(), aliases.end());
+    if (pageSize > 0) {
+        size_t begin = std::min(aliases.size(), page * pageSize);
+        size_t end = std::min(aliases.size(), begin + pageSize);
+        std::cout << "Keys " << begin << " to " << end << " of " << aliases.size() << ":\n";
+        aliases = std::vector<std::string>(aliases.begin() + begin, aliases.begin() + end);
+    } else {
+        std::cout << "Keys:\n";
+    }
+
+    if (!withChars) {
+        for (const auto& alias : aliases) {
+            std::cout << "  " << alias << std::endl;
+        }
+        return 0;
+    }
+
+    std::vector<std::variant<int, std::vector<ks2::Authorization>>> characteristics(
+        aliases.size());
+    std::atomic<size_t> nextKey = 0;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(kListCharsThreads, aliases.size()); ++i) {
+        threads.emplace_back([&] {
+            for (size_t k; (k = nextKey.fetch_add(1)) < aliases.size();) {
+                ks2::KeyEntryResponse keyEntryResponse;
+                auto rc = keystore->getKeyEntry(keyDescriptor(aliases[k]), &keyEntryResponse);
+                if (rc.isOk()) {
+                    characteristics[k] = std::move(keyEntryResponse.metadata.authorizations);
+                } else {
+                    characteristics[k] = unwrapError(rc);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    int result = 0;
+    for (size_t k = 0; k < aliases.size(); ++k) {
+        std::cout << "  " << aliases[k] << std::endl;
+        if (auto error = std::get_if<int>(&characteristics[k])) {
+            std::cerr << "Failed to get key entry of " << aliases[k] << ": " << *error
+                      << std::endl;
+            result = *error;
+        } else {
+            PrintKeyCharacteristics(std::get<std::vector<ks2::Authorization>>(characteristics[k]));
+        }
+    }
+    return result;
 }
 
 int SignAndVerify(const std::string& name) {
@@ -969,6 +1344,291 @@ keymint::SecurityLevel securityLevelOption2SecurlityLevel(const CommandLine& cmd
     return keymint::SecurityLevel::TRUSTED_ENVIRONMENT;
 }
 
+// The workloads of the bench command. Each thread runs its share of operations against a key
+// of its own, set up before the clock starts so that only the calls themselves are measured.
+constexpr const char* kBenchOps[] = {"generate", "sign", "encrypt", "get-entry"};
+constexpr const char kBenchAliasPrefix[] = "keystore_cli_bench_";
+constexpr size_t kBenchDataSize = 256;
+
+struct BenchConfig {
+    std::string op;
+    std::string algorithm;
+    uint32_t keySize;
+    keymint::SecurityLevel securityLevel;
+    int threads;
+    int iterations;
+};
+
+struct BenchResult {
+    BenchConfig config;
+    size_t operations = 0;
+    size_t errors = 0;
+    double seconds = 0.0;
+    std::vector<double> latenciesUs;  // Of the successful operations, sorted.
+};
+
+struct BenchWorker {
+    ks2::KeyDescriptor alias;
+    ks2::KeyDescriptor key;  // As returned by getKeyEntry, for creating operations.
+    std::shared_ptr<ks2::IKeystoreSecurityLevel> secLevel;
+    std::vector<double> latenciesUs;
+    size_t errors = 0;
+};
+
+const char* securityLevelName(keymint::SecurityLevel securityLevel) {
+    return securityLevel == keymint::SecurityLevel::STRONGBOX ? "strongbox" : "tee";
+}
+
+uint32_t defaultKeySize(const std::string& algorithm) {
+    return algorithm == "rsa" ? 2048 : 256;
+}
+
+keymint::AuthorizationSet GetBenchKeyParameters(const std::string& algorithm, uint32_t key_size) {
+    if (algorithm == "rsa") return GetRSASignParameters(key_size, true /* sha256_only */);
+    if (algorithm == "ec") return GetECDSAParameters(key_size, true /* sha256_only */);
+    keymint::AuthorizationSetBuilder parameters;
+    parameters.AesEncryptionKey(key_size)
+        .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::GCM)
+        .Padding(keymint::PaddingMode::NONE)
+        .Authorization(keymint::TAG_MIN_MAC_LENGTH, 128)
+        .Authorization(keymint::TAG_NO_AUTH_REQUIRED);
+    return std::move(parameters);
+}
+
+keymint::AuthorizationSet GetBenchOperationParameters(const std::string& algorithm) {
+    keymint::AuthorizationSetBuilder parameters;
+    if (algorithm == "aes") {
+        parameters.Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::ENCRYPT)
+            .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::GCM)
+            .Padding(keymint::PaddingMode::NONE)
+            .Authorization(keymint::TAG_MAC_LENGTH, 128);
+    } else {
+        parameters.Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::SIGN)
+            .Digest(keymint::Digest::SHA_2_256);
+        if (algorithm == "rsa") parameters.Padding(keymint::PaddingMode::RSA_PKCS1_1_5_SIGN);
+    }
+    return std::move(parameters);
+}
+
+// Generates the key of |worker| and looks it up, so sign and encrypt can use its key id.
+bool SetUpBenchWorker(const std::shared_ptr<ks2::IKeystoreService>& keystore,
+                      const std::shared_ptr<ks2::IKeystoreSecurityLevel>& secLevel,
+                      const keymint::AuthorizationSet& keyParams, BenchWorker* worker) {
+    ks2::KeyMetadata keyMetadata;
+    auto rc = secLevel->generateKey(worker->alias, {} /* attestationKey */, keyParams.vector_data(),
+                                    0 /* flags */, {} /* entropy */, &keyMetadata);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to generate benchmark key: " << rc.getDescription() << std::endl;
+        return false;
+    }
+    ks2::KeyEntryResponse keyEntryResponse;
+    rc = keystore->getKeyEntry(worker->alias, &keyEntryResponse);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to get benchmark key entry: " << rc.getDescription() << std::endl;
+        return false;
+    }
+    worker->key = keyEntryResponse.metadata.key;
+    worker->secLevel = keyEntryResponse.iSecurityLevel;
+    return true;
+}
+
+// Runs one benchmarked call.
+ndk::ScopedAStatus RunBenchOperation(const BenchConfig& config,
+                                     const std::shared_ptr<ks2::IKeystoreService>& keystore,
+                                     const keymint::AuthorizationSet& keyParams,
+                                     const keymint::AuthorizationSet& opParams,
+                                     const std::vector<uint8_t>& data, const BenchWorker& worker) {
+    if (config.op == "generate") {
+        ks2::KeyMetadata keyMetadata;
+        return worker.secLevel->generateKey(worker.alias, {} /* attestationKey */,
+                                            keyParams.vector_data(), 0 /* flags */,
+                                            {} /* entropy */, &keyMetadata);
+    }
+    if (config.op == "get-entry") {
+        ks2::KeyEntryResponse keyEntryResponse;
+        return keystore->getKeyEntry(worker.alias, &keyEntryResponse);
+    }
+    ks2::CreateOperationResponse operationResponse;
+    auto rc = worker.secLevel->createOperation(worker.key, opParams.vector_data(),
+                                               false /* forced */, &operationResponse);
+    if (!rc.isOk()) return rc;
+    std::optional<std::vector<uint8_t>> output;
+    return operationResponse.iOperation->finish(data, {}, &output);
+}
+
+double Percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+std::variant<int, BenchResult> RunBench(const std::shared_ptr<ks2::IKeystoreService>& keystore,
+                                        const BenchConfig& config) {
+    auto secLevel = GetSecurityLevelInterface(keystore, config.securityLevel);
+    auto keyParams = GetBenchKeyParameters(config.algorithm, config.keySize);
+    auto opParams = GetBenchOperationParameters(config.algorithm);
+    const std::vector<uint8_t> data(kBenchDataSize, 0x5a);
+
+    std::vector<BenchWorker> workers(config.threads);
+    for (int i = 0; i < config.threads; ++i) {
+        workers[i].alias = keyDescriptor(kBenchAliasPrefix + std::to_string(i));
+        workers[i].secLevel = secLevel;
+        if (config.op != "generate" &&
+            !SetUpBenchWorker(keystore, secLevel, keyParams, &workers[i])) {
+            // Worker i may have generated its key before failing to look it up.
+            for (int j = 0; j <= i; ++j) {
+                keystore->deleteKey(workers[j].alias);
+            }
+            return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&, w = &worker] {
+            w->latenciesUs.reserve(config.iterations);
+            for (int i = 0; i < config.iterations; ++i) {
+                auto opStart = std::chrono::steady_clock::now();
+                auto rc = RunBenchOperation(config, keystore, keyParams, opParams, data, *w);
+                std::chrono::duration<double, std::micro> latency =
+                    std::chrono::steady_clock::now() - opStart;
+                if (rc.isOk()) {
+                    w->latenciesUs.push_back(latency.count());
+                } else if (w->errors++ == 0) {
+                    std::cerr << config.op << " failed: " << rc.getDescription() << std::endl;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    BenchResult result = {.config = config, .seconds = elapsed.count()};
+    for (auto& worker : workers) {
+        result.errors += worker.errors;
+        result.latenciesUs.insert(result.latenciesUs.end(), worker.latenciesUs.begin(),
+                                  worker.latenciesUs.end());
+        keystore->deleteKey(worker.alias);
+    }
+    result.operations = result.latenciesUs.size() + result.errors;
+    std::sort(result.latenciesUs.begin(), result.latenciesUs.end());
+    return result;
+}
+
+void PrintBenchResult(const BenchResult& result) {
+    const auto& c = result.config;
+    const auto& l = result.latenciesUs;
+    printf("%s %s-%u on %s, %d threads x %d iterations\n", c.op.c_str(), c.algorithm.c_str(),
+           c.keySize, securityLevelName(c.securityLevel), c.threads, c.iterations);
+    printf("  %zu operations, %zu errors in %.3f s: %.1f ops/s\n", result.operations,
+           result.errors, result.seconds, l.size() / result.seconds);
+    printf("  latency (us): p50 %.0f  p99 %.0f  p999 %.0f  max %.0f\n", Percentile(l, 0.5),
+           Percentile(l, 0.99), Percentile(l, 0.999), l.empty() ? 0.0 : l.back());
+}
+
+void PrintBenchResultsJson(const std::vector<BenchResult>& results) {
+    printf("[");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& c = results[i].config;
+        const auto& l = results[i].latenciesUs;
+        printf("%s\n  {\"op\": \"%s\", \"algorithm\": \"%s\", \"key_size\": %u, "
+               "\"seclevel\": \"%s\", \"threads\": %d, \"iterations\": %d, "
+               "\"operations\": %zu, \"errors\": %zu, \"seconds\": %.6f, "
+               "\"ops_per_second\": %.3f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f}",
+               i == 0 ? "" : ",", c.op.c_str(), c.algorithm.c_str(), c.keySize,
+               securityLevelName(c.securityLevel), c.threads, c.iterations,
+               results[i].operations, results[i].errors, results[i].seconds,
+               l.size() / results[i].seconds, Percentile(l, 0.5), Percentile(l, 0.99),
+               Percentile(l, 0.999), l.empty() ? 0.0 : l.back());
+    }
+    printf("\n]\n");
+}
+
+std::vector<std::string> SplitList(const CommandLine& cmd, const std::string& name,
+                                   const std::string& defaultValue) {
+    std::string value = cmd.HasSwitch(name) ? cmd.GetSwitchValueASCII(name) : defaultValue;
+    return base::SplitString(value, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+}
+
+// Runs every combination of the comma separated --op, --seclevel and --key_size values.
+int Bench(const CommandLine& cmd) {
+    int threads = 1;
+    int iterations = 100;
+    if ((cmd.HasSwitch("threads") &&
+         !base::StringToInt(cmd.GetSwitchValueASCII("threads"), &threads)) ||
+        (cmd.HasSwitch("iterations") &&
+         !base::StringToInt(cmd.GetSwitchValueASCII("iterations"), &iterations)) ||
+        threads < 1 || iterations < 1) {
+        printf("--threads and --iterations must be positive numbers.\n");
+        return 1;
+    }
+
+    auto ops = SplitList(cmd, "op", "sign");
+    for (const auto& op : ops) {
+        if (std::find(std::begin(kBenchOps), std::end(kBenchOps), op) == std::end(kBenchOps)) {
+            printf("Unknown --op: %s\n", op.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<keymint::SecurityLevel> securityLevels;
+    for (const auto& str : SplitList(cmd, "seclevel", "tee")) {
+        if (str == "strongbox") {
+            securityLevels.push_back(keymint::SecurityLevel::STRONGBOX);
+        } else if (str == "tee") {
+            securityLevels.push_back(keymint::SecurityLevel::TRUSTED_ENVIRONMENT);
+        } else {
+            printf("Unknown --seclevel: %s\n", str.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<BenchConfig> configs;
+    for (const auto& op : ops) {
+        std::string algorithm = op == "encrypt" ? "aes" : "ec";
+        if (cmd.HasSwitch("algorithm")) algorithm = cmd.GetSwitchValueASCII("algorithm");
+        if (algorithm != "rsa" && algorithm != "ec" && algorithm != "aes") {
+            printf("Unknown --algorithm: %s\n", algorithm.c_str());
+            return 1;
+        }
+        if ((op == "sign" && algorithm == "aes") || (op == "encrypt" && algorithm != "aes")) {
+            printf("--op=%s does not work with --algorithm=%s\n", op.c_str(), algorithm.c_str());
+            return 1;
+        }
+        for (auto securityLevel : securityLevels) {
+            for (const auto& str :
+                 SplitList(cmd, "key_size", std::to_string(defaultKeySize(algorithm)))) {
+                int keySize;
+                if (!base::StringToInt(str, &keySize) || keySize < 1) {
+                    printf("Error parsing %s in --key_size parameter as a number.\n",
+                           str.c_str());
+                    return 1;
+                }
+                configs.push_back({op, algorithm, static_cast<uint32_t>(keySize), securityLevel,
+                                   threads, iterations});
+            }
+        }
+    }
+
+    auto keystore = CreateKeystoreInstance();
+    bool json = cmd.HasSwitch("json");
+    std::vector<BenchResult> results;
+    for (const auto& config : configs) {
+        auto result = RunBench(keystore, config);
+        if (auto error = std::get_if<int>(&result)) {
+            return *error;
+        }
+        results.push_back(std::move(std::get<BenchResult>(result)));
+        if (!json) PrintBenchResult(results.back());
+    }
+    if (json) PrintBenchResultsJson(results);
+    return 0;
+}
+
 class ConfirmationListener
     : public apc::BnConfirmationCallback,
       public std::promise<std::tuple<apc::ResponseCode, std::optional<std::vector<uint8_t>>>> {
@@ -1107,9 +1767,29 @@ int main(int argc, char** argv) {
     } else if (args[0] == "exists") {
         return DoesKeyExist(command_line->GetSwitchValueASCII("name"));
     } else if (args[0] == "list") {
-        return List();
+        int pageSize = 0;
+        int page = 0;
+        if ((command_line->HasSwitch("page_size") &&
+             !base::StringToInt(command_line->GetSwitchValueASCII("page_size"), &pageSize)) ||
+            (command_line->HasSwitch("page") &&
+             !base::StringToInt(command_line->GetSwitchValueASCII("page"), &page)) ||
+            pageSize < 0 || page < 0) {
+            printf("--page_size and --page must be non-negative numbers.\n");
+            return 1;
+        }
+        return List(command_line->GetSwitchValueASCII("prefix"), pageSize, page,
+                    command_line->HasSwitch("with_chars"));
     } else if (args[0] == "sign-verify") {
         return SignAndVerify(command_line->GetSwitchValueASCII("name"));
+    } else if (args[0] == "encrypt" && command_line->HasSwitch("stream")) {
+        return EncryptStreaming(command_line->GetSwitchValueASCII("name"),
+                                command_line->GetSwitchValueASCII("in"),
+                                command_line->GetSwitchValueASCII("out"),
+                                securityLevelOption2SecurlityLevel(*command_line));
+    } else if (args[0] == "decrypt" && command_line->HasSwitch("stream")) {
+        return DecryptStreaming(command_line->GetSwitchValueASCII("name"),
+                                command_line->GetSwitchValueASCII("in"),
+                                command_line->GetSwitchValueASCII("out"));
     } else if (args[0] == "encrypt") {
         return Encrypt(command_line->GetSwitchValueASCII("name"),
                        command_line->GetSwitchValueASCII("in"),
@@ -1125,6 +1805,8 @@ int main(int argc, char** argv) {
                             command_line->GetSwitchValueASCII("locale"),
                             command_line->GetSwitchValueASCII("ui_options"),
                             command_line->GetSwitchValueASCII("cancel_after"));
+    } else if (args[0] == "bench") {
+        return Bench(*command_line);
     } else {
         PrintUsageAndExit();
     }
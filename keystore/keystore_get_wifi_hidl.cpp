@@ -23,28 +23,77 @@
 #include <android/system/wifi/keystore/1.0/IKeystore.h>
 #include <log/log.h>
 
+#include <mutex>
+
 #include <keystore/keystore_get.h>
 
 using namespace android;
 
+using android::hardware::hidl_death_recipient;
 using android::hardware::hidl_string;
 using android::hardware::hidl_vec;
 using android::hardware::Return;
+using android::hidl::base::V1_0::IBase;
 using android::sp;
+using android::wp;
 using android::system::wifi::keystore::V1_0::IKeystore;
 
-ssize_t keystore_get(const char *key, size_t keyLength, uint8_t** value) {
-    if (key == nullptr || keyLength == 0 || value == nullptr) {
-        ALOGE("Null pointer argument passed");
-        return -1;
+namespace {
+
+// wpa_supplicant looks up several blobs per connection, so the service handle is kept across
+// calls instead of asking the service manager for it every time. It is dropped when the service
+// dies or a transaction fails, and looked up again by the next call.
+std::mutex gServiceMutex;
+sp<IKeystore> gService;
+// Identifies gService, so a stale death notification does not drop a newer handle.
+uint64_t gServiceGeneration = 0;
+
+void resetService(uint64_t generation) {
+    std::lock_guard<std::mutex> lock(gServiceMutex);
+    if (generation == gServiceGeneration) {
+        gService = nullptr;
     }
+}
 
-    sp<IKeystore> service = IKeystore::tryGetService();
-    if (service == nullptr) {
-        ALOGE("could not contact keystore HAL");
-        return -1;
+class ServiceDeathRecipient : public hidl_death_recipient {
+  public:
+    void serviceDied(uint64_t cookie, const wp<IBase>& /* who */) override {
+        ALOGW("keystore HAL died");
+        resetService(cookie);
+    }
+};
+
+std::pair<sp<IKeystore>, uint64_t> getService() {
+    static sp<ServiceDeathRecipient> deathRecipient = new ServiceDeathRecipient();
+    std::lock_guard<std::mutex> lock(gServiceMutex);
+    if (gService == nullptr) {
+        sp<IKeystore> service = IKeystore::tryGetService();
+        if (service == nullptr) {
+            ALOGE("could not contact keystore HAL");
+            return {nullptr, 0};
+        }
+        ++gServiceGeneration;
+        auto ret = service->linkToDeath(deathRecipient, gServiceGeneration);
+        if (!ret.isOk() || !ret) {
+            // Still usable, just not cached.
+            ALOGW("could not link to keystore HAL death");
+            return {service, 0};
+        }
+        gService = service;
     }
+    return {gService, gServiceGeneration};
+}
 
+bool checkKeyArgument(const char* key, size_t keyLength) {
+    if (key == nullptr || keyLength == 0) {
+        ALOGE("Null pointer argument passed");
+        return false;
+    }
+    return true;
+}
+
+ssize_t getBlob(const sp<IKeystore>& service, uint64_t generation, const char* key,
+                size_t keyLength, uint8_t** value) {
     ssize_t return_size;
     bool success = false;
     auto cb = [&](IKeystore::KeystoreStatusCode status, hidl_vec<uint8_t> returnedValue) {
@@ -55,6 +104,59 @@ ssize_t keystore_get(const char *key, size_t keyLength, uint8_t** value) {
         }
     };
 
-    Return<void> ret = service->getBlob(hidl_string(key, keyLength), cb);
-    return ret.isOk() && success ? return_size : -1;
+    hidl_string keyString;
+    keyString.setToExternal(key, keyLength);
+    Return<void> ret = service->getBlob(keyString, cb);
+    if (!ret.isOk()) {
+        ALOGE("keystore HAL transaction failed: %s", ret.description().c_str());
+        if (generation != 0) resetService(generation);
+        return -1;
+    }
+    return success ? return_size : -1;
+}
+
+}  // namespace
+
+ssize_t keystore_get(const char *key, size_t keyLength, uint8_t** value) {
+    if (!checkKeyArgument(key, keyLength) || value == nullptr) {
+        return -1;
+    }
+
+    auto [service, generation] = getService();
+    if (service == nullptr) {
+        return -1;
+    }
+    return getBlob(service, generation, key, keyLength, value);
+}
+
+ssize_t keystore_get_many(size_t count, const char* const* keys, const size_t* keyLengths,
+                          uint8_t** values, ssize_t* valueLengths) {
+    if (count == 0) {
+        return 0;
+    }
+    if (keys == nullptr || keyLengths == nullptr || values == nullptr ||
+        valueLengths == nullptr) {
+        ALOGE("Null pointer argument passed");
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = nullptr;
+        valueLengths[i] = -1;
+        if (!checkKeyArgument(keys[i], keyLengths[i])) {
+            return -1;
+        }
+    }
+
+    auto [service, generation] = getService();
+    if (service == nullptr) {
+        return -1;
+    }
+    ssize_t found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        valueLengths[i] = getBlob(service, generation, keys[i], keyLengths[i], &values[i]);
+        if (valueLengths[i] >= 0) {
+            ++found;
+        }
+    }
+    return found;
 }
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <utils/String16.h>
+
+#include <keystore/KeyAttestationApplicationId.h>
+#include <keystore/KeyAttestationPackageInfo.h>
+#include <keystore/Signature.h>
+#include <keystore/keystore_attestation_id.h>
+
+using ::android::String16;
+using ::android::content::pm::Signature;
+using ::android::security::build_attestation_application_id;
+using ::android::security::keymaster::KeyAttestationApplicationId;
+using ::android::security::keymaster::KeyAttestationPackageInfo;
+
+// Encodes the attestation application ID of a uid shared by state.range(0) packages, each signed
+// with the same three certificates. With many packages the ID gets truncated.
+static void BM_BuildAttestationApplicationId(benchmark::State& state) {
+    std::vector<uint8_t> certificate(1024, 0x5a);
+    KeyAttestationApplicationId::PackageInfoVector packages;
+    for (int i = 0; i < state.range(0); ++i) {
+        KeyAttestationPackageInfo::SignaturesVector signatures;
+        for (int j = 0; j < 3; ++j) {
+            signatures.push_back(std::make_optional<Signature>(certificate));
+        }
+        std::string name = "com.example.shared.package" + std::to_string(i);
+        packages.push_back(std::make_optional<KeyAttestationPackageInfo>(
+            String16(name.c_str()), i /* version code */,
+            std::make_shared<KeyAttestationPackageInfo::SignaturesVector>(std::move(signatures))));
+    }
+    KeyAttestationApplicationId app_id(std::move(packages));
+
+    for (auto _ : state) {
+        auto result = build_attestation_application_id(app_id);
+        if (!result.isOk()) {
+            state.SkipWithError("build_attestation_application_id failed");
+            break;
+        }
+        benchmark::DoNotOptimize(result.value().data());
+    }
+}
+BENCHMARK(BM_BuildAttestationApplicationId)->Arg(1)->Arg(4)->Arg(16)->Arg(64);
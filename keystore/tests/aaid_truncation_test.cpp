@@ -17,9 +17,11 @@
 #include <gtest/gtest.h>
 
 #include <string>
+#include <utility>
 #include <utils/String16.h>
 
 #include <keymaster/logger.h>
+#include <openssl/bytestring.h>
 #include <keystore/keystore_attestation_id.h>
 
 #include <keystore/KeyAttestationApplicationId.h>
@@ -88,6 +90,35 @@ std::optional<KeyAttestationPackageInfo> make_package_info(const char* package_n
                                              KeyAttestationPackageInfo::SignaturesVector());
 }
 
+// Returns the number of package infos and signature digests in |encoded_app_id|, or (-1, -1)
+// if it is not a well formed attestation application ID.
+std::pair<int, int> count_app_id_elements(const std::vector<uint8_t>& encoded_app_id) {
+    CBS cbs, app_id, package_infos, signature_digests;
+    CBS_init(&cbs, encoded_app_id.data(), encoded_app_id.size());
+    if (!CBS_get_asn1(&cbs, &app_id, CBS_ASN1_SEQUENCE) || CBS_len(&cbs) != 0 ||
+        !CBS_get_asn1(&app_id, &package_infos, CBS_ASN1_SET) ||
+        !CBS_get_asn1(&app_id, &signature_digests, CBS_ASN1_SET) || CBS_len(&app_id) != 0) {
+        return {-1, -1};
+    }
+    std::pair<int, int> counts(0, 0);
+    while (CBS_len(&package_infos) != 0) {
+        CBS package_info, name;
+        uint64_t version;
+        if (!CBS_get_asn1(&package_infos, &package_info, CBS_ASN1_SEQUENCE) ||
+            !CBS_get_asn1(&package_info, &name, CBS_ASN1_OCTETSTRING) ||
+            !CBS_get_asn1_uint64(&package_info, &version) || CBS_len(&package_info) != 0) {
+            return {-1, -1};
+        }
+        ++counts.first;
+    }
+    while (CBS_len(&signature_digests) != 0) {
+        CBS digest;
+        if (!CBS_get_asn1(&signature_digests, &digest, CBS_ASN1_OCTETSTRING)) return {-1, -1};
+        ++counts.second;
+    }
+    return counts;
+}
+
 TEST(AaidTruncationTest, shortPackageInfoTest) {
     KeyAttestationApplicationId app_id(make_package_info(kDummyPackageName));
 
@@ -97,6 +128,17 @@ TEST(AaidTruncationTest, shortPackageInfoTest) {
     ASSERT_LT(encoded_app_id.size(), KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE);
 }
 
+TEST(AaidTruncationTest, shortPackageInfoEncodingTest) {
+    KeyAttestationApplicationId app_id(make_package_info(kDummyPackageName));
+
+    auto result = build_attestation_application_id(app_id);
+    ASSERT_TRUE(result.isOk());
+    const std::vector<uint8_t> expected = {
+        0x30, 0x17, 0x31, 0x13, 0x30, 0x11, 0x04, 0x0c, 'D',  'u',  'm',  'm',  'y',
+        'P',  'a',  'c',  'k',  'a',  'g',  'e',  0x02, 0x01, 0x01, 0x31, 0x00};
+    ASSERT_EQ(expected, result.value());
+}
+
 TEST(AaidTruncationTest, tooLongPackageNameTest) {
     KeyAttestationApplicationId app_id(make_package_info(kLongPackageName));
 
@@ -121,6 +163,8 @@ TEST(AaidTruncationTest, tooManySignaturesTest) {
     ASSERT_TRUE(result.isOk());
     std::vector<uint8_t>& encoded_app_id = result;
     ASSERT_LT(encoded_app_id.size(), KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE);
+    // 28 digests fit after the package info.
+    ASSERT_EQ(std::make_pair(1, 28), count_app_id_elements(encoded_app_id));
 }
 
 TEST(AaidTruncationTest, combinedPackagesAndSignaturesTest) {
@@ -142,6 +186,8 @@ TEST(AaidTruncationTest, combinedPackagesAndSignaturesTest) {
     ASSERT_TRUE(result.isOk());
     std::vector<uint8_t>& encoded_app_id = result;
     ASSERT_LT(encoded_app_id.size(), KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE);
+    // Only two of the packages fit, leaving room for the signatures of the first one.
+    ASSERT_EQ(std::make_pair(2, 3), count_app_id_elements(encoded_app_id));
 }
 
 }  // namespace test
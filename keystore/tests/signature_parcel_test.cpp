@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <binder/Parcel.h>
+#include <openssl/sha.h>
+
+#include <keystore/Signature.h>
+
+using ::android::NO_ERROR;
+using ::android::Parcel;
+using ::android::content::pm::Signature;
+
+namespace keystore {
+
+namespace test {
+
+namespace {
+
+Signature::Digest sha256(const std::vector<uint8_t>& data) {
+    Signature::Digest digest;
+    SHA256(data.data(), data.size(), digest.data());
+    return digest;
+}
+
+}  // namespace
+
+TEST(SignatureParcelTest, digestOfParcelledSignature) {
+    // Odd sized, so the parcel pads it.
+    std::vector<uint8_t> certificate(1021, 0x5a);
+    Signature written(certificate);
+    ASSERT_EQ(sha256(certificate), written.sha256());
+
+    Parcel parcel;
+    ASSERT_EQ(NO_ERROR, written.writeToParcel(&parcel));
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(42));
+    parcel.setDataPosition(0);
+
+    Signature read;
+    ASSERT_EQ(NO_ERROR, read.readFromParcel(&parcel));
+    EXPECT_EQ(sha256(certificate), read.sha256());
+    EXPECT_TRUE(read.data().empty());
+    // The parcel is left right after the signature.
+    EXPECT_EQ(42, parcel.readInt32());
+
+    Parcel again;
+    EXPECT_NE(NO_ERROR, read.writeToParcel(&again));
+}
+
+TEST(SignatureParcelTest, emptySignature) {
+    Parcel parcel;
+    ASSERT_EQ(NO_ERROR, Signature().writeToParcel(&parcel));
+    parcel.setDataPosition(0);
+
+    Signature read;
+    ASSERT_EQ(NO_ERROR, read.readFromParcel(&parcel));
+    EXPECT_EQ(sha256({}), read.sha256());
+}
+
+TEST(SignatureParcelTest, nullSignature) {
+    Parcel parcel;
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(-1));
+    parcel.setDataPosition(0);
+
+    Signature read;
+    EXPECT_NE(NO_ERROR, read.readFromParcel(&parcel));
+}
+
+}  // namespace test
+
+}  // namespace keystore
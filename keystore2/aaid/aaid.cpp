@@ -19,6 +19,7 @@
 #include <keystore/keystore_attestation_id.h>
 
 using android::security::gather_attestation_application_id;
+using android::security::invalidate_attestation_application_id;
 
 uint32_t aaid_keystore_attestation_id(uint32_t uid, uint8_t* aaid, size_t* aaid_size) {
     static_assert(sizeof(uint32_t) == sizeof(uid_t), "uid_t has unexpected size");
@@ -33,10 +34,18 @@ uint32_t aaid_keystore_attestation_id(uint32_t uid, uint8_t* aaid, size_t* aaid_
     if (result.value().size() > KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE) {
         return ::android::NO_MEMORY;
     }
-    if (*aaid_size != KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE) {
+    if (aaid == nullptr) {
+        *aaid_size = result.value().size();
+        return ::android::OK;
+    }
+    if (*aaid_size < result.value().size()) {
         return ::android::BAD_VALUE;
     }
     std::copy(result.value().begin(), result.value().end(), aaid);
     *aaid_size = result.value().size();
     return ::android::OK;
 }
+
+void aaid_invalidate_attestation_id(uint32_t uid) {
+    invalidate_attestation_application_id(uid);
+}
@@ -30,15 +30,25 @@ constexpr const size_t KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE = 1024;
 extern "C" {
     /**
      * Fills the buffer at aaid with the attestation application id of the app uid.
-     * The buffer must be exactly KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE bytes in size.
      * *aaid_size is set to the number of bytes written to aaid.
      *
+     * Attestation application ids are cached per uid for a while, so calling this again for
+     * the same uid does not query the package manager again.
+     *
      * @param uid the uid of the app to retrieve the aaid for.
-     * @param aaid output buffer for the attestation id.
-     * @param aaid_size must be set to the size of the output buffer, which must be exactly
-     *          KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE bytes in size, by the caller. On success
-     *          it is set to the number of bytes written.
-     * @return OK on success.
+     * @param aaid output buffer for the attestation id, or NULL to only query its size.
+     * @param aaid_size must be set to the size of the output buffer by the caller. A buffer of
+     *          KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE bytes is always large enough. On success
+     *          it is set to the number of bytes written, or that would have been written if
+     *          aaid is NULL.
+     * @return OK on success, BAD_VALUE if the buffer is too small.
      */
     uint32_t aaid_keystore_attestation_id(uint32_t uid, uint8_t* aaid, size_t* aaid_size);
+
+    /**
+     * Drops the cached attestation application id of uid, e.g., because the app was removed.
+     *
+     * @param uid the uid of the app.
+     */
+    void aaid_invalidate_attestation_id(uint32_t uid);
 }
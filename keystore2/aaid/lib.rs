@@ -15,21 +15,33 @@
 //! Rust binding for getting the attestation application id.
 
 use keystore2_aaid_bindgen::{
-    aaid_keystore_attestation_id, KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE,
+    aaid_invalidate_attestation_id, aaid_keystore_attestation_id,
+    KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE,
 };
 
 /// Returns the attestation application id for the given uid or an error code
 /// corresponding to ::android::status_t.
+/// The id is cached per uid for a while, see invalidate_aaid.
 pub fn get_aaid(uid: u32) -> Result<Vec<u8>, u32> {
-    let mut buffer = [0u8; KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE];
-    let mut size = KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE;
+    let mut buffer = vec![0u8; KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE];
+    let mut size = buffer.len();
     // Safety:
-    // aaid_keystore_attestation_id expects a buffer of exactly
-    // KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE bytes and returns the number of bytes written
-    // in the second pointer argument.
+    // aaid_keystore_attestation_id expects a buffer of at least the given size, which
+    // KEY_ATTESTATION_APPLICATION_ID_MAX_SIZE always is, and returns the number of bytes
+    // written in the second pointer argument.
     let status = unsafe { aaid_keystore_attestation_id(uid, buffer.as_mut_ptr(), &mut size) };
     match status {
-        0 => Ok(buffer[0..size as usize].to_vec()),
+        0 => {
+            buffer.truncate(size);
+            Ok(buffer)
+        }
         status => Err(status),
     }
 }
+
+/// Drops the cached attestation application id of the given uid, so the next get_aaid call
+/// asks the package manager again.
+pub fn invalidate_aaid(uid: u32) {
+    // Safety: aaid_invalidate_attestation_id only takes the uid by value.
+    unsafe { aaid_invalidate_attestation_id(uid) }
+}
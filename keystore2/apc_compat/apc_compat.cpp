@@ -19,6 +19,8 @@
 #include <android/hardware/confirmationui/1.0/IConfirmationUI.h>
 #include <hwbinder/IBinder.h>
 
+#include <atomic>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <thread>
@@ -30,6 +32,7 @@ namespace keystore2 {
 
 using android::sp;
 using android::hardware::hidl_death_recipient;
+using android::hardware::hidl_string;
 using android::hardware::hidl_vec;
 using android::hardware::Return;
 using android::hardware::Status;
@@ -66,85 +69,111 @@ class ConfuiCompatSession : public IConfirmationResultCallback, public hidl_deat
   public:
     static sp<ConfuiCompatSession>* tryGetService() {
         sp<IConfirmationUI> service = IConfirmationUI::tryGetService();
-        if (service) {
-            return new sp(new ConfuiCompatSession(std::move(service)));
-        } else {
+        if (!service) {
             return nullptr;
         }
+        sp<ConfuiCompatSession> session = new ConfuiCompatSession(service);
+        // The death recipient is registered once for the lifetime of the session, not for
+        // every prompt.
+        auto err = service->linkToDeath(session, 0);
+        if (!err.isOk()) {
+            LOG(ERROR) << "Communication error: tryGetService: "
+                          "Trying to register death recipient: "
+                       << err.description();
+            return nullptr;
+        }
+        return new sp(std::move(session));
     }
 
     uint32_t promptUserConfirmation(ApcCompatCallback callback, const char* prompt_text,
                                     const uint8_t* extra_data, size_t extra_data_size,
                                     const char* locale, ApcCompatUiOptions ui_options) {
-        std::string hidl_prompt(prompt_text);
-        std::vector<uint8_t> hidl_extra(extra_data, extra_data + extra_data_size);
-        std::string hidl_locale(locale);
-        std::vector<UIOption> hidl_ui_options;
+        uint64_t idle = state_.load(std::memory_order_relaxed);
+        if ((idle & kPhaseMask) != kIdle ||
+            !state_.compare_exchange_strong(idle, withPhase(idle, kClaimed),
+                                            std::memory_order_acquire)) {
+            return APC_COMPAT_ERROR_OPERATION_PENDING;
+        }
+        // Nobody else touches callback_ while the slot is claimed. Publishing it before the
+        // HIDL call means a result which arrives before the call returns is not lost.
+        callback_ = callback;
+        uint64_t active = withPhase(idle, kActive);
+        state_.store(active, std::memory_order_release);
+
+        // The HIDL call only reads its arguments, so they can refer to the caller's buffers.
+        hidl_string hidl_prompt;
+        hidl_prompt.setToExternal(prompt_text, strlen(prompt_text));
+        hidl_vec<uint8_t> hidl_extra;
+        hidl_extra.setToExternal(const_cast<uint8_t*>(extra_data), extra_data_size);
+        hidl_string hidl_locale;
+        hidl_locale.setToExternal(locale, strlen(locale));
+        UIOption options[2];
+        size_t option_count = 0;
         if (ui_options.inverted) {
-            hidl_ui_options.push_back(UIOption::AccessibilityInverted);
+            options[option_count++] = UIOption::AccessibilityInverted;
         }
         if (ui_options.magnified) {
-            hidl_ui_options.push_back(UIOption::AccessibilityMagnified);
-        }
-        auto lock = std::lock_guard(callback_lock_);
-        if (callback_.result != nullptr) {
-            return APC_COMPAT_ERROR_OPERATION_PENDING;
-        }
-        auto err = service_->linkToDeath(sp(this), 0);
-        if (!err.isOk()) {
-            LOG(ERROR) << "Communication error: promptUserConfirmation: "
-                          "Trying to register death recipient: "
-                       << err.description();
-            return APC_COMPAT_ERROR_SYSTEM_ERROR;
+            options[option_count++] = UIOption::AccessibilityMagnified;
         }
+        hidl_vec<UIOption> hidl_ui_options;
+        hidl_ui_options.setToExternal(options, option_count);
 
         auto rc = service_->promptUserConfirmation(sp(this), hidl_prompt, hidl_extra, hidl_locale,
                                                    hidl_ui_options);
         if (!rc.isOk()) {
             LOG(ERROR) << "Communication error: promptUserConfirmation: " << rc.description();
         }
-        if (rc == ResponseCode::OK) {
-            callback_ = callback;
+        auto response = rc.withDefault(ResponseCode::SystemError);
+        if (response == ResponseCode::OK) {
+            return APC_COMPAT_ERROR_OK;
         }
-        return responseCode2Compat(rc.withDefault(ResponseCode::SystemError));
+        // Take the callback back, unless finalize() got to it first, e.g., because the service
+        // died during the call. Then the callback has been called and the session counts as
+        // started. The generation in state_ keeps this from taking the slot of a later prompt.
+        if (!state_.compare_exchange_strong(active, nextIdle(active), std::memory_order_acq_rel)) {
+            return APC_COMPAT_ERROR_OK;
+        }
+        return responseCode2Compat(response);
     }
 
     void abort() { service_->abort(); }
 
+    void close() {
+        abort();
+        service_->unlinkToDeath(sp(this));
+    }
+
     void
     finalize(ResponseCode responseCode,
              std::optional<std::reference_wrapper<const hidl_vec<uint8_t>>> dataConfirmed,
              std::optional<std::reference_wrapper<const hidl_vec<uint8_t>>> confirmationToken) {
-        ApcCompatCallback callback;
-        {
-            auto lock = std::lock_guard(callback_lock_);
-            // Calling the callback consumes the callback data structure. We have to make
-            // sure that it can only be called once.
-            callback = callback_;
-            callback_ = {nullptr, nullptr};
-            // Unlock the callback_lock_ here. It must never be held while calling the callback.
+        // Calling the callback consumes the callback data structure. Emptying the slot makes
+        // sure that it can only be called once.
+        uint64_t active = state_.load(std::memory_order_relaxed);
+        if ((active & kPhaseMask) != kActive ||
+            !state_.compare_exchange_strong(active, withPhase(active, kClaimed),
+                                            std::memory_order_acquire)) {
+            return;
         }
-
-        if (callback.result != nullptr) {
-            service_->unlinkToDeath(sp(this));
-
-            size_t dataConfirmedSize = 0;
-            const uint8_t* dataConfirmedPtr = nullptr;
-            size_t confirmationTokenSize = 0;
-            const uint8_t* confirmationTokenPtr = nullptr;
-            if (responseCode == ResponseCode::OK) {
-                if (dataConfirmed) {
-                    dataConfirmedPtr = dataConfirmed->get().data();
-                    dataConfirmedSize = dataConfirmed->get().size();
-                }
-                if (dataConfirmed) {
-                    confirmationTokenPtr = confirmationToken->get().data();
-                    confirmationTokenSize = confirmationToken->get().size();
-                }
+        ApcCompatCallback callback = callback_;
+        state_.store(nextIdle(active), std::memory_order_release);
+
+        size_t dataConfirmedSize = 0;
+        const uint8_t* dataConfirmedPtr = nullptr;
+        size_t confirmationTokenSize = 0;
+        const uint8_t* confirmationTokenPtr = nullptr;
+        if (responseCode == ResponseCode::OK) {
+            if (dataConfirmed) {
+                dataConfirmedPtr = dataConfirmed->get().data();
+                dataConfirmedSize = dataConfirmed->get().size();
+            }
+            if (confirmationToken) {
+                confirmationTokenPtr = confirmationToken->get().data();
+                confirmationTokenSize = confirmationToken->get().size();
             }
-            callback.result(callback.data, responseCode2Compat(responseCode), dataConfirmedPtr,
-                            dataConfirmedSize, confirmationTokenPtr, confirmationTokenSize);
         }
+        callback.result(callback.data, responseCode2Compat(responseCode), dataConfirmedPtr,
+                        dataConfirmedSize, confirmationTokenPtr, confirmationTokenSize);
     }
 
     // IConfirmationResultCallback overrides:
@@ -165,9 +194,19 @@ class ConfuiCompatSession : public IConfirmationResultCallback, public hidl_deat
         : service_(service), callback_{nullptr, nullptr} {}
     sp<IConfirmationUI> service_;
 
-    // The callback_lock_ protects the callback_ field against concurrent modification.
-    // IMPORTANT: It must never be held while calling the call back.
-    std::mutex callback_lock_;
+    // The callback slot. The low bits of state_ hold its phase, the others count the prompts.
+    // callback_ may only be written by whoever moved the phase from kIdle to kClaimed, and
+    // only be read by whoever moved it from kActive to kClaimed; both then release the slot
+    // again. No lock is ever held while the callback is called.
+    static constexpr uint64_t kIdle = 0;
+    static constexpr uint64_t kClaimed = 1;
+    static constexpr uint64_t kActive = 2;
+    static constexpr uint64_t kPhaseMask = 3;
+    static uint64_t withPhase(uint64_t state, uint64_t phase) {
+        return (state & ~kPhaseMask) | phase;
+    }
+    static uint64_t nextIdle(uint64_t state) { return (state & ~kPhaseMask) + kPhaseMask + 1; }
+    std::atomic<uint64_t> state_ = kIdle;
     ApcCompatCallback callback_;
 };
 
@@ -197,8 +236,9 @@ void closeUserConfirmationService(ApcCompatServiceHandle handle) {
     // Closing the handle implicitly aborts an ongoing sessions.
     // Note that a resulting callback is still safely conducted, because we only delete a
     // StrongPointer below. libhwbinder still owns another StrongPointer to this session.
-    abortUserConfirmation(handle);
-    delete reinterpret_cast<sp<ConfuiCompatSession>*>(handle);
+    auto session = reinterpret_cast<sp<ConfuiCompatSession>*>(handle);
+    (*session)->close();
+    delete session;
 }
 
 const ApcCompatServiceHandle INVALID_SERVICE_HANDLE = nullptr;
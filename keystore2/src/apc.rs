@@ -124,7 +124,7 @@ where
 /// it can retry. After the sixth failed attempt, the time doubles with every failed attempt
 /// until it goes into saturation at 24h.
 ///
-/// A successful user prompt resets the counter.
+/// A successful user prompt resets the counter, and so does 24h without a failed attempt.
 #[derive(Debug, Clone)]
 struct RateInfo {
     counter: u32,
@@ -134,7 +134,7 @@ struct RateInfo {
 impl RateInfo {
     const ONE_DAY: Duration = Duration::from_secs(60u64 * 60u64 * 24u64);
 
-    fn get_remaining_back_off(&self) -> Option<Duration> {
+    fn get_remaining_back_off(&self, now: Instant) -> Option<Duration> {
         let back_off = match self.counter {
             // The first three attempts come without penalty.
             0..=2 => return None,
@@ -148,12 +148,18 @@ impl RateInfo {
             // After that we cap of at 24h between attempts.
             _ => Self::ONE_DAY,
         };
-        let elapsed = self.timestamp.elapsed();
+        let elapsed = now.saturating_duration_since(self.timestamp);
         // This does exactly what we want.
         // `back_off - elapsed` is the remaining back off duration or None if elapsed is larger
         // than back_off. Also, this operation cannot overflow as long as elapsed is less than
         // back_off, which is all that we care about.
-        back_off.checked_sub(elapsed)
+        back_off.checked_sub(elapsed).filter(|remaining| !remaining.is_zero())
+    }
+
+    /// No back off is ever longer than a day, so a day after the last failed attempt the
+    /// entry carries no information worth keeping.
+    fn expiry(&self) -> Instant {
+        self.timestamp + Self::ONE_DAY
     }
 }
 
@@ -163,6 +169,117 @@ impl Default for RateInfo {
     }
 }
 
+/// One shard of the rate limiter. Besides the rate infos it keeps a timer wheel of uids in
+/// the order their entries expire. Each slot covers `TICK` and holds the uids whose entries
+/// expire within it, so reclaiming stale entries only touches the slots that have passed and
+/// never scans the whole map. A slot may name a uid whose entry has since been penalized
+/// again or reset; such entries are checked against their current expiry and kept if they
+/// are still live.
+struct RateShard {
+    infos: HashMap<u32, RateInfo>,
+    wheel: Vec<Vec<u32>>,
+    base: Instant,
+    current_tick: u64,
+}
+
+impl RateShard {
+    const TICK: Duration = Duration::from_secs(60 * 60);
+    // One day of ticks, plus one for rounding up the expiry and one for the current slot.
+    const SLOTS: usize = 26;
+
+    fn new(base: Instant) -> Self {
+        Self {
+            infos: Default::default(),
+            wheel: vec![Vec::new(); Self::SLOTS],
+            base,
+            current_tick: 0,
+        }
+    }
+
+    fn tick_of(&self, t: Instant, round_up: bool) -> u64 {
+        let since_base = t.saturating_duration_since(self.base).as_secs();
+        let tick = Self::TICK.as_secs();
+        if round_up {
+            (since_base + tick - 1) / tick
+        } else {
+            since_base / tick
+        }
+    }
+
+    /// Drops the entries that expired before `now`.
+    fn expire(&mut self, now: Instant) {
+        let now_tick = self.tick_of(now, false);
+        // Past a full turn of the wheel every slot has been due once.
+        let first_tick = self.current_tick.max(now_tick.saturating_sub(Self::SLOTS as u64));
+        for tick in first_tick + 1..=now_tick {
+            let slot = std::mem::take(&mut self.wheel[(tick % Self::SLOTS as u64) as usize]);
+            for uid in slot {
+                if self.infos.get(&uid).map_or(false, |info| info.expiry() <= now) {
+                    self.infos.remove(&uid);
+                }
+            }
+        }
+        self.current_tick = self.current_tick.max(now_tick);
+    }
+
+    fn schedule(&mut self, uid: u32, expiry: Instant) {
+        let tick = self.tick_of(expiry, true).max(self.current_tick + 1);
+        self.wheel[(tick % Self::SLOTS as u64) as usize].push(uid);
+    }
+}
+
+/// Tracks the rate infos of all clients. The map is split into shards, each behind a lock of
+/// its own, so that checking one client does not wait for updates to another.
+struct RateLimiter {
+    shards: Vec<Mutex<RateShard>>,
+}
+
+impl RateLimiter {
+    const SHARDS: usize = 16;
+
+    fn new() -> Self {
+        let base = Instant::now();
+        Self { shards: (0..Self::SHARDS).map(|_| Mutex::new(RateShard::new(base))).collect() }
+    }
+
+    fn shard(&self, uid: u32) -> &Mutex<RateShard> {
+        &self.shards[uid as usize % Self::SHARDS]
+    }
+
+    /// Returns the time `uid` still has to wait before it may present a prompt, if any.
+    fn get_remaining_back_off(&self, uid: u32, now: Instant) -> Option<Duration> {
+        let mut shard = self.shard(uid).lock().unwrap();
+        shard.expire(now);
+        // The wheel reclaims entries at tick granularity, so the caller's own entry may have
+        // expired already without having been dropped yet.
+        if shard.infos.get(&uid).map_or(false, |info| info.expiry() <= now) {
+            shard.infos.remove(&uid);
+        }
+        shard.infos.get(&uid).and_then(|info| info.get_remaining_back_off(now))
+    }
+
+    /// Counts a failed attempt by `uid` which started at `start`.
+    fn penalize(&self, uid: u32, start: Instant, now: Instant) {
+        let mut shard = self.shard(uid).lock().unwrap();
+        shard.expire(now);
+        let rate_info = shard.infos.entry(uid).or_default();
+        rate_info.counter += 1;
+        rate_info.timestamp = start;
+        let expiry = rate_info.expiry();
+        shard.schedule(uid, expiry);
+    }
+
+    /// Forgets the failed attempts of `uid`.
+    fn reset(&self, uid: u32) {
+        self.shard(uid).lock().unwrap().infos.remove(&uid);
+    }
+
+    #[cfg(test)]
+    fn len(&self) -> usize {
+        self.shards.iter().map(|shard| shard.lock().unwrap().infos.len()).sum()
+    }
+}
+
 /// The APC session state represents the state of an APC session.
 struct ApcSessionState {
     /// A reference to the APC HAL backend.
@@ -181,19 +298,19 @@ struct ApcSessionState {
 
 struct ApcState {
     session: Option<ApcSessionState>,
-    rate_limiting: HashMap<u32, RateInfo>,
     confirmation_token_sender: Sender<Vec<u8>>,
 }
 
 impl ApcState {
     fn new(confirmation_token_sender: Sender<Vec<u8>>) -> Self {
-        Self { session: None, rate_limiting: Default::default(), confirmation_token_sender }
+        Self { session: None, confirmation_token_sender }
     }
 }
 
 /// Implementation of the APC service.
 pub struct ApcManager {
     state: Arc<Mutex<ApcState>>,
+    rate_limiter: Arc<RateLimiter>,
 }
 
 impl Interface for ApcManager {}
@@ -204,13 +321,17 @@ impl ApcManager {
         confirmation_token_sender: Sender<Vec<u8>>,
     ) -> Result<Strong<dyn IProtectedConfirmation>> {
         Ok(BnProtectedConfirmation::new_binder(
-            Self { state: Arc::new(Mutex::new(ApcState::new(confirmation_token_sender))) },
+            Self {
+                state: Arc::new(Mutex::new(ApcState::new(confirmation_token_sender))),
+                rate_limiter: Arc::new(RateLimiter::new()),
+            },
             BinderFeatures { set_requesting_sid: true, ..BinderFeatures::default() },
         ))
     }
 
     fn result(
         state: Arc<Mutex<ApcState>>,
+        rate_limiter: Arc<RateLimiter>,
         rc: u32,
         data_confirmed: Option<&[u8]>,
         confirmation_token: Option<&[u8]>,
@@ -225,23 +346,26 @@ impl ApcManager {
 
         let rc = compat_2_response_code(rc);
 
-        // Update rate limiting information.
+        // Send the confirmation token, if any, to the enforcement module.
+        if let (ResponseCode::OK, Some(confirmation_token)) = (rc, confirmation_token) {
+            if let Err(e) = state.confirmation_token_sender.send(confirmation_token.to_vec()) {
+                log::error!("Got confirmation token, but receiver would not have it. {:?}", e);
+            }
+        }
+        drop(state);
+
+        // Update rate limiting information. This only locks the caller's shard of the rate
+        // limiter, so it is done without holding the session state.
         match (rc, client_aborted, confirmation_token) {
             // If the user confirmed the dialog.
-            (ResponseCode::OK, _, Some(confirmation_token)) => {
+            (ResponseCode::OK, _, Some(_)) => {
                 // Reset counter.
-                state.rate_limiting.remove(&uid);
-                // Send confirmation token to the enforcement module.
-                if let Err(e) = state.confirmation_token_sender.send(confirmation_token.to_vec()) {
-                    log::error!("Got confirmation token, but receiver would not have it. {:?}", e);
-                }
+                rate_limiter.reset(uid);
             }
             // If cancelled by the user or if aborted by the client.
             (ResponseCode::CANCELLED, _, _) | (ResponseCode::ABORTED, true, _) => {
                 // Penalize.
-                let mut rate_info = state.rate_limiting.entry(uid).or_default();
-                rate_info.counter += 1;
-                rate_info.timestamp = start;
+                rate_limiter.penalize(uid, start, Instant::now());
             }
             (ResponseCode::OK, _, None) => {
                 log::error!(
@@ -251,7 +375,6 @@ impl ApcManager {
             // In any other case this try does not count at all.
             _ => {}
         }
-        drop(state);
 
         if let Ok(listener) = callback.into_interface::<dyn IConfirmationCallback>() {
             if let Err(e) = listener.onCompleted(rc, data_confirmed) {
@@ -273,24 +396,24 @@ impl ApcManager {
         locale: &str,
         ui_option_flags: i32,
     ) -> Result<()> {
+        // Look up the rate limiting information first. This only locks the caller's shard of
+        // the rate limiter, so it is done without holding the session state.
+        let uid = ThreadState::get_calling_uid();
+        let back_off = self.rate_limiter.get_remaining_back_off(uid, Instant::now());
+
         let mut state = self.state.lock().unwrap();
+        // A pending session takes precedence over the back off.
         if state.session.is_some() {
             return Err(Error::pending())
                 .context("In ApcManager::present_prompt: Session pending.");
         }
 
         // Perform rate limiting.
-        let uid = ThreadState::get_calling_uid();
-        match state.rate_limiting.get(&uid) {
-            None => {}
-            Some(rate_info) => {
-                if let Some(back_off) = rate_info.get_remaining_back_off() {
-                    return Err(Error::sys()).context(format!(
-                        "In ApcManager::present_prompt: Cooling down. Remaining back-off: {}s",
-                        back_off.as_secs()
-                    ));
-                }
-            }
+        if let Some(back_off) = back_off {
+            return Err(Error::sys()).context(format!(
+                "In ApcManager::present_prompt: Cooling down. Remaining back-off: {}s",
+                back_off.as_secs()
+            ));
         }
 
         let hal = ApcHal::try_get_service();
@@ -305,13 +428,14 @@ impl ApcManager {
         let ui_opts = ui_opts_2_compat(ui_option_flags);
 
         let state_clone = self.state.clone();
+        let rate_limiter = self.rate_limiter.clone();
         hal.prompt_user_confirmation(
             prompt_text,
             extra_data,
             locale,
             ui_opts,
             move |rc, data_confirmed, confirmation_token| {
-                Self::result(state_clone, rc, data_confirmed, confirmation_token)
+                Self::result(state_clone, rate_limiter, rc, data_confirmed, confirmation_token)
             },
         )
         .map_err(|rc| Error::Rc(compat_2_response_code(rc)))
@@ -382,3 +506,108 @@ impl IProtectedConfirmation for ApcManager {
         map_or_log_err(Self::is_supported(), Ok)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const UID: u32 = 20;
+
+    fn assert_cooling_down(limiter: &RateLimiter, uid: u32, now: Instant) {
+        assert!(limiter.get_remaining_back_off(uid, now).is_some());
+    }
+
+    fn assert_allowed(limiter: &RateLimiter, uid: u32, now: Instant) {
+        assert_eq!(limiter.get_remaining_back_off(uid, now), None);
+    }
+
+    #[test]
+    fn success_leaves_no_entries() {
+        let limiter = RateLimiter::new();
+        let now = Instant::now();
+        for uid in 0..1000 {
+            assert_allowed(&limiter, uid, now);
+            limiter.penalize(uid, now, now);
+            limiter.reset(uid);
+        }
+        assert_eq!(limiter.len(), 0);
+    }
+
+    #[test]
+    fn back_off_policy() {
+        let limiter = RateLimiter::new();
+        let mut now = Instant::now();
+
+        // The first three tries are free.
+        for _ in 0..3 {
+            assert_allowed(&limiter, UID, now);
+            limiter.penalize(UID, now, now);
+        }
+
+        // The next three tries get a 30s penalty.
+        for _ in 3..6 {
+            now += Duration::from_secs(29);
+            assert_cooling_down(&limiter, UID, now);
+            now += Duration::from_secs(1);
+            assert_allowed(&limiter, UID, now);
+            limiter.penalize(UID, now, now);
+        }
+
+        // There after the penalty doubles with each cancellation.
+        for i in 6..17 {
+            now += Duration::from_secs(60 * (1u64 << (i - 6)) - 1);
+            assert_cooling_down(&limiter, UID, now);
+            now += Duration::from_secs(1);
+            assert_allowed(&limiter, UID, now);
+            limiter.penalize(UID, now, now);
+        }
+
+        // Other clients are not affected.
+        assert_allowed(&limiter, UID + 1, now);
+        assert_allowed(&limiter, UID + RateLimiter::SHARDS as u32, now);
+        assert_eq!(limiter.len(), 1);
+
+        now += RateInfo::ONE_DAY - Duration::from_secs(1);
+        assert_cooling_down(&limiter, UID, now);
+
+        // After 24h the counter is forgotten.
+        now += Duration::from_secs(1);
+        assert_allowed(&limiter, UID, now);
+        assert_eq!(limiter.len(), 0);
+        for _ in 0..3 {
+            limiter.penalize(UID, now, now);
+        }
+        assert_cooling_down(&limiter, UID, now);
+    }
+
+    #[test]
+    fn stale_entries_are_reclaimed() {
+        let limiter = RateLimiter::new();
+        let start = Instant::now();
+        for uid in 0..1000 {
+            limiter.penalize(uid, start, start);
+        }
+        // Penalizing again moves the expiry of an entry; the old wheel slot must not drop it.
+        let later = start + Duration::from_secs(5 * 60 * 60);
+        limiter.penalize(UID, later, later);
+        assert_eq!(limiter.len(), 1000);
+
+        // Idle for far longer than a turn of the wheel. Checking any uid expires the stale
+        // entries of its own shard only.
+        let now = start + RateInfo::ONE_DAY + Duration::from_secs(2 * 60 * 60);
+        assert_allowed(&limiter, 1, now);
+        let shard_len = |uid: u32| limiter.shard(uid).lock().unwrap().infos.len();
+        assert_eq!(shard_len(1), 0);
+        assert!(shard_len(2) > 0);
+
+        for uid in 0..RateLimiter::SHARDS as u32 {
+            assert_allowed(&limiter, uid, now);
+        }
+        assert_eq!(limiter.len(), 1);
+        assert!(limiter.shard(UID).lock().unwrap().infos.contains_key(&UID));
+
+        let now = later + RateInfo::ONE_DAY + RateShard::TICK;
+        assert_allowed(&limiter, UID, now);
+        assert_eq!(limiter.len(), 0);
+    }
+}
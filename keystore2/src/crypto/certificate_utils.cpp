@@ -16,13 +16,18 @@
 
 #include <certificate_utils.h>
 
+#include <openssl/bytestring.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/mem.h>
+#include <openssl/sha.h>
 #include <openssl/x509v3.h>
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <limits>
+#include <thread>
 #include <variant>
 #include <vector>
 
@@ -214,8 +219,7 @@ std::optional<std::array<char, 16>> toTimeString(int64_t timeMillis) {
 // before accessing the result.
 std::variant<CertUtilsError, X509_Ptr>
 makeCertRump(std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial,
-             std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject,
-             const int64_t activeDateTimeMilliSeconds,
+             const X509_NAME* subject, const int64_t activeDateTimeMilliSeconds,
              const int64_t usageExpireDateTimeMilliSeconds) {
 
     // Create certificate structure.
@@ -250,13 +254,8 @@ makeCertRump(std::optional<std::reference_wrapper<const std::vector<uint8_t>>> s
         return CertUtilsError::BoringSsl;
 
     // Set Subject Name
-    auto subjectName = makeCommonName(subject);
-    if (auto x509_subject = std::get_if<X509_NAME_Ptr>(&subjectName)) {
-        if (!X509_set_subject_name(certificate.get(), x509_subject->get() /* copied */)) {
-            return CertUtilsError::BoringSsl;
-        }
-    } else {
-        return std::get<CertUtilsError>(subjectName);
+    if (!X509_set_subject_name(certificate.get(), const_cast<X509_NAME*>(subject) /* copied */)) {
+        return CertUtilsError::BoringSsl;
     }
 
     auto notBeforeTime = toTimeString(activeDateTimeMilliSeconds);
@@ -284,44 +283,56 @@ makeCertRump(std::optional<std::reference_wrapper<const std::vector<uint8_t>>> s
     return certificate;
 }
 
-std::variant<CertUtilsError, X509_Ptr>
-makeCert(const EVP_PKEY* evp_pkey,
-         std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial,
-         std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject,
-         const int64_t activeDateTimeMilliSeconds, const int64_t usageExpireDateTimeMilliSeconds,
-         bool addSubjectKeyIdEx, std::optional<KeyUsageExtension> keyUsageEx,
-         std::optional<BasicConstraintsExtension> basicConstraints) {
+// Encodes `ext_struc` as the extension `nid` once, so that it can be copied into certificates.
+static std::variant<CertUtilsError, X509_EXTENSION_Ptr> makeExtension(int nid, bool critical,
+                                                                      void* ext_struc) {
+    X509_EXTENSION_Ptr extension(X509V3_EXT_i2d(nid, critical, ext_struc));
+    if (!extension) {
+        return CertUtilsError::BoringSsl;
+    }
+    return extension;
+}
 
-    // Make the rump certificate with serial, subject, not before and not after dates.
-    auto certificateV =
-        makeCertRump(serial, subject, activeDateTimeMilliSeconds, usageExpireDateTimeMilliSeconds);
-    if (auto error = std::get_if<CertUtilsError>(&certificateV)) {
+CertTemplate::CertTemplate(X509_NAME_Ptr subject, std::vector<X509_EXTENSION_Ptr> extensions,
+                           bool addSubjectKeyIdEx)
+    : subject_(std::move(subject)), extensions_(std::move(extensions)),
+      addSubjectKeyIdEx_(addSubjectKeyIdEx) {}
+
+std::variant<CertUtilsError, CertTemplate>
+CertTemplate::create(std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject,
+                     bool addSubjectKeyIdEx, std::optional<KeyUsageExtension> keyUsageEx,
+                     std::optional<BasicConstraintsExtension> basicConstraints) {
+    auto subjectNameV = makeCommonName(subject);
+    if (auto error = std::get_if<CertUtilsError>(&subjectNameV)) {
         return *error;
     }
-    auto certificate = std::move(std::get<X509_Ptr>(certificateV));
-
-    // Set the public key.
-    if (!X509_set_pubkey(certificate.get(), const_cast<EVP_PKEY*>(evp_pkey))) {
-        return CertUtilsError::BoringSsl;
+    auto subjectName = std::move(std::get<X509_NAME_Ptr>(subjectNameV));
+    // Encode the name now. Copying it into a certificate then only reads the cached encoding,
+    // which makes it safe to use the template from several threads.
+    if (i2d_X509_NAME(subjectName.get(), nullptr) < 0) {
+        return CertUtilsError::Encoding;
     }
 
+    std::vector<X509_EXTENSION_Ptr> extensions;
+
     if (keyUsageEx) {
-        // Make and add the key usage extension.
+        // Make the key usage extension.
         auto key_usage_extensionV = makeKeyUsageExtension(
             keyUsageEx->isSigningKey, keyUsageEx->isEncryptionKey, keyUsageEx->isCertificationKey);
         if (auto error = std::get_if<CertUtilsError>(&key_usage_extensionV)) {
             return *error;
         }
         auto key_usage_extension = std::move(std::get<ASN1_BIT_STRING_Ptr>(key_usage_extensionV));
-        if (!X509_add1_ext_i2d(certificate.get(), NID_key_usage,
-                               key_usage_extension.get() /* Don't release; copied */,
-                               true /* critical */, 0 /* flags */)) {
-            return CertUtilsError::BoringSsl;
+        auto extensionV =
+            makeExtension(NID_key_usage, true /* critical */, key_usage_extension.get());
+        if (auto error = std::get_if<CertUtilsError>(&extensionV)) {
+            return *error;
         }
+        extensions.push_back(std::move(std::get<X509_EXTENSION_Ptr>(extensionV)));
     }
 
     if (basicConstraints) {
-        // Make and add basic constraints
+        // Make basic constraints
         auto basic_constraints_extensionV =
             makeBasicConstraintsExtension(basicConstraints->isCa, basicConstraints->pathLength);
         if (auto error = std::get_if<CertUtilsError>(&basic_constraints_extensionV)) {
@@ -329,14 +340,44 @@ makeCert(const EVP_PKEY* evp_pkey,
         }
         auto basic_constraints_extension =
             std::move(std::get<BASIC_CONSTRAINTS_Ptr>(basic_constraints_extensionV));
-        if (!X509_add1_ext_i2d(certificate.get(), NID_basic_constraints,
-                               basic_constraints_extension.get() /* Don't release; copied */,
-                               true /* critical */, 0 /* flags */)) {
+        auto extensionV = makeExtension(NID_basic_constraints, true /* critical */,
+                                        basic_constraints_extension.get());
+        if (auto error = std::get_if<CertUtilsError>(&extensionV)) {
+            return *error;
+        }
+        extensions.push_back(std::move(std::get<X509_EXTENSION_Ptr>(extensionV)));
+    }
+
+    return CertTemplate(std::move(subjectName), std::move(extensions), addSubjectKeyIdEx);
+}
+
+std::variant<CertUtilsError, X509_Ptr>
+CertTemplate::makeCert(const EVP_PKEY* evp_pkey,
+                       std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial,
+                       const int64_t activeDateTimeMilliSeconds,
+                       const int64_t usageExpireDateTimeMilliSeconds) const {
+
+    // Make the rump certificate with serial, subject, not before and not after dates.
+    auto certificateV = makeCertRump(serial, subject_.get(), activeDateTimeMilliSeconds,
+                                     usageExpireDateTimeMilliSeconds);
+    if (auto error = std::get_if<CertUtilsError>(&certificateV)) {
+        return *error;
+    }
+    auto certificate = std::move(std::get<X509_Ptr>(certificateV));
+
+    // Set the public key.
+    if (!X509_set_pubkey(certificate.get(), const_cast<EVP_PKEY*>(evp_pkey))) {
+        return CertUtilsError::BoringSsl;
+    }
+
+    // Add the pre-encoded key usage and basic constraints extensions.
+    for (const auto& extension : extensions_) {
+        if (!X509_add_ext(certificate.get(), extension.get() /* copied */, -1 /* loc */)) {
             return CertUtilsError::BoringSsl;
         }
     }
 
-    if (addSubjectKeyIdEx) {
+    if (addSubjectKeyIdEx_) {
         // Make and add subject key id extension.
         auto keyidV = makeKeyId(certificate.get());
         if (auto error = std::get_if<CertUtilsError>(&keyidV)) {
@@ -360,6 +401,21 @@ makeCert(const EVP_PKEY* evp_pkey,
     return certificate;
 }
 
+std::variant<CertUtilsError, X509_Ptr>
+makeCert(const EVP_PKEY* evp_pkey,
+         std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial,
+         std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject,
+         const int64_t activeDateTimeMilliSeconds, const int64_t usageExpireDateTimeMilliSeconds,
+         bool addSubjectKeyIdEx, std::optional<KeyUsageExtension> keyUsageEx,
+         std::optional<BasicConstraintsExtension> basicConstraints) {
+    auto templateV = CertTemplate::create(subject, addSubjectKeyIdEx, keyUsageEx, basicConstraints);
+    if (auto error = std::get_if<CertUtilsError>(&templateV)) {
+        return *error;
+    }
+    return std::get<CertTemplate>(templateV).makeCert(evp_pkey, serial, activeDateTimeMilliSeconds,
+                                                      usageExpireDateTimeMilliSeconds);
+}
+
 CertUtilsError setIssuer(X509* cert, const X509* signingCert, bool addAuthKeyExt) {
 
     X509_NAME* issuerName(X509_get_subject_name(signingCert));
@@ -409,6 +465,62 @@ CertUtilsError signCert(X509* certificate, EVP_PKEY* signing_key) {
     return CertUtilsError::Ok;
 }
 
+std::vector<std::variant<CertUtilsError, std::vector<uint8_t>>>
+makeSignedCerts(const CertTemplate& certTemplate, const std::vector<const EVP_PKEY*>& publicKeys,
+                const std::vector<std::vector<uint8_t>>& serials,
+                const int64_t activeDateTimeMilliSeconds,
+                const int64_t usageExpireDateTimeMilliSeconds, const X509* issuer,
+                bool addAuthKeyExt, BatchSignFunction sign, Algo algo, Padding padding,
+                Digest digest, size_t numThreads) {
+    using Result = std::variant<CertUtilsError, std::vector<uint8_t>>;
+    if (!serials.empty() && serials.size() != publicKeys.size()) {
+        return std::vector<Result>(publicKeys.size(), CertUtilsError::InvalidArgument);
+    }
+
+    auto makeOne = [&](size_t i) -> Result {
+        std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial;
+        if (!serials.empty()) {
+            serial = serials[i];
+        }
+        auto certV = certTemplate.makeCert(publicKeys[i], serial, activeDateTimeMilliSeconds,
+                                           usageExpireDateTimeMilliSeconds);
+        if (auto error = std::get_if<CertUtilsError>(&certV)) {
+            return *error;
+        }
+        auto& cert = std::get<X509_Ptr>(certV);
+        // The issuer is only read, so all threads share it.
+        if (auto error = setIssuer(cert.get(), issuer ? issuer : cert.get(), addAuthKeyExt)) {
+            return error;
+        }
+        return signAndEncodeCertWith(
+            cert.get(), [&](const uint8_t* data, size_t len) { return sign(i, data, len); }, algo,
+            padding, digest);
+    };
+
+    // The certificates are independent of each other, so every thread takes the next one that
+    // is left until none are, with the calling thread being one of the workers.
+    std::vector<Result> results(publicKeys.size(), CertUtilsError::Ok);
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i = next++; i < publicKeys.size(); i = next++) {
+            results[i] = makeOne(i);
+        }
+    };
+    if (numThreads == 0) {
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    numThreads = std::min(numThreads, std::max<size_t>(publicKeys.size(), 1));
+    std::vector<std::thread> threads;
+    for (size_t n = 1; n < numThreads; ++n) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
 std::variant<CertUtilsError, std::vector<uint8_t>> encodeCert(X509* certificate) {
     int len = i2d_X509(certificate, nullptr);
     if (len < 0) {
@@ -517,7 +629,10 @@ std::variant<CertUtilsError, ASN1_STRING_Ptr> buildRsaPssParameter(Digest digest
     return ASN1_STRING_Ptr(algo_str);
 }
 
-CertUtilsError makeAndSetAlgo(X509_ALGOR* algo_field, Algo algo, Padding padding, Digest digest) {
+// Builds the signature algorithm identifier from scratch. Use makeAndSetAlgo, which uses
+// precomputed encodings of the results.
+static CertUtilsError makeAndSetAlgoUncached(X509_ALGOR* algo_field, Algo algo, Padding padding,
+                                             Digest digest) {
     if (algo_field == nullptr) {
         return CertUtilsError::UnexpectedNullPointer;
     }
@@ -597,6 +712,125 @@ CertUtilsError makeAndSetAlgo(X509_ALGOR* algo_field, Algo algo, Padding padding
     return CertUtilsError::Ok;
 }
 
+namespace {
+
+// A signature AlgorithmIdentifier in DER form, and the parts needed to set an X509_ALGOR to it.
+struct SignatureAlgorithm {
+    int nid;
+    int param_type;
+    // The DER encoded parameters if param_type is V_ASN1_SEQUENCE, empty otherwise.
+    std::vector<uint8_t> param;
+    // The DER encoded AlgorithmIdentifier.
+    std::vector<uint8_t> encoded;
+};
+
+constexpr size_t kNumAlgos = static_cast<size_t>(Algo::RSA) + 1;
+constexpr size_t kNumPaddings = static_cast<size_t>(Padding::PSS) + 1;
+constexpr size_t kNumDigests = static_cast<size_t>(Digest::SHA512) + 1;
+
+using SignatureAlgorithmTable = std::vector<std::variant<CertUtilsError, SignatureAlgorithm>>;
+
+size_t signatureAlgorithmIndex(Algo algo, Padding padding, Digest digest) {
+    return (static_cast<size_t>(algo) * kNumPaddings + static_cast<size_t>(padding)) *
+               kNumDigests +
+           static_cast<size_t>(digest);
+}
+
+std::variant<CertUtilsError, SignatureAlgorithm> encodeSignatureAlgorithm(Algo algo,
+                                                                          Padding padding,
+                                                                          Digest digest) {
+    X509_ALGOR_Ptr algor(X509_ALGOR_new());
+    if (!algor) {
+        return CertUtilsError::MemoryAllocation;
+    }
+    if (auto error = makeAndSetAlgoUncached(algor.get(), algo, padding, digest)) {
+        return error;
+    }
+
+    SignatureAlgorithm result;
+    const ASN1_OBJECT* obj;
+    const void* pval;
+    X509_ALGOR_get0(&obj, &result.param_type, &pval, algor.get());
+    result.nid = OBJ_obj2nid(obj);
+    if (result.param_type == V_ASN1_SEQUENCE) {
+        auto param = reinterpret_cast<const ASN1_STRING*>(pval);
+        result.param.assign(ASN1_STRING_get0_data(param),
+                            ASN1_STRING_get0_data(param) + ASN1_STRING_length(param));
+    }
+
+    uint8_t* buf = nullptr;
+    int len = i2d_X509_ALGOR(algor.get(), &buf);
+    if (len < 0) {
+        return CertUtilsError::Encoding;
+    }
+    bssl::UniquePtr<uint8_t> free_buf(buf);
+    result.encoded.assign(buf, buf + len);
+    return result;
+}
+
+// There are only a few combinations of algorithm, padding and digest, and the identifiers
+// only depend on those, so all of them are encoded once, on first use. The table is never
+// modified afterwards and can be read from any thread.
+const SignatureAlgorithmTable& getSignatureAlgorithmTable() {
+    static const SignatureAlgorithmTable* table = [] {
+        auto table = new SignatureAlgorithmTable();
+        table->reserve(kNumAlgos * kNumPaddings * kNumDigests);
+        for (size_t a = 0; a < kNumAlgos; ++a) {
+            for (size_t p = 0; p < kNumPaddings; ++p) {
+                for (size_t d = 0; d < kNumDigests; ++d) {
+                    table->push_back(encodeSignatureAlgorithm(
+                        static_cast<Algo>(a), static_cast<Padding>(p), static_cast<Digest>(d)));
+                }
+            }
+        }
+        return table;
+    }();
+    return *table;
+}
+
+std::variant<CertUtilsError, const SignatureAlgorithm*>
+getSignatureAlgorithm(Algo algo, Padding padding, Digest digest) {
+    if (static_cast<size_t>(algo) >= kNumAlgos || static_cast<size_t>(padding) >= kNumPaddings ||
+        static_cast<size_t>(digest) >= kNumDigests) {
+        return CertUtilsError::InvalidArgument;
+    }
+    const auto& entry =
+        getSignatureAlgorithmTable()[signatureAlgorithmIndex(algo, padding, digest)];
+    if (auto error = std::get_if<CertUtilsError>(&entry)) {
+        return *error;
+    }
+    return &std::get<SignatureAlgorithm>(entry);
+}
+
+CertUtilsError setAlgo(X509_ALGOR* algo_field, const SignatureAlgorithm& sigAlg) {
+    if (algo_field == nullptr) {
+        return CertUtilsError::UnexpectedNullPointer;
+    }
+    ASN1_STRING_Ptr param;
+    if (sigAlg.param_type == V_ASN1_SEQUENCE) {
+        param.reset(ASN1_STRING_type_new(V_ASN1_SEQUENCE));
+        if (!param || !ASN1_STRING_set(param.get(), sigAlg.param.data(), sigAlg.param.size())) {
+            return CertUtilsError::MemoryAllocation;
+        }
+    }
+    if (!X509_ALGOR_set0(algo_field, OBJ_nid2obj(sigAlg.nid), sigAlg.param_type, param.get())) {
+        return CertUtilsError::Encoding;
+    }
+    // The X509 struct took ownership.
+    param.release();
+    return CertUtilsError::Ok;
+}
+
+}  // namespace
+
+CertUtilsError makeAndSetAlgo(X509_ALGOR* algo_field, Algo algo, Padding padding, Digest digest) {
+    auto sigAlgV = getSignatureAlgorithm(algo, padding, digest);
+    if (auto error = std::get_if<CertUtilsError>(&sigAlgV)) {
+        return *error;
+    }
+    return setAlgo(algo_field, *std::get<const SignatureAlgorithm*>(sigAlgV));
+}
+
 // This function allows for signing a
 CertUtilsError signCertWith(X509* certificate,
                             std::function<std::vector<uint8_t>(const uint8_t*, size_t)> sign,
@@ -630,4 +864,137 @@ CertUtilsError signCertWith(X509* certificate,
     return CertUtilsError::Ok;
 }
 
+std::variant<CertUtilsError, std::vector<uint8_t>>
+signAndEncodeCertWith(X509* certificate,
+                      std::function<std::vector<uint8_t>(const uint8_t*, size_t)> sign,
+                      Algo algo, Padding padding, Digest digest) {
+    if (certificate == nullptr) {
+        return CertUtilsError::UnexpectedNullPointer;
+    }
+    auto sigAlgV = getSignatureAlgorithm(algo, padding, digest);
+    if (auto error = std::get_if<CertUtilsError>(&sigAlgV)) {
+        return *error;
+    }
+    const SignatureAlgorithm& sigAlg = *std::get<const SignatureAlgorithm*>(sigAlgV);
+
+    // The TBSCertificate carries a copy of the signature algorithm, so it has to be set before
+    // the TBSCertificate is encoded.
+    if (auto error = setAlgo(certificate->cert_info->signature, sigAlg)) {
+        return error;
+    }
+
+    uint8_t* tbs_buf = nullptr;
+    int tbs_len = i2d_re_X509_tbs(certificate, &tbs_buf);
+    if (tbs_len < 0) {
+        return CertUtilsError::Encoding;
+    }
+    bssl::UniquePtr<uint8_t> free_tbs_buf(tbs_buf);
+
+    auto signature = sign(tbs_buf, tbs_len);
+    if (signature.empty()) {
+        return CertUtilsError::SignatureFailed;
+    }
+
+    // Certificate ::= SEQUENCE { tbsCertificate, signatureAlgorithm, signatureValue BIT STRING }
+    // Each of the two headers written here takes at most 6 bytes, and the bit string needs one
+    // more byte for the number of unused bits.
+    std::vector<uint8_t> result(tbs_len + sigAlg.encoded.size() + signature.size() + 13);
+    bssl::ScopedCBB cbb;
+    CBB cert, bits;
+    size_t len;
+    if (!CBB_init_fixed(cbb.get(), result.data(), result.size()) ||
+        !CBB_add_asn1(cbb.get(), &cert, CBS_ASN1_SEQUENCE) ||
+        !CBB_add_bytes(&cert, tbs_buf, tbs_len) ||
+        !CBB_add_bytes(&cert, sigAlg.encoded.data(), sigAlg.encoded.size()) ||
+        !CBB_add_asn1(&cert, &bits, CBS_ASN1_BITSTRING) ||
+        !CBB_add_u8(&bits, 0 /* unused bits */) ||
+        !CBB_add_bytes(&bits, signature.data(), signature.size()) ||
+        !CBB_finish(cbb.get(), nullptr, &len)) {
+        return CertUtilsError::Encoding;
+    }
+    result.resize(len);
+    return result;
+}
+
+bool VerifiedIssuerCache::contains(const Entry& entry) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(entry) != 0;
+}
+
+void VerifiedIssuerCache::insert(const Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.size() >= maxEntries_) {
+        entries_.clear();
+    }
+    entries_.insert(entry);
+}
+
+size_t VerifiedIssuerCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+CertUtilsError verifyCertificateChain(const std::vector<std::vector<uint8_t>>& chain,
+                                      VerifiedIssuerCache* cache) {
+    if (chain.empty()) {
+        return CertUtilsError::InvalidArgument;
+    }
+
+    // Parse every certificate and extract every public key once.
+    std::vector<X509_Ptr> certs;
+    std::vector<EVP_PKEY_Ptr> keys;
+    std::vector<VerifiedIssuerCache::Digest> digests(chain.size());
+    for (size_t i = 0; i < chain.size(); ++i) {
+        const uint8_t* p = chain[i].data();
+        X509_Ptr cert(d2i_X509(nullptr, &p, chain[i].size()));
+        if (!cert) {
+            return CertUtilsError::Encoding;
+        }
+        EVP_PKEY_Ptr key(X509_get_pubkey(cert.get()));
+        if (!key) {
+            return CertUtilsError::Encoding;
+        }
+        if (cache) {
+            SHA256(chain[i].data(), chain[i].size(), digests[i].data());
+        }
+        certs.push_back(std::move(cert));
+        keys.push_back(std::move(key));
+    }
+
+    // Link i is certificate i with its issuer i + 1. The last certificate is its own issuer if
+    // it is self issued, and has no link to check otherwise.
+    size_t numLinks = chain.size() - 1;
+    X509* last = certs.back().get();
+    if (X509_NAME_cmp(X509_get_subject_name(last), X509_get_issuer_name(last)) == 0) {
+        ++numLinks;
+    }
+
+    std::vector<size_t> toVerify;
+    for (size_t i = 0; i < numLinks; ++i) {
+        size_t issuer = std::min(i + 1, chain.size() - 1);
+        if (X509_NAME_cmp(X509_get_issuer_name(certs[i].get()),
+                          X509_get_subject_name(certs[issuer].get())) != 0) {
+            return CertUtilsError::VerificationFailed;
+        }
+        if (!cache || !cache->contains({digests[i], digests[issuer]})) {
+            toVerify.push_back(i);
+        }
+    }
+
+    // Chains are only a few certificates long, so the links are checked in turn. Starting a
+    // thread per link would cost more than the signature check itself.
+    for (size_t i : toVerify) {
+        size_t issuer = std::min(i + 1, chain.size() - 1);
+        if (X509_verify(certs[i].get(), keys[issuer].get()) != 1) {
+            return CertUtilsError::VerificationFailed;
+        }
+    }
+    if (cache) {
+        for (size_t i : toVerify) {
+            cache->insert({digests[i], digests[std::min(i + 1, chain.size() - 1)]});
+        }
+    }
+    return CertUtilsError::Ok;
+}
+
 }  // namespace keystore
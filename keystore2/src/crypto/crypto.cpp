@@ -19,20 +19,31 @@
 #include "crypto.hpp"
 
 #include <log/log.h>
+#include <openssl/aead.h>
 #include <openssl/aes.h>
+#include <openssl/bytestring.h>
 #include <openssl/ec.h>
 #include <openssl/ec_key.h>
 #include <openssl/ecdh.h>
 #include <openssl/evp.h>
 #include <openssl/hkdf.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
-#include <openssl/x509.h>
-
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 // Copied from system/security/keystore/blob.h.
 
 constexpr size_t kGcmTagLength = 128 / 8;
+constexpr size_t kGcmIvLength = 96 / 8;
 constexpr size_t kAes128KeySizeBytes = 128 / 8;
 
 // Copied from system/security/keystore/blob.cpp.
@@ -146,33 +157,133 @@ bool AES_gcm_decrypt(const uint8_t* in, uint8_t* out, size_t len, const uint8_t*
     return true;
 }
 
-// Copied from system/security/keystore/keymaster_enforcement.cpp.
+// An AES-GCM key whose key schedule is expanded once and then used for any number of
+// encryptions and decryptions. EVP_AEAD_CTX may be used from several threads at once
+// after initialization.
 
-class EvpMdCtx {
-  public:
-    EvpMdCtx() { EVP_MD_CTX_init(&ctx_); }
-    ~EvpMdCtx() { EVP_MD_CTX_cleanup(&ctx_); }
+struct AesGcmContext {
+    EVP_AEAD_CTX ctx;
+};
 
-    EVP_MD_CTX* get() { return &ctx_; }
+AesGcmContext* AES_gcm_context_new(const uint8_t* key, size_t key_size) {
+    const EVP_AEAD* aead = EVP_aead_aes_256_gcm();
+    if (key_size == kAes128KeySizeBytes) {
+        aead = EVP_aead_aes_128_gcm();
+    }
 
-  private:
-    EVP_MD_CTX ctx_;
-};
+    auto context = new AesGcmContext;
+    if (!EVP_AEAD_CTX_init(&context->ctx, aead, key, key_size, kGcmTagLength,
+                           nullptr /* engine */)) {
+        ALOGE("Failed to initialize AES-GCM context");
+        delete context;
+        return nullptr;
+    }
+    return context;
+}
 
-bool CreateKeyId(const uint8_t* key_blob, size_t len, km_id_t* out_id) {
-    EvpMdCtx ctx;
+void AES_gcm_context_free(AesGcmContext* context) {
+    if (context != nullptr) {
+        EVP_AEAD_CTX_cleanup(&context->ctx);
+        delete context;
+    }
+}
 
-    uint8_t hash[EVP_MAX_MD_SIZE];
-    unsigned int hash_len;
-    if (EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr /* ENGINE */) &&
-        EVP_DigestUpdate(ctx.get(), key_blob, len) &&
-        EVP_DigestFinal_ex(ctx.get(), hash, &hash_len)) {
-        assert(hash_len >= sizeof(*out_id));
-        memcpy(out_id, hash, sizeof(*out_id));
-        return true;
+/*
+ * Like AES_gcm_encrypt, but with the key held by 'context'.
+ */
+bool AES_gcm_context_encrypt(const AesGcmContext* context, const uint8_t* in, uint8_t* out,
+                             size_t len, const uint8_t* iv, uint8_t* tag) {
+    size_t tag_len;
+    if (!EVP_AEAD_CTX_seal_scatter(&context->ctx, out, tag, &tag_len, kGcmTagLength, iv,
+                                   kGcmIvLength, in, len, nullptr /* extra_in */,
+                                   0 /* extra_in_len */, nullptr /* ad */, 0 /* ad_len */)) {
+        ALOGD("Failed to encrypt with AES-GCM context");
+        return false;
     }
+    return tag_len == kGcmTagLength;
+}
 
-    return false;
+/*
+ * Like AES_gcm_decrypt, but with the key held by 'context'. Nothing is written to 'out' unless
+ * the tag is valid.
+ */
+bool AES_gcm_context_decrypt(const AesGcmContext* context, const uint8_t* in, uint8_t* out,
+                             size_t len, const uint8_t* iv, const uint8_t* tag) {
+    if (!EVP_AEAD_CTX_open_gather(&context->ctx, out, iv, kGcmIvLength, in, len, tag,
+                                  kGcmTagLength, nullptr /* ad */, 0 /* ad_len */)) {
+        ALOGE("Failed to decrypt blob; ciphertext or tag is likely corrupted");
+        return false;
+    }
+    return true;
+}
+
+// Batches smaller than this are processed on the calling thread; larger ones are split across
+// up to kMaxBatchThreads threads so that each gets at least this many blobs.
+constexpr size_t kMinBlobsPerBatchThread = 32;
+constexpr size_t kMaxBatchThreads = 4;
+
+/*
+ * Runs 'op' on every blob in 'blobs', writing each result to 'results', and returns true if all
+ * of them succeeded.
+ */
+template <typename Op>
+static bool AES_gcm_context_batch(const AesGcmContext* context, const AesGcmBlob* blobs,
+                                  size_t count, bool* results, Op op) {
+    auto run = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            results[i] = op(context, blobs[i]);
+        }
+    };
+
+    size_t num_threads =
+        std::min({count / kMinBlobsPerBatchThread, kMaxBatchThreads,
+                  static_cast<size_t>(std::max(1u, std::thread::hardware_concurrency()))});
+    if (num_threads <= 1) {
+        run(0, count);
+    } else {
+        std::vector<std::thread> threads;
+        size_t chunk = (count + num_threads - 1) / num_threads;
+        // The calling thread takes the first chunk itself.
+        for (size_t begin = chunk; begin < count; begin += chunk) {
+            threads.emplace_back(run, begin, std::min(begin + chunk, count));
+        }
+        run(0, std::min(chunk, count));
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    return std::all_of(results, results + count, [](bool result) { return result; });
+}
+
+bool AES_gcm_context_encrypt_batch(const AesGcmContext* context, const AesGcmBlob* blobs,
+                                   size_t count, bool* results) {
+    return AES_gcm_context_batch(context, blobs, count, results,
+                                 [](const AesGcmContext* ctx, const AesGcmBlob& blob) {
+                                     return AES_gcm_context_encrypt(ctx, blob.in, blob.out,
+                                                                    blob.len, blob.iv, blob.tag);
+                                 });
+}
+
+bool AES_gcm_context_decrypt_batch(const AesGcmContext* context, const AesGcmBlob* blobs,
+                                   size_t count, bool* results) {
+    return AES_gcm_context_batch(context, blobs, count, results,
+                                 [](const AesGcmContext* ctx, const AesGcmBlob& blob) {
+                                     return AES_gcm_context_decrypt(ctx, blob.in, blob.out,
+                                                                    blob.len, blob.iv, blob.tag);
+                                 });
+}
+
+// Copied from system/security/keystore/keymaster_enforcement.cpp.
+
+bool CreateKeyId(const uint8_t* key_blob, size_t len, km_id_t* out_id) {
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    static_assert(sizeof(hash) >= sizeof(*out_id));
+    if (!SHA256(key_blob, len, hash)) {
+        return false;
+    }
+    memcpy(out_id, hash, sizeof(*out_id));
+    return true;
 }
 
 // Copied from system/security/keystore/user_state.h
@@ -219,11 +330,76 @@ bool HKDFExpand(uint8_t* out_key, size_t out_len, const uint8_t* prk, size_t prk
     return result == 1;
 }
 
+bool HKDFExtractExpand(uint8_t* out_key, size_t out_len, const uint8_t* secret,
+                       size_t secret_len, const uint8_t* salt, size_t salt_len,
+                       const uint8_t* info, size_t info_len) {
+    const EVP_MD* digest = EVP_sha256();
+    auto result = HKDF(out_key, out_len, digest, secret, secret_len, salt, salt_len, info, info_len);
+    return result == 1;
+}
+
+bool HKDFExpandMulti(uint8_t* const* out_keys, const size_t* out_lens, const uint8_t* const* infos,
+                     const size_t* info_lens, size_t count, const uint8_t* prk, size_t prk_len) {
+    const EVP_MD* digest = EVP_sha256();
+    const size_t digest_len = EVP_MD_size(digest);
+
+    // The HMAC key is set up once and reused for every block of every output, which is what
+    // calling HKDF_expand once per output cannot do.
+    bssl::ScopedHMAC_CTX hmac;
+    if (!HMAC_Init_ex(hmac.get(), prk, prk_len, digest, nullptr /* engine */)) {
+        return false;
+    }
+
+    uint8_t previous[EVP_MAX_MD_SIZE];
+    ArrayEraser previous_eraser(previous, sizeof(previous));
+    for (size_t i = 0; i < count; i++) {
+        // RFC 5869 section 2.3: at most 255 blocks per output.
+        if (out_lens[i] > 255 * digest_len) {
+            return false;
+        }
+        size_t done = 0;
+        for (uint8_t counter = 1; done < out_lens[i]; counter++) {
+            unsigned int block_len;
+            if (!HMAC_Init_ex(hmac.get(), nullptr, 0, nullptr, nullptr) ||
+                (counter != 1 && !HMAC_Update(hmac.get(), previous, digest_len)) ||
+                !HMAC_Update(hmac.get(), infos[i], info_lens[i]) ||
+                !HMAC_Update(hmac.get(), &counter, 1) ||
+                !HMAC_Final(hmac.get(), previous, &block_len)) {
+                return false;
+            }
+            size_t todo = std::min(static_cast<size_t>(block_len), out_lens[i] - done);
+            std::copy(previous, previous + todo, out_keys[i] + done);
+            done += todo;
+        }
+    }
+    return true;
+}
+
 int ECDHComputeKey(void* out, const EC_POINT* pub_key, const EC_KEY* priv_key) {
     return ECDH_compute_key(out, EC_MAX_BYTES, pub_key, priv_key, nullptr);
 }
 
-EC_KEY* ECKEYGenerateKey() {
+bool ECDHHKDF(uint8_t* out_key, size_t out_len, const uint8_t* peer_pub, size_t peer_pub_len,
+              const EC_KEY* priv_key, const uint8_t* salt, size_t salt_len, const uint8_t* info,
+              size_t info_len) {
+    // The point is decoded on the private key's group, so no group has to be created for it.
+    const EC_GROUP* group = EC_KEY_get0_group(priv_key);
+    bssl::UniquePtr<EC_POINT> point(EC_POINT_new(group));
+    if (!point || !EC_POINT_oct2point(group, point.get(), peer_pub, peer_pub_len, nullptr)) {
+        return false;
+    }
+
+    uint8_t secret[EC_MAX_BYTES];
+    ArrayEraser secret_eraser(secret, sizeof(secret));
+    int secret_len = ECDHComputeKey(secret, point.get(), priv_key);
+    if (secret_len < 0) {
+        return false;
+    }
+    return HKDFExtractExpand(out_key, out_len, secret, secret_len, salt, salt_len, info,
+                             info_len);
+}
+
+static EC_KEY* generateP521Key() {
     EC_KEY* key = EC_KEY_new();
     EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp521r1);
     EC_KEY_set_group(key, group);
@@ -236,6 +412,99 @@ EC_KEY* ECKEYGenerateKey() {
     return key;
 }
 
+// A pool of P-521 keys generated ahead of time by a background thread, so that bursts of
+// ECKEYGenerateKey calls, e.g. when many keys are created for a locked user, do not each wait
+// for a key generation. The pool is empty and the thread is not started until a depth is set.
+class EcKeyPool {
+  public:
+    static EcKeyPool& get() {
+        static EcKeyPool* pool = new EcKeyPool();
+        return *pool;
+    }
+
+    void setDepth(size_t depth) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            depth_ = depth;
+            while (keys_.size() > depth_) {
+                keys_.pop_back();
+            }
+            if (depth_ > 0 && !refillThreadStarted_) {
+                std::thread([this] { refill(); }).detach();
+                refillThreadStarted_ = true;
+            }
+        }
+        cv_.notify_one();
+    }
+
+    // Returns a pooled key, or nullptr if the pool is empty or disabled.
+    EC_KEY* take() {
+        bssl::UniquePtr<EC_KEY> key;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (depth_ == 0) {
+                return nullptr;
+            }
+            if (keys_.empty()) {
+                misses_++;
+                return nullptr;
+            }
+            key = std::move(keys_.front());
+            keys_.pop_front();
+            hits_++;
+        }
+        cv_.notify_one();
+        return key.release();
+    }
+
+    void getStats(uint64_t* hits, uint64_t* misses) const {
+        *hits = hits_;
+        *misses = misses_;
+    }
+
+  private:
+    void refill() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return keys_.size() < depth_; });
+            lock.unlock();
+            bssl::UniquePtr<EC_KEY> key(generateP521Key());
+            lock.lock();
+            if (!key) {
+                ALOGE("EcKeyPool: failed to generate key");
+                continue;
+            }
+            if (keys_.size() < depth_) {
+                keys_.push_back(std::move(key));
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<bssl::UniquePtr<EC_KEY>> keys_;
+    size_t depth_ = 0;
+    bool refillThreadStarted_ = false;
+    std::atomic<uint64_t> hits_ = 0;
+    std::atomic<uint64_t> misses_ = 0;
+};
+
+EC_KEY* ECKEYGenerateKey() {
+    EC_KEY* key = EcKeyPool::get().take();
+    if (key != nullptr) {
+        return key;
+    }
+    return generateP521Key();
+}
+
+void ECKEYPoolSetDepth(size_t depth) {
+    EcKeyPool::get().setDepth(depth);
+}
+
+void ECKEYPoolGetStats(uint64_t* hits, uint64_t* misses) {
+    EcKeyPool::get().getStats(hits, misses);
+}
+
 size_t ECKEYMarshalPrivateKey(const EC_KEY* priv_key, uint8_t* buf, size_t len) {
     CBB cbb;
     size_t out_len;
@@ -281,6 +550,28 @@ EC_POINT* ECPOINTOct2Point(const uint8_t* buf, size_t len) {
     return point;
 }
 
+// Locates the DER encoded subject name in a DER encoded certificate without decoding the rest
+// of the certificate. On success, `subject` spans the complete subject Name element.
+static bool findCertificateSubject(const uint8_t* cert_buf, size_t cert_len, CBS* subject) {
+    CBS cbs, cert, tbs_cert, version;
+    CBS_init(&cbs, cert_buf, cert_len);
+    // Certificate ::= SEQUENCE { tbsCertificate TBSCertificate, ... }
+    // Like d2i_X509, this ignores any data following the certificate.
+    if (!CBS_get_asn1(&cbs, &cert, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1(&cert, &tbs_cert, CBS_ASN1_SEQUENCE)) {
+        return false;
+    }
+    // TBSCertificate ::= SEQUENCE { version [0] EXPLICIT Version DEFAULT v1,
+    //                               serialNumber, signature, issuer, validity, subject, ... }
+    return CBS_get_optional_asn1(&tbs_cert, &version, nullptr,
+                                 CBS_ASN1_CONSTRUCTED | CBS_ASN1_CONTEXT_SPECIFIC | 0) &&
+           CBS_skip_asn1(&tbs_cert, CBS_ASN1_INTEGER) &&
+           CBS_skip_asn1(&tbs_cert, CBS_ASN1_SEQUENCE) &&
+           CBS_skip_asn1(&tbs_cert, CBS_ASN1_SEQUENCE) &&
+           CBS_skip_asn1(&tbs_cert, CBS_ASN1_SEQUENCE) &&
+           CBS_get_asn1_element(&tbs_cert, subject, CBS_ASN1_SEQUENCE);
+}
+
 int extractSubjectFromCertificate(const uint8_t* cert_buf, size_t cert_len, uint8_t* subject_buf,
                                   size_t subject_buf_len) {
     if (!cert_buf || !subject_buf) {
@@ -288,24 +579,17 @@ int extractSubjectFromCertificate(const uint8_t* cert_buf, size_t cert_len, uint
         return 0;
     }
 
-    const uint8_t* p = cert_buf;
-    bssl::UniquePtr<X509> cert(d2i_X509(nullptr /* Allocate X509 struct */, &p, cert_len));
-    if (!cert) {
+    CBS subject;
+    if (!findCertificateSubject(cert_buf, cert_len, &subject)) {
         ALOGE("extractSubjectFromCertificate: failed to parse certificate");
         return 0;
     }
 
-    X509_NAME* subject = X509_get_subject_name(cert.get());
-    if (!subject) {
-        ALOGE("extractSubjectFromCertificate: failed to retrieve subject name");
-        return 0;
-    }
-
-    int subject_len = i2d_X509_NAME(subject, nullptr /* Don't copy the data */);
-    if (subject_len < 0) {
-        ALOGE("extractSubjectFromCertificate: error obtaining encoded subject name length");
+    if (CBS_len(&subject) > INT_MAX) {
+        ALOGE("extractSubjectFromCertificate: subject name too long");
         return 0;
     }
+    int subject_len = CBS_len(&subject);
 
     if (subject_len > subject_buf_len) {
         // Return the subject length, negated, so the caller knows how much
@@ -316,6 +600,6 @@ int extractSubjectFromCertificate(const uint8_t* cert_buf, size_t cert_len, uint
     }
 
     // subject_buf has enough space.
-    uint8_t* tmp = subject_buf;
-    return i2d_X509_NAME(subject, &tmp);
+    memcpy(subject_buf, CBS_data(&subject), subject_len);
+    return subject_len;
 }
@@ -29,6 +29,35 @@ extern "C" {
                        const uint8_t* key, size_t key_size, const uint8_t* iv,
                        const uint8_t* tag);
 
+  // An AES-GCM key with a pre-expanded key schedule, for encrypting or decrypting many
+  // blobs under the same key.
+  struct AesGcmContext;
+
+  AesGcmContext* AES_gcm_context_new(const uint8_t* key, size_t key_size);
+  void AES_gcm_context_free(AesGcmContext* context);
+  bool AES_gcm_context_encrypt(const AesGcmContext* context, const uint8_t* in, uint8_t* out,
+                               size_t len, const uint8_t* iv, uint8_t* tag);
+  bool AES_gcm_context_decrypt(const AesGcmContext* context, const uint8_t* in, uint8_t* out,
+                               size_t len, const uint8_t* iv, const uint8_t* tag);
+
+  // One message of a batch operation. For encryption 'tag' receives the computed tag, for
+  // decryption it holds the tag to check and is not written to.
+  typedef struct {
+      const uint8_t* in;
+      uint8_t* out;
+      size_t len;
+      const uint8_t* iv;
+      uint8_t* tag;
+  } AesGcmBlob;
+
+  // Encrypt or decrypt 'count' blobs under the key held by 'context', spreading large batches
+  // over several threads. 'results[i]' tells whether blob i succeeded; the return value is true
+  // if all of them did.
+  bool AES_gcm_context_encrypt_batch(const AesGcmContext* context, const AesGcmBlob* blobs,
+                                     size_t count, bool* results);
+  bool AES_gcm_context_decrypt_batch(const AesGcmContext* context, const AesGcmBlob* blobs,
+                                     size_t count, bool* results);
+
   // Copied from system/security/keystore/keymaster_enforcement.h.
   typedef uint64_t km_id_t;
 
@@ -48,13 +77,42 @@ extern "C" {
                   const uint8_t *prk, size_t prk_len,
                   const uint8_t *info, size_t info_len);
 
+  // HKDFExtract followed by HKDFExpand in one call, without handing the PRK back.
+  bool HKDFExtractExpand(uint8_t *out_key, size_t out_len,
+                         const uint8_t *secret, size_t secret_len,
+                         const uint8_t *salt, size_t salt_len,
+                         const uint8_t *info, size_t info_len);
+
+  // Like calling HKDFExpand once for each of the 'count' (out_keys[i], out_lens[i], infos[i],
+  // info_lens[i]) tuples with the same PRK, but with the HMAC key set up only once.
+  bool HKDFExpandMulti(uint8_t *const *out_keys, const size_t *out_lens,
+                       const uint8_t *const *infos, const size_t *info_lens, size_t count,
+                       const uint8_t *prk, size_t prk_len);
+
   // We define this as field_elem_size.
   static const size_t EC_MAX_BYTES = 32;
 
   int ECDHComputeKey(void *out, const EC_POINT *pub_key, const EC_KEY *priv_key);
 
+  // ECDHComputeKey between the peer's public point, encoded as by ECPOINTPoint2Oct, and
+  // 'priv_key', followed by HKDFExtractExpand of the shared secret into 'out_key'. The shared
+  // secret never leaves this call and is erased before it returns.
+  bool ECDHHKDF(uint8_t *out_key, size_t out_len,
+                const uint8_t *peer_pub, size_t peer_pub_len,
+                const EC_KEY *priv_key,
+                const uint8_t *salt, size_t salt_len,
+                const uint8_t *info, size_t info_len);
+
   EC_KEY* ECKEYGenerateKey();
 
+  // ECKEYGenerateKey hands out keys from a background-refilled pool of up to 'depth' keys.
+  // A depth of zero, the default, disables the pool.
+  void ECKEYPoolSetDepth(size_t depth);
+
+  // Reports how many ECKEYGenerateKey calls were served from the pool and how many found it
+  // empty, while the pool was enabled.
+  void ECKEYPoolGetStats(uint64_t *hits, uint64_t *misses);
+
   size_t ECKEYMarshalPrivateKey(const EC_KEY *priv_key, uint8_t *buf, size_t len);
 
   EC_KEY* ECKEYParsePrivateKey(const uint8_t *buf, size_t len);
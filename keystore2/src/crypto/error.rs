@@ -25,6 +25,10 @@ pub enum Error {
     #[error("Failed to encrypt.")]
     EncryptionFailed,
 
+    /// This is returned if the C/C++ implementation of AES_gcm_context_new returned null.
+    #[error("Failed to initialize AES GCM context.")]
+    AesGcmContextInitFailed,
+
     /// The initialization vector has the wrong length.
     #[error("Invalid IV length.")]
     InvalidIvLength,
@@ -66,10 +70,18 @@ pub enum Error {
     #[error("Failed to expand.")]
     HKDFExpandFailed,
 
+    /// This is returned if the C implementation of HKDFExtractExpand returned false.
+    #[error("Failed to derive key.")]
+    HKDFFailed,
+
     /// This is returned if the C implementation of ECDHComputeKey returned -1.
     #[error("Failed to compute ecdh key.")]
     ECDHComputeKeyFailed,
 
+    /// This is returned if the C implementation of ECDHHKDF returned false.
+    #[error("Failed to agree key.")]
+    ECDHHKDFFailed,
+
     /// This is returned if the C implementation of ECKEYGenerateKey returned null.
     #[error("Failed to generate key.")]
     ECKEYGenerateKeyFailed,
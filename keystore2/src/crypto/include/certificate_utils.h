@@ -20,9 +20,15 @@
 #include <openssl/x509.h>
 #include <stdint.h>
 
+#include <array>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <utility>
 #include <variant>
+#include <vector>
 
 namespace keystore {
 // We use boringssl error codes. Error codes that we add are folded into LIB_USER.
@@ -54,6 +60,7 @@ class CertUtilsError {
         UnexpectedNullPointer,
         SignatureFailed,
         TimeError,
+        VerificationFailed,
     };
 
   private:
@@ -99,6 +106,43 @@ makeCert(const EVP_PKEY* evp_pkey,
          std::optional<KeyUsageExtension> keyUsageEx,                                //
          std::optional<BasicConstraintsExtension> basicConstraints);                 //
 
+/**
+ * Holds the parts of a certificate that are the same for every certificate made from it: the
+ * subject name and the key usage and basic constraints extensions. They are built and encoded
+ * once by `create`, so that `makeCert` only fills in the public key, serial, validity dates and
+ * the subject key id. A template may be shared between threads.
+ */
+class CertTemplate {
+  public:
+    /**
+     * Creates a template. The parameters have the same meaning as the corresponding parameters
+     * of the free function `makeCert`.
+     * @return The template on success. An error code otherwise.
+     */
+    static std::variant<CertUtilsError, CertTemplate>
+    create(std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject,
+           bool addSubjectKeyIdEx, std::optional<KeyUsageExtension> keyUsageEx,
+           std::optional<BasicConstraintsExtension> basicConstraints);
+
+    /**
+     * Allocates an X509 certificate structure for `evp_pkey` from this template. Next steps are
+     * the same as for the free function `makeCert`.
+     */
+    std::variant<CertUtilsError, X509_Ptr>
+    makeCert(const EVP_PKEY* evp_pkey,
+             std::optional<std::reference_wrapper<const std::vector<uint8_t>>> serial,
+             const int64_t activeDateTimeMilliSeconds,
+             const int64_t usageExpireDateTimeMilliSeconds) const;
+
+  private:
+    CertTemplate(X509_NAME_Ptr subject, std::vector<X509_EXTENSION_Ptr> extensions,
+                 bool addSubjectKeyIdEx);
+
+    X509_NAME_Ptr subject_;
+    std::vector<X509_EXTENSION_Ptr> extensions_;
+    bool addSubjectKeyIdEx_;
+};
+
 /**
  * Takes the subject name from `signingCert` and sets it as issuer name in `cert`.
  * if `addAuthKeyExt` is true it also generates the digest of the signing certificates's public key
@@ -168,6 +212,64 @@ CertUtilsError signCertWith(X509* certificate,
                             std::function<std::vector<uint8_t>(const uint8_t*, size_t)> sign,
                             Algo algo, Padding padding, Digest digest);
 
+/**
+ * Like `signCertWith` followed by `encodeCert`, but encodes the to-be-signed certificate only
+ * once: the signed bytes are wrapped with the signature algorithm and the signature directly
+ * into the returned DER encoding. Apart from the signature algorithm field inside the
+ * to-be-signed certificate, `certificate` is left unsigned.
+ *
+ * @param certificate X509 certificate structure to be signed.
+ * @param sign Callback function used to digest and sign the DER encoded to-be-signed certificate.
+ * @param algo Algorithm specifier used to encode the signing algorithm id of the X509 certificate.
+ * @param padding Padding specifier used to encode the signing algorithm id of the X509 certificate.
+ * @param digest Digest specifier used to encode the signing algorithm id of the X509 certificate.
+ * @return std::vector<uint8_t> with the DER encoded signed certificate on success. An error code
+ *         otherwise.
+ */
+std::variant<CertUtilsError, std::vector<uint8_t>>
+signAndEncodeCertWith(X509* certificate,
+                      std::function<std::vector<uint8_t>(const uint8_t*, size_t)> sign,
+                      Algo algo, Padding padding, Digest digest);
+
+/**
+ * The signing callback of `makeSignedCerts`. Like the callback of `signCertWith`, but it also
+ * gets the index of the certificate being signed, so that self signed batches can sign each
+ * certificate with its own key. It is called from several threads at once.
+ */
+using BatchSignFunction =
+    std::function<std::vector<uint8_t>(size_t index, const uint8_t* data, size_t len)>;
+
+/**
+ * Makes and signs one certificate per public key, as `CertTemplate::makeCert`, `setIssuer` and
+ * `signAndEncodeCertWith` would one after the other, with the certificates spread over a pool
+ * of worker threads.
+ *
+ * @param certTemplate The template all certificates are made from.
+ * @param publicKeys The public keys to issue certificates for.
+ * @param serials Either empty, in which case every certificate gets the default serial, or one
+ *                serial per public key.
+ * @param activeDateTimeMilliSeconds The not before date in epoch milliseconds.
+ * @param usageExpireDateTimeMilliSeconds The not after date in epoch milliseconds.
+ * @param issuer The certificate that issues all certificates, or null if each certificate is
+ *               self issued.
+ * @param addAuthKeyExt If true, adds the authority key id extension, see `setIssuer`.
+ * @param sign Callback function used to digest and sign the DER encoded to-be-signed
+ *             certificates.
+ * @param algo, padding, digest As for `signCertWith`.
+ * @param numThreads The number of threads to use, including the calling thread. Zero uses one
+ *                   thread per CPU.
+ * @return One entry per public key, in the same order: the DER encoded certificate on success,
+ *         an error code otherwise. If `serials` has the wrong size, every entry is
+ *         CertUtilsError::InvalidArgument.
+ */
+std::vector<std::variant<CertUtilsError, std::vector<uint8_t>>>
+makeSignedCerts(const CertTemplate& certTemplate, const std::vector<const EVP_PKEY*>& publicKeys,
+                const std::vector<std::vector<uint8_t>>& serials,
+                const int64_t activeDateTimeMilliSeconds,
+                const int64_t usageExpireDateTimeMilliSeconds, const X509* issuer,
+                bool addAuthKeyExt, BatchSignFunction sign, Algo algo, Padding padding,
+                Digest digest, size_t numThreads = 0);
+
 /**
  * Generates the DER representation of the given signed X509 certificate structure.
  * @param certificate
@@ -176,4 +278,44 @@ CertUtilsError signCertWith(X509* certificate,
  */
 std::variant<CertUtilsError, std::vector<uint8_t>> encodeCert(X509* certificate);
 
+/**
+ * Remembers certificate/issuer pairs whose signature was verified, so that chains sharing
+ * intermediates and roots, e.g. attestation chains from the same device, only check those links
+ * once. Entries are identified by the SHA-256 digest of both DER encoded certificates. The cache
+ * holds at most `maxEntries` pairs and is cleared when it is full. It is safe to use from
+ * several threads.
+ */
+class VerifiedIssuerCache {
+  public:
+    explicit VerifiedIssuerCache(size_t maxEntries = 64) : maxEntries_(maxEntries) {}
+
+    using Digest = std::array<uint8_t, 32>;
+    using Entry = std::pair<Digest /* certificate */, Digest /* issuer */>;
+
+    bool contains(const Entry& entry) const;
+    void insert(const Entry& entry);
+    size_t size() const;
+
+  private:
+    size_t maxEntries_;
+    mutable std::mutex mutex_;
+    std::set<Entry> entries_;
+};
+
+/**
+ * Verifies a chain of DER encoded certificates, leaf first. Each certificate must name the next
+ * one as its issuer and carry a valid signature by the next certificate's key. The last
+ * certificate is checked against its own key if it is self issued, and accepted as the trust
+ * anchor otherwise. Every certificate is parsed and its public key extracted only once.
+ * Validity periods and extensions are not checked.
+ *
+ * @param chain The DER encoded certificates.
+ * @param cache If not null, links found in the cache are not verified again, and verified links
+ *              are added to it.
+ * @return CertUtilsError::Ok if the chain verifies, CertUtilsError::VerificationFailed if a
+ *         link does not, and another error code if the chain could not be parsed.
+ */
+CertUtilsError verifyCertificateChain(const std::vector<std::vector<uint8_t>>& chain,
+                                      VerifiedIssuerCache* cache = nullptr);
+
 }  // namespace keystore
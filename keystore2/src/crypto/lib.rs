@@ -19,10 +19,13 @@ mod error;
 mod zvec;
 pub use error::Error;
 use keystore2_crypto_bindgen::{
-    extractSubjectFromCertificate, generateKeyFromPassword, randomBytes, AES_gcm_decrypt,
-    AES_gcm_encrypt, ECDHComputeKey, ECKEYGenerateKey, ECKEYMarshalPrivateKey,
-    ECKEYParsePrivateKey, ECPOINTOct2Point, ECPOINTPoint2Oct, EC_KEY_free, EC_KEY_get0_public_key,
-    EC_POINT_free, HKDFExpand, HKDFExtract, EC_KEY, EC_MAX_BYTES, EC_POINT, EVP_MAX_MD_SIZE,
+    extractSubjectFromCertificate, generateKeyFromPassword, randomBytes, AES_gcm_context_decrypt,
+    AES_gcm_context_decrypt_batch, AES_gcm_context_encrypt, AES_gcm_context_encrypt_batch,
+    AES_gcm_context_free, AES_gcm_context_new, AES_gcm_decrypt, AES_gcm_encrypt, AesGcmBlob,
+    AesGcmContext, ECDHComputeKey, ECKEYGenerateKey, ECKEYMarshalPrivateKey, ECKEYParsePrivateKey,
+    ECKEYPoolGetStats, ECKEYPoolSetDepth, ECPOINTOct2Point, ECPOINTPoint2Oct, EC_KEY_free,
+    EC_KEY_get0_public_key, EC_POINT_free, HKDFExpand, HKDFExpandMulti, HKDFExtract,
+    HKDFExtractExpand, ECDHHKDF, EC_KEY, EC_MAX_BYTES, EC_POINT, EVP_MAX_MD_SIZE,
 };
 use std::convert::TryFrom;
 use std::convert::TryInto;
@@ -72,14 +75,9 @@ pub fn generate_random_data(size: usize) -> Result<Vec<u8>, Error> {
     }
 }
 
-/// Uses AES GCM to decipher a message given an initialization vector, aead tag, and key.
-/// This function accepts 128 and 256-bit keys and uses AES128 and AES256 respectively based
-/// on the key length.
-/// This function returns the plaintext message in a ZVec because it is assumed that
-/// it contains sensitive information that should be zeroed from memory before its buffer is
-/// freed. Input key is taken as a slice for flexibility, but it is recommended that it is held
-/// in a ZVec as well.
-pub fn aes_gcm_decrypt(data: &[u8], iv: &[u8], tag: &[u8], key: &[u8]) -> Result<ZVec, Error> {
+/// Checks the lengths of an AES GCM initialization vector and aead tag and returns the part of
+/// the IV that is actually used.
+fn check_gcm_iv_and_tag<'a>(iv: &'a [u8], tag: &[u8]) -> Result<&'a [u8], Error> {
     // Old versions of aes_gcm_encrypt produced 16 byte IVs, but the last four bytes were ignored
     // so trim these to the correct size.
     let iv = match iv.len() {
@@ -90,6 +88,18 @@ pub fn aes_gcm_decrypt(data: &[u8], iv: &[u8], tag: &[u8], key: &[u8]) -> Result
     if tag.len() != TAG_LENGTH {
         return Err(Error::InvalidAeadTagLength);
     }
+    Ok(iv)
+}
+
+/// Uses AES GCM to decipher a message given an initialization vector, aead tag, and key.
+/// This function accepts 128 and 256-bit keys and uses AES128 and AES256 respectively based
+/// on the key length.
+/// This function returns the plaintext message in a ZVec because it is assumed that
+/// it contains sensitive information that should be zeroed from memory before its buffer is
+/// freed. Input key is taken as a slice for flexibility, but it is recommended that it is held
+/// in a ZVec as well.
+pub fn aes_gcm_decrypt(data: &[u8], iv: &[u8], tag: &[u8], key: &[u8]) -> Result<ZVec, Error> {
+    let iv = check_gcm_iv_and_tag(iv, tag)?;
 
     match key.len() {
         AES_128_KEY_LENGTH | AES_256_KEY_LENGTH => {}
@@ -155,6 +165,176 @@ pub fn aes_gcm_encrypt(plaintext: &[u8], key: &[u8]) -> Result<(Vec<u8>, Vec<u8>
     }
 }
 
+/// An AES GCM key whose key schedule is expanded once, for encrypting or decrypting many
+/// messages under the same key. Behaves like `aes_gcm_encrypt` and `aes_gcm_decrypt` otherwise.
+pub struct AesGcm(*mut AesGcmContext);
+
+// Safety: BoringSSL allows an initialized EVP_AEAD_CTX to be used from several threads at
+// once, and the context is never modified after construction.
+unsafe impl Send for AesGcm {}
+unsafe impl Sync for AesGcm {}
+
+impl AesGcm {
+    /// Expands the key schedule for the given 128 or 256-bit key.
+    pub fn new(key: &[u8]) -> Result<Self, Error> {
+        match key.len() {
+            AES_128_KEY_LENGTH | AES_256_KEY_LENGTH => {}
+            _ => return Err(Error::InvalidKeyLength),
+        }
+        // Safety: We pass the length of the key buffer along with the key. The key is copied
+        // into the context, so it need not outlive this call.
+        let context = unsafe { AES_gcm_context_new(key.as_ptr(), key.len()) };
+        if context.is_null() {
+            return Err(Error::AesGcmContextInitFailed);
+        }
+        Ok(Self(context))
+    }
+
+    /// Encrypts the message with a freshly generated initialization vector. The return value is
+    /// a tuple of `(ciphertext, iv, tag)`.
+    pub fn encrypt(&self, plaintext: &[u8]) -> Result<(Vec<u8>, Vec<u8>, Vec<u8>), Error> {
+        let mut iv = vec![0; GCM_IV_LENGTH];
+        // Safety: iv is GCM_IV_LENGTH bytes long.
+        if !unsafe { randomBytes(iv.as_mut_ptr(), GCM_IV_LENGTH) } {
+            return Err(Error::RandomNumberGenerationFailed);
+        }
+
+        let mut ciphertext: Vec<u8> = vec![0; plaintext.len()];
+        let mut tag: Vec<u8> = vec![0; TAG_LENGTH];
+        // Safety: self.0 is a valid context. The input and output buffers have the size given
+        // by the length argument, the `iv` buffer is 12 bytes and the `tag` buffer 16.
+        if unsafe {
+            AES_gcm_context_encrypt(
+                self.0,
+                plaintext.as_ptr(),
+                ciphertext.as_mut_ptr(),
+                plaintext.len(),
+                iv.as_ptr(),
+                tag.as_mut_ptr(),
+            )
+        } {
+            Ok((ciphertext, iv, tag))
+        } else {
+            Err(Error::EncryptionFailed)
+        }
+    }
+
+    /// Decrypts the message given an initialization vector and aead tag. The plaintext is
+    /// returned in a ZVec.
+    pub fn decrypt(&self, data: &[u8], iv: &[u8], tag: &[u8]) -> Result<ZVec, Error> {
+        let iv = check_gcm_iv_and_tag(iv, tag)?;
+        let mut result = ZVec::new(data.len())?;
+        // Safety: self.0 is a valid context. The input and output buffers have the size given
+        // by the length argument, and the `iv` and `tag` lengths are checked above.
+        match unsafe {
+            AES_gcm_context_decrypt(
+                self.0,
+                data.as_ptr(),
+                result.as_mut_ptr(),
+                data.len(),
+                iv.as_ptr(),
+                tag.as_ptr(),
+            )
+        } {
+            true => Ok(result),
+            false => Err(Error::DecryptionFailed),
+        }
+    }
+}
+
+impl AesGcm {
+    /// Encrypts each of the messages like `encrypt`, each with its own initialization vector.
+    /// Large batches are spread over several threads. Fails if any of the messages could not be
+    /// encrypted.
+    pub fn encrypt_batch(
+        &self,
+        plaintexts: &[&[u8]],
+    ) -> Result<Vec<(Vec<u8>, Vec<u8>, Vec<u8>)>, Error> {
+        let mut outputs = Vec::with_capacity(plaintexts.len());
+        for plaintext in plaintexts {
+            let mut iv = vec![0; GCM_IV_LENGTH];
+            // Safety: iv is GCM_IV_LENGTH bytes long.
+            if !unsafe { randomBytes(iv.as_mut_ptr(), GCM_IV_LENGTH) } {
+                return Err(Error::RandomNumberGenerationFailed);
+            }
+            outputs.push((vec![0; plaintext.len()], iv, vec![0; TAG_LENGTH]));
+        }
+
+        let blobs: Vec<AesGcmBlob> = plaintexts
+            .iter()
+            .zip(outputs.iter_mut())
+            .map(|(plaintext, (ciphertext, iv, tag))| AesGcmBlob {
+                in_: plaintext.as_ptr(),
+                out: ciphertext.as_mut_ptr(),
+                len: plaintext.len(),
+                iv: iv.as_ptr(),
+                tag: tag.as_mut_ptr(),
+            })
+            .collect();
+        let mut results = vec![false; blobs.len()];
+        // Safety: self.0 is a valid context. Every blob points to input and output buffers of
+        // its length, a 12 byte `iv` and a 16 byte `tag`, all of which outlive this call.
+        // `results` has one entry per blob.
+        if unsafe {
+            AES_gcm_context_encrypt_batch(self.0, blobs.as_ptr(), blobs.len(), results.as_mut_ptr())
+        } {
+            Ok(outputs)
+        } else {
+            Err(Error::EncryptionFailed)
+        }
+    }
+
+    /// Decrypts each of the `(data, iv, tag)` messages like `decrypt`. Large batches are spread
+    /// over several threads. Returns one result per message, so a corrupted message does not
+    /// affect the others.
+    pub fn decrypt_batch(&self, messages: &[(&[u8], &[u8], &[u8])]) -> Vec<Result<ZVec, Error>> {
+        let mut outputs: Vec<Result<ZVec, Error>> = messages
+            .iter()
+            .map(|(data, iv, tag)| {
+                check_gcm_iv_and_tag(iv, tag)?;
+                ZVec::new(data.len())
+            })
+            .collect();
+
+        let mut blobs = Vec::with_capacity(messages.len());
+        let mut indices = Vec::with_capacity(messages.len());
+        for (i, ((data, iv, tag), output)) in messages.iter().zip(outputs.iter_mut()).enumerate() {
+            if let Ok(output) = output {
+                blobs.push(AesGcmBlob {
+                    in_: data.as_ptr(),
+                    out: output.as_mut_ptr(),
+                    len: data.len(),
+                    iv: iv.as_ptr(),
+                    // The tag is only read when decrypting.
+                    tag: tag.as_ptr() as *mut u8,
+                });
+                indices.push(i);
+            }
+        }
+
+        let mut results = vec![false; blobs.len()];
+        // Safety: self.0 is a valid context. Every blob points to input and output buffers of
+        // its length and to an `iv` and `tag` whose lengths were checked above, all of which
+        // outlive this call. `results` has one entry per blob.
+        unsafe {
+            AES_gcm_context_decrypt_batch(self.0, blobs.as_ptr(), blobs.len(), results.as_mut_ptr())
+        };
+        for (i, result) in indices.into_iter().zip(results) {
+            if !result {
+                outputs[i] = Err(Error::DecryptionFailed);
+            }
+        }
+        outputs
+    }
+}
+
+impl Drop for AesGcm {
+    fn drop(&mut self) {
+        // Safety: We only create AesGcm with a valid context and free it exactly once here.
+        unsafe { AES_gcm_context_free(self.0) };
+    }
+}
+
 /// Represents a "password" that can be used to key the PBKDF2 algorithm.
 pub enum Password<'a> {
     /// Borrow an existing byte array
@@ -263,6 +443,59 @@ pub fn hkdf_expand(out_len: usize, prk: &[u8], info: &[u8]) -> Result<ZVec, Erro
     Ok(buf)
 }
 
+/// Calls `hkdf_extract` followed by `hkdf_expand` in one step, without returning the
+/// pseudorandom key.
+pub fn hkdf(secret: &[u8], salt: &[u8], info: &[u8], out_len: usize) -> Result<ZVec, Error> {
+    let mut buf = ZVec::new(out_len)?;
+    // Safety: HKDF writes out_len bytes to the buffer.
+    // secret, salt and info are valid buffers.
+    let result = unsafe {
+        HKDFExtractExpand(
+            buf.as_mut_ptr(),
+            out_len,
+            secret.as_ptr(),
+            secret.len(),
+            salt.as_ptr(),
+            salt.len(),
+            info.as_ptr(),
+            info.len(),
+        )
+    };
+    if !result {
+        return Err(Error::HKDFFailed);
+    }
+    Ok(buf)
+}
+
+/// Calls `hkdf_expand` with the same pseudorandom key for each `(out_len, info)` pair, in a
+/// single call. The keys are returned in the order of `outputs`.
+pub fn hkdf_expand_multi(prk: &[u8], outputs: &[(usize, &[u8])]) -> Result<Vec<ZVec>, Error> {
+    let mut keys =
+        outputs.iter().map(|(out_len, _)| ZVec::new(*out_len)).collect::<Result<Vec<_>, _>>()?;
+    let mut out_ptrs: Vec<*mut u8> = keys.iter_mut().map(|key| key.as_mut_ptr()).collect();
+    let out_lens: Vec<usize> = outputs.iter().map(|(out_len, _)| *out_len).collect();
+    let info_ptrs: Vec<*const u8> = outputs.iter().map(|(_, info)| info.as_ptr()).collect();
+    let info_lens: Vec<usize> = outputs.iter().map(|(_, info)| info.len()).collect();
+    // Safety: Each of the pointer and length arrays has one entry per output. Output i is a
+    // buffer of out_lens[i] bytes, and info i a buffer of info_lens[i] bytes. prk is a valid
+    // buffer.
+    let result = unsafe {
+        HKDFExpandMulti(
+            out_ptrs.as_mut_ptr(),
+            out_lens.as_ptr(),
+            info_ptrs.as_ptr(),
+            info_lens.as_ptr(),
+            outputs.len(),
+            prk.as_ptr(),
+            prk.len(),
+        )
+    };
+    if !result {
+        return Err(Error::HKDFExpandFailed);
+    }
+    Ok(keys)
+}
+
 /// A wrapper around the boringssl EC_KEY type that frees it on drop.
 pub struct ECKey(*mut EC_KEY);
 
@@ -334,6 +567,38 @@ pub fn ecdh_compute_key(pub_key: &EC_POINT, priv_key: &ECKey) -> Result<ZVec, Er
     Ok(buf)
 }
 
+/// Calls `ecdh_compute_key` with the public key encoded in `peer_public_key`, as by
+/// `ec_point_point_to_oct`, and derives a key from the shared secret with `hkdf`, in one step.
+/// The shared secret is never returned.
+pub fn ecdh_hkdf(
+    peer_public_key: &[u8],
+    priv_key: &ECKey,
+    salt: &[u8],
+    info: &[u8],
+    out_len: usize,
+) -> Result<ZVec, Error> {
+    let mut buf = ZVec::new(out_len)?;
+    // Safety: ECDHHKDF writes out_len bytes to the buffer.
+    // peer_public_key, salt and info are valid buffers and the key is a valid object.
+    let result = unsafe {
+        ECDHHKDF(
+            buf.as_mut_ptr(),
+            out_len,
+            peer_public_key.as_ptr(),
+            peer_public_key.len(),
+            priv_key.0,
+            salt.as_ptr(),
+            salt.len(),
+            info.as_ptr(),
+            info.len(),
+        )
+    };
+    if !result {
+        return Err(Error::ECDHHKDFFailed);
+    }
+    Ok(buf)
+}
+
 /// Calls the boringssl EC_KEY_generate_key function.
 pub fn ec_key_generate_key() -> Result<ECKey, Error> {
     // Safety: Creates a new key on its own.
@@ -344,6 +609,23 @@ pub fn ec_key_generate_key() -> Result<ECKey, Error> {
     Ok(ECKey(key))
 }
 
+/// Keeps up to `depth` precomputed keys for `ec_key_generate_key`, refilled in the background.
+/// A depth of zero disables the pool.
+pub fn ec_key_pool_set_depth(depth: usize) {
+    // Safety: Only updates the pool configuration.
+    unsafe { ECKEYPoolSetDepth(depth) }
+}
+
+/// Returns how many `ec_key_generate_key` calls were served from the key pool and how many
+/// found it empty and generated a key inline.
+pub fn ec_key_pool_stats() -> (u64, u64) {
+    let mut hits = 0u64;
+    let mut misses = 0u64;
+    // Safety: Both out parameters point to valid u64 values.
+    unsafe { ECKEYPoolGetStats(&mut hits, &mut misses) };
+    (hits, misses)
+}
+
 /// Calls the boringssl EC_KEY_marshal_private_key function.
 pub fn ec_key_marshal_private_key(key: &ECKey) -> Result<ZVec, Error> {
     let len = 73; // Empirically observed length of private key
@@ -474,6 +756,56 @@ mod tests {
         assert_eq!(message[..], message2[..])
     }
 
+    #[test]
+    fn test_aes_gcm_context() {
+        let key = generate_aes256_key().unwrap();
+        let aes_gcm = AesGcm::new(&key).unwrap();
+        let message = b"totally awesome message";
+        let (cipher_text, iv, tag) = aes_gcm.encrypt(message).unwrap();
+        // Messages encrypted with a context can be decrypted without one and vice versa.
+        let message2 = aes_gcm_decrypt(&cipher_text, &iv, &tag, &key).unwrap();
+        assert_eq!(message[..], message2[..]);
+        let (cipher_text, iv, tag) = aes_gcm_encrypt(message, &key).unwrap();
+        let message3 = aes_gcm.decrypt(&cipher_text, &iv, &tag).unwrap();
+        assert_eq!(message[..], message3[..]);
+
+        let mut bad_tag = tag.clone();
+        bad_tag[0] ^= 1;
+        assert_eq!(
+            aes_gcm.decrypt(&cipher_text, &iv, &bad_tag).unwrap_err(),
+            Error::DecryptionFailed
+        );
+        assert_eq!(AesGcm::new(&key[..20]).err(), Some(Error::InvalidKeyLength));
+    }
+
+    #[test]
+    fn test_aes_gcm_batch() {
+        let key = generate_aes256_key().unwrap();
+        let aes_gcm = AesGcm::new(&key).unwrap();
+        // Enough messages for the batch to be split across threads.
+        let messages: Vec<Vec<u8>> = (0..200u8).map(|i| vec![i; i as usize]).collect();
+        let plaintexts: Vec<&[u8]> = messages.iter().map(|m| &m[..]).collect();
+        let encrypted = aes_gcm.encrypt_batch(&plaintexts).unwrap();
+        assert_eq!(encrypted.len(), messages.len());
+
+        let mut bad_tag = encrypted[1].2.clone();
+        bad_tag[0] ^= 1;
+        let mut to_decrypt: Vec<(&[u8], &[u8], &[u8])> =
+            encrypted.iter().map(|(data, iv, tag)| (&data[..], &iv[..], &tag[..])).collect();
+        to_decrypt[1].2 = &bad_tag;
+        to_decrypt[2].1 = &[0; 3];
+
+        let decrypted = aes_gcm.decrypt_batch(&to_decrypt);
+        assert_eq!(decrypted.len(), messages.len());
+        for (i, (message, result)) in messages.iter().zip(decrypted).enumerate() {
+            match i {
+                1 => assert_eq!(result.unwrap_err(), Error::DecryptionFailed),
+                2 => assert_eq!(result.unwrap_err(), Error::InvalidIvLength),
+                _ => assert_eq!(message[..], result.unwrap()[..]),
+            }
+        }
+    }
+
     #[test]
     fn test_encrypt_decrypt() {
         let input = vec![0; 16];
@@ -542,6 +874,28 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_hkdf_fused() -> Result<(), Error> {
+        let secret = generate_random_data(32)?;
+        let salt = generate_salt()?;
+        let prk = hkdf_extract(&secret, &salt)?;
+        for out_len in [16, 32, 100].iter() {
+            assert_eq!(
+                hkdf(&secret, &salt, b"info", *out_len)?,
+                hkdf_expand(*out_len, &prk, b"info")?
+            );
+        }
+
+        let outputs: Vec<(usize, &[u8])> = vec![(32, b"AES"), (7, b""), (100, b"advance")];
+        let keys = hkdf_expand_multi(&prk, &outputs)?;
+        assert_eq!(keys.len(), outputs.len());
+        for ((out_len, info), key) in outputs.iter().zip(keys) {
+            assert_eq!(key, hkdf_expand(*out_len, &prk, info)?);
+        }
+        assert!(hkdf_expand_multi(&prk, &[])?.is_empty());
+        Ok(())
+    }
+
     #[test]
     fn test_ec() -> Result<(), Error> {
         let priv0 = ec_key_generate_key()?;
@@ -565,4 +919,47 @@ mod tests {
         assert_eq!(left_key, right_key);
         Ok(())
     }
+
+    #[test]
+    fn test_ecdh_hkdf() -> Result<(), Error> {
+        let priv0 = ec_key_generate_key()?;
+        let priv1 = ec_key_generate_key()?;
+        let pub1s = ec_point_point_to_oct(ec_key_get0_public_key(&priv1).get_point())?;
+        let salt = generate_salt()?;
+
+        let pub1 = ec_point_oct_to_point(&pub1s)?;
+        let secret = ecdh_compute_key(pub1.get_point(), &priv0)?;
+        assert_eq!(
+            ecdh_hkdf(&pub1s, &priv0, &salt, b"info", AES_256_KEY_LENGTH)?,
+            hkdf(&secret, &salt, b"info", AES_256_KEY_LENGTH)?
+        );
+
+        assert_eq!(
+            ecdh_hkdf(&pub1s[..pub1s.len() - 1], &priv0, &salt, b"info", AES_256_KEY_LENGTH),
+            Err(Error::ECDHHKDFFailed)
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_ec_key_pool() -> Result<(), Error> {
+        ec_key_pool_set_depth(2);
+        let (hits0, misses0) = ec_key_pool_stats();
+        let keys: Vec<ECKey> =
+            (0..4).map(|_| ec_key_generate_key()).collect::<Result<_, Error>>()?;
+        let (hits1, misses1) = ec_key_pool_stats();
+        assert!(hits1 + misses1 >= hits0 + misses0 + 4);
+
+        // Pooled keys are as usable as freshly generated ones.
+        let pub0s = ec_point_point_to_oct(ec_key_get0_public_key(&keys[0]).get_point())?;
+        let pub0 = ec_point_oct_to_point(&pub0s)?;
+        let pub1s = ec_point_point_to_oct(ec_key_get0_public_key(&keys[1]).get_point())?;
+        let pub1 = ec_point_oct_to_point(&pub1s)?;
+        assert_eq!(
+            ecdh_compute_key(pub0.get_point(), &keys[1])?,
+            ecdh_compute_key(pub1.get_point(), &keys[0])?
+        );
+        ec_key_pool_set_depth(0);
+        Ok(())
+    }
 }
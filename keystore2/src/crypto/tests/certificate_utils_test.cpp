@@ -316,6 +316,287 @@ TEST_P(CertificateUtilsWithRsa, CertSigningWithCallbackRsa) {
     ASSERT_TRUE(X509_verify(decoded_cert.get(), decoded_pkey.get()));
 }
 
+TEST(CertTemplateTest, MatchesMakeCert) {
+    BasicConstraintsExtension bcons{
+        .isCa = false,
+        .pathLength = {},
+    };
+    KeyUsageExtension keyUsage{
+        .isSigningKey = true,
+        .isEncryptionKey = true,
+        .isCertificationKey = false,
+    };
+    auto templateV = CertTemplate::create(std::nullopt, true /* subject key id extension */,
+                                          keyUsage, bcons);
+    ASSERT_TRUE(std::holds_alternative<CertTemplate>(templateV));
+    auto& certTemplate = std::get<CertTemplate>(templateV);
+
+    std::vector<uint8_t> serial = {0x01, 0x02, 0x03};
+    uint64_t now_ms = (uint64_t)time(nullptr) * 1000;
+    std::vector<std::pair<const unsigned char*, unsigned int>> keys = {
+        {rsa_key_2k, rsa_key_2k_len},
+        {rsa_key_4k, rsa_key_4k_len},
+    };
+    // The same template serves certificates for different keys.
+    for (auto [key, key_len] : keys) {
+        CBS cbs;
+        CBS_init(&cbs, key, key_len);
+        EVP_PKEY_Ptr pkey(EVP_parse_private_key(&cbs));
+        ASSERT_TRUE(pkey);
+
+        auto expectedV = makeCert(pkey.get(), serial, std::nullopt, now_ms - kValidity,
+                                  now_ms + kValidity, true /* subject key id extension */,
+                                  keyUsage, bcons);
+        ASSERT_TRUE(std::holds_alternative<X509_Ptr>(expectedV));
+        auto& expected = std::get<X509_Ptr>(expectedV);
+        ASSERT_TRUE(!setIssuer(expected.get(), expected.get(), true));
+
+        auto certV =
+            certTemplate.makeCert(pkey.get(), serial, now_ms - kValidity, now_ms + kValidity);
+        ASSERT_TRUE(std::holds_alternative<X509_Ptr>(certV));
+        auto& cert = std::get<X509_Ptr>(certV);
+        ASSERT_TRUE(!setIssuer(cert.get(), cert.get(), true));
+
+        // RSA PKCS#1 v1.5 signatures are deterministic, so the encodings must match exactly.
+        ASSERT_TRUE(!signCert(expected.get(), pkey.get()));
+        ASSERT_TRUE(!signCert(cert.get(), pkey.get()));
+        auto expectedEncV = encodeCert(expected.get());
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(expectedEncV));
+        auto encV = encodeCert(cert.get());
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(encV));
+        ASSERT_EQ(std::get<std::vector<uint8_t>>(encV),
+                  std::get<std::vector<uint8_t>>(expectedEncV));
+    }
+}
+
+TEST(SignAndEncodeCertTest, MatchesSignCertWithAndEncodeCert) {
+    CBS cbs;
+    CBS_init(&cbs, rsa_key_2k, rsa_key_2k_len);
+    EVP_PKEY_Ptr pkey(EVP_parse_private_key(&cbs));
+    ASSERT_TRUE(pkey);
+
+    uint64_t now_ms = (uint64_t)time(nullptr) * 1000;
+    auto makeSelfIssuedCert = [&]() -> X509_Ptr {
+        auto certV = makeCert(pkey.get(), std::nullopt, std::nullopt, now_ms - kValidity,
+                              now_ms + kValidity, true /* subject key id extension */,
+                              std::nullopt, std::nullopt);
+        EXPECT_TRUE(std::holds_alternative<X509_Ptr>(certV));
+        if (!std::holds_alternative<X509_Ptr>(certV)) return nullptr;
+        X509_Ptr cert = std::move(std::get<X509_Ptr>(certV));
+        EXPECT_TRUE(!setIssuer(cert.get(), cert.get(), true));
+        return cert;
+    };
+
+    for (auto padding : rsa_paddings) {
+        auto sign = [&](const uint8_t* data, size_t len) {
+            bssl::ScopedEVP_MD_CTX sign_ctx;
+            EVP_PKEY_CTX* pkey_sign_ctx_ptr;
+            EXPECT_TRUE(EVP_DigestSignInit(sign_ctx.get(), &pkey_sign_ctx_ptr, EVP_sha256(),
+                                           nullptr, pkey.get()));
+            if (padding == Padding::PSS) {
+                EXPECT_TRUE(EVP_PKEY_CTX_set_rsa_padding(pkey_sign_ctx_ptr, RSA_PKCS1_PSS_PADDING));
+                EXPECT_TRUE(EVP_PKEY_CTX_set_rsa_pss_saltlen(pkey_sign_ctx_ptr, -1));
+            } else {
+                EXPECT_TRUE(EVP_PKEY_CTX_set_rsa_padding(pkey_sign_ctx_ptr, RSA_PKCS1_PADDING));
+            }
+            std::vector<uint8_t> sig_buf(1024);
+            size_t sig_len = 1024;
+            EVP_DigestSign(sign_ctx.get(), sig_buf.data(), &sig_len, data, len);
+            sig_buf.resize(sig_len);
+            return sig_buf;
+        };
+
+        auto cert = makeSelfIssuedCert();
+        ASSERT_TRUE(cert);
+        auto encCertV = signAndEncodeCertWith(cert.get(), sign, Algo::RSA, padding,
+                                              Digest::SHA256);
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(encCertV));
+        auto& encCert = std::get<std::vector<uint8_t>>(encCertV);
+
+        const uint8_t* p = encCert.data();
+        X509_Ptr decoded_cert(d2i_X509(nullptr, &p, (long)encCert.size()));
+        ASSERT_TRUE(decoded_cert);
+        ASSERT_EQ(p, encCert.data() + encCert.size());
+        EVP_PKEY_Ptr decoded_pkey(X509_get_pubkey(decoded_cert.get()));
+        ASSERT_TRUE(X509_verify(decoded_cert.get(), decoded_pkey.get()));
+
+        if (padding == Padding::PKCS1_5) {
+            // PKCS#1 v1.5 signatures are deterministic, so the two-pass path must produce the
+            // same bytes.
+            auto expectedCert = makeSelfIssuedCert();
+            ASSERT_TRUE(expectedCert);
+            ASSERT_TRUE(
+                !signCertWith(expectedCert.get(), sign, Algo::RSA, padding, Digest::SHA256));
+            auto expectedV = encodeCert(expectedCert.get());
+            ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(expectedV));
+            ASSERT_EQ(encCert, std::get<std::vector<uint8_t>>(expectedV));
+        }
+    }
+}
+
+// Makes a certificate for `pkey` with the common name `name`, issued by `issuer` (self issued if
+// null) and signed with `signingKey`.
+static std::vector<uint8_t> makeChainCert(EVP_PKEY* pkey, const char* name, X509* issuer,
+                                          EVP_PKEY* signingKey, X509_Ptr* certOut) {
+    X509_NAME_Ptr subject(X509_NAME_new());
+    X509_NAME_add_entry_by_txt(subject.get(), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const uint8_t*>(name), -1, -1, 0);
+    std::vector<uint8_t> encodedSubject(i2d_X509_NAME(subject.get(), nullptr));
+    uint8_t* p = encodedSubject.data();
+    i2d_X509_NAME(subject.get(), &p);
+
+    uint64_t now_ms = (uint64_t)time(nullptr) * 1000;
+    auto certV = makeCert(pkey, std::nullopt, encodedSubject, now_ms - kValidity,
+                          now_ms + kValidity, true /* subject key id extension */, std::nullopt,
+                          std::nullopt);
+    EXPECT_TRUE(std::holds_alternative<X509_Ptr>(certV));
+    if (!std::holds_alternative<X509_Ptr>(certV)) return {};
+    X509_Ptr cert = std::move(std::get<X509_Ptr>(certV));
+    EXPECT_TRUE(!setIssuer(cert.get(), issuer ? issuer : cert.get(), true));
+    EXPECT_TRUE(!signCert(cert.get(), signingKey));
+    auto encCertV = encodeCert(cert.get());
+    EXPECT_TRUE(std::holds_alternative<std::vector<uint8_t>>(encCertV));
+    if (!std::holds_alternative<std::vector<uint8_t>>(encCertV)) return {};
+    if (certOut) *certOut = std::move(cert);
+    return std::get<std::vector<uint8_t>>(encCertV);
+}
+
+TEST(CertificateChainTest, VerifyChain) {
+    CBS cbs;
+    CBS_init(&cbs, rsa_key_4k, rsa_key_4k_len);
+    EVP_PKEY_Ptr rootKey(EVP_parse_private_key(&cbs));
+    ASSERT_TRUE(rootKey);
+    CBS_init(&cbs, rsa_key_2k, rsa_key_2k_len);
+    EVP_PKEY_Ptr leafKey(EVP_parse_private_key(&cbs));
+    ASSERT_TRUE(leafKey);
+
+    X509_Ptr root, intermediate;
+    auto rootCert = makeChainCert(rootKey.get(), "Root", nullptr, rootKey.get(), &root);
+    auto intermediateCert =
+        makeChainCert(leafKey.get(), "Intermediate", root.get(), rootKey.get(), &intermediate);
+    auto leafCert =
+        makeChainCert(leafKey.get(), "Leaf", intermediate.get(), leafKey.get(), nullptr);
+    ASSERT_FALSE(rootCert.empty());
+    ASSERT_FALSE(intermediateCert.empty());
+    ASSERT_FALSE(leafCert.empty());
+
+    std::vector<std::vector<uint8_t>> chain = {leafCert, intermediateCert, rootCert};
+    ASSERT_TRUE(!verifyCertificateChain(chain));
+    // A chain ending in a certificate that is not self issued is anchored there.
+    ASSERT_TRUE(!verifyCertificateChain({leafCert, intermediateCert}));
+
+    // Out of order.
+    ASSERT_TRUE(verifyCertificateChain({intermediateCert, leafCert, rootCert}));
+
+    // Broken signature.
+    auto badLeaf = leafCert;
+    badLeaf[badLeaf.size() - 1] ^= 1;
+    ASSERT_TRUE(verifyCertificateChain({badLeaf, intermediateCert, rootCert}));
+
+    // Not a certificate.
+    ASSERT_TRUE(verifyCertificateChain({std::vector<uint8_t>(16, 0)}));
+    ASSERT_TRUE(verifyCertificateChain({}));
+
+    // The cache remembers the three verified links, and a chain with a bad leaf still fails
+    // when the other links come from the cache.
+    VerifiedIssuerCache cache;
+    ASSERT_TRUE(!verifyCertificateChain(chain, &cache));
+    ASSERT_EQ(cache.size(), 3u);
+    ASSERT_TRUE(!verifyCertificateChain(chain, &cache));
+    ASSERT_EQ(cache.size(), 3u);
+    ASSERT_TRUE(verifyCertificateChain({badLeaf, intermediateCert, rootCert}, &cache));
+    ASSERT_EQ(cache.size(), 3u);
+}
+
+// Signs `data` with `pkey` using RSA PKCS#1 v1.5 and SHA-256.
+static std::vector<uint8_t> signRsaPkcs1Sha256(EVP_PKEY* pkey, const uint8_t* data, size_t len) {
+    bssl::ScopedEVP_MD_CTX sign_ctx;
+    EVP_PKEY_CTX* pkey_sign_ctx_ptr;
+    EXPECT_TRUE(
+        EVP_DigestSignInit(sign_ctx.get(), &pkey_sign_ctx_ptr, EVP_sha256(), nullptr, pkey));
+    EXPECT_TRUE(EVP_PKEY_CTX_set_rsa_padding(pkey_sign_ctx_ptr, RSA_PKCS1_PADDING));
+    std::vector<uint8_t> sig_buf(1024);
+    size_t sig_len = sig_buf.size();
+    EXPECT_TRUE(EVP_DigestSign(sign_ctx.get(), sig_buf.data(), &sig_len, data, len));
+    sig_buf.resize(sig_len);
+    return sig_buf;
+}
+
+TEST(MakeSignedCertsTest, MatchesSequentialCerts) {
+    auto templateV = CertTemplate::create(std::nullopt, true /* subject key id extension */,
+                                          std::nullopt, std::nullopt);
+    ASSERT_TRUE(std::holds_alternative<CertTemplate>(templateV));
+    auto& certTemplate = std::get<CertTemplate>(templateV);
+
+    std::vector<EVP_PKEY_Ptr> keys;
+    for (auto [key, key_len] : {std::make_pair(rsa_key_2k, rsa_key_2k_len),
+                                std::make_pair(rsa_key_4k, rsa_key_4k_len)}) {
+        CBS cbs;
+        CBS_init(&cbs, key, key_len);
+        keys.emplace_back(EVP_parse_private_key(&cbs));
+        ASSERT_TRUE(keys.back());
+    }
+    // More certificates than keys, so that the workers have something to share.
+    std::vector<const EVP_PKEY*> publicKeys;
+    std::vector<std::vector<uint8_t>> serials;
+    for (uint8_t i = 0; i < 8; ++i) {
+        publicKeys.push_back(keys[i % keys.size()].get());
+        serials.push_back({0x01, i});
+    }
+    uint64_t now_ms = (uint64_t)time(nullptr) * 1000;
+
+    // Self issued: every certificate is signed with its own key, as the index tells.
+    auto selfSign = [&](size_t index, const uint8_t* data, size_t len) {
+        return signRsaPkcs1Sha256(keys[index % keys.size()].get(), data, len);
+    };
+    auto results = makeSignedCerts(certTemplate, publicKeys, serials, now_ms - kValidity,
+                                   now_ms + kValidity, nullptr /* issuer */, true, selfSign,
+                                   Algo::RSA, Padding::PKCS1_5, Digest::SHA256, 4);
+    ASSERT_EQ(results.size(), publicKeys.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(results[i]));
+        auto certV = certTemplate.makeCert(publicKeys[i], serials[i], now_ms - kValidity,
+                                           now_ms + kValidity);
+        ASSERT_TRUE(std::holds_alternative<X509_Ptr>(certV));
+        auto& cert = std::get<X509_Ptr>(certV);
+        ASSERT_TRUE(!setIssuer(cert.get(), cert.get(), true));
+        auto expectedV = signAndEncodeCertWith(
+            cert.get(),
+            [&](const uint8_t* data, size_t len) { return selfSign(i, data, len); }, Algo::RSA,
+            Padding::PKCS1_5, Digest::SHA256);
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(expectedV));
+        // PKCS#1 v1.5 signatures are deterministic, so the certificates must match exactly.
+        ASSERT_EQ(std::get<std::vector<uint8_t>>(results[i]),
+                  std::get<std::vector<uint8_t>>(expectedV));
+    }
+
+    // Issued by a shared root, which signs everything.
+    X509_Ptr root;
+    auto rootCert = makeChainCert(keys[1].get(), "Root", nullptr, keys[1].get(), &root);
+    ASSERT_FALSE(rootCert.empty());
+    auto rootSign = [&](size_t, const uint8_t* data, size_t len) {
+        return signRsaPkcs1Sha256(keys[1].get(), data, len);
+    };
+    results = makeSignedCerts(certTemplate, publicKeys, {} /* serials */, now_ms - kValidity,
+                              now_ms + kValidity, root.get(), true, rootSign, Algo::RSA,
+                              Padding::PKCS1_5, Digest::SHA256);
+    ASSERT_EQ(results.size(), publicKeys.size());
+    for (const auto& result : results) {
+        ASSERT_TRUE(std::holds_alternative<std::vector<uint8_t>>(result));
+        ASSERT_TRUE(!verifyCertificateChain({std::get<std::vector<uint8_t>>(result), rootCert}));
+    }
+
+    // The serials must match the public keys.
+    serials.pop_back();
+    results = makeSignedCerts(certTemplate, publicKeys, serials, now_ms - kValidity,
+                              now_ms + kValidity, nullptr, true, selfSign, Algo::RSA,
+                              Padding::PKCS1_5, Digest::SHA256);
+    ASSERT_EQ(results.size(), publicKeys.size());
+    for (const auto& result : results) {
+        ASSERT_TRUE(std::holds_alternative<CertUtilsError>(result));
+    }
+}
+
 TEST(TimeStringTests, toTimeStringTest) {
     // Two test vectors that need to result in UTCTime
     ASSERT_EQ(std::string(toTimeString(1622758591000)->data()), std::string("210603221631Z"));
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctime>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <openssl/bytestring.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+
+#include "certificate_utils.h"
+#include "crypto.hpp"
+#include "test_keys.h"
+
+// Run with --benchmark_format=json (or --benchmark_out=<file> --benchmark_out_format=json) to get
+// machine readable results for tracking regressions.
+
+// Derives a key of state.range(0) bytes the way super keys are protected with the LSKF.
+// 16 byte keys use PBKDF2-HMAC-SHA1; 32 byte keys use PBKDF2-HMAC-SHA256.
+static void BM_GenerateKeyFromPassword(benchmark::State& state) {
+    std::vector<uint8_t> key(state.range(0));
+    const char pw[] = "benchmark password";
+    std::vector<uint8_t> salt(16, 0x5a);
+    for (auto _ : state) {
+        generateKeyFromPassword(key.data(), key.size(), pw, sizeof(pw) - 1, salt.data());
+        benchmark::DoNotOptimize(key.data());
+    }
+}
+BENCHMARK(BM_GenerateKeyFromPassword)->Arg(16)->Arg(32);
+
+// Encrypts and decrypts blobs of state.range(0) bytes with a 256 bit key.
+static void BM_AesGcmEncrypt(benchmark::State& state) {
+    std::vector<uint8_t> key(32, 0x11);
+    std::vector<uint8_t> iv(12, 0x22);
+    std::vector<uint8_t> in(state.range(0), 0x33);
+    std::vector<uint8_t> out(in.size());
+    uint8_t tag[16];
+    for (auto _ : state) {
+        AES_gcm_encrypt(in.data(), out.data(), in.size(), key.data(), key.size(), iv.data(), tag);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * in.size());
+}
+BENCHMARK(BM_AesGcmEncrypt)->Arg(32)->Arg(1024)->Arg(16 * 1024);
+
+static void BM_AesGcmDecrypt(benchmark::State& state) {
+    std::vector<uint8_t> key(32, 0x11);
+    std::vector<uint8_t> iv(12, 0x22);
+    std::vector<uint8_t> plaintext(state.range(0), 0x33);
+    std::vector<uint8_t> ciphertext(plaintext.size());
+    uint8_t tag[16];
+    AES_gcm_encrypt(plaintext.data(), ciphertext.data(), plaintext.size(), key.data(), key.size(),
+                    iv.data(), tag);
+    for (auto _ : state) {
+        if (!AES_gcm_decrypt(ciphertext.data(), plaintext.data(), ciphertext.size(), key.data(),
+                             key.size(), iv.data(), tag)) {
+            state.SkipWithError("AES_gcm_decrypt failed");
+            break;
+        }
+        benchmark::DoNotOptimize(plaintext.data());
+    }
+    state.SetBytesProcessed(state.iterations() * plaintext.size());
+}
+BENCHMARK(BM_AesGcmDecrypt)->Arg(32)->Arg(1024)->Arg(16 * 1024);
+
+// Computes the key id of a key blob of state.range(0) bytes.
+static void BM_CreateKeyId(benchmark::State& state) {
+    std::vector<uint8_t> blob(state.range(0), 0x44);
+    km_id_t id;
+    for (auto _ : state) {
+        CreateKeyId(blob.data(), blob.size(), &id);
+        benchmark::DoNotOptimize(id);
+    }
+}
+BENCHMARK(BM_CreateKeyId)->Arg(256)->Arg(4096);
+
+// Derives a 32 byte key with extract and expand, as for the ECDH super key agreement.
+static void BM_Hkdf(benchmark::State& state) {
+    std::vector<uint8_t> secret(66, 0x55);
+    std::vector<uint8_t> salt(16, 0x66);
+    const uint8_t info[] = "AES-256-GCM key";
+    std::vector<uint8_t> key(32);
+    for (auto _ : state) {
+        HKDFExtractExpand(key.data(), key.size(), secret.data(), secret.size(), salt.data(),
+                          salt.size(), info, sizeof(info) - 1);
+        benchmark::DoNotOptimize(key.data());
+    }
+}
+BENCHMARK(BM_Hkdf);
+
+// Generates a P-521 key the way ECDHPrivateKey::generate does, with the key pool disabled.
+static void BM_EcKeyGenerate(benchmark::State& state) {
+    ECKEYPoolSetDepth(0);
+    for (auto _ : state) {
+        EC_KEY* key = ECKEYGenerateKey();
+        benchmark::DoNotOptimize(key);
+        EC_KEY_free(key);
+    }
+}
+BENCHMARK(BM_EcKeyGenerate);
+
+static void BM_Ecdh(benchmark::State& state) {
+    bssl::UniquePtr<EC_KEY> priv(ECKEYGenerateKey());
+    bssl::UniquePtr<EC_KEY> peer(ECKEYGenerateKey());
+    uint8_t secret[EC_MAX_BYTES];
+    for (auto _ : state) {
+        ECDHComputeKey(secret, EC_KEY_get0_public_key(peer.get()), priv.get());
+        benchmark::DoNotOptimize(secret);
+    }
+}
+BENCHMARK(BM_Ecdh);
+
+// Agrees a 32 byte key with an encoded peer public key, as ECDHPrivateKey::agree_key does.
+static void BM_EcdhHkdf(benchmark::State& state) {
+    bssl::UniquePtr<EC_KEY> priv(ECKEYGenerateKey());
+    bssl::UniquePtr<EC_KEY> peer(ECKEYGenerateKey());
+    uint8_t peer_pub[133];
+    size_t peer_pub_len =
+        ECPOINTPoint2Oct(EC_KEY_get0_public_key(peer.get()), peer_pub, sizeof(peer_pub));
+    std::vector<uint8_t> salt(32, 0x66);
+    const uint8_t info[] = "AES-256-GCM key";
+    std::vector<uint8_t> key(32);
+    for (auto _ : state) {
+        ECDHHKDF(key.data(), key.size(), peer_pub, peer_pub_len, priv.get(), salt.data(),
+                 salt.size(), info, sizeof(info) - 1);
+        benchmark::DoNotOptimize(key.data());
+    }
+}
+BENCHMARK(BM_EcdhHkdf);
+
+static keystore::EVP_PKEY_Ptr parseRsaKey() {
+    CBS cbs;
+    CBS_init(&cbs, rsa_key_2k, rsa_key_2k_len);
+    return keystore::EVP_PKEY_Ptr(EVP_parse_private_key(&cbs));
+}
+
+// Builds, signs and encodes a certificate for a 2048 bit RSA key with SHA-256 and the padding
+// given by state.range(0). The sign callback returns a constant, so this measures only the
+// certificate handling, including setting the signature AlgorithmIdentifier. With the
+// precomputed identifiers, PSS should cost the same as PKCS#1 v1.5.
+static void BM_SignCertWith(benchmark::State& state) {
+    auto padding = static_cast<keystore::Padding>(state.range(0));
+    auto pkey = parseRsaKey();
+    int64_t now_ms = (int64_t)time(nullptr) * 1000;
+    std::vector<uint8_t> signature(256, 0x5a);
+    auto sign = [&](const uint8_t*, size_t) { return signature; };
+    for (auto _ : state) {
+        auto certV = keystore::makeCert(pkey.get(), std::nullopt, std::nullopt, now_ms, now_ms,
+                                        false, std::nullopt, std::nullopt);
+        auto& cert = std::get<keystore::X509_Ptr>(certV);
+        keystore::setIssuer(cert.get(), cert.get(), false);
+        keystore::signCertWith(cert.get(), sign, keystore::Algo::RSA, padding,
+                               keystore::Digest::SHA256);
+        auto encCert = keystore::encodeCert(cert.get());
+        benchmark::DoNotOptimize(encCert);
+    }
+}
+BENCHMARK(BM_SignCertWith)
+    ->Arg(static_cast<int>(keystore::Padding::PKCS1_5))
+    ->Arg(static_cast<int>(keystore::Padding::PSS));
+
+// Like BM_SignCertWith, but with the single-pass signAndEncodeCertWith.
+static void BM_SignAndEncodeCertWith(benchmark::State& state) {
+    auto padding = static_cast<keystore::Padding>(state.range(0));
+    auto pkey = parseRsaKey();
+    int64_t now_ms = (int64_t)time(nullptr) * 1000;
+    std::vector<uint8_t> signature(256, 0x5a);
+    auto sign = [&](const uint8_t*, size_t) { return signature; };
+    for (auto _ : state) {
+        auto certV = keystore::makeCert(pkey.get(), std::nullopt, std::nullopt, now_ms, now_ms,
+                                        false, std::nullopt, std::nullopt);
+        auto& cert = std::get<keystore::X509_Ptr>(certV);
+        keystore::setIssuer(cert.get(), cert.get(), false);
+        auto encCert = keystore::signAndEncodeCertWith(cert.get(), sign, keystore::Algo::RSA,
+                                                       padding, keystore::Digest::SHA256);
+        benchmark::DoNotOptimize(encCert);
+    }
+}
+BENCHMARK(BM_SignAndEncodeCertWith)
+    ->Arg(static_cast<int>(keystore::Padding::PKCS1_5))
+    ->Arg(static_cast<int>(keystore::Padding::PSS));
+
+enum class CertKey { EC, RSA_PKCS1_5, RSA_PSS };
+
+// Makes, self signs with a real signature and encodes a certificate, as km_compat does for keys
+// without attestation. state.range(0) selects the key: P-256 EC, or 2048 bit RSA with PKCS#1 v1.5
+// or PSS padding.
+static void BM_MakeAndSignCert(benchmark::State& state) {
+    auto certKey = static_cast<CertKey>(state.range(0));
+    keystore::EVP_PKEY_Ptr pkey;
+    if (certKey == CertKey::EC) {
+        keystore::EVP_PKEY_CTX_Ptr pkey_ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr));
+        EVP_PKEY* pkey_ptr = nullptr;
+        if (!pkey_ctx || !EVP_PKEY_keygen_init(pkey_ctx.get()) ||
+            !EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pkey_ctx.get(), NID_X9_62_prime256v1) ||
+            !EVP_PKEY_keygen(pkey_ctx.get(), &pkey_ptr)) {
+            state.SkipWithError("EC key generation failed");
+            return;
+        }
+        pkey.reset(pkey_ptr);
+    } else {
+        pkey = parseRsaKey();
+    }
+    auto algo = certKey == CertKey::EC ? keystore::Algo::ECDSA : keystore::Algo::RSA;
+    auto padding = certKey == CertKey::EC            ? keystore::Padding::Ignored
+                   : certKey == CertKey::RSA_PKCS1_5 ? keystore::Padding::PKCS1_5
+                                                     : keystore::Padding::PSS;
+    auto sign = [&](const uint8_t* data, size_t len) {
+        bssl::ScopedEVP_MD_CTX sign_ctx;
+        EVP_PKEY_CTX* pkey_sign_ctx = nullptr;
+        std::vector<uint8_t> sig(EVP_PKEY_size(pkey.get()));
+        size_t sig_len = sig.size();
+        if (!EVP_DigestSignInit(sign_ctx.get(), &pkey_sign_ctx, EVP_sha256(), nullptr,
+                                pkey.get()) ||
+            (padding == keystore::Padding::PSS &&
+             (!EVP_PKEY_CTX_set_rsa_padding(pkey_sign_ctx, RSA_PKCS1_PSS_PADDING) ||
+              !EVP_PKEY_CTX_set_rsa_pss_saltlen(pkey_sign_ctx, -1))) ||
+            !EVP_DigestSign(sign_ctx.get(), sig.data(), &sig_len, data, len)) {
+            return std::vector<uint8_t>();
+        }
+        sig.resize(sig_len);
+        return sig;
+    };
+    int64_t now_ms = (int64_t)time(nullptr) * 1000;
+    for (auto _ : state) {
+        auto certV = keystore::makeCert(pkey.get(), std::nullopt, std::nullopt, now_ms, now_ms,
+                                        true /* subject key id extension */, std::nullopt,
+                                        std::nullopt);
+        auto& cert = std::get<keystore::X509_Ptr>(certV);
+        keystore::setIssuer(cert.get(), cert.get(), true);
+        auto encCertV = keystore::signAndEncodeCertWith(cert.get(), sign, algo, padding,
+                                                        keystore::Digest::SHA256);
+        if (!std::holds_alternative<std::vector<uint8_t>>(encCertV)) {
+            state.SkipWithError("signAndEncodeCertWith failed");
+            break;
+        }
+        benchmark::DoNotOptimize(encCertV);
+    }
+}
+BENCHMARK(BM_MakeAndSignCert)
+    ->Arg(static_cast<int>(CertKey::EC))
+    ->Arg(static_cast<int>(CertKey::RSA_PKCS1_5))
+    ->Arg(static_cast<int>(CertKey::RSA_PSS));
+
+static void BM_ExtractSubjectFromCertificate(benchmark::State& state) {
+    auto pkey = parseRsaKey();
+    int64_t now_ms = (int64_t)time(nullptr) * 1000;
+    auto certV = keystore::makeCert(pkey.get(), std::nullopt, std::nullopt, now_ms, now_ms,
+                                    true /* subject key id extension */, std::nullopt,
+                                    std::nullopt);
+    auto& cert = std::get<keystore::X509_Ptr>(certV);
+    keystore::setIssuer(cert.get(), cert.get(), true);
+    keystore::signCert(cert.get(), pkey.get());
+    auto encCert = std::get<std::vector<uint8_t>>(keystore::encodeCert(cert.get()));
+    std::vector<uint8_t> subject(256);
+    for (auto _ : state) {
+        int len = extractSubjectFromCertificate(encCert.data(), encCert.size(), subject.data(),
+                                                subject.size());
+        benchmark::DoNotOptimize(len);
+    }
+}
+BENCHMARK(BM_ExtractSubjectFromCertificate);
+
+BENCHMARK_MAIN();
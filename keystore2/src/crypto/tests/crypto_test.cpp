@@ -0,0 +1,136 @@
+/*
+ * Copyright 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "certificate_utils.h"
+#include "crypto.hpp"
+
+#include <openssl/bytestring.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <ctime>
+#include <vector>
+
+#include "test_keys.h"
+
+using namespace keystore;
+
+constexpr uint64_t kValidity = 24 * 60 * 60 * 1000;  // 24 hours in milliseconds
+
+static EVP_PKEY_Ptr parseKey(const unsigned char* key, size_t key_len) {
+    CBS cbs;
+    CBS_init(&cbs, key, key_len);
+    return EVP_PKEY_Ptr(EVP_parse_private_key(&cbs));
+}
+
+static std::vector<uint8_t> encodeName(const char* common_name) {
+    bssl::UniquePtr<X509_NAME> name(X509_NAME_new());
+    EXPECT_TRUE(X509_NAME_add_entry_by_txt(name.get(), "CN", MBSTRING_ASC,
+                                           reinterpret_cast<const uint8_t*>(common_name), -1, -1,
+                                           0));
+    EXPECT_TRUE(X509_NAME_add_entry_by_txt(name.get(), "O", MBSTRING_ASC,
+                                           reinterpret_cast<const uint8_t*>("Android"), -1, -1, 0));
+    std::vector<uint8_t> encoded(i2d_X509_NAME(name.get(), nullptr));
+    uint8_t* p = encoded.data();
+    i2d_X509_NAME(name.get(), &p);
+    return encoded;
+}
+
+// Builds a self signed certificate for `pkey`, with the default subject if `subject` is empty.
+static std::vector<uint8_t> makeSelfSignedCert(EVP_PKEY* pkey,
+                                               const std::vector<uint8_t>& subject) {
+    uint64_t now_ms = (uint64_t)time(nullptr) * 1000;
+    std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subjectArg;
+    if (!subject.empty()) subjectArg = subject;
+    auto certV = makeCert(pkey, std::nullopt, subjectArg, now_ms - kValidity, now_ms + kValidity,
+                          true /* subject key id extension */, std::nullopt, std::nullopt);
+    EXPECT_TRUE(std::holds_alternative<X509_Ptr>(certV));
+    if (!std::holds_alternative<X509_Ptr>(certV)) return {};
+    auto& cert = std::get<X509_Ptr>(certV);
+    EXPECT_FALSE(setIssuer(cert.get(), cert.get(), true));
+    EXPECT_FALSE(signCert(cert.get(), pkey));
+    auto encCertV = encodeCert(cert.get());
+    EXPECT_TRUE(std::holds_alternative<std::vector<uint8_t>>(encCertV));
+    if (!std::holds_alternative<std::vector<uint8_t>>(encCertV)) return {};
+    return std::get<std::vector<uint8_t>>(encCertV);
+}
+
+// Extracts the subject by decoding the full certificate and re-encoding its subject name.
+static std::vector<uint8_t> subjectFromX509(const std::vector<uint8_t>& encCert) {
+    const uint8_t* p = encCert.data();
+    X509_Ptr cert(d2i_X509(nullptr, &p, (long)encCert.size()));
+    EXPECT_TRUE(cert);
+    if (!cert) return {};
+    X509_NAME* name = X509_get_subject_name(cert.get());
+    std::vector<uint8_t> subject(i2d_X509_NAME(name, nullptr));
+    uint8_t* q = subject.data();
+    i2d_X509_NAME(name, &q);
+    return subject;
+}
+
+TEST(ExtractSubjectTest, MatchesX509Parser) {
+    std::vector<EVP_PKEY_Ptr> keys;
+    keys.push_back(parseKey(rsa_key_2k, rsa_key_2k_len));
+    keys.push_back(parseKey(rsa_key_4k, rsa_key_4k_len));
+    std::vector<std::vector<uint8_t>> subjects = {{}, encodeName("Subject Test")};
+
+    for (auto& pkey : keys) {
+        ASSERT_TRUE(pkey);
+        for (auto& subject : subjects) {
+            auto encCert = makeSelfSignedCert(pkey.get(), subject);
+            ASSERT_FALSE(encCert.empty());
+            auto expected = subjectFromX509(encCert);
+            ASSERT_FALSE(expected.empty());
+
+            std::vector<uint8_t> buf(1024);
+            int len = extractSubjectFromCertificate(encCert.data(), encCert.size(), buf.data(),
+                                                    buf.size());
+            ASSERT_EQ(len, (int)expected.size());
+            buf.resize(len);
+            EXPECT_EQ(buf, expected);
+
+            // Data following the certificate is ignored, as it is by d2i_X509.
+            auto trailing = encCert;
+            trailing.push_back(0);
+            ASSERT_EQ(extractSubjectFromCertificate(trailing.data(), trailing.size(), buf.data(),
+                                                    buf.size()),
+                      len);
+
+            // A short buffer reports the required size, negated.
+            ASSERT_EQ(extractSubjectFromCertificate(encCert.data(), encCert.size(), buf.data(),
+                                                    len - 1),
+                      -len);
+        }
+    }
+}
+
+TEST(ExtractSubjectTest, RejectsMalformedCertificates) {
+    auto pkey = parseKey(rsa_key_2k, rsa_key_2k_len);
+    ASSERT_TRUE(pkey);
+    auto encCert = makeSelfSignedCert(pkey.get(), {});
+    ASSERT_FALSE(encCert.empty());
+
+    std::vector<uint8_t> buf(1024);
+    // Truncated certificate.
+    EXPECT_EQ(extractSubjectFromCertificate(encCert.data(), encCert.size() - 1, buf.data(),
+                                            buf.size()),
+              0);
+    // Not a certificate at all.
+    EXPECT_EQ(extractSubjectFromCertificate(rsa_key_2k, rsa_key_2k_len, buf.data(), buf.size()),
+              0);
+}
@@ -3169,6 +3169,35 @@ impl KeystoreDB {
         self.perboot.find_auth_token_entry(p).map(|entry| (entry, self.get_last_off_body()))
     }
 
+    /// Find the newest auth token with the given challenge matching the given predicate.
+    pub fn find_auth_token_entry_by_challenge<F>(
+        &self,
+        challenge: i64,
+        p: F,
+    ) -> Option<(AuthTokenEntry, MonotonicRawTime)>
+    where
+        F: Fn(&AuthTokenEntry) -> bool,
+    {
+        self.perboot
+            .find_auth_token_entry_by_challenge(challenge, p)
+            .map(|entry| (entry, self.get_last_off_body()))
+    }
+
+    /// Find the newest auth token issued for one of the given secure ids matching the given
+    /// predicate.
+    pub fn find_auth_token_entry_by_sids<F>(
+        &self,
+        sids: &[i64],
+        p: F,
+    ) -> Option<(AuthTokenEntry, MonotonicRawTime)>
+    where
+        F: Fn(&AuthTokenEntry) -> bool,
+    {
+        self.perboot
+            .find_auth_token_entry_by_sids(sids, p)
+            .map(|entry| (entry, self.get_last_off_body()))
+    }
+
     /// Insert last_off_body into the metadata table at the initialization of auth token table
     pub fn insert_last_off_body(&self, last_off_body: MonotonicRawTime) {
         self.perboot.set_last_off_body(last_off_body)
@@ -20,12 +20,12 @@ use android_hardware_security_keymint::aidl::android::hardware::security::keymin
     HardwareAuthToken::HardwareAuthToken, HardwareAuthenticatorType::HardwareAuthenticatorType,
 };
 use lazy_static::lazy_static;
-use std::collections::HashSet;
+use std::collections::{BTreeMap, HashMap, HashSet};
 use std::sync::atomic::{AtomicI64, Ordering};
 use std::sync::Arc;
 use std::sync::RwLock;
 
-#[derive(PartialEq, PartialOrd, Ord, Eq, Hash)]
+#[derive(PartialEq, PartialOrd, Ord, Eq, Hash, Clone, Copy)]
 struct AuthTokenId {
     user_id: i64,
     auth_id: i64,
@@ -42,34 +42,98 @@ impl AuthTokenId {
     }
 }
 
-//Implements Eq/Hash to only operate on the AuthTokenId portion
-//of the AuthTokenEntry. This allows a HashSet to DTRT.
-#[derive(Clone)]
-struct AuthTokenEntryWrap(AuthTokenEntry);
+/// Upper bound on the number of auth tokens kept. Tokens are only replaced when a new one with
+/// the same AuthTokenId arrives, so without a bound a stream of distinct authenticator ids can
+/// grow the table for the whole boot. Once full, the oldest token is evicted.
+const MAX_AUTH_TOKENS: usize = 8192;
 
-impl std::hash::Hash for AuthTokenEntryWrap {
-    fn hash<H: std::hash::Hasher>(&self, state: &mut H) {
-        AuthTokenId::from_auth_token(&self.0.auth_token).hash(state)
-    }
+/// Position of an entry in the age order. The sequence number breaks ties between tokens
+/// received within the same millisecond, so that the later insert is considered newer.
+type AgeKey = (MonotonicRawTime, u64);
+
+/// The auth token table. Every token is stored once in `entries`, keyed by AuthTokenId, and
+/// referenced by id from the indexes:
+///  * `by_age` orders all tokens by the time they were received, so the newest match is the
+///    first one found when walking it backwards and the oldest tokens are at its front.
+///  * `by_challenge` maps an operation challenge to the tokens that carry it.
+///  * `by_sid` maps a secure id to the tokens whose user id or authenticator id is that sid.
+///    Since the authenticator type is part of AuthTokenId, each bucket holds at most one token
+///    per (sid, authenticator type) and authenticator id pair.
+#[derive(Default)]
+struct AuthTokenTable {
+    entries: HashMap<AuthTokenId, (AuthTokenEntry, AgeKey)>,
+    by_age: BTreeMap<AgeKey, AuthTokenId>,
+    by_challenge: HashMap<i64, HashSet<AuthTokenId>>,
+    by_sid: HashMap<i64, HashSet<AuthTokenId>>,
+    next_seq: u64,
 }
 
-impl PartialEq<AuthTokenEntryWrap> for AuthTokenEntryWrap {
-    fn eq(&self, other: &AuthTokenEntryWrap) -> bool {
-        AuthTokenId::from_auth_token(&self.0.auth_token)
-            == AuthTokenId::from_auth_token(&other.0.auth_token)
+impl AuthTokenTable {
+    fn insert(&mut self, entry: AuthTokenEntry) {
+        let id = AuthTokenId::from_auth_token(&entry.auth_token);
+        if self.remove(&id).is_none() && self.entries.len() >= MAX_AUTH_TOKENS {
+            self.evict_oldest();
+        }
+        let age = (entry.time_received, self.next_seq);
+        self.next_seq += 1;
+        self.by_age.insert(age, id);
+        self.by_challenge.entry(entry.auth_token.challenge).or_default().insert(id);
+        self.by_sid.entry(id.user_id).or_default().insert(id);
+        self.by_sid.entry(id.auth_id).or_default().insert(id);
+        self.entries.insert(id, (entry, age));
+    }
+
+    fn remove(&mut self, id: &AuthTokenId) -> Option<AuthTokenEntry> {
+        let (entry, age) = self.entries.remove(id)?;
+        self.by_age.remove(&age);
+        Self::unindex(&mut self.by_challenge, entry.auth_token.challenge, id);
+        Self::unindex(&mut self.by_sid, id.user_id, id);
+        Self::unindex(&mut self.by_sid, id.auth_id, id);
+        Some(entry)
+    }
+
+    fn evict_oldest(&mut self) {
+        if let Some(id) = self.by_age.values().next().copied() {
+            self.remove(&id);
+        }
+    }
+
+    fn unindex(index: &mut HashMap<i64, HashSet<AuthTokenId>>, key: i64, id: &AuthTokenId) {
+        if let Some(ids) = index.get_mut(&key) {
+            ids.remove(id);
+            if ids.is_empty() {
+                index.remove(&key);
+            }
+        }
+    }
+
+    /// Returns the newest entry that satisfies the predicate, walking all tokens newest first.
+    fn find_newest<P: Fn(&AuthTokenEntry) -> bool>(&self, p: P) -> Option<&AuthTokenEntry> {
+        self.by_age.values().rev().map(|id| &self.entries[id].0).find(|entry| p(*entry))
     }
-}
 
-impl Eq for AuthTokenEntryWrap {}
+    /// Returns the newest entry among the given candidates that satisfies the predicate.
+    fn find_newest_of<'a, I, P>(&self, ids: I, p: P) -> Option<&AuthTokenEntry>
+    where
+        I: IntoIterator<Item = &'a AuthTokenId>,
+        P: Fn(&AuthTokenEntry) -> bool,
+    {
+        ids.into_iter()
+            .map(|id| &self.entries[id])
+            .filter(|(entry, _)| p(entry))
+            .max_by_key(|(_, age)| *age)
+            .map(|(entry, _)| entry)
+    }
+}
 
 /// Per-boot state structure. Currently only used to track auth tokens and
 /// last-off-body.
 #[derive(Default)]
 pub struct PerbootDB {
     // We can use a .unwrap() discipline on this lock, because only panicking
-    // while holding a .write() lock will poison it. The only write usage is
-    // an insert call which inserts a pre-constructed pair.
-    auth_tokens: RwLock<HashSet<AuthTokenEntryWrap>>,
+    // while holding a .write() lock will poison it. The write usages only
+    // update the table's maps, none of which can panic half way through.
+    auth_tokens: RwLock<AuthTokenTable>,
     // Ordering::Relaxed is appropriate for accessing this atomic, since it
     // does not currently need to be synchronized with anything else.
     last_off_body: AtomicI64,
@@ -89,18 +153,37 @@ impl PerbootDB {
     /// Add a new auth token + timestamp to the database, replacing any which
     /// match all of user_id, auth_id, and auth_type.
     pub fn insert_auth_token_entry(&self, entry: AuthTokenEntry) {
-        self.auth_tokens.write().unwrap().replace(AuthTokenEntryWrap(entry));
+        self.auth_tokens.write().unwrap().insert(entry);
     }
     /// Locate an auth token entry which matches the predicate with the most
     /// recent update time.
     pub fn find_auth_token_entry<P: Fn(&AuthTokenEntry) -> bool>(
         &self,
         p: P,
+    ) -> Option<AuthTokenEntry> {
+        self.auth_tokens.read().unwrap().find_newest(p).cloned()
+    }
+    /// Like find_auth_token_entry, but only considers entries carrying the
+    /// given challenge, which are looked up through the challenge index.
+    pub fn find_auth_token_entry_by_challenge<P: Fn(&AuthTokenEntry) -> bool>(
+        &self,
+        challenge: i64,
+        p: P,
     ) -> Option<AuthTokenEntry> {
         let reader = self.auth_tokens.read().unwrap();
-        let mut matches: Vec<_> = reader.iter().filter(|x| p(&x.0)).collect();
-        matches.sort_by_key(|x| x.0.time_received);
-        matches.last().map(|x| x.0.clone())
+        reader.by_challenge.get(&challenge).and_then(|ids| reader.find_newest_of(ids, p)).cloned()
+    }
+    /// Like find_auth_token_entry, but only considers entries whose user id or
+    /// authenticator id is one of the given secure ids, which are looked up
+    /// through the secure id index.
+    pub fn find_auth_token_entry_by_sids<P: Fn(&AuthTokenEntry) -> bool>(
+        &self,
+        sids: &[i64],
+        p: P,
+    ) -> Option<AuthTokenEntry> {
+        let reader = self.auth_tokens.read().unwrap();
+        let ids = sids.iter().filter_map(|sid| reader.by_sid.get(sid)).flatten();
+        reader.find_newest_of(ids, p).cloned()
     }
     /// Get the last time the device was off the user's body
     pub fn get_last_off_body(&self) -> MonotonicRawTime {
@@ -112,11 +195,138 @@ impl PerbootDB {
     }
     /// Return how many auth tokens are currently tracked.
     pub fn auth_tokens_len(&self) -> usize {
-        self.auth_tokens.read().unwrap().len()
+        self.auth_tokens.read().unwrap().entries.len()
     }
     #[cfg(test)]
     /// For testing, return all auth tokens currently tracked.
     pub fn get_all_auth_token_entries(&self) -> Vec<AuthTokenEntry> {
-        self.auth_tokens.read().unwrap().iter().cloned().map(|x| x.0).collect()
+        self.auth_tokens.read().unwrap().entries.values().map(|(entry, _)| entry.clone()).collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use android_hardware_security_secureclock::aidl::android::hardware::security::secureclock::{
+        Timestamp::Timestamp,
+    };
+    use std::cell::Cell;
+
+    fn make_entry(challenge: i64, sid: i64, time_received: i64) -> AuthTokenEntry {
+        AuthTokenEntry::new(
+            HardwareAuthToken {
+                challenge,
+                userId: sid,
+                authenticatorId: sid + 1,
+                authenticatorType: HardwareAuthenticatorType::FINGERPRINT,
+                timestamp: Timestamp { milliSeconds: time_received },
+                mac: b"mac".to_vec(),
+            },
+            MonotonicRawTime(time_received),
+        )
+    }
+
+    #[test]
+    fn indexes_follow_replacement() {
+        let db = PerbootDB::new();
+        db.insert_auth_token_entry(make_entry(1, 100, 10));
+        db.insert_auth_token_entry(make_entry(2, 200, 11));
+        // Same AuthTokenId as the first entry, with a new challenge.
+        db.insert_auth_token_entry(make_entry(3, 100, 12));
+        assert_eq!(db.auth_tokens_len(), 2);
+
+        assert!(db.find_auth_token_entry_by_challenge(1, |_| true).is_none());
+        let found = db.find_auth_token_entry_by_challenge(3, |_| true).unwrap();
+        assert_eq!(found.auth_token.userId, 100);
+        assert_eq!(found.time_received, MonotonicRawTime(12));
+
+        let found = db.find_auth_token_entry_by_sids(&[201], |_| true).unwrap();
+        assert_eq!(found.auth_token.challenge, 2);
+        let found = db.find_auth_token_entry_by_sids(&[100, 200], |_| true).unwrap();
+        assert_eq!(found.auth_token.challenge, 3);
+        assert!(db
+            .find_auth_token_entry_by_sids(&[100], |e| e
+                .satisfies(&[100], HardwareAuthenticatorType::PASSWORD))
+            .is_none());
+        assert!(db.find_auth_token_entry_by_sids(&[300], |_| true).is_none());
+
+        assert_eq!(db.find_auth_token_entry(|_| true).unwrap().auth_token.challenge, 3);
+        assert_eq!(
+            db.find_auth_token_entry(|e| e.auth_token.userId == 200).unwrap().auth_token.challenge,
+            2
+        );
+    }
+
+    #[test]
+    fn newest_wins_within_same_millisecond() {
+        let db = PerbootDB::new();
+        db.insert_auth_token_entry(make_entry(7, 100, 10));
+        db.insert_auth_token_entry(make_entry(7, 200, 10));
+        assert_eq!(
+            db.find_auth_token_entry_by_challenge(7, |_| true).unwrap().auth_token.userId,
+            200
+        );
+        assert_eq!(db.find_auth_token_entry(|_| true).unwrap().auth_token.userId, 200);
+    }
+
+    #[test]
+    fn evicts_oldest_when_full() {
+        let db = PerbootDB::new();
+        for i in 0..(MAX_AUTH_TOKENS as i64 + 10) {
+            db.insert_auth_token_entry(make_entry(i, i * 2, i));
+        }
+        assert_eq!(db.auth_tokens_len(), MAX_AUTH_TOKENS);
+        for i in 0..10 {
+            assert!(db.find_auth_token_entry_by_challenge(i, |_| true).is_none());
+            assert!(db.find_auth_token_entry_by_sids(&[i * 2], |_| true).is_none());
+        }
+        assert!(db.find_auth_token_entry_by_challenge(10, |_| true).is_some());
+        let oldest = db.find_auth_token_entry(|e| e.time_received < MonotonicRawTime(11));
+        assert_eq!(oldest.unwrap().auth_token.challenge, 10);
+    }
+
+    // The indexed lookups only evaluate the predicate on the candidates from their index, while
+    // the full scan walks the tokens newest first until one matches.
+    #[test]
+    fn lookup_scales_with_table_size() {
+        for &size in &[64i64, 1024, 8192] {
+            let db = PerbootDB::new();
+            for i in 0..size {
+                db.insert_auth_token_entry(make_entry(i, i * 2, i));
+            }
+
+            for challenge in [0, size / 2, size - 1] {
+                let probes = Cell::new(0);
+                let found = db
+                    .find_auth_token_entry_by_challenge(challenge, |_| {
+                        probes.set(probes.get() + 1);
+                        true
+                    })
+                    .unwrap();
+                assert_eq!(found.auth_token.challenge, challenge);
+                assert_eq!(probes.get(), 1);
+
+                let sid = challenge * 2;
+                probes.set(0);
+                let found = db
+                    .find_auth_token_entry_by_sids(&[sid], |e| {
+                        probes.set(probes.get() + 1);
+                        e.satisfies(&[sid], HardwareAuthenticatorType::ANY)
+                    })
+                    .unwrap();
+                assert_eq!(found.auth_token.userId, sid);
+                assert_eq!(probes.get(), 1);
+
+                probes.set(0);
+                let found = db
+                    .find_auth_token_entry(|e| {
+                        probes.set(probes.get() + 1);
+                        e.challenge() == challenge
+                    })
+                    .unwrap();
+                assert_eq!(found.auth_token.challenge, challenge);
+                assert_eq!(probes.get(), size - challenge);
+            }
+        }
     }
 }
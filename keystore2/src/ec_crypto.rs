@@ -17,9 +17,8 @@
 use anyhow::{Context, Result};
 use keystore2_crypto::{
     aes_gcm_decrypt, aes_gcm_encrypt, ec_key_generate_key, ec_key_get0_public_key,
-    ec_key_marshal_private_key, ec_key_parse_private_key, ec_point_oct_to_point,
-    ec_point_point_to_oct, ecdh_compute_key, generate_salt, hkdf_expand, hkdf_extract, ECKey, ZVec,
-    AES_256_KEY_LENGTH,
+    ec_key_marshal_private_key, ec_key_parse_private_key, ec_point_point_to_oct, ecdh_hkdf,
+    generate_salt, hkdf_extract, ECKey, ZVec, AES_256_KEY_LENGTH,
 };
 
 /// Private key for ECDH encryption.
@@ -67,15 +66,9 @@ impl ECDHPrivateKey {
             .context("In ECDHPrivateKey::agree_key: hkdf_extract on sender_public_key failed")?;
         let hkdf = hkdf_extract(recipient_public_key, &hkdf)
             .context("In ECDHPrivateKey::agree_key: hkdf_extract on recipient_public_key failed")?;
-        let other_public_key = ec_point_oct_to_point(other_public_key)
-            .context("In ECDHPrivateKey::agree_key: ec_point_oct_to_point failed")?;
-        let secret = ecdh_compute_key(other_public_key.get_point(), &self.0)
-            .context("In ECDHPrivateKey::agree_key: ecdh_compute_key failed")?;
-        let prk = hkdf_extract(&secret, &hkdf)
-            .context("In ECDHPrivateKey::agree_key: hkdf_extract on secret failed")?;
-
-        let aes_key = hkdf_expand(AES_256_KEY_LENGTH, &prk, b"AES-256-GCM key")
-            .context("In ECDHPrivateKey::agree_key: hkdf_expand failed")?;
+        let aes_key =
+            ecdh_hkdf(other_public_key, &self.0, &hkdf, b"AES-256-GCM key", AES_256_KEY_LENGTH)
+                .context("In ECDHPrivateKey::agree_key: ecdh_hkdf failed")?;
         Ok(aes_key)
     }
 
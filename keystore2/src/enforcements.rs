@@ -632,13 +632,16 @@ impl Enforcements {
         let need_auth_token = timeout_bound || unlocked_device_required;
 
         let hat_and_last_off_body = if need_auth_token {
-            let hat_and_last_off_body = Self::find_auth_token(|hat: &AuthTokenEntry| {
-                if let (Some(auth_type), true) = (user_auth_type, has_sids) {
-                    hat.satisfies(&user_secure_ids, auth_type)
-                } else {
-                    unlocked_device_required
-                }
-            });
+            let hat_and_last_off_body = if let (Some(auth_type), true) = (user_auth_type, has_sids)
+            {
+                DB.with(|db| {
+                    db.borrow().find_auth_token_entry_by_sids(&user_secure_ids, |hat| {
+                        hat.satisfies(&user_secure_ids, auth_type)
+                    })
+                })
+            } else {
+                Self::find_auth_token(|_| unlocked_device_required)
+            };
             Some(
                 hat_and_last_off_body
                     .ok_or(Error::Km(Ec::KEY_USER_NOT_AUTHENTICATED))
@@ -815,8 +818,10 @@ impl Enforcements {
         let auth_type = HardwareAuthenticatorType::ANY;
         let sids: Vec<i64> = vec![secure_user_id];
         // Filter the matching auth tokens by challenge
-        let result = Self::find_auth_token(|hat: &AuthTokenEntry| {
-            (challenge == hat.challenge()) && hat.satisfies(&sids, auth_type)
+        let result = DB.with(|db| {
+            db.borrow().find_auth_token_entry_by_challenge(challenge, |hat| {
+                hat.satisfies(&sids, auth_type)
+            })
         });
 
         let auth_token = if let Some((auth_token_entry, _)) = result {
@@ -825,13 +830,15 @@ impl Enforcements {
             // Filter the matching auth tokens by age.
             if auth_token_max_age_millis != 0 {
                 let now_in_millis = MonotonicRawTime::now();
-                let result = Self::find_auth_token(|auth_token_entry: &AuthTokenEntry| {
-                    let token_valid = now_in_millis
-                        .checked_sub(&auth_token_entry.time_received())
-                        .map_or(false, |token_age_in_millis| {
-                            auth_token_max_age_millis > token_age_in_millis.milliseconds()
-                        });
-                    token_valid && auth_token_entry.satisfies(&sids, auth_type)
+                let result = DB.with(|db| {
+                    db.borrow().find_auth_token_entry_by_sids(&sids, |auth_token_entry| {
+                        let token_valid = now_in_millis
+                            .checked_sub(&auth_token_entry.time_received())
+                            .map_or(false, |token_age_in_millis| {
+                                auth_token_max_age_millis > token_age_in_millis.milliseconds()
+                            });
+                        token_valid && auth_token_entry.satisfies(&sids, auth_type)
+                    })
                 });
 
                 if let Some((auth_token_entry, _)) = result {
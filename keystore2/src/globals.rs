@@ -37,7 +37,8 @@ use android_hardware_security_keymint::binder::{StatusCode, Strong};
 use android_security_compat::aidl::android::security::compat::IKeystoreCompatService::IKeystoreCompatService;
 use anyhow::{Context, Result};
 use binder::FromIBinder;
-use keystore2_vintf::get_aidl_instances;
+use keystore2_system_property::PropertyWatcher;
+use keystore2_vintf::get_cached_aidl_instances;
 use lazy_static::lazy_static;
 use std::sync::{Arc, Mutex, RwLock};
 use std::{cell::RefCell, sync::Once};
@@ -45,6 +46,20 @@ use std::{collections::HashMap, path::Path, path::PathBuf};
 
 static DB_INIT: Once = Once::new();
 
+/// Number of precomputed ephemeral EC keys kept for encrypting keys with an ECDH super key
+/// while the user is locked, unless overridden by the keystore.ec_key_pool_depth property.
+const DEFAULT_EC_KEY_POOL_DEPTH: usize = 4;
+
+/// Configures the pool of precomputed EC keys used by keystore2_crypto::ec_key_generate_key.
+/// This should be called once during startup.
+pub fn init_ec_key_pool() {
+    let depth = PropertyWatcher::new("keystore.ec_key_pool_depth")
+        .and_then(|mut w| w.read(|_n, v| v.parse::<usize>().map_err(std::convert::Into::into)))
+        .unwrap_or(DEFAULT_EC_KEY_POOL_DEPTH);
+    log::info!("In init_ec_key_pool: Keeping {} precomputed EC keys.", depth);
+    keystore2_crypto::ec_key_pool_set_depth(depth);
+}
+
 /// Open a connection to the Keystore 2.0 database. This is called during the initialization of
 /// the thread local DB field. It should never be called directly. The first time this is called
 /// we also call KeystoreDB::cleanup_leftovers to restore the key lifecycle invariant. See the
@@ -186,7 +201,7 @@ static KEYMINT_SERVICE_NAME: &str = "android.hardware.security.keymint.IKeyMintD
 /// up the compatibility service and attempts to connect to the legacy wrapper.
 fn connect_keymint(security_level: &SecurityLevel) -> Result<(Asp, KeyMintHardwareInfo)> {
     let keymint_instances =
-        get_aidl_instances("android.hardware.security.keymint", 1, "IKeyMintDevice");
+        get_cached_aidl_instances("android.hardware.security.keymint", 1, "IKeyMintDevice");
 
     let service_name = match *security_level {
         SecurityLevel::TRUSTED_ENVIRONMENT => {
@@ -296,7 +311,7 @@ static TIME_STAMP_SERVICE_NAME: &str = "android.hardware.security.secureclock.IS
 /// to connect to the legacy wrapper.
 fn connect_secureclock() -> Result<Asp> {
     let secureclock_instances =
-        get_aidl_instances("android.hardware.security.secureclock", 1, "ISecureClock");
+        get_cached_aidl_instances("android.hardware.security.secureclock", 1, "ISecureClock");
 
     let secure_clock_available =
         secureclock_instances.as_vec()?.iter().any(|instance| *instance == "default");
@@ -345,8 +360,11 @@ static REMOTE_PROVISIONING_HAL_SERVICE_NAME: &str =
     "android.hardware.security.keymint.IRemotelyProvisionedComponent";
 
 fn connect_remotely_provisioned_component(security_level: &SecurityLevel) -> Result<Asp> {
-    let remotely_prov_instances =
-        get_aidl_instances("android.hardware.security.keymint", 1, "IRemotelyProvisionedComponent");
+    let remotely_prov_instances = get_cached_aidl_instances(
+        "android.hardware.security.keymint",
+        1,
+        "IRemotelyProvisionedComponent",
+    );
 
     let service_name = match *security_level {
         SecurityLevel::TRUSTED_ENVIRONMENT => {
@@ -73,6 +73,7 @@ fn main() {
     ENFORCEMENTS.install_confirmation_token_receiver(confirmation_token_receiver);
 
     entropy::register_feeder();
+    keystore2::globals::init_ec_key_pool();
     shared_secret_negotiation::perform_shared_secret_negotiation();
 
     info!("Starting thread pool now.");
@@ -16,6 +16,7 @@
 
 #include "km_compat.h"
 
+#include "km_compat_call_stats.h"
 #include "km_compat_type_conversion.h"
 #include <AndroidKeyMintDevice.h>
 #include <aidl/android/hardware/security/keymint/Algorithm.h>
@@ -24,15 +25,22 @@
 #include <aidl/android/hardware/security/keymint/KeyParameterValue.h>
 #include <aidl/android/hardware/security/keymint/PaddingMode.h>
 #include <aidl/android/system/keystore2/ResponseCode.h>
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android/hidl/manager/1.2/IServiceManager.h>
 #include <binder/IServiceManager.h>
 #include <hardware/keymaster_defs.h>
 #include <keymasterV4_1/Keymaster.h>
 #include <keymasterV4_1/Keymaster3.h>
 #include <keymasterV4_1/Keymaster4.h>
+#include <openssl/sha.h>
 
+#include <algorithm>
 #include <chrono>
+#include <future>
+#include <thread>
 
 #include "certificate_utils.h"
 
@@ -46,12 +54,10 @@ using ::aidl::android::system::keystore2::ResponseCode;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::keymaster::V4_0::TagType;
 using ::android::hidl::manager::V1_2::IServiceManager;
-using V4_0_HardwareAuthToken = ::android::hardware::keymaster::V4_0::HardwareAuthToken;
 using V4_0_HmacSharingParameters = ::android::hardware::keymaster::V4_0::HmacSharingParameters;
 using V4_0_KeyCharacteristics = ::android::hardware::keymaster::V4_0::KeyCharacteristics;
 using V4_0_KeyFormat = ::android::hardware::keymaster::V4_0::KeyFormat;
 using V4_0_KeyParameter = ::android::hardware::keymaster::V4_0::KeyParameter;
-using V4_0_VerificationToken = ::android::hardware::keymaster::V4_0::VerificationToken;
 namespace V4_0 = ::android::hardware::keymaster::V4_0;
 namespace V4_1 = ::android::hardware::keymaster::V4_1;
 namespace KMV1 = ::aidl::android::hardware::security::keymint;
@@ -61,6 +67,26 @@ using std::chrono::duration_cast;
 
 static const KMV1::Tag KM_TAG_FBE_ICE = static_cast<KMV1::Tag>((7 << 28) | 16201);
 
+// Number of getKeyCharacteristics results kept per device.
+static const size_t kKeyCharacteristicsCacheSize = 64;
+
+// How long begin() may wait for a free operation slot, in milliseconds.
+static const char* kSlotWaitTimeProperty = "ro.keystore.km_compat.slot_wait_ms";
+static const uint32_t kMaxSlotWaitTimeMs = 1000;
+
+// How long addRngEntropy() may hold entropy back to forward it together with later calls, in
+// milliseconds.
+static const char* kEntropyFlushDelayProperty = "ro.keystore.km_compat.entropy_flush_ms";
+static const uint32_t kMaxEntropyFlushDelayMs = 1000;
+
+// The most entropy Keymaster accepts in one addRngEntropy call.
+static const size_t kMaxEntropyBatchSize = 2048;
+
+// The most calls that may be in the HAL of each security level at once, see CallLane.
+static const char* kTeeMaxCallsProperty = "ro.keystore.km_compat.tee_max_calls";
+static const char* kStrongBoxMaxCallsProperty = "ro.keystore.km_compat.strongbox_max_calls";
+static const uint32_t kMaxCallLaneLimit = 64;
+
 // Utility functions
 
 // Returns true if this parameter may be passed to attestKey.
@@ -147,6 +173,14 @@ const size_t kKeyBlobPrefixSize = 8;
 //
 const uint8_t kKeyBlobMagic[7] = {'p', 'K', 'M', 'b', 'l', 'o', 'b'};
 
+// Wraps data in a hidl_vec without copying it. The caller must keep data alive for as long as
+// the returned hidl_vec is in use.
+static hidl_vec<uint8_t> makeHidlView(const uint8_t* data, size_t size) {
+    hidl_vec<uint8_t> view;
+    view.setToExternal(const_cast<uint8_t*>(data), size, false /* shouldOwn */);
+    return view;
+}
+
 // Prefixes a keyblob returned by e.g. generateKey() with information on whether it
 // originated from the real underlying KeyMaster HAL or from soft-KeyMint.
 //
@@ -211,18 +245,14 @@ bool prefixedKeyBlobIsSoftKeyMint(const std::vector<uint8_t>& prefixedBlob) {
 }
 
 // Inspects the given blob for prefixes.
-// Returns the blob stripped of the prefix if present. The boolean argument is true if the blob was
-// a software blob.
-std::pair<std::vector<uint8_t>, bool>
-dissectPrefixedKeyBlob(const std::vector<uint8_t>& prefixedBlob) {
+// Returns a view of the blob stripped of the prefix if present, which can be handed to the HAL
+// without copying the blob. The view points into prefixedBlob and must not outlive it. The boolean
+// argument is true if the blob was a software blob.
+std::pair<hidl_vec<uint8_t>, bool>
+dissectPrefixedKeyBlobView(const std::vector<uint8_t>& prefixedBlob) {
     auto [hasPrefix, isSoftware] = prefixedKeyBlobParsePrefix(prefixedBlob);
-    if (!hasPrefix) {
-        // Not actually prefixed, blob was probably persisted to disk prior to the
-        // prefixing code being introduced.
-        return {prefixedBlob, false};
-    }
-    return {std::vector<uint8_t>(prefixedBlob.begin() + kKeyBlobPrefixSize, prefixedBlob.end()),
-            isSoftware};
+    size_t offset = hasPrefix ? kKeyBlobPrefixSize : 0;
+    return {makeHidlView(prefixedBlob.data() + offset, prefixedBlob.size() - offset), isSoftware};
 }
 
 /*
@@ -241,26 +271,56 @@ bool isNewAndKeystoreEnforceable(const KMV1::KeyParameter& param) {
     }
 }
 
-std::vector<KMV1::KeyParameter>
-extractGenerationParams(const std::vector<KMV1::KeyParameter>& params) {
-    std::vector<KMV1::KeyParameter> result;
-    std::copy_if(params.begin(), params.end(), std::back_inserter(result), isKeyCreationParameter);
-    return result;
+KeyCreationParams::KeyCreationParams(const std::vector<KeyParameter>& params) : mAll(params) {
+    for (const auto& param : params) {
+        if (isKeyCreationParameter(param)) {
+            mGenerationParams.push_back(param);
+        }
+        if (isAttestationParameter(param)) {
+            mAttestationParams.push_back(param);
+        }
+        if (isNewAndKeystoreEnforceable(param)) {
+            mNewAndKeystoreEnforceableParams.push_back(param);
+        }
+        if (auto index = indexOf(param.tag); index && !mIndexed[*index]) {
+            mIndexed[*index] = &param;
+        }
+    }
 }
 
-std::vector<KMV1::KeyParameter>
-extractAttestationParams(const std::vector<KMV1::KeyParameter>& params) {
-    std::vector<KMV1::KeyParameter> result;
-    std::copy_if(params.begin(), params.end(), std::back_inserter(result), isAttestationParameter);
-    return result;
+// The tags that getCertificate looks up.
+std::optional<size_t> KeyCreationParams::indexOf(KMV1::Tag tag) {
+    switch (tag) {
+    case Tag::ALGORITHM:
+        return 0;
+    case Tag::APPLICATION_ID:
+        return 1;
+    case Tag::APPLICATION_DATA:
+        return 2;
+    case Tag::ATTESTATION_CHALLENGE:
+        return 3;
+    case Tag::CERTIFICATE_SERIAL:
+        return 4;
+    case Tag::CERTIFICATE_SUBJECT:
+        return 5;
+    case Tag::CERTIFICATE_NOT_BEFORE:
+        return 6;
+    case Tag::CERTIFICATE_NOT_AFTER:
+        return 7;
+    case Tag::NO_AUTH_REQUIRED:
+        return 8;
+    default:
+        return std::nullopt;
+    }
 }
 
-std::vector<KMV1::KeyParameter>
-extractNewAndKeystoreEnforceableParams(const std::vector<KMV1::KeyParameter>& params) {
-    std::vector<KMV1::KeyParameter> result;
-    std::copy_if(params.begin(), params.end(), std::back_inserter(result),
-                 isNewAndKeystoreEnforceable);
-    return result;
+const KeyParameter* KeyCreationParams::find(KMV1::Tag tag) const {
+    if (auto index = indexOf(tag)) {
+        return mIndexed[*index];
+    }
+    auto it = std::find_if(mAll.begin(), mAll.end(),
+                           [tag](const KeyParameter& param) { return param.tag == tag; });
+    return it != mAll.end() ? &*it : nullptr;
 }
 
 ScopedAStatus convertErrorCode(KMV1::ErrorCode result) {
@@ -283,59 +343,48 @@ static KMV1::ErrorCode toErrorCode(const ScopedAStatus& status) {
     }
 }
 
-static std::vector<V4_0::KeyParameter>
-convertKeyParametersToLegacy(const std::vector<KeyParameter>& kps) {
-    std::vector<V4_0::KeyParameter> legacyKps;
-    legacyKps.reserve(kps.size());
-    for (const auto& kp : kps) {
-        auto p = convertKeyParameterToLegacy(kp);
-        if (p.tag != V4_0::Tag::INVALID) {
-            legacyKps.push_back(std::move(p));
-        }
-    }
-    return legacyKps;
-}
-
-static std::vector<KeyParameter>
-convertKeyParametersFromLegacy(const std::vector<V4_0_KeyParameter>& legacyKps) {
-    std::vector<KeyParameter> kps(legacyKps.size());
-    std::transform(legacyKps.begin(), legacyKps.end(), kps.begin(), convertKeyParameterFromLegacy);
-    return kps;
-}
-
+// Builds the KeyMint characteristics from the legacy ones. Every list is sized before it is
+// filled and moved into the result, so the parameters, some of which carry blobs, are converted
+// once and never copied.
 static std::vector<KeyCharacteristics>
 processLegacyCharacteristics(KeyMintSecurityLevel securityLevel,
-                             const std::vector<KeyParameter>& genParams,
+                             const std::vector<KeyParameter>& newAndKeystoreEnforceableParams,
                              const V4_0_KeyCharacteristics& legacyKc, bool kmEnforcedOnly = false) {
+    std::vector<KeyCharacteristics> result;
+    result.reserve(kmEnforcedOnly ? 1 : 2);
 
-    KeyCharacteristics kmEnforced{securityLevel, convertKeyParametersFromLegacy(
-                                                     securityLevel == KeyMintSecurityLevel::SOFTWARE
-                                                         ? legacyKc.softwareEnforced
-                                                         : legacyKc.hardwareEnforced)};
+    KeyCharacteristics& kmEnforced = result.emplace_back();
+    kmEnforced.securityLevel = securityLevel;
+    kmEnforced.authorizations = convertKeyParametersFromLegacy(
+        securityLevel == KeyMintSecurityLevel::SOFTWARE ? legacyKc.softwareEnforced
+                                                        : legacyKc.hardwareEnforced);
 
     if (securityLevel == KeyMintSecurityLevel::SOFTWARE && legacyKc.hardwareEnforced.size() > 0) {
         LOG(WARNING) << "Unexpected hardware enforced parameters.";
     }
 
     if (kmEnforcedOnly) {
-        return {kmEnforced};
+        return result;
     }
 
-    KeyCharacteristics keystoreEnforced{KeyMintSecurityLevel::KEYSTORE, {}};
+    KeyCharacteristics& keystoreEnforced = result.emplace_back();
+    keystoreEnforced.securityLevel = KeyMintSecurityLevel::KEYSTORE;
+    auto& authorizations = keystoreEnforced.authorizations;
 
-    if (securityLevel != KeyMintSecurityLevel::SOFTWARE) {
-        // Don't include these tags on software backends, else they'd end up duplicated
-        // across both the keystore-enforced and software keymaster-enforced tags.
-        keystoreEnforced.authorizations = convertKeyParametersFromLegacy(legacyKc.softwareEnforced);
+    // Don't include the software enforced tags on software backends, else they'd end up
+    // duplicated across both the keystore-enforced and software keymaster-enforced tags.
+    bool addSoftwareEnforced = securityLevel != KeyMintSecurityLevel::SOFTWARE;
+    authorizations.reserve((addSoftwareEnforced ? legacyKc.softwareEnforced.size() : 0) +
+                           newAndKeystoreEnforceableParams.size());
+    if (addSoftwareEnforced) {
+        appendKeyParametersFromLegacy(legacyKc.softwareEnforced, &authorizations);
     }
 
     // Add all parameters that we know can be enforced by keystore but not by the legacy backend.
-    auto unsupported_requested = extractNewAndKeystoreEnforceableParams(genParams);
-    keystoreEnforced.authorizations.insert(keystoreEnforced.authorizations.end(),
-                                           std::begin(unsupported_requested),
-                                           std::end(unsupported_requested));
+    authorizations.insert(authorizations.end(), std::begin(newAndKeystoreEnforceableParams),
+                          std::end(newAndKeystoreEnforceableParams));
 
-    return {kmEnforced, keystoreEnforced};
+    return result;
 }
 
 static V4_0_KeyFormat convertKeyFormatToLegacy(const KeyFormat& kf) {
@@ -387,22 +436,125 @@ convertSharedSecretParametersToLegacy(const std::vector<SharedSecretParameters>&
 }
 
 void OperationSlots::setNumFreeSlots(uint8_t numFreeSlots) {
-    std::lock_guard<std::mutex> lock(mNumFreeSlotsMutex);
-    mNumFreeSlots = numFreeSlots;
+    mNumFreeSlots.store(numFreeSlots);
+}
+
+void OperationSlots::setMaxWaitTime(std::chrono::milliseconds maxWaitTime) {
+    mMaxWaitTime = maxWaitTime;
+}
+
+bool OperationSlots::tryClaimSlot() {
+    // Sequentially consistent, so that this pairs with the waiter check in freeSlot().
+    uint8_t numFreeSlots = mNumFreeSlots.load();
+    // On failure compare_exchange_weak reloads numFreeSlots, so just retry until we either
+    // claimed a slot or there are none left.
+    while (numFreeSlots > 0) {
+        if (mNumFreeSlots.compare_exchange_weak(numFreeSlots, numFreeSlots - 1,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool OperationSlots::waitForSlot() {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + mMaxWaitTime;
+
+    std::unique_lock<std::mutex> lock(mWaitMutex);
+    uint64_t id = mNextWaiterId++;
+    mWaitQueue.push_back(id);
+    uint32_t numWaiting = ++mNumWaiting;
+    mWaitStats.maxNumWaiting = std::max(mWaitStats.maxNumWaiting, numWaiting);
+    mWaitStats.numWaits++;
+
+    // Only the caller at the head of the queue may claim a slot, which keeps this fair
+    // among waiters.
+    bool claimed = mWaitCondition.wait_until(
+        lock, deadline, [&] { return mWaitQueue.front() == id && tryClaimSlot(); });
+
+    mWaitQueue.erase(std::find(mWaitQueue.begin(), mWaitQueue.end(), id));
+    --mNumWaiting;
+    if (!claimed) {
+        mWaitStats.numTimeouts++;
+    }
+    mWaitStats.totalWaitTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+    lock.unlock();
+    // The head of the queue changed, and if we timed out there may be a free slot that
+    // the next waiter could claim.
+    mWaitCondition.notify_all();
+    return claimed;
 }
 
 bool OperationSlots::claimSlot() {
-    std::lock_guard<std::mutex> lock(mNumFreeSlotsMutex);
-    if (mNumFreeSlots > 0) {
-        mNumFreeSlots--;
+    // Don't let new callers overtake the ones that are already waiting.
+    if (mNumWaiting == 0 && tryClaimSlot()) {
         return true;
     }
-    return false;
+    if (mMaxWaitTime.count() <= 0) {
+        return false;
+    }
+    return waitForSlot();
 }
 
 void OperationSlots::freeSlot() {
-    std::lock_guard<std::mutex> lock(mNumFreeSlotsMutex);
-    mNumFreeSlots++;
+    mNumFreeSlots.fetch_add(1);
+    // Waiters register under mWaitMutex before checking for a free slot, so taking the
+    // lock here guarantees that they either see this slot or get the notification.
+    if (mNumWaiting > 0) {
+        std::lock_guard<std::mutex> lock(mWaitMutex);
+        mWaitCondition.notify_all();
+    }
+}
+
+OperationSlotWaitStats OperationSlots::getWaitStats() {
+    std::lock_guard<std::mutex> lock(mWaitMutex);
+    OperationSlotWaitStats stats = mWaitStats;
+    stats.numWaiting = mNumWaiting;
+    return stats;
+}
+
+CallLane::Entry::Entry(CallLane* lane, bool wait) : mLane(lane), mEntered(lane->enter(wait)) {}
+
+CallLane::Entry::~Entry() {
+    if (mEntered) mLane->leave();
+}
+
+bool CallLane::enter(bool wait) {
+    if (mMaxCalls == 0) return true;
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mNumCalls >= mMaxCalls) {
+        if (!wait) {
+            mNumRejects++;
+            return false;
+        }
+        mNumWaits++;
+        mCondition.wait(lock, [&] { return mNumCalls < mMaxCalls; });
+    }
+    mNumCalls++;
+    return true;
+}
+
+void CallLane::leave() {
+    if (mMaxCalls == 0) return;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mNumCalls--;
+    }
+    mCondition.notify_one();
+}
+
+CallLaneStats CallLane::getStats() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    CallLaneStats stats;
+    stats.maxCalls = mMaxCalls;
+    stats.numCalls = mNumCalls;
+    stats.numWaits = mNumWaits;
+    stats.numRejects = mNumRejects;
+    return stats;
 }
 
 void OperationSlot::freeSlot() {
@@ -426,7 +578,67 @@ ScopedAStatus KeyMintDevice::getHardwareInfo(KeyMintHardwareInfo* _aidl_return)
 }
 
 ScopedAStatus KeyMintDevice::addRngEntropy(const std::vector<uint8_t>& in_data) {
-    auto result = mDevice->addRngEntropy(in_data);
+    std::vector<uint8_t> batch;
+    bool forwardNow;
+    {
+        std::lock_guard<std::mutex> lock(mEntropyMutex);
+        // Oversized input goes to the HAL as it is, which rejects it.
+        forwardNow = mEntropyFlushDelay == std::chrono::milliseconds::zero() ||
+                     in_data.size() > kMaxEntropyBatchSize;
+        if (!forwardNow) {
+            if (mPendingEntropy.size() + in_data.size() > kMaxEntropyBatchSize) {
+                batch.swap(mPendingEntropy);
+            }
+            mPendingEntropy.insert(mPendingEntropy.end(), in_data.begin(), in_data.end());
+            if (batch.empty() && mPendingEntropy.size() == kMaxEntropyBatchSize) {
+                batch.swap(mPendingEntropy);
+            }
+            if (!mPendingEntropy.empty()) {
+                if (!mEntropyFlushThread.joinable()) {
+                    mEntropyFlushThread = std::thread([this] { flushEntropyLoop(); });
+                }
+                mEntropyFlushCv.notify_one();
+            }
+        }
+    }
+    // The HAL is called without mEntropyMutex, so that other callers are not held up by it.
+    if (forwardNow) return forwardRngEntropy(in_data.data(), in_data.size());
+    if (batch.empty()) return ScopedAStatus::ok();
+    return forwardRngEntropy(batch.data(), batch.size());
+}
+
+void KeyMintDevice::flushEntropyLoop() {
+    std::unique_lock<std::mutex> lock(mEntropyMutex);
+    while (!mStopEntropyFlush) {
+        if (mPendingEntropy.empty()) {
+            mEntropyFlushCv.wait(lock);
+            continue;
+        }
+        // Collected entropy waits at most the delay. It may be forwarded earlier by a caller
+        // filling up the batch, or by turning batching off.
+        mEntropyFlushCv.wait_for(lock, mEntropyFlushDelay,
+                                 [this] { return mStopEntropyFlush || mPendingEntropy.empty(); });
+        forwardPendingEntropy(lock);
+    }
+    forwardPendingEntropy(lock);
+}
+
+void KeyMintDevice::forwardPendingEntropy(std::unique_lock<std::mutex>& lock) {
+    if (mPendingEntropy.empty()) return;
+    std::vector<uint8_t> batch;
+    batch.swap(mPendingEntropy);
+    lock.unlock();
+    auto status = forwardRngEntropy(batch.data(), batch.size());
+    lock.lock();
+    // The callers that added this entropy have returned already, so all that is left is to log.
+    if (!status.isOk()) {
+        LOG(ERROR) << "Failed to forward batched entropy: " << status.getDescription();
+    }
+}
+
+ScopedAStatus KeyMintDevice::forwardRngEntropy(const uint8_t* data, size_t size) {
+    auto result = mDevice->addRngEntropy(makeHidlView(data, size));
+    mNumEntropyCalls.fetch_add(1, std::memory_order_relaxed);
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
         return convertErrorCode(KMV1::ErrorCode::UNKNOWN_ERROR);
@@ -434,9 +646,31 @@ ScopedAStatus KeyMintDevice::addRngEntropy(const std::vector<uint8_t>& in_data)
     return convertErrorCode(result);
 }
 
+void KeyMintDevice::setEntropyFlushDelay(std::chrono::milliseconds delay) {
+    std::unique_lock<std::mutex> lock(mEntropyMutex);
+    mEntropyFlushDelay = delay;
+    // Entropy must not stay behind when batching gets turned off.
+    if (delay == std::chrono::milliseconds::zero()) {
+        forwardPendingEntropy(lock);
+    }
+    mEntropyFlushCv.notify_one();
+}
+
+uint64_t KeyMintDevice::getNumEntropyCalls() {
+    return mNumEntropyCalls.load(std::memory_order_relaxed);
+}
+
 ScopedAStatus KeyMintDevice::generateKey(const std::vector<KeyParameter>& inKeyParams,
                                          const std::optional<AttestationKey>& in_attestationKey,
                                          KeyCreationResult* out_creationResult) {
+    return CompatCallStats::getInstance().track(CompatCall::GENERATE_KEY, [&] {
+        return generateKeyImpl(inKeyParams, in_attestationKey, out_creationResult);
+    });
+}
+
+ScopedAStatus KeyMintDevice::generateKeyImpl(const std::vector<KeyParameter>& inKeyParams,
+                                             const std::optional<AttestationKey>& in_attestationKey,
+                                             KeyCreationResult* out_creationResult) {
 
     // Since KeyMaster doesn't support ECDH, route all key creation requests to
     // soft-KeyMint if and only an ECDH key is requested.
@@ -460,7 +694,8 @@ ScopedAStatus KeyMintDevice::generateKey(const std::vector<KeyParameter>& inKeyP
         }
     }
 
-    auto legacyKeyGenParams = convertKeyParametersToLegacy(extractGenerationParams(inKeyParams));
+    KeyCreationParams keyParams(inKeyParams);
+    auto legacyKeyGenParams = convertKeyParametersToLegacy(keyParams.generationParams());
     KMV1::ErrorCode errorCode;
 
     for (const auto& keyParam : inKeyParams) {
@@ -469,7 +704,8 @@ ScopedAStatus KeyMintDevice::generateKey(const std::vector<KeyParameter>& inKeyP
             param1.tag = static_cast<::android::hardware::keymaster::V4_0::Tag>
 			(android::hardware::keymaster::V4_0::KM_TAG_FBE_ICE);
             param1.f.boolValue = true;
-            legacyKeyGenParams.push_back(param1);
+            legacyKeyGenParams.resize(legacyKeyGenParams.size() + 1);
+            legacyKeyGenParams[legacyKeyGenParams.size() - 1] = param1;
             break;
         }
     }
@@ -479,15 +715,15 @@ ScopedAStatus KeyMintDevice::generateKey(const std::vector<KeyParameter>& inKeyP
                                 const V4_0_KeyCharacteristics& keyCharacteristics) {
             errorCode = convert(error);
             out_creationResult->keyBlob = keyBlobPrefix(keyBlob, false);
-            out_creationResult->keyCharacteristics =
-                processLegacyCharacteristics(securityLevel_, inKeyParams, keyCharacteristics);
+            out_creationResult->keyCharacteristics = processLegacyCharacteristics(
+                securityLevel_, keyParams.newAndKeystoreEnforceableParams(), keyCharacteristics);
         });
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
         return convertErrorCode(KMV1::ErrorCode::UNKNOWN_ERROR);
     }
     if (errorCode == KMV1::ErrorCode::OK) {
-        auto cert = getCertificate(inKeyParams, out_creationResult->keyBlob);
+        auto cert = getCertificate(keyParams, out_creationResult->keyBlob);
         if (std::holds_alternative<KMV1::ErrorCode>(cert)) {
             auto code = std::get<KMV1::ErrorCode>(cert);
             // We return OK in successful cases that do not generate a certificate.
@@ -505,12 +741,36 @@ ScopedAStatus KeyMintDevice::generateKey(const std::vector<KeyParameter>& inKeyP
 ScopedAStatus KeyMintDevice::importKey(const std::vector<KeyParameter>& inKeyParams,
                                        KeyFormat in_inKeyFormat,
                                        const std::vector<uint8_t>& in_inKeyData,
-                                       const std::optional<AttestationKey>& /* in_attestationKey */,
+                                       const std::optional<AttestationKey>& in_attestationKey,
                                        KeyCreationResult* out_creationResult) {
-    auto legacyKeyGENParams = convertKeyParametersToLegacy(extractGenerationParams(inKeyParams));
-    auto legacyKeyFormat = convertKeyFormatToLegacy(in_inKeyFormat);
+    return CompatCallStats::getInstance().track(CompatCall::IMPORT_KEY, [&] {
+        return importKeyImpl(inKeyParams, in_inKeyFormat, in_inKeyData, in_attestationKey,
+                             out_creationResult);
+    });
+}
+
+ScopedAStatus
+KeyMintDevice::importKeyImpl(const std::vector<KeyParameter>& inKeyParams, KeyFormat in_inKeyFormat,
+                             const std::vector<uint8_t>& in_inKeyData,
+                             const std::optional<AttestationKey>& /* in_attestationKey */,
+                             KeyCreationResult* out_creationResult) {
+    KeyCreationParams keyParams(inKeyParams);
+    auto errorCode = importLegacyKey(keyParams, in_inKeyFormat, in_inKeyData, out_creationResult);
+    if (errorCode == KMV1::ErrorCode::OK) {
+        errorCode = certifyImportedKey(keyParams, out_creationResult);
+    }
+    return convertErrorCode(errorCode);
+}
+
+KMV1::ErrorCode KeyMintDevice::importLegacyKey(const KeyCreationParams& keyParams,
+                                               KeyFormat keyFormat,
+                                               const std::vector<uint8_t>& keyData,
+                                               KeyCreationResult* out_creationResult) {
+    auto legacyKeyGENParams = convertKeyParametersToLegacy(keyParams.generationParams());
+    auto legacyKeyFormat = convertKeyFormatToLegacy(keyFormat);
     KMV1::ErrorCode errorCode;
-    auto result = mDevice->importKey(legacyKeyGENParams, legacyKeyFormat, in_inKeyData,
+    auto result = mDevice->importKey(legacyKeyGENParams, legacyKeyFormat,
+                                     makeHidlView(keyData.data(), keyData.size()),
                                      [&](V4_0_ErrorCode error, const hidl_vec<uint8_t>& keyBlob,
                                          const V4_0_KeyCharacteristics& keyCharacteristics) {
                                          errorCode = convert(error);
@@ -518,26 +778,62 @@ ScopedAStatus KeyMintDevice::importKey(const std::vector<KeyParameter>& inKeyPar
                                              keyBlobPrefix(keyBlob, false);
                                          out_creationResult->keyCharacteristics =
                                              processLegacyCharacteristics(
-                                                 securityLevel_, inKeyParams, keyCharacteristics);
+                                                 securityLevel_,
+                                                 keyParams.newAndKeystoreEnforceableParams(),
+                                                 keyCharacteristics);
                                      });
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
-        return convertErrorCode(KMV1::ErrorCode::UNKNOWN_ERROR);
+        return KMV1::ErrorCode::UNKNOWN_ERROR;
     }
-    if (errorCode == KMV1::ErrorCode::OK) {
-        auto cert = getCertificate(inKeyParams, out_creationResult->keyBlob);
-        if (std::holds_alternative<KMV1::ErrorCode>(cert)) {
-            auto code = std::get<KMV1::ErrorCode>(cert);
-            // We return OK in successful cases that do not generate a certificate.
-            if (code != KMV1::ErrorCode::OK) {
-                errorCode = code;
-                deleteKey(out_creationResult->keyBlob);
-            }
-        } else {
-            out_creationResult->certificateChain = std::get<std::vector<Certificate>>(cert);
+    return errorCode;
+}
+
+KMV1::ErrorCode KeyMintDevice::certifyImportedKey(const KeyCreationParams& keyParams,
+                                                  KeyCreationResult* out_creationResult) {
+    auto cert = getCertificate(keyParams, out_creationResult->keyBlob);
+    if (std::holds_alternative<KMV1::ErrorCode>(cert)) {
+        auto code = std::get<KMV1::ErrorCode>(cert);
+        // We return OK in successful cases that do not generate a certificate.
+        if (code != KMV1::ErrorCode::OK) {
+            deleteKey(out_creationResult->keyBlob);
+        }
+        return code;
+    }
+    out_creationResult->certificateChain = std::get<std::vector<Certificate>>(cert);
+    return KMV1::ErrorCode::OK;
+}
+
+std::vector<ScopedAStatus>
+KeyMintDevice::importKeys(const std::vector<ImportKeyRequest>& requests,
+                          std::vector<KeyCreationResult>* results) {
+    results->clear();
+    results->resize(requests.size());
+    std::vector<KMV1::ErrorCode> errorCodes(requests.size());
+    // Certifies the previous key while the current one is imported. Certificates are made one
+    // at a time, so at most two HAL calls of a batch are in flight.
+    std::future<void> certifying;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        // The parameters refer to the request, which outlives them.
+        auto keyParams = std::make_unique<KeyCreationParams>(requests[i].keyParams);
+        errorCodes[i] = importLegacyKey(*keyParams, requests[i].keyFormat, requests[i].keyData,
+                                        &(*results)[i]);
+        if (certifying.valid()) certifying.get();
+        if (errorCodes[i] == KMV1::ErrorCode::OK) {
+            certifying = std::async(std::launch::async, [this, i, results, &errorCodes,
+                                                         keyParams = std::move(keyParams)] {
+                errorCodes[i] = certifyImportedKey(*keyParams, &(*results)[i]);
+            });
         }
     }
-    return convertErrorCode(errorCode);
+    if (certifying.valid()) certifying.get();
+
+    std::vector<ScopedAStatus> statuses;
+    statuses.reserve(requests.size());
+    for (auto errorCode : errorCodes) {
+        statuses.push_back(convertErrorCode(errorCode));
+    }
+    return statuses;
 }
 
 ScopedAStatus
@@ -547,9 +843,8 @@ KeyMintDevice::importWrappedKey(const std::vector<uint8_t>& in_inWrappedKeyData,
                                 const std::vector<KeyParameter>& in_inUnwrappingParams,
                                 int64_t in_inPasswordSid, int64_t in_inBiometricSid,
                                 KeyCreationResult* out_creationResult) {
-    const std::vector<uint8_t>& wrappingKeyBlob =
-        prefixedKeyBlobRemovePrefix(in_inPrefixedWrappingKeyBlob);
-    if (prefixedKeyBlobIsSoftKeyMint(in_inPrefixedWrappingKeyBlob)) {
+    auto [wrappingKeyBlob, isSoftware] = dissectPrefixedKeyBlobView(in_inPrefixedWrappingKeyBlob);
+    if (isSoftware) {
         return softKeyMintDevice_->importWrappedKey(
             in_inWrappedKeyData, wrappingKeyBlob, in_inMaskingKey, in_inUnwrappingParams,
             in_inPasswordSid, in_inBiometricSid, out_creationResult);
@@ -558,7 +853,8 @@ KeyMintDevice::importWrappedKey(const std::vector<uint8_t>& in_inWrappedKeyData,
     auto legacyUnwrappingParams = convertKeyParametersToLegacy(in_inUnwrappingParams);
     KMV1::ErrorCode errorCode;
     auto result = mDevice->importWrappedKey(
-        in_inWrappedKeyData, wrappingKeyBlob, in_inMaskingKey, legacyUnwrappingParams,
+        makeHidlView(in_inWrappedKeyData.data(), in_inWrappedKeyData.size()), wrappingKeyBlob,
+        makeHidlView(in_inMaskingKey.data(), in_inMaskingKey.size()), legacyUnwrappingParams,
         in_inPasswordSid, in_inBiometricSid,
         [&](V4_0_ErrorCode error, const hidl_vec<uint8_t>& keyBlob,
             const V4_0_KeyCharacteristics& keyCharacteristics) {
@@ -580,8 +876,9 @@ ScopedAStatus KeyMintDevice::upgradeKey(const std::vector<uint8_t>& in_inKeyBlob
     auto legacyUpgradeParams = convertKeyParametersToLegacy(in_inUpgradeParams);
     V4_0_ErrorCode errorCode;
 
+    auto [keyBlob, isSoftware] = dissectPrefixedKeyBlobView(in_inKeyBlobToUpgrade);
     auto result =
-        mDevice->upgradeKey(prefixedKeyBlobRemovePrefix(in_inKeyBlobToUpgrade), legacyUpgradeParams,
+        mDevice->upgradeKey(keyBlob, legacyUpgradeParams,
                             [&](V4_0_ErrorCode error, const hidl_vec<uint8_t>& upgradedKeyBlob) {
                                 errorCode = error;
                                 *_aidl_return = keyBlobPrefix(upgradedKeyBlob, false);
@@ -590,15 +887,69 @@ ScopedAStatus KeyMintDevice::upgradeKey(const std::vector<uint8_t>& in_inKeyBlob
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
         return convertErrorCode(KMV1::ErrorCode::UNKNOWN_ERROR);
     }
+    if (errorCode == V4_0_ErrorCode::OK) {
+        mKeyCharacteristicsCache.invalidate(keyBlob);
+    }
     return convertErrorCode(errorCode);
 }
 
+std::future<void> KeyMintDevice::upgradeKeys(std::vector<std::vector<uint8_t>> prefixedKeyBlobs,
+                                             std::vector<KeyParameter> upgradeParams,
+                                             uint32_t maxUpgradesPerSecond,
+                                             KeyUpgradeCallback onUpgraded) {
+    mNumKeyUpgradesQueued.fetch_add(prefixedKeyBlobs.size(), std::memory_order_relaxed);
+    std::promise<void> done;
+    auto future = done.get_future();
+    // The thread holds a reference to the device, so the batch outlives the caller's.
+    std::thread([self = ref<KeyMintDevice>(), prefixedKeyBlobs = std::move(prefixedKeyBlobs),
+                 upgradeParams = std::move(upgradeParams), maxUpgradesPerSecond,
+                 onUpgraded = std::move(onUpgraded), done = std::move(done)]() mutable {
+        using std::chrono::steady_clock;
+        auto interval = maxUpgradesPerSecond == 0
+                            ? steady_clock::duration::zero()
+                            : std::chrono::duration_cast<steady_clock::duration>(
+                                  std::chrono::seconds(1)) /
+                                  maxUpgradesPerSecond;
+        auto nextStart = steady_clock::now();
+        for (size_t i = 0; i < prefixedKeyBlobs.size(); ++i) {
+            std::this_thread::sleep_until(nextStart);
+            auto start = steady_clock::now();
+            nextStart = start + interval;
+
+            std::vector<uint8_t> upgradedKeyBlob;
+            auto status = self->upgradeKey(prefixedKeyBlobs[i], upgradeParams, &upgradedKeyBlob);
+            auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 steady_clock::now() - start)
+                                 .count();
+            self->mTotalKeyUpgradeTimeUs.fetch_add(elapsedUs, std::memory_order_relaxed);
+            (status.isOk() ? self->mNumKeysUpgraded : self->mNumKeyUpgradesFailed)
+                .fetch_add(1, std::memory_order_relaxed);
+            if (onUpgraded) {
+                onUpgraded(i, status, status.isOk() ? std::move(upgradedKeyBlob)
+                                                    : std::vector<uint8_t>());
+            }
+        }
+        done.set_value();
+    }).detach();
+    return future;
+}
+
+KeyUpgradeProgress KeyMintDevice::getKeyUpgradeProgress() {
+    KeyUpgradeProgress progress;
+    progress.numQueued = mNumKeyUpgradesQueued.load(std::memory_order_relaxed);
+    progress.numUpgraded = mNumKeysUpgraded.load(std::memory_order_relaxed);
+    progress.numFailed = mNumKeyUpgradesFailed.load(std::memory_order_relaxed);
+    progress.totalUpgradeTimeUs = mTotalKeyUpgradeTimeUs.load(std::memory_order_relaxed);
+    return progress;
+}
+
 ScopedAStatus KeyMintDevice::deleteKey(const std::vector<uint8_t>& prefixedKeyBlob) {
-    const std::vector<uint8_t>& keyBlob = prefixedKeyBlobRemovePrefix(prefixedKeyBlob);
-    if (prefixedKeyBlobIsSoftKeyMint(prefixedKeyBlob)) {
+    auto [keyBlob, isSoftware] = dissectPrefixedKeyBlobView(prefixedKeyBlob);
+    if (isSoftware) {
         return softKeyMintDevice_->deleteKey(keyBlob);
     }
 
+    mKeyCharacteristicsCache.invalidate(keyBlob);
     auto result = mDevice->deleteKey(keyBlob);
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
@@ -608,6 +959,7 @@ ScopedAStatus KeyMintDevice::deleteKey(const std::vector<uint8_t>& prefixedKeyBl
 }
 
 ScopedAStatus KeyMintDevice::deleteAllKeys() {
+    mKeyCharacteristicsCache.clear();
     auto result = mDevice->deleteAllKeys();
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
@@ -627,20 +979,43 @@ ScopedAStatus KeyMintDevice::begin(KeyPurpose in_inPurpose,
                                    const std::vector<KeyParameter>& in_inParams,
                                    const std::optional<HardwareAuthToken>& in_inAuthToken,
                                    BeginResult* _aidl_return) {
+    return CompatCallStats::getInstance().track(CompatCall::BEGIN, [&] {
+        return beginImpl(in_inPurpose, prefixedKeyBlob, in_inParams, in_inAuthToken,
+                         false /* waitForLane */, _aidl_return);
+    });
+}
+
+ScopedAStatus KeyMintDevice::beginImpl(KeyPurpose in_inPurpose,
+                                       const std::vector<uint8_t>& prefixedKeyBlob,
+                                       const std::vector<KeyParameter>& in_inParams,
+                                       const std::optional<HardwareAuthToken>& in_inAuthToken,
+                                       bool waitForLane, BeginResult* _aidl_return) {
     if (!mOperationSlots.claimSlot()) {
         return convertErrorCode(V4_0_ErrorCode::TOO_MANY_OPERATIONS);
     }
 
-    const std::vector<uint8_t>& in_inKeyBlob = prefixedKeyBlobRemovePrefix(prefixedKeyBlob);
-    if (prefixedKeyBlobIsSoftKeyMint(prefixedKeyBlob)) {
+    auto [in_inKeyBlob, isSoftware] = dissectPrefixedKeyBlobView(prefixedKeyBlob);
+    if (isSoftware) {
         return softKeyMintDevice_->begin(in_inPurpose, in_inKeyBlob, in_inParams, in_inAuthToken,
                                          _aidl_return);
     }
 
+    // A new operation on a busy HAL is turned away like one without a slot, which keystore2
+    // already knows how to handle.
+    CallLane::Entry laneEntry(&mCallLane, waitForLane);
+    if (!laneEntry.entered()) {
+        mOperationSlots.freeSlot();
+        return convertErrorCode(V4_0_ErrorCode::TOO_MANY_OPERATIONS);
+    }
+
     auto legacyPurpose =
         static_cast<::android::hardware::keymaster::V4_0::KeyPurpose>(in_inPurpose);
     auto legacyParams = convertKeyParametersToLegacy(in_inParams);
     auto legacyAuthToken = convertAuthTokenToLegacy(in_inAuthToken);
+    // Only symmetric ciphers take a block mode. The operation uses this to size its output.
+    bool hasBlockMode =
+        std::any_of(in_inParams.begin(), in_inParams.end(),
+                    [](const KeyParameter& param) { return param.tag == Tag::BLOCK_MODE; });
     KMV1::ErrorCode errorCode;
     auto result = mDevice->begin(
         legacyPurpose, in_inKeyBlob, legacyParams, legacyAuthToken,
@@ -649,8 +1024,17 @@ ScopedAStatus KeyMintDevice::begin(KeyPurpose in_inPurpose,
             errorCode = convert(error);
             _aidl_return->challenge = operationHandle;
             _aidl_return->params = convertKeyParametersFromLegacy(outParams);
-            _aidl_return->operation = ndk::SharedRefBase::make<KeyMintOperation>(
-                mDevice, operationHandle, &mOperationSlots, error == V4_0_ErrorCode::OK);
+            auto operation = ndk::SharedRefBase::make<KeyMintOperation>(
+                mDevice, operationHandle, &mOperationSlots, error == V4_0_ErrorCode::OK,
+                &mCallLane, in_inPurpose, hasBlockMode);
+            if (error == V4_0_ErrorCode::OK) {
+                std::lock_guard<std::mutex> lock(mOperationsMutex);
+                mOperations.erase(std::remove_if(mOperations.begin(), mOperations.end(),
+                                                 [](const auto& op) { return op.expired(); }),
+                                  mOperations.end());
+                mOperations.push_back(operation);
+            }
+            _aidl_return->operation = std::move(operation);
         });
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
@@ -699,8 +1083,7 @@ KeyMintDevice::convertStorageKeyToEphemeral(const std::vector<uint8_t>& prefixed
         return convertErrorCode(KMV1::ErrorCode::UNIMPLEMENTED);
     }
 
-    const std::vector<uint8_t>& storageKeyBlob =
-        prefixedKeyBlobRemovePrefix(prefixedStorageKeyBlob);
+    auto [storageKeyBlob, isSoftware] = dissectPrefixedKeyBlobView(prefixedStorageKeyBlob);
 
     auto hidlCb = [&](V4_0_ErrorCode ret, const hidl_vec<uint8_t>& exportedKeyBlob) {
         km_error = convert(ret);
@@ -727,14 +1110,19 @@ KeyMintDevice::convertStorageKeyToEphemeral(const std::vector<uint8_t>& prefixed
 ScopedAStatus KeyMintDevice::getKeyCharacteristics(
     const std::vector<uint8_t>& prefixedKeyBlob, const std::vector<uint8_t>& appId,
     const std::vector<uint8_t>& appData, std::vector<KeyCharacteristics>* keyCharacteristics) {
-    auto [strippedKeyBlob, isSoftware] = dissectPrefixedKeyBlob(prefixedKeyBlob);
+    auto [strippedKeyBlob, isSoftware] = dissectPrefixedKeyBlobView(prefixedKeyBlob);
     if (isSoftware) {
         return softKeyMintDevice_->getKeyCharacteristics(strippedKeyBlob, appId, appData,
                                                          keyCharacteristics);
     } else {
+        if (auto cached = mKeyCharacteristicsCache.get(strippedKeyBlob, appId, appData)) {
+            *keyCharacteristics = std::move(*cached);
+            return convertErrorCode(KMV1::ErrorCode::OK);
+        }
         KMV1::ErrorCode km_error;
         auto ret = mDevice->getKeyCharacteristics(
-            strippedKeyBlob, appId, appData,
+            strippedKeyBlob, makeHidlView(appId.data(), appId.size()),
+            makeHidlView(appData.data(), appData.size()),
             [&](V4_0_ErrorCode errorCode, const V4_0_KeyCharacteristics& v40KeyCharacteristics) {
                 km_error = convert(errorCode);
                 *keyCharacteristics =
@@ -749,6 +1137,8 @@ ScopedAStatus KeyMintDevice::getKeyCharacteristics(
         if (km_error != KMV1::ErrorCode::OK) {
             LOG(ERROR) << __func__
                        << " getKeyCharacteristics failed with code: " << toString(km_error);
+        } else {
+            mKeyCharacteristicsCache.put(strippedKeyBlob, appId, appData, *keyCharacteristics);
         }
 
         return convertErrorCode(km_error);
@@ -758,8 +1148,11 @@ ScopedAStatus KeyMintDevice::getKeyCharacteristics(
 ScopedAStatus KeyMintOperation::updateAad(const std::vector<uint8_t>& input,
                                           const std::optional<HardwareAuthToken>& optAuthToken,
                                           const std::optional<TimeStampToken>& optTimeStampToken) {
-    V4_0_HardwareAuthToken authToken = convertAuthTokenToLegacy(optAuthToken);
-    V4_0_VerificationToken verificationToken = convertTimestampTokenToLegacy(optTimeStampToken);
+    ActivityScope activity(this, input.size());
+    // This is an update call to the legacy HAL, so it takes the lane like update() does.
+    CallLane::Entry laneEntry(mCallLane, true /* wait */);
+    const V4_0_HardwareAuthToken& authToken = getLegacyAuthToken(optAuthToken);
+    const V4_0_VerificationToken& verificationToken = getLegacyTimestampToken(optTimeStampToken);
 
     KMV1::ErrorCode errorCode;
     auto result = mDevice->update(
@@ -776,8 +1169,33 @@ ScopedAStatus KeyMintOperation::updateAad(const std::vector<uint8_t>& input,
     return convertErrorCode(errorCode);
 }
 
-void KeyMintOperation::setUpdateBuffer(std::vector<uint8_t> data) {
-    mUpdateBuffer = std::move(data);
+const V4_0_HardwareAuthToken&
+KeyMintOperation::getLegacyAuthToken(const std::optional<HardwareAuthToken>& authToken) {
+    if (authToken != mLastAuthToken) {
+        mLegacyAuthToken = convertAuthTokenToLegacy(authToken);
+        mLastAuthToken = authToken;
+    }
+    return mLegacyAuthToken;
+}
+
+const V4_0_VerificationToken&
+KeyMintOperation::getLegacyTimestampToken(const std::optional<TimeStampToken>& timestampToken) {
+    if (timestampToken != mLastTimestampToken) {
+        mLegacyTimestampToken = convertTimestampTokenToLegacy(timestampToken);
+        mLastTimestampToken = timestampToken;
+    }
+    return mLegacyTimestampToken;
+}
+
+void KeyMintOperation::setUpdateBuffer(const uint8_t* data, size_t size) {
+    const uint8_t* bufferBegin = mUpdateBuffer.data();
+    if (!mUpdateBuffer.empty() && data >= bufferBegin &&
+        data <= bufferBegin + mUpdateBuffer.size()) {
+        // The data is a tail of mUpdateBuffer, so just drop what was consumed in front of it.
+        mUpdateBuffer.erase(mUpdateBuffer.begin(), mUpdateBuffer.begin() + (data - bufferBegin));
+    } else {
+        mUpdateBuffer.assign(data, data + size);
+    }
 }
 
 const std::vector<uint8_t>&
@@ -790,29 +1208,61 @@ KeyMintOperation::getExtendedUpdateBuffer(const std::vector<uint8_t>& suffix) {
     }
 }
 
-ScopedAStatus KeyMintOperation::update(const std::vector<uint8_t>& input_raw,
+// Largest block size of the symmetric ciphers, which is also the largest GCM tag.
+static const size_t kMaxCipherBlockSize = 16;
+// Largest output of a single RSA operation, for 4096-bit keys. Also covers EC and HMAC.
+static const size_t kMaxAsymmetricOutputSize = 512;
+
+size_t KeyMintOperation::estimateOutputSize(size_t inputSize, bool isFinish) const {
+    bool isCipher = mPurpose == KeyPurpose::ENCRYPT || mPurpose == KeyPurpose::DECRYPT;
+    if (isCipher && mHasBlockMode) {
+        // The HAL may hold back up to a block from earlier calls and release it now, and
+        // finish may add padding or a tag.
+        return inputSize + kMaxCipherBlockSize;
+    }
+    // Asymmetric operations and MACs only produce output on finish.
+    return isFinish ? kMaxAsymmetricOutputSize : 0;
+}
+
+ScopedAStatus KeyMintOperation::update(const std::vector<uint8_t>& input,
                                        const std::optional<HardwareAuthToken>& optAuthToken,
                                        const std::optional<TimeStampToken>& optTimeStampToken,
                                        std::vector<uint8_t>* out_output) {
-    V4_0_HardwareAuthToken authToken = convertAuthTokenToLegacy(optAuthToken);
-    V4_0_VerificationToken verificationToken = convertTimestampTokenToLegacy(optTimeStampToken);
+    return CompatCallStats::getInstance().track(CompatCall::UPDATE, [&] {
+        // A call waiting for the lane counts as busy too.
+        ActivityScope activity(this, input.size());
+        CallLane::Entry laneEntry(mCallLane, true /* wait */);
+        return updateImpl(input, optAuthToken, optTimeStampToken, out_output);
+    });
+}
+
+ScopedAStatus KeyMintOperation::updateImpl(const std::vector<uint8_t>& input_raw,
+                                           const std::optional<HardwareAuthToken>& optAuthToken,
+                                           const std::optional<TimeStampToken>& optTimeStampToken,
+                                           std::vector<uint8_t>* out_output) {
+    const V4_0_HardwareAuthToken& authToken = getLegacyAuthToken(optAuthToken);
+    const V4_0_VerificationToken& verificationToken = getLegacyTimestampToken(optTimeStampToken);
 
     size_t inputPos = 0;
     *out_output = {};
     KMV1::ErrorCode errorCode = KMV1::ErrorCode::OK;
-    auto input = getExtendedUpdateBuffer(input_raw);
+    const std::vector<uint8_t>& input = getExtendedUpdateBuffer(input_raw);
+    out_output->reserve(estimateOutputSize(input.size(), false /* isFinish */));
 
     while (inputPos < input.size() && errorCode == KMV1::ErrorCode::OK) {
         uint32_t consumed = 0;
-        auto result =
-            mDevice->update(mOperationHandle, {} /* inParams */,
-                            {input.begin() + inputPos, input.end()}, authToken, verificationToken,
-                            [&](V4_0_ErrorCode error, uint32_t inputConsumed, auto /* outParams */,
-                                const hidl_vec<uint8_t>& output) {
-                                errorCode = convert(error);
-                                out_output->insert(out_output->end(), output.begin(), output.end());
-                                consumed = inputConsumed;
-                            });
+        // Hand the HAL a view of the remaining input, so that partial consumption does not
+        // copy the rest of the input on every round.
+        auto result = mDevice->update(
+            mOperationHandle, {} /* inParams */,
+            makeHidlView(input.data() + inputPos, input.size() - inputPos), authToken,
+            verificationToken,
+            [&](V4_0_ErrorCode error, uint32_t inputConsumed, auto /* outParams */,
+                const hidl_vec<uint8_t>& output) {
+                errorCode = convert(error);
+                out_output->insert(out_output->end(), output.begin(), output.end());
+                consumed = inputConsumed;
+            });
 
         if (!result.isOk()) {
             LOG(ERROR) << __func__ << " transaction failed. " << result.description();
@@ -823,11 +1273,13 @@ ScopedAStatus KeyMintOperation::update(const std::vector<uint8_t>& input_raw,
             // Some very old KM implementations do not buffer sub blocks in certain block modes,
             // instead, the simply return consumed == 0. So we buffer the input here in the
             // hope that we complete the bock in a future call to update.
-            setUpdateBuffer({input.begin() + inputPos, input.end()});
+            setUpdateBuffer(input.data() + inputPos, input.size() - inputPos);
             return convertErrorCode(errorCode);
         }
         inputPos += consumed;
     }
+    // Everything that was buffered has been consumed. Keep the storage for the next round.
+    mUpdateBuffer.clear();
 
     if (errorCode != KMV1::ErrorCode::OK) mOperationSlot.freeSlot();
 
@@ -841,24 +1293,49 @@ KeyMintOperation::finish(const std::optional<std::vector<uint8_t>>& in_input,
                          const std::optional<TimeStampToken>& in_timeStampToken,
                          const std::optional<std::vector<uint8_t>>& in_confirmationToken,
                          std::vector<uint8_t>* out_output) {
-    auto input_raw = in_input.value_or(std::vector<uint8_t>());
-    auto input = getExtendedUpdateBuffer(input_raw);
-    auto signature = in_signature.value_or(std::vector<uint8_t>());
-    V4_0_HardwareAuthToken authToken = convertAuthTokenToLegacy(in_authToken);
-    V4_0_VerificationToken verificationToken = convertTimestampTokenToLegacy(in_timeStampToken);
+    return CompatCallStats::getInstance().track(CompatCall::FINISH, [&] {
+        ActivityScope activity(this, in_input ? in_input->size() : 0);
+        CallLane::Entry laneEntry(mCallLane, true /* wait */);
+        return finishImpl(in_input, in_signature, in_authToken, in_timeStampToken,
+                          in_confirmationToken, out_output);
+    });
+}
+
+ScopedAStatus
+KeyMintOperation::finishImpl(const std::optional<std::vector<uint8_t>>& in_input,
+                             const std::optional<std::vector<uint8_t>>& in_signature,
+                             const std::optional<HardwareAuthToken>& in_authToken,
+                             const std::optional<TimeStampToken>& in_timeStampToken,
+                             const std::optional<std::vector<uint8_t>>& in_confirmationToken,
+                             std::vector<uint8_t>* out_output) {
+    const std::vector<uint8_t>& input =
+        in_input ? getExtendedUpdateBuffer(*in_input) : mUpdateBuffer;
+    const V4_0_HardwareAuthToken& authToken = getLegacyAuthToken(in_authToken);
+    const V4_0_VerificationToken& verificationToken = getLegacyTimestampToken(in_timeStampToken);
 
     std::vector<V4_0_KeyParameter> inParams;
     if (in_confirmationToken) {
         inParams.push_back(makeKeyParameter(V4_0::TAG_CONFIRMATION_TOKEN, *in_confirmationToken));
     }
 
+    hidl_vec<uint8_t> signature;
+    if (in_signature) {
+        signature = makeHidlView(in_signature->data(), in_signature->size());
+    }
+
+    // The HIDL callback only lends us its buffer, so copy it once into storage that is
+    // already large enough, instead of going through a temporary vector.
+    out_output->clear();
+    out_output->reserve(estimateOutputSize(input.size(), true /* isFinish */));
     KMV1::ErrorCode errorCode;
     auto result = mDevice->finish(
-        mOperationHandle, inParams, input, signature, authToken, verificationToken,
+        mOperationHandle, inParams, makeHidlView(input.data(), input.size()), signature,
+        authToken, verificationToken,
         [&](V4_0_ErrorCode error, auto /* outParams */, const hidl_vec<uint8_t>& output) {
             errorCode = convert(error);
-            *out_output = output;
+            out_output->assign(output.begin(), output.end());
         });
+    mUpdateBuffer.clear();
 
     mOperationSlot.freeSlot();
     if (!result.isOk()) {
@@ -869,6 +1346,8 @@ KeyMintOperation::finish(const std::optional<std::vector<uint8_t>>& in_input,
 }
 
 ScopedAStatus KeyMintOperation::abort() {
+    ActivityScope activity(this, 0);
+    CallLane::Entry laneEntry(mCallLane, true /* wait */);
     auto result = mDevice->abort(mOperationHandle);
     mOperationSlot.freeSlot();
     if (!result.isOk()) {
@@ -878,6 +1357,33 @@ ScopedAStatus KeyMintOperation::abort() {
     return convertErrorCode(result);
 }
 
+int64_t KeyMintOperation::steadyClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+KeyMintOperation::ActivityScope::ActivityScope(KeyMintOperation* operation, size_t inputSize)
+    : mOperation(operation) {
+    mOperation->mCallsInHal++;
+    mOperation->mBytesProcessed += inputSize;
+}
+
+KeyMintOperation::ActivityScope::~ActivityScope() {
+    mOperation->mLastActivityNs = steadyClockNs();
+    mOperation->mCallsInHal--;
+}
+
+OperationActivity KeyMintOperation::getActivity() const {
+    OperationActivity activity;
+    activity.challenge = static_cast<int64_t>(mOperationHandle);
+    int64_t idleNs = std::max<int64_t>(steadyClockNs() - mLastActivityNs, 0);
+    activity.idleMillis = idleNs / 1000000;
+    activity.bytesProcessed = mBytesProcessed;
+    activity.busy = mCallsInHal != 0;
+    return activity;
+}
+
 KeyMintOperation::~KeyMintOperation() {
     if (mOperationSlot.hasSlot()) {
         auto error = abort();
@@ -889,56 +1395,85 @@ KeyMintOperation::~KeyMintOperation() {
 
 // SecureClock implementation
 
-ScopedAStatus SecureClock::generateTimeStamp(int64_t in_challenge, TimeStampToken* _aidl_return) {
-    KMV1::ErrorCode errorCode;
+void SecureClock::requestTimeStamp(int64_t challenge, PendingTimeStamp* pending) {
     auto result = mDevice->verifyAuthorization(
-        in_challenge, {}, V4_0_HardwareAuthToken(),
+        challenge, {}, V4_0_HardwareAuthToken(),
         [&](V4_0_ErrorCode error, const V4_0_VerificationToken& token) {
-            errorCode = convert(error);
-            _aidl_return->challenge = token.challenge;
-            _aidl_return->timestamp.milliSeconds = token.timestamp;
-            _aidl_return->mac = token.mac;
+            pending->errorCode = convert(error);
+            pending->token.challenge = token.challenge;
+            pending->token.timestamp.milliSeconds = token.timestamp;
+            pending->token.mac = token.mac;
         });
     if (!result.isOk()) {
         LOG(ERROR) << __func__ << " transaction failed. " << result.description();
-        errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
+        pending->errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
     }
-    return convertErrorCode(errorCode);
+}
+
+ScopedAStatus SecureClock::generateTimeStamp(int64_t in_challenge, TimeStampToken* _aidl_return) {
+    return CompatCallStats::getInstance().track(CompatCall::GENERATE_TIMESTAMP, [&] {
+        std::unique_lock<std::mutex> lock(mPendingMutex);
+        auto [it, inserted] = mPending.try_emplace(in_challenge);
+        if (inserted) {
+            auto pending = std::make_shared<PendingTimeStamp>();
+            it->second = pending;
+            lock.unlock();
+            requestTimeStamp(in_challenge, pending.get());
+            lock.lock();
+            pending->done = true;
+            mPending.erase(in_challenge);
+            mPendingDone.notify_all();
+            *_aidl_return = pending->token;
+            return convertErrorCode(pending->errorCode);
+        }
+        // The token of the call in flight is at most one round-trip older than one from a call
+        // of our own would be, which is fine for checking timeouts.
+        auto pending = it->second;
+        mPendingDone.wait(lock, [&] { return pending->done; });
+        *_aidl_return = pending->token;
+        return convertErrorCode(pending->errorCode);
+    });
 }
 
 // SharedSecret implementation
 
+// The legacy devices don't share any state with each other, so keystore2 negotiates with all of
+// them concurrently. Both calls are tracked so the per-device latency shows up in dumpsys.
 ScopedAStatus SharedSecret::getSharedSecretParameters(SharedSecretParameters* _aidl_return) {
-    KMV1::ErrorCode errorCode;
-    auto result = mDevice->getHmacSharingParameters(
-        [&](V4_0_ErrorCode error, const V4_0_HmacSharingParameters& params) {
-            errorCode = convert(error);
-            _aidl_return->seed = params.seed;
-            std::copy(params.nonce.data(), params.nonce.data() + params.nonce.elementCount(),
-                      std::back_inserter(_aidl_return->nonce));
-        });
-    if (!result.isOk()) {
-        LOG(ERROR) << __func__ << " transaction failed. " << result.description();
-        errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
-    }
-    return convertErrorCode(errorCode);
+    return CompatCallStats::getInstance().track(CompatCall::GET_SHARED_SECRET_PARAMETERS, [&] {
+        KMV1::ErrorCode errorCode;
+        auto result = mDevice->getHmacSharingParameters(
+            [&](V4_0_ErrorCode error, const V4_0_HmacSharingParameters& params) {
+                errorCode = convert(error);
+                _aidl_return->seed = params.seed;
+                std::copy(params.nonce.data(), params.nonce.data() + params.nonce.elementCount(),
+                          std::back_inserter(_aidl_return->nonce));
+            });
+        if (!result.isOk()) {
+            LOG(ERROR) << __func__ << " transaction failed. " << result.description();
+            errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
+        }
+        return convertErrorCode(errorCode);
+    });
 }
 
 ScopedAStatus
 SharedSecret::computeSharedSecret(const std::vector<SharedSecretParameters>& in_params,
                                   std::vector<uint8_t>* _aidl_return) {
-    KMV1::ErrorCode errorCode;
-    auto legacyParams = convertSharedSecretParametersToLegacy(in_params);
-    auto result = mDevice->computeSharedHmac(
-        legacyParams, [&](V4_0_ErrorCode error, const hidl_vec<uint8_t>& sharingCheck) {
-            errorCode = convert(error);
-            *_aidl_return = sharingCheck;
-        });
-    if (!result.isOk()) {
-        LOG(ERROR) << __func__ << " transaction failed. " << result.description();
-        errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
-    }
-    return convertErrorCode(errorCode);
+    return CompatCallStats::getInstance().track(CompatCall::COMPUTE_SHARED_SECRET, [&] {
+        KMV1::ErrorCode errorCode;
+        auto legacyParams = convertSharedSecretParametersToLegacy(in_params);
+        auto result = mDevice->computeSharedHmac(
+            legacyParams, [&](V4_0_ErrorCode error, const hidl_vec<uint8_t>& sharingCheck) {
+                errorCode = convert(error);
+                *_aidl_return = sharingCheck;
+            });
+        if (!result.isOk()) {
+            LOG(ERROR) << __func__ << " transaction failed. " << result.description();
+            errorCode = KMV1::ErrorCode::UNKNOWN_ERROR;
+        }
+        return convertErrorCode(errorCode);
+    });
 }
 
 // Certificate implementation
@@ -955,8 +1490,16 @@ static auto getParam(const std::vector<KeyParameter>& keyParams, KMV1::TypedTag<
     return {};
 }
 
-template <typename T>
-static bool containsParam(const std::vector<KeyParameter>& keyParams, T ttag) {
+template <KMV1::Tag tag, KMV1::TagType type>
+static auto getParam(const KeyCreationParams& keyParams, KMV1::TypedTag<type, tag> ttag)
+    -> decltype(authorizationValue(ttag, KeyParameter())) {
+    if (auto param = keyParams.find(tag)) {
+        return authorizationValue(ttag, *param);
+    }
+    return {};
+}
+
+template <typename Params, typename T> static bool containsParam(const Params& keyParams, T ttag) {
     return static_cast<bool>(getParam(keyParams, ttag));
 }
 
@@ -985,7 +1528,7 @@ getMaximum(const std::vector<KeyParameter>& keyParams, T tag,
 }
 
 static std::variant<keystore::X509_Ptr, KMV1::ErrorCode>
-makeCert(::android::sp<Keymaster> mDevice, const std::vector<KeyParameter>& keyParams,
+makeCert(::android::sp<Keymaster> mDevice, const KeyCreationParams& keyParams,
          const std::vector<uint8_t>& keyBlob) {
     // Start generating the certificate.
     // Get public key for makeCert.
@@ -1015,7 +1558,11 @@ makeCert(::android::sp<Keymaster> mDevice, const std::vector<KeyParameter>& keyP
     // Get pkey for makeCert.
     CBS cbs;
     CBS_init(&cbs, key.data(), key.size());
-    auto pkey = EVP_parse_public_key(&cbs);
+    keystore::EVP_PKEY_Ptr pkey(EVP_parse_public_key(&cbs));
+    if (!pkey) {
+        LOG(ERROR) << __func__ << ": Failed to parse exported public key";
+        return KMV1::ErrorCode::UNKNOWN_ERROR;
+    }
 
     // makeCert
     std::optional<std::reference_wrapper<const std::vector<uint8_t>>> subject;
@@ -1043,7 +1590,7 @@ makeCert(::android::sp<Keymaster> mDevice, const std::vector<KeyParameter>& keyP
     }
 
     auto certOrError = keystore::makeCert(
-        pkey, serial, subject, activation, expiration, false /* intentionally left blank */,
+        pkey.get(), serial, subject, activation, expiration, false /* intentionally left blank */,
         std::nullopt /* intentionally left blank */, std::nullopt /* intentionally left blank */);
     if (std::holds_alternative<keystore::CertUtilsError>(certOrError)) {
         LOG(ERROR) << __func__ << ": Failed to make certificate";
@@ -1052,6 +1599,28 @@ makeCert(::android::sp<Keymaster> mDevice, const std::vector<KeyParameter>& keyP
     return std::move(std::get<keystore::X509_Ptr>(certOrError));
 }
 
+// Returns the key used to sign certificates of keys that cannot sign their own. Nobody can verify
+// these certificates, so one key per process serves as well as one per certificate and saves an
+// EC key generation on every generateKey and importKey. Returns nullptr if key generation fails;
+// the next call tries again. The key and its mutex are never destroyed, because the detached
+// warm-up thread started by the KeyMintDevice constructor may still be using them at exit.
+static EVP_PKEY* getEphemeralSigningKey() {
+    static std::mutex* mutex = new std::mutex();
+    static EVP_PKEY* key = nullptr;
+    std::lock_guard<std::mutex> lock(*mutex);
+    if (!key) {
+        keystore::EVP_PKEY_CTX_Ptr pkey_ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL));
+        EVP_PKEY* pkey_ptr = nullptr;
+        if (pkey_ctx && EVP_PKEY_keygen_init(pkey_ctx.get()) &&
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pkey_ctx.get(), NID_X9_62_prime256v1) &&
+            EVP_PKEY_keygen(pkey_ctx.get(), &pkey_ptr)) {
+            key = pkey_ptr;
+        }
+    }
+    // The key is never replaced or freed once set, so handing out the raw pointer is safe.
+    return key;
+}
+
 static std::variant<keystore::Algo, KMV1::ErrorCode> getKeystoreAlgorithm(Algorithm algorithm) {
     switch (algorithm) {
     case Algorithm::RSA:
@@ -1096,7 +1665,8 @@ static std::variant<keystore::Digest, KMV1::ErrorCode> getKeystoreDigest(Digest
 
 std::optional<KMV1::ErrorCode>
 KeyMintDevice::signCertificate(const std::vector<KeyParameter>& keyParams,
-                               const std::vector<uint8_t>& prefixedKeyBlob, X509* cert) {
+                               const std::vector<uint8_t>& prefixedKeyBlob, X509* cert,
+                               std::vector<uint8_t>* encodedCert) {
 
     auto algorithm = getParam(keyParams, KMV1::TAG_ALGORITHM);
     auto algoOrError = getKeystoreAlgorithm(*algorithm);
@@ -1121,7 +1691,7 @@ KeyMintDevice::signCertificate(const std::vector<KeyParameter>& keyParams,
     auto digest = std::get<keystore::Digest>(digestOrError);
 
     KMV1::ErrorCode errorCode = KMV1::ErrorCode::OK;
-    auto error = keystore::signCertWith(
+    auto encodedCertOrError = keystore::signAndEncodeCertWith(
         &*cert,
         [&](const uint8_t* data, size_t len) {
             std::vector<uint8_t> dataVec(data, data + len);
@@ -1132,8 +1702,10 @@ KeyMintDevice::signCertificate(const std::vector<KeyParameter>& keyParams,
                 kps.push_back(KMV1::makeKeyParameter(KMV1::TAG_PADDING, origPadding));
             }
             BeginResult beginResult;
-            auto error =
-                begin(KeyPurpose::SIGN, prefixedKeyBlob, kps, HardwareAuthToken(), &beginResult);
+            // This runs within generateKey or importKey, which must not fail just because the
+            // call lane is busy.
+            auto error = beginImpl(KeyPurpose::SIGN, prefixedKeyBlob, kps, HardwareAuthToken(),
+                                   true /* waitForLane */, &beginResult);
             if (!error.isOk()) {
                 errorCode = toErrorCode(error);
                 return std::vector<uint8_t>();
@@ -1153,19 +1725,20 @@ KeyMintDevice::signCertificate(const std::vector<KeyParameter>& keyParams,
             return result;
         },
         algo, padding, digest);
-    if (error) {
-        LOG(ERROR) << __func__
-                   << ": signCertWith failed. (Callback diagnosed: " << toString(errorCode) << ")";
+    if (std::holds_alternative<keystore::CertUtilsError>(encodedCertOrError)) {
+        LOG(ERROR) << __func__ << ": signAndEncodeCertWith failed. (Callback diagnosed: "
+                   << toString(errorCode) << ")";
         return KMV1::ErrorCode::UNKNOWN_ERROR;
     }
     if (errorCode != KMV1::ErrorCode::OK) {
         return errorCode;
     }
+    *encodedCert = std::move(std::get<std::vector<uint8_t>>(encodedCertOrError));
     return std::nullopt;
 }
 
 std::variant<std::vector<Certificate>, KMV1::ErrorCode>
-KeyMintDevice::getCertificate(const std::vector<KeyParameter>& keyParams,
+KeyMintDevice::getCertificate(const KeyCreationParams& keyParams,
                               const std::vector<uint8_t>& prefixedKeyBlob) {
     const std::vector<uint8_t>& keyBlob = prefixedKeyBlobRemovePrefix(prefixedKeyBlob);
 
@@ -1185,7 +1758,7 @@ KeyMintDevice::getCertificate(const std::vector<KeyParameter>& keyParams,
 
     // If attestation was requested, call and use attestKey.
     if (containsParam(keyParams, KMV1::TAG_ATTESTATION_CHALLENGE)) {
-        auto legacyParams = convertKeyParametersToLegacy(extractAttestationParams(keyParams));
+        auto legacyParams = convertKeyParametersToLegacy(keyParams.attestationParams());
         std::vector<Certificate> certs;
         KMV1::ErrorCode errorCode = KMV1::ErrorCode::OK;
         auto result = mDevice->attestKey(
@@ -1223,40 +1796,43 @@ KeyMintDevice::getCertificate(const std::vector<KeyParameter>& keyParams,
     }
 
     // Signing
+    const auto& allParams = keyParams.all();
     auto canSelfSign =
-        std::find_if(keyParams.begin(), keyParams.end(), [&](const KeyParameter& kp) {
+        std::find_if(allParams.begin(), allParams.end(), [&](const KeyParameter& kp) {
             if (auto v = KMV1::authorizationValue(KMV1::TAG_PURPOSE, kp)) {
                 return *v == KeyPurpose::SIGN;
             }
             return false;
-        }) != keyParams.end();
+        }) != allParams.end();
     auto noAuthRequired = containsParam(keyParams, KMV1::TAG_NO_AUTH_REQUIRED);
+    // Self signing produces the encoded certificate directly.
+    std::vector<uint8_t> encodedCert;
     // If we cannot sign because of purpose or authorization requirement,
     if (!(canSelfSign && noAuthRequired)
         // or if self signing fails for any other reason,
-        || signCertificate(keyParams, keyBlob, &*cert).has_value()) {
+        || signCertificate(allParams, keyBlob, &*cert, &encodedCert).has_value()) {
         // we sign with ephemeral key.
-        keystore::EVP_PKEY_CTX_Ptr pkey_ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL));
-        EVP_PKEY_keygen_init(pkey_ctx.get());
-        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pkey_ctx.get(), NID_X9_62_prime256v1);
-        EVP_PKEY* pkey_ptr = nullptr;
-        EVP_PKEY_keygen(pkey_ctx.get(), &pkey_ptr);
+        EVP_PKEY* pkey_ptr = getEphemeralSigningKey();
+        if (!pkey_ptr) {
+            LOG(ERROR) << __func__ << ": Failed to generate ephemeral signing key.";
+            return KMV1::ErrorCode::UNKNOWN_ERROR;
+        }
         error = keystore::signCert(&*cert, pkey_ptr);
         if (error) {
             LOG(ERROR) << __func__ << ": signCert failed.";
             return KMV1::ErrorCode::UNKNOWN_ERROR;
         }
-    }
 
-    // encodeCert
-    auto encodedCertOrError = keystore::encodeCert(&*cert);
-    if (std::holds_alternative<keystore::CertUtilsError>(encodedCertOrError)) {
-        LOG(ERROR) << __func__ << ": encodeCert failed.";
-        return KMV1::ErrorCode::UNKNOWN_ERROR;
+        // encodeCert
+        auto encodedCertOrError = keystore::encodeCert(&*cert);
+        if (std::holds_alternative<keystore::CertUtilsError>(encodedCertOrError)) {
+            LOG(ERROR) << __func__ << ": encodeCert failed.";
+            return KMV1::ErrorCode::UNKNOWN_ERROR;
+        }
+        encodedCert = std::move(std::get<std::vector<uint8_t>>(encodedCertOrError));
     }
 
-    Certificate certificate{.encodedCertificate =
-                                std::get<std::vector<uint8_t>>(encodedCertOrError)};
+    Certificate certificate{.encodedCertificate = std::move(encodedCert)};
     std::vector certificates = {certificate};
     return certificates;
 }
@@ -1303,53 +1879,73 @@ using keymasterNs::support::Keymaster4;
 
 template <typename Wrapper>
 KeymasterDevices enumerateKeymasterDevices(IServiceManager* serviceManager) {
-    KeymasterDevices result;
+    std::vector<std::string> names;
     serviceManager->listManifestByInterface(
-        Wrapper::WrappedIKeymasterDevice::descriptor, [&](const hidl_vec<hidl_string>& names) {
-            auto try_get_device = [&](const auto& name, bool fail_silent) {
-                auto device = Wrapper::WrappedIKeymasterDevice::getService(name);
-                if (fail_silent && !device) return;
-                CHECK(device) << "Failed to get service for \""
-                              << Wrapper::WrappedIKeymasterDevice::descriptor
-                              << "\" with interface name \"" << name << "\"";
-
-                sp<Keymaster> kmDevice(new Wrapper(device, name));
-                auto halVersion = kmDevice->halVersion();
-                SecurityLevel securityLevel = halVersion.securityLevel;
-                LOG(INFO) << "found " << Wrapper::WrappedIKeymasterDevice::descriptor
-                          << " with interface name " << name << " and seclevel "
-                          << toString(securityLevel);
-                CHECK(static_cast<uint32_t>(securityLevel) < result.size())
-                    << "Security level of \"" << Wrapper::WrappedIKeymasterDevice::descriptor
-                    << "\" with interface name \"" << name << "\" out of range";
-                auto& deviceSlot = result[securityLevel];
-                if (deviceSlot) {
-                    if (!fail_silent) {
-                        LOG(WARNING) << "Implementation of \""
-                                     << Wrapper::WrappedIKeymasterDevice::descriptor
-                                     << "\" with interface name \"" << name
-                                     << "\" and security level: " << toString(securityLevel)
-                                     << " Masked by other implementation of Keymaster";
-                    }
-                } else {
-                    deviceSlot = kmDevice;
-                }
-            };
-            bool has_default = false;
-            for (auto& n : names) {
-                try_get_device(n, false);
-                if (n == "default") has_default = true;
-            }
-            // Make sure that we always check the default device. If we enumerate only what is
-            // known to hwservicemanager, we miss a possible passthrough HAL.
-            if (!has_default) {
-                try_get_device("default", true /* fail_silent */);
+        Wrapper::WrappedIKeymasterDevice::descriptor, [&](const hidl_vec<hidl_string>& list) {
+            for (const auto& name : list) {
+                names.push_back(name);
             }
         });
+    // Make sure that we always check the default device. If we enumerate only what is
+    // known to hwservicemanager, we miss a possible passthrough HAL.
+    const size_t numListed = names.size();
+    if (std::find(names.begin(), names.end(), "default") == names.end()) {
+        names.push_back("default");
+    }
+
+    // Bringing up an instance can take a while, StrongBox in particular, so probe all of them
+    // at once instead of one after the other.
+    struct Probe {
+        sp<Keymaster> device;
+        SecurityLevel securityLevel;
+    };
+    std::vector<std::future<Probe>> probes;
+    for (size_t i = 0; i < names.size(); i++) {
+        const bool fail_silent = i >= numListed;
+        probes.push_back(std::async(std::launch::async, [name = names[i], fail_silent]() {
+            auto device = Wrapper::WrappedIKeymasterDevice::getService(name);
+            if (fail_silent && !device) return Probe{};
+            CHECK(device) << "Failed to get service for \""
+                          << Wrapper::WrappedIKeymasterDevice::descriptor
+                          << "\" with interface name \"" << name << "\"";
+
+            sp<Keymaster> kmDevice(new Wrapper(device, name));
+            return Probe{kmDevice, kmDevice->halVersion().securityLevel};
+        }));
+    }
+
+    // Collect the results in manifest order, so that the same instance wins as before when two
+    // instances report the same security level.
+    KeymasterDevices result;
+    for (size_t i = 0; i < probes.size(); i++) {
+        const auto& name = names[i];
+        const bool fail_silent = i >= numListed;
+        auto [kmDevice, securityLevel] = probes[i].get();
+        if (!kmDevice) continue;
+        LOG(INFO) << "found " << Wrapper::WrappedIKeymasterDevice::descriptor
+                  << " with interface name " << name << " and seclevel "
+                  << toString(securityLevel);
+        CHECK(static_cast<uint32_t>(securityLevel) < result.size())
+            << "Security level of \"" << Wrapper::WrappedIKeymasterDevice::descriptor
+            << "\" with interface name \"" << name << "\" out of range";
+        auto& deviceSlot = result[securityLevel];
+        if (deviceSlot) {
+            if (!fail_silent) {
+                LOG(WARNING) << "Implementation of \""
+                             << Wrapper::WrappedIKeymasterDevice::descriptor
+                             << "\" with interface name \"" << name
+                             << "\" and security level: " << toString(securityLevel)
+                             << " Masked by other implementation of Keymaster";
+            }
+        } else {
+            deviceSlot = kmDevice;
+        }
+    }
     return result;
 }
 
 KeymasterDevices initializeKeymasters() {
+    auto start = std::chrono::steady_clock::now();
     auto serviceManager = IServiceManager::getService();
     CHECK(serviceManager.get()) << "Failed to get ServiceManager";
     auto result = enumerateKeymasterDevices<Keymaster4>(serviceManager.get());
@@ -1365,24 +1961,154 @@ KeymasterDevices initializeKeymasters() {
         result[SecurityLevel::SOFTWARE] = nullptr;
     }
     // The software bit was removed since we do not need it.
+    LOG(INFO) << "Keymaster enumeration took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << "ms";
     return result;
 }
 
+static KeyCharacteristicsCache::Digest digestBlob(const hidl_vec<uint8_t>& blob) {
+    KeyCharacteristicsCache::Digest digest;
+    SHA256(blob.data(), blob.size(), digest.data());
+    return digest;
+}
+
+// Length-prefixes appId and appData, so that moving bytes between them changes the key.
+static KeyCharacteristicsCache::Digest cacheKey(const KeyCharacteristicsCache::Digest& blobDigest,
+                                                const std::vector<uint8_t>& appId,
+                                                const std::vector<uint8_t>& appData) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, blobDigest.data(), blobDigest.size());
+    for (const auto& field : {&appId, &appData}) {
+        uint64_t size = field->size();
+        SHA256_Update(&ctx, &size, sizeof(size));
+        SHA256_Update(&ctx, field->data(), field->size());
+    }
+    KeyCharacteristicsCache::Digest key;
+    SHA256_Final(key.data(), &ctx);
+    return key;
+}
+
+std::optional<std::vector<KeyCharacteristics>>
+KeyCharacteristicsCache::get(const hidl_vec<uint8_t>& keyBlob,
+                             const std::vector<uint8_t>& appId,
+                             const std::vector<uint8_t>& appData) {
+    auto key = cacheKey(digestBlob(keyBlob), appId, appData);
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(key);
+    if (it == mIndex.end()) {
+        return std::nullopt;
+    }
+    mEntries.splice(mEntries.begin(), mEntries, it->second);
+    return it->second->characteristics;
+}
+
+void KeyCharacteristicsCache::put(const hidl_vec<uint8_t>& keyBlob,
+                                  const std::vector<uint8_t>& appId,
+                                  const std::vector<uint8_t>& appData,
+                                  const std::vector<KeyCharacteristics>& characteristics) {
+    auto blobDigest = digestBlob(keyBlob);
+    auto key = cacheKey(blobDigest, appId, appData);
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (auto it = mIndex.find(key); it != mIndex.end()) {
+        it->second->characteristics = characteristics;
+        mEntries.splice(mEntries.begin(), mEntries, it->second);
+        return;
+    }
+    mEntries.push_front({blobDigest, key, characteristics});
+    mIndex.emplace(key, mEntries.begin());
+    if (mEntries.size() > mCapacity) {
+        mIndex.erase(mEntries.back().key);
+        mEntries.pop_back();
+    }
+}
+
+void KeyCharacteristicsCache::invalidate(const hidl_vec<uint8_t>& keyBlob) {
+    auto blobDigest = digestBlob(keyBlob);
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto it = mEntries.begin(); it != mEntries.end();) {
+        if (it->blobDigest == blobDigest) {
+            mIndex.erase(it->key);
+            it = mEntries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void KeyCharacteristicsCache::clear() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIndex.clear();
+    mEntries.clear();
+}
+
 void KeyMintDevice::setNumFreeSlots(uint8_t numFreeSlots) {
     mOperationSlots.setNumFreeSlots(numFreeSlots);
 }
 
+void KeyMintDevice::setMaxSlotWaitTime(std::chrono::milliseconds maxWaitTime) {
+    mOperationSlots.setMaxWaitTime(maxWaitTime);
+}
+
+OperationSlotWaitStats KeyMintDevice::getSlotWaitStats() {
+    return mOperationSlots.getWaitStats();
+}
+
+CallLaneStats KeyMintDevice::getCallLaneStats() {
+    return mCallLane.getStats();
+}
+
+std::vector<OperationActivity> KeyMintDevice::getOperationActivity() {
+    std::vector<OperationActivity> result;
+    std::lock_guard<std::mutex> lock(mOperationsMutex);
+    for (const auto& weakOperation : mOperations) {
+        if (auto operation = weakOperation.lock()) {
+            result.push_back(operation->getActivity());
+        }
+    }
+    return result;
+}
+
 // Constructors and helpers.
 
 KeyMintDevice::KeyMintDevice(sp<Keymaster> device, KeyMintSecurityLevel securityLevel)
-    : mDevice(device), securityLevel_(securityLevel) {
+    : mDevice(device), mKeyCharacteristicsCache(kKeyCharacteristicsCacheSize),
+      securityLevel_(securityLevel) {
     if (securityLevel == KeyMintSecurityLevel::STRONGBOX) {
         setNumFreeSlots(3);
     } else {
         setNumFreeSlots(15);
     }
+    // Waiting for a slot is off by default, in which case begin() fails right away with
+    // TOO_MANY_OPERATIONS and keystore2 prunes an operation.
+    setMaxSlotWaitTime(std::chrono::milliseconds(
+        android::base::GetUintProperty<uint32_t>(kSlotWaitTimeProperty, 0, kMaxSlotWaitTimeMs)));
+    mCallLane.setMaxCalls(android::base::GetUintProperty<uint32_t>(
+        securityLevel == KeyMintSecurityLevel::STRONGBOX ? kStrongBoxMaxCallsProperty
+                                                         : kTeeMaxCallsProperty,
+        0, kMaxCallLaneLimit));
+    // Entropy is forwarded right away by default.
+    setEntropyFlushDelay(std::chrono::milliseconds(android::base::GetUintProperty<uint32_t>(
+        kEntropyFlushDelayProperty, 0, kMaxEntropyFlushDelayMs)));
 
     softKeyMintDevice_.reset(CreateKeyMintDevice(KeyMintSecurityLevel::SOFTWARE));
+    // Generate the ephemeral certificate signing key off the binder thread, so that the first
+    // generateKey does not pay for it.
+    mSigningKeyWarmUp = std::thread([] { getEphemeralSigningKey(); });
+}
+
+KeyMintDevice::~KeyMintDevice() {
+    {
+        std::lock_guard<std::mutex> lock(mEntropyMutex);
+        mStopEntropyFlush = true;
+    }
+    mEntropyFlushCv.notify_one();
+    // The flush thread forwards what is still collected before it exits.
+    if (mEntropyFlushThread.joinable()) mEntropyFlushThread.join();
+    if (mSigningKeyWarmUp.joinable()) mSigningKeyWarmUp.join();
 }
 
 sp<Keymaster> getDevice(KeyMintSecurityLevel securityLevel) {
@@ -1432,6 +2158,7 @@ std::shared_ptr<SecureClock> SecureClock::createSecureClock(KeyMintSecurityLevel
 ScopedAStatus
 KeystoreCompatService::getKeyMintDevice(KeyMintSecurityLevel in_securityLevel,
                                         std::shared_ptr<IKeyMintDevice>* _aidl_return) {
+    std::lock_guard<std::mutex> lock(mDeviceCacheMutex);
     auto i = mDeviceCache.find(in_securityLevel);
     if (i == mDeviceCache.end()) {
         auto device = KeyMintDevice::createKeyMintDevice(in_securityLevel);
@@ -1458,6 +2185,58 @@ ScopedAStatus KeystoreCompatService::getSharedSecret(KeyMintSecurityLevel in_sec
     return ScopedAStatus::ok();
 }
 
+ScopedAStatus
+KeystoreCompatService::getOperationActivity(KeyMintSecurityLevel in_securityLevel,
+                                            std::vector<OperationActivity>* _aidl_return) {
+    _aidl_return->clear();
+    std::lock_guard<std::mutex> lock(mDeviceCacheMutex);
+    auto i = mDeviceCache.find(in_securityLevel);
+    if (i != mDeviceCache.end()) {
+        *_aidl_return = std::static_pointer_cast<KeyMintDevice>(i->second)->getOperationActivity();
+    }
+    return ScopedAStatus::ok();
+}
+
+binder_status_t KeystoreCompatService::dump(int fd, const char** /* args */,
+                                            uint32_t /* numArgs */) {
+    std::string out = CompatCallStats::getInstance().toString();
+    std::lock_guard<std::mutex> lock(mDeviceCacheMutex);
+    for (const auto& [securityLevel, device] : mDeviceCache) {
+        auto keyMintDevice = std::static_pointer_cast<KeyMintDevice>(device);
+        auto laneStats = keyMintDevice->getCallLaneStats();
+        if (laneStats.maxCalls != 0) {
+            android::base::StringAppendF(&out,
+                                         "call lane (%s): max=%" PRIu32 " in_flight=%" PRIu32
+                                         " waits=%" PRIu64 " rejects=%" PRIu64 "\n",
+                                         toString(securityLevel).c_str(), laneStats.maxCalls,
+                                         laneStats.numCalls, laneStats.numWaits,
+                                         laneStats.numRejects);
+        }
+        auto slotStats = keyMintDevice->getSlotWaitStats();
+        if (slotStats.numWaits != 0) {
+            android::base::StringAppendF(&out,
+                                         "slot waits (%s): waiting=%" PRIu32 " max_waiting=%" PRIu32
+                                         " waits=%" PRIu64 " timeouts=%" PRIu64
+                                         " total_us=%" PRIu64 "\n",
+                                         toString(securityLevel).c_str(), slotStats.numWaiting,
+                                         slotStats.maxNumWaiting, slotStats.numWaits,
+                                         slotStats.numTimeouts, slotStats.totalWaitTimeUs);
+        }
+        auto progress = keyMintDevice->getKeyUpgradeProgress();
+        if (progress.numQueued == 0) continue;
+        android::base::StringAppendF(&out,
+                                     "key upgrades (%s): queued=%" PRIu64 " upgraded=%" PRIu64
+                                     " failed=%" PRIu64 " total_us=%" PRIu64 "\n",
+                                     toString(securityLevel).c_str(), progress.numQueued,
+                                     progress.numUpgraded, progress.numFailed,
+                                     progress.totalUpgradeTimeUs);
+    }
+    if (!android::base::WriteStringToFd(out, fd)) {
+        return STATUS_UNKNOWN_ERROR;
+    }
+    return STATUS_OK;
+}
+
 ScopedAStatus KeystoreCompatService::getSecureClock(std::shared_ptr<ISecureClock>* _aidl_return) {
     if (!mSecureClock) {
         // The legacy verification service was always provided by the TEE variant.
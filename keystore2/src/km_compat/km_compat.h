@@ -22,7 +22,21 @@
 #include <aidl/android/hardware/security/secureclock/BnSecureClock.h>
 #include <aidl/android/hardware/security/sharedsecret/BnSharedSecret.h>
 #include <aidl/android/security/compat/BnKeystoreCompatService.h>
+#include <aidl/android/security/compat/OperationActivity.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <keymasterV4_1/Keymaster4.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
 #include <variant>
 
@@ -40,25 +54,117 @@ using ::aidl::android::hardware::security::keymint::KeyParameter;
 using ::aidl::android::hardware::security::keymint::KeyPurpose;
 using KeyMintSecurityLevel = ::aidl::android::hardware::security::keymint::SecurityLevel;
 using V4_0_ErrorCode = ::android::hardware::keymaster::V4_0::ErrorCode;
+using V4_0_HardwareAuthToken = ::android::hardware::keymaster::V4_0::HardwareAuthToken;
+using V4_0_VerificationToken = ::android::hardware::keymaster::V4_0::VerificationToken;
 using ::aidl::android::hardware::security::keymint::IKeyMintDevice;
 using KMV1_ErrorCode = ::aidl::android::hardware::security::keymint::ErrorCode;
+using KMV1_Tag = ::aidl::android::hardware::security::keymint::Tag;
 using ::aidl::android::hardware::security::secureclock::ISecureClock;
 using ::aidl::android::hardware::security::secureclock::TimeStampToken;
 using ::aidl::android::hardware::security::sharedsecret::ISharedSecret;
 using ::aidl::android::hardware::security::sharedsecret::SharedSecretParameters;
 using ::aidl::android::security::compat::BnKeystoreCompatService;
+using ::aidl::android::security::compat::OperationActivity;
 using ::android::hardware::keymaster::V4_1::support::Keymaster;
 using ::ndk::ScopedAStatus;
 
+// Statistics about callers that had to wait for an operation slot.
+struct OperationSlotWaitStats {
+    uint32_t numWaiting;     // Callers currently waiting for a slot.
+    uint32_t maxNumWaiting;  // Highest number of callers that waited at the same time.
+    uint64_t numWaits;       // Callers that had to wait, whether or not they got a slot.
+    uint64_t numTimeouts;    // Callers that gave up waiting.
+    uint64_t totalWaitTimeUs;
+};
+
+// Progress of the batch key upgrades of a device, see KeyMintDevice::upgradeKeys().
+struct KeyUpgradeProgress {
+    uint64_t numQueued;           // Keys handed to upgradeKeys(), including those still pending.
+    uint64_t numUpgraded;         // Keys upgraded successfully.
+    uint64_t numFailed;           // Keys whose upgrade failed.
+    uint64_t totalUpgradeTimeUs;  // Time spent upgrading, not counting rate limiting.
+};
+
+// Tracks the number of free operation slots of a device. Claiming and freeing
+// slots is lock free while nobody is waiting, since it happens on every begin,
+// finish and abort. Waiting callers, and freeSlot() while there are any, take
+// the lock that guards the wait queue.
+//
+// By default, claimSlot() fails immediately if no slot is free. If a maximum
+// wait time is set, callers instead queue up in FIFO order and wait for a slot
+// to be freed for up to that long.
 class OperationSlots {
   private:
-    uint8_t mNumFreeSlots;
-    std::mutex mNumFreeSlotsMutex;
+    std::atomic<uint8_t> mNumFreeSlots;
+    std::atomic<uint32_t> mNumWaiting = 0;
+    std::chrono::milliseconds mMaxWaitTime{0};
+
+    // Protects the wait queue and the wait statistics.
+    std::mutex mWaitMutex;
+    std::condition_variable mWaitCondition;
+    std::deque<uint64_t> mWaitQueue;
+    uint64_t mNextWaiterId = 0;
+    OperationSlotWaitStats mWaitStats = {};
+
+    bool tryClaimSlot();
+    bool waitForSlot();
 
   public:
     void setNumFreeSlots(uint8_t numFreeSlots);
+    // Sets how long claimSlot() may wait for a slot. Must be set before the slots are used.
+    void setMaxWaitTime(std::chrono::milliseconds maxWaitTime);
     bool claimSlot();
     void freeSlot();
+    OperationSlotWaitStats getWaitStats();
+};
+
+// Statistics about the calls of a CallLane.
+struct CallLaneStats {
+    uint32_t maxCalls;   // The configured limit, zero if there is none.
+    uint32_t numCalls;   // Calls currently in the HAL.
+    uint64_t numWaits;   // Calls that had to wait for the lane.
+    uint64_t numRejects; // Calls that were turned away because the lane was full.
+};
+
+// Limits how many calls may be in the legacy HAL of one security level at the same time. All
+// of them run on keystore2's binder threads, so without a limit a slow StrongBox can tie up
+// every one of those threads and leave none for the TEE. The lane covers begin, update and
+// finish. A begin from a client is turned away when the lane is full, the other calls wait.
+//
+// Without a limit, which is the default, entering and leaving the lane are no-ops.
+class CallLane {
+  public:
+    class Entry {
+      public:
+        // Enters |lane|. If the lane is full, waits for it if |wait| is set, and otherwise
+        // leaves entered() false.
+        Entry(CallLane* lane, bool wait);
+        ~Entry();
+        Entry(const Entry&) = delete;
+        Entry& operator=(const Entry&) = delete;
+
+        bool entered() const { return mEntered; }
+
+      private:
+        CallLane* mLane;
+        bool mEntered;
+    };
+
+    // Sets the most calls the lane lets in at once, zero for no limit. Must be set before the
+    // lane is used.
+    void setMaxCalls(uint32_t maxCalls) { mMaxCalls = maxCalls; }
+    CallLaneStats getStats();
+
+  private:
+    bool enter(bool wait);
+    void leave();
+
+    uint32_t mMaxCalls = 0;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    uint32_t mNumCalls = 0;
+    uint64_t mNumWaits = 0;
+    uint64_t mNumRejects = 0;
 };
 
 // An abstraction for a single operation slot.
@@ -77,13 +183,82 @@ class OperationSlot {
     bool hasSlot() { return mIsActive; }
 };
 
+// A small LRU cache of the key characteristics reported by the legacy device. Entries are keyed
+// by a digest of the key blob, application id and application data, and can be invalidated by key
+// blob when the key is deleted or upgraded.
+class KeyCharacteristicsCache {
+  public:
+    using Digest = std::array<uint8_t, 32>;
+
+    explicit KeyCharacteristicsCache(size_t capacity) : mCapacity(capacity) {}
+
+    std::optional<std::vector<KeyCharacteristics>>
+    get(const ::android::hardware::hidl_vec<uint8_t>& keyBlob, const std::vector<uint8_t>& appId,
+        const std::vector<uint8_t>& appData);
+    void put(const ::android::hardware::hidl_vec<uint8_t>& keyBlob,
+             const std::vector<uint8_t>& appId,
+             const std::vector<uint8_t>& appData,
+             const std::vector<KeyCharacteristics>& characteristics);
+    // Drops all entries for keyBlob, whatever application id and data they were cached with.
+    void invalidate(const ::android::hardware::hidl_vec<uint8_t>& keyBlob);
+    void clear();
+
+  private:
+    struct Entry {
+        Digest blobDigest;
+        Digest key;
+        std::vector<KeyCharacteristics> characteristics;
+    };
+
+    std::mutex mMutex;
+    size_t mCapacity;
+    // Most recently used entries first.
+    std::list<Entry> mEntries;
+    std::map<Digest, std::list<Entry>::iterator> mIndex;
+};
+
+// The parameters of a generateKey or importKey call, sorted in a single pass into the sets that
+// the legacy device and keystore need. The tags used to build the certificate are indexed, so that
+// looking them up does not scan the parameters again.
+class KeyCreationParams {
+  public:
+    explicit KeyCreationParams(const std::vector<KeyParameter>& params);
+
+    const std::vector<KeyParameter>& all() const { return mAll; }
+    // Parameters that may be passed to generateKey/importKey.
+    const std::vector<KeyParameter>& generationParams() const { return mGenerationParams; }
+    // Parameters that may be passed to attestKey.
+    const std::vector<KeyParameter>& attestationParams() const { return mAttestationParams; }
+    // Parameters the legacy device does not know but keystore can enforce.
+    const std::vector<KeyParameter>& newAndKeystoreEnforceableParams() const {
+        return mNewAndKeystoreEnforceableParams;
+    }
+    // Returns the first parameter with the given tag, or nullptr if there is none.
+    const KeyParameter* find(KMV1_Tag tag) const;
+
+  private:
+    static constexpr size_t kNumIndexedTags = 9;
+    static std::optional<size_t> indexOf(KMV1_Tag tag);
+
+    const std::vector<KeyParameter>& mAll;
+    std::vector<KeyParameter> mGenerationParams;
+    std::vector<KeyParameter> mAttestationParams;
+    std::vector<KeyParameter> mNewAndKeystoreEnforceableParams;
+    std::array<const KeyParameter*, kNumIndexedTags> mIndexed = {};
+};
+
+class KeyMintOperation;
+
 class KeyMintDevice : public aidl::android::hardware::security::keymint::BnKeyMintDevice {
   private:
     ::android::sp<Keymaster> mDevice;
     OperationSlots mOperationSlots;
+    CallLane mCallLane;
+    KeyCharacteristicsCache mKeyCharacteristicsCache;
 
   public:
     explicit KeyMintDevice(::android::sp<Keymaster>, KeyMintSecurityLevel);
+    ~KeyMintDevice();
     static std::shared_ptr<KeyMintDevice> createKeyMintDevice(KeyMintSecurityLevel securityLevel);
 
     ScopedAStatus getHardwareInfo(KeyMintHardwareInfo* _aidl_return) override;
@@ -126,24 +301,124 @@ class KeyMintDevice : public aidl::android::hardware::security::keymint::BnKeyMi
     // These are public to allow testing code to use them directly.
     // This class should not be used publicly anyway.
     std::variant<std::vector<Certificate>, KMV1_ErrorCode>
-    getCertificate(const std::vector<KeyParameter>& keyParams, const std::vector<uint8_t>& keyBlob);
+    getCertificate(const KeyCreationParams& keyParams, const std::vector<uint8_t>& keyBlob);
 
     void setNumFreeSlots(uint8_t numFreeSlots);
+    void setMaxSlotWaitTime(std::chrono::milliseconds maxWaitTime);
+    OperationSlotWaitStats getSlotWaitStats();
+    CallLaneStats getCallLaneStats();
+    // The activity of every live operation begun on this device.
+    std::vector<OperationActivity> getOperationActivity();
+
+    // A key for importKeys().
+    struct ImportKeyRequest {
+        std::vector<KeyParameter> keyParams;
+        KeyFormat keyFormat;
+        std::vector<uint8_t> keyData;
+    };
+
+    // Imports the keys of |requests| as importKey() would, for bulk provisioning. |results|
+    // gets one entry per request and so does the returned list of statuses. The certificates
+    // of each key are made while the next key is imported.
+    std::vector<ScopedAStatus> importKeys(const std::vector<ImportKeyRequest>& requests,
+                                          std::vector<KeyCreationResult>* results);
+
+    // Called by upgradeKeys() for every key, with the key's index in the batch, the status of
+    // its upgrade and, on success, the upgraded key blob.
+    using KeyUpgradeCallback = std::function<void(size_t index, const ScopedAStatus& status,
+                                                  std::vector<uint8_t> upgradedKeyBlob)>;
+
+    // Upgrades the given key blobs as upgradeKey() would, on a background thread, so all keys
+    // can be upgraded after an OTA before they are used. If |maxUpgradesPerSecond| is not zero,
+    // the upgrades are spread out so that they leave the HAL to other callers. Returns a future
+    // which is ready once every key has been handled; it may be dropped without waiting.
+    std::future<void> upgradeKeys(std::vector<std::vector<uint8_t>> prefixedKeyBlobs,
+                                  std::vector<KeyParameter> upgradeParams,
+                                  uint32_t maxUpgradesPerSecond, KeyUpgradeCallback onUpgraded);
+    KeyUpgradeProgress getKeyUpgradeProgress();
+
+    // With a non-zero delay, addRngEntropy() collects entropy and forwards it to the HAL in
+    // one call once it has the most the HAL takes at once, or after the delay, whichever comes
+    // first. Zero forwards every call right away, and forwards anything still collected.
+    // While batching, addRngEntropy() may return before the HAL has seen the entropy, and a
+    // failure to forward it later is only logged.
+    void setEntropyFlushDelay(std::chrono::milliseconds delay);
+    // The number of addRngEntropy calls made to the HAL.
+    uint64_t getNumEntropyCalls();
 
   private:
+    // The untracked implementations of the calls that CompatCallStats records.
+    ScopedAStatus generateKeyImpl(const std::vector<KeyParameter>& in_keyParams,
+                                  const std::optional<AttestationKey>& in_attestationKey,
+                                  KeyCreationResult* out_creationResult);
+    ScopedAStatus importKeyImpl(const std::vector<KeyParameter>& in_inKeyParams,
+                                KeyFormat in_inKeyFormat, const std::vector<uint8_t>& in_inKeyData,
+                                const std::optional<AttestationKey>& in_attestationKey,
+                                KeyCreationResult* out_creationResult);
+    // The two halves of importKeyImpl: the HAL import, and the certificates of the imported
+    // key, which is deleted again if they cannot be made.
+    KMV1_ErrorCode importLegacyKey(const KeyCreationParams& keyParams, KeyFormat keyFormat,
+                                   const std::vector<uint8_t>& keyData,
+                                   KeyCreationResult* out_creationResult);
+    KMV1_ErrorCode certifyImportedKey(const KeyCreationParams& keyParams,
+                                      KeyCreationResult* out_creationResult);
+    // If the call lane is full, waits for it if |waitForLane| is set, and otherwise fails
+    // with TOO_MANY_OPERATIONS.
+    ScopedAStatus beginImpl(KeyPurpose in_inPurpose, const std::vector<uint8_t>& in_inKeyBlob,
+                            const std::vector<KeyParameter>& in_inParams,
+                            const std::optional<HardwareAuthToken>& in_inAuthToken,
+                            bool waitForLane, BeginResult* _aidl_return);
+
     std::optional<KMV1_ErrorCode> signCertificate(const std::vector<KeyParameter>& keyParams,
-                                                  const std::vector<uint8_t>& keyBlob, X509* cert);
+                                                  const std::vector<uint8_t>& keyBlob, X509* cert,
+                                                  std::vector<uint8_t>* encodedCert);
+
+    /** Runs on mEntropyFlushThread and forwards collected entropy once the delay is up. */
+    void flushEntropyLoop();
+    /**
+     * Forwards the collected entropy to the HAL. |lock| holds mEntropyMutex, which is released
+     * during the HAL call.
+     */
+    void forwardPendingEntropy(std::unique_lock<std::mutex>& lock);
+    ScopedAStatus forwardRngEntropy(const uint8_t* data, size_t size);
+
     KeyMintSecurityLevel securityLevel_;
 
+    // Entropy collected by addRngEntropy(), see setEntropyFlushDelay().
+    std::mutex mEntropyMutex;
+    std::vector<uint8_t> mPendingEntropy;
+    std::chrono::milliseconds mEntropyFlushDelay = std::chrono::milliseconds::zero();
+    std::condition_variable mEntropyFlushCv;
+    bool mStopEntropyFlush = false;
+    // Started by the first batched addRngEntropy() call, and joined by the destructor.
+    std::thread mEntropyFlushThread;
+    std::atomic<uint64_t> mNumEntropyCalls = 0;
+
+    // See KeyUpgradeProgress.
+    std::atomic<uint64_t> mNumKeyUpgradesQueued = 0;
+    std::atomic<uint64_t> mNumKeysUpgraded = 0;
+    std::atomic<uint64_t> mNumKeyUpgradesFailed = 0;
+    std::atomic<uint64_t> mTotalKeyUpgradeTimeUs = 0;
+
+    // The operations begun by begin(), for getOperationActivity(). They are dropped once they
+    // have expired.
+    std::mutex mOperationsMutex;
+    std::vector<std::weak_ptr<KeyMintOperation>> mOperations;
+
     // Software-based KeyMint device used to implement ECDH.
     std::shared_ptr<IKeyMintDevice> softKeyMintDevice_;
+
+    // Generates the ephemeral signing key in the background, joined by the destructor.
+    std::thread mSigningKeyWarmUp;
 };
 
 class KeyMintOperation : public aidl::android::hardware::security::keymint::BnKeyMintOperation {
   public:
     KeyMintOperation(::android::sp<Keymaster> device, uint64_t operationHandle,
-                     OperationSlots* slots, bool isActive)
-        : mDevice(device), mOperationHandle(operationHandle), mOperationSlot(slots, isActive) {}
+                     OperationSlots* slots, bool isActive, CallLane* callLane, KeyPurpose purpose,
+                     bool hasBlockMode)
+        : mDevice(device), mOperationHandle(operationHandle), mOperationSlot(slots, isActive),
+          mCallLane(callLane), mPurpose(purpose), mHasBlockMode(hasBlockMode) {}
     ~KeyMintOperation();
 
     ScopedAStatus updateAad(const std::vector<uint8_t>& input,
@@ -164,12 +439,46 @@ class KeyMintOperation : public aidl::android::hardware::security::keymint::BnKe
 
     ScopedAStatus abort();
 
+    // How long the operation has been idle, how much input it has taken, and whether one of its
+    // calls is in the HAL right now.
+    OperationActivity getActivity() const;
+
   private:
     /**
-     * Sets mUpdateBuffer to the given value.
+     * Marks a call of the operation as busy for its lifetime, and counts its input. It covers
+     * the wait for the call lane as well as the HAL call.
+     */
+    class ActivityScope {
+      public:
+        ActivityScope(KeyMintOperation* operation, size_t inputSize);
+        ~ActivityScope();
+
+      private:
+        KeyMintOperation* mOperation;
+    };
+
+    /** Returns the time of the steady clock in nanoseconds. */
+    static int64_t steadyClockNs();
+
+    // The untracked implementations of the calls that CompatCallStats records.
+    ScopedAStatus updateImpl(const std::vector<uint8_t>& input,
+                             const std::optional<HardwareAuthToken>& authToken,
+                             const std::optional<TimeStampToken>& timestampToken,
+                             std::vector<uint8_t>* output);
+    ScopedAStatus finishImpl(const std::optional<std::vector<uint8_t>>& input,
+                             const std::optional<std::vector<uint8_t>>& signature,
+                             const std::optional<HardwareAuthToken>& authToken,
+                             const std::optional<TimeStampToken>& timeStampToken,
+                             const std::optional<std::vector<uint8_t>>& confirmationToken,
+                             std::vector<uint8_t>* output);
+
+    /**
+     * Sets mUpdateBuffer to the given range, reusing its storage. The range may be a tail of
+     * mUpdateBuffer itself.
      * @param data
+     * @param size
      */
-    void setUpdateBuffer(std::vector<uint8_t> data);
+    void setUpdateBuffer(const uint8_t* data, size_t size);
     /**
      * If mUpdateBuffer is not empty, suffix is appended to mUpdateBuffer, and a reference to
      * mUpdateBuffer is returned. Otherwise a reference to suffix is returned.
@@ -177,11 +486,43 @@ class KeyMintOperation : public aidl::android::hardware::security::keymint::BnKe
      * @return
      */
     const std::vector<uint8_t>& getExtendedUpdateBuffer(const std::vector<uint8_t>& suffix);
+    /**
+     * Returns an upper bound for the output of an update or finish call with inputSize bytes
+     * of input, so that the output can be reserved up front.
+     * @param inputSize
+     * @param isFinish
+     * @return
+     */
+    size_t estimateOutputSize(size_t inputSize, bool isFinish) const;
+    /**
+     * Returns the legacy equivalents of the given tokens. Streaming clients pass the same tokens
+     * with every update, so the last conversion is kept and only redone when a token changes.
+     * The returned reference is valid until the next call.
+     */
+    const V4_0_HardwareAuthToken&
+    getLegacyAuthToken(const std::optional<HardwareAuthToken>& authToken);
+    const V4_0_VerificationToken&
+    getLegacyTimestampToken(const std::optional<TimeStampToken>& timestampToken);
+
+    // The tokens of the last call and their legacy equivalents. The default constructed legacy
+    // tokens are what no token converts to.
+    std::optional<HardwareAuthToken> mLastAuthToken;
+    V4_0_HardwareAuthToken mLegacyAuthToken;
+    std::optional<TimeStampToken> mLastTimestampToken;
+    V4_0_VerificationToken mLegacyTimestampToken;
 
     std::vector<uint8_t> mUpdateBuffer;
     ::android::sp<Keymaster> mDevice;
     uint64_t mOperationHandle;
     OperationSlot mOperationSlot;
+    CallLane* mCallLane;
+    KeyPurpose mPurpose;
+    bool mHasBlockMode;
+
+    // See OperationActivity. The times are those of the steady clock.
+    std::atomic<int64_t> mLastActivityNs = steadyClockNs();
+    std::atomic<int64_t> mBytesProcessed = 0;
+    std::atomic<uint32_t> mCallsInHal = 0;
 };
 
 class SharedSecret : public aidl::android::hardware::security::sharedsecret::BnSharedSecret {
@@ -201,6 +542,19 @@ class SecureClock : public aidl::android::hardware::security::secureclock::BnSec
   private:
     ::android::sp<Keymaster> mDevice;
 
+    // A verifyAuthorization call in flight. Requests for the same challenge which arrive while
+    // it runs wait for it and get the same token instead of making calls of their own.
+    struct PendingTimeStamp {
+        bool done = false;
+        KMV1_ErrorCode errorCode = KMV1_ErrorCode::UNKNOWN_ERROR;
+        TimeStampToken token;
+    };
+    std::mutex mPendingMutex;
+    std::condition_variable mPendingDone;
+    std::map<int64_t, std::shared_ptr<PendingTimeStamp>> mPending;
+
+    void requestTimeStamp(int64_t challenge, PendingTimeStamp* pending);
+
   public:
     SecureClock(::android::sp<Keymaster> device) : mDevice(device) {}
     static std::shared_ptr<SecureClock> createSecureClock(KeyMintSecurityLevel securityLevel);
@@ -210,6 +564,8 @@ class SecureClock : public aidl::android::hardware::security::secureclock::BnSec
 
 class KeystoreCompatService : public BnKeystoreCompatService {
   private:
+    // Protects mDeviceCache, which binder calls may fill while dump() walks it.
+    std::mutex mDeviceCacheMutex;
     std::unordered_map<KeyMintSecurityLevel, std::shared_ptr<IKeyMintDevice>> mDeviceCache;
     std::unordered_map<KeyMintSecurityLevel, std::shared_ptr<ISharedSecret>> mSharedSecretCache;
     std::shared_ptr<ISecureClock> mSecureClock;
@@ -221,4 +577,7 @@ class KeystoreCompatService : public BnKeystoreCompatService {
     ScopedAStatus getSharedSecret(KeyMintSecurityLevel in_securityLevel,
                                   std::shared_ptr<ISharedSecret>* _aidl_return) override;
     ScopedAStatus getSecureClock(std::shared_ptr<ISecureClock>* _aidl_return) override;
+    ScopedAStatus getOperationActivity(KeyMintSecurityLevel in_securityLevel,
+                                       std::vector<OperationActivity>* _aidl_return) override;
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
 };
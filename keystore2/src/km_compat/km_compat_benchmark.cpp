@@ -0,0 +1,269 @@
+/*
+ * Copyright 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the overhead of km_compat itself: KeyMintDevice and KeyMintOperation run against an
+// in-process fake Keymaster 4 device, so the numbers contain no binder or TEE time other than
+// the latency the fake is told to add.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <keymasterV4_1/Keymaster4.h>
+#include <keymint_support/keymint_tags.h>
+
+#include "km_compat.h"
+
+using ::aidl::android::hardware::security::keymint::BlockMode;
+using ::aidl::android::hardware::security::keymint::KeyPurpose;
+using ::aidl::android::hardware::security::keymint::PaddingMode;
+using ::aidl::android::hardware::security::keymint::SecurityLevel;
+using ::android::sp;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::Return;
+using ::android::hardware::Void;
+using ::android::hardware::keymaster::V4_1::support::Keymaster4;
+
+namespace KMV1 = ::aidl::android::hardware::security::keymint;
+namespace V4_0 = ::android::hardware::keymaster::V4_0;
+
+namespace {
+
+// A Keymaster 4.0 device which does no cryptography. Every call that reaches it takes
+// |latency|, and update() consumes at most |maxConsumed| bytes per call, like a HAL with a
+// limited transfer buffer. Zero means it consumes all of its input.
+class FakeKeymasterDevice : public V4_0::IKeymasterDevice {
+  public:
+    FakeKeymasterDevice(std::chrono::microseconds latency, uint32_t maxConsumed)
+        : mLatency(latency), mMaxConsumed(maxConsumed) {}
+
+    Return<void> getHardwareInfo(getHardwareInfo_cb _hidl_cb) override {
+        _hidl_cb(V4_0::SecurityLevel::TRUSTED_ENVIRONMENT, "FakeKeymasterDevice", "Android");
+        return Void();
+    }
+    Return<void> getHmacSharingParameters(getHmacSharingParameters_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<void> computeSharedHmac(const hidl_vec<V4_0::HmacSharingParameters>&,
+                                   computeSharedHmac_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<void> verifyAuthorization(uint64_t, const hidl_vec<V4_0::KeyParameter>&,
+                                     const V4_0::HardwareAuthToken&,
+                                     verifyAuthorization_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<V4_0::ErrorCode> addRngEntropy(const hidl_vec<uint8_t>&) override {
+        wait();
+        return V4_0::ErrorCode::OK;
+    }
+    Return<void> generateKey(const hidl_vec<V4_0::KeyParameter>&,
+                             generateKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {}, {});
+        return Void();
+    }
+    Return<void> importKey(const hidl_vec<V4_0::KeyParameter>&, V4_0::KeyFormat,
+                           const hidl_vec<uint8_t>&, importKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {}, {});
+        return Void();
+    }
+    Return<void> importWrappedKey(const hidl_vec<uint8_t>&, const hidl_vec<uint8_t>&,
+                                  const hidl_vec<uint8_t>&, const hidl_vec<V4_0::KeyParameter>&,
+                                  uint64_t, uint64_t, importWrappedKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {}, {});
+        return Void();
+    }
+    Return<void> getKeyCharacteristics(const hidl_vec<uint8_t>&, const hidl_vec<uint8_t>&,
+                                       const hidl_vec<uint8_t>&,
+                                       getKeyCharacteristics_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<void> exportKey(V4_0::KeyFormat, const hidl_vec<uint8_t>&, const hidl_vec<uint8_t>&,
+                           const hidl_vec<uint8_t>&, exportKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<void> attestKey(const hidl_vec<uint8_t>&, const hidl_vec<V4_0::KeyParameter>&,
+                           attestKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<void> upgradeKey(const hidl_vec<uint8_t>&, const hidl_vec<V4_0::KeyParameter>&,
+                            upgradeKey_cb _hidl_cb) override {
+        _hidl_cb(V4_0::ErrorCode::UNIMPLEMENTED, {});
+        return Void();
+    }
+    Return<V4_0::ErrorCode> deleteKey(const hidl_vec<uint8_t>&) override {
+        return V4_0::ErrorCode::OK;
+    }
+    Return<V4_0::ErrorCode> deleteAllKeys() override { return V4_0::ErrorCode::OK; }
+    Return<V4_0::ErrorCode> destroyAttestationIds() override { return V4_0::ErrorCode::OK; }
+
+    Return<void> begin(V4_0::KeyPurpose, const hidl_vec<uint8_t>&,
+                       const hidl_vec<V4_0::KeyParameter>&, const V4_0::HardwareAuthToken&,
+                       begin_cb _hidl_cb) override {
+        wait();
+        _hidl_cb(V4_0::ErrorCode::OK, {}, mNextOperationHandle.fetch_add(1));
+        return Void();
+    }
+    Return<void> update(uint64_t, const hidl_vec<V4_0::KeyParameter>&,
+                        const hidl_vec<uint8_t>& input, const V4_0::HardwareAuthToken&,
+                        const V4_0::VerificationToken&, update_cb _hidl_cb) override {
+        wait();
+        uint32_t consumed = input.size();
+        if (mMaxConsumed != 0) consumed = std::min(consumed, mMaxConsumed);
+        hidl_vec<uint8_t> output;
+        output.setToExternal(const_cast<uint8_t*>(input.data()), consumed, false /* shouldOwn */);
+        _hidl_cb(V4_0::ErrorCode::OK, consumed, {}, output);
+        return Void();
+    }
+    Return<void> finish(uint64_t, const hidl_vec<V4_0::KeyParameter>&,
+                        const hidl_vec<uint8_t>& input, const hidl_vec<uint8_t>&,
+                        const V4_0::HardwareAuthToken&, const V4_0::VerificationToken&,
+                        finish_cb _hidl_cb) override {
+        wait();
+        _hidl_cb(V4_0::ErrorCode::OK, {}, input);
+        return Void();
+    }
+    Return<V4_0::ErrorCode> abort(uint64_t) override { return V4_0::ErrorCode::OK; }
+
+  private:
+    void wait() {
+        if (mLatency.count() > 0) std::this_thread::sleep_for(mLatency);
+    }
+
+    const std::chrono::microseconds mLatency;
+    const uint32_t mMaxConsumed;
+    std::atomic<uint64_t> mNextOperationHandle = 1;
+};
+
+std::shared_ptr<KeyMintDevice> makeDevice(std::chrono::microseconds latency,
+                                          uint32_t maxConsumed) {
+    sp<Keymaster4> keymaster =
+        new Keymaster4(new FakeKeymasterDevice(latency, maxConsumed), hidl_string("fake"));
+    return ndk::SharedRefBase::make<KeyMintDevice>(keymaster, SecurityLevel::TRUSTED_ENVIRONMENT);
+}
+
+// The fake does not look at the key blob, so any blob without km_compat's prefix sends the
+// operation to it.
+const std::vector<uint8_t> kFakeKeyBlob(64, 0x5a);
+
+std::vector<KeyParameter> makeBeginParams() {
+    return {
+        KMV1::makeKeyParameter(KMV1::TAG_BLOCK_MODE, BlockMode::CTR),
+        KMV1::makeKeyParameter(KMV1::TAG_PADDING, PaddingMode::NONE),
+        KMV1::makeKeyParameter(KMV1::TAG_NONCE, std::vector<uint8_t>(16, 0)),
+    };
+}
+
+// Arguments: payload size, fake latency in microseconds, bytes the fake consumes per update
+// (0 for all of them).
+void benchmarkArgs(benchmark::internal::Benchmark* b) {
+    for (int64_t payload : {16, 1024, 32 * 1024}) {
+        for (int64_t latencyUs : {0, 100}) {
+            b->Args({payload, latencyUs, 0});
+        }
+        b->Args({payload, 0, 256});
+    }
+    b->ThreadRange(1, 8)->UseRealTime();
+}
+
+std::shared_ptr<KeyMintDevice> makeDevice(const benchmark::State& state) {
+    return makeDevice(std::chrono::microseconds(state.range(1)),
+                      static_cast<uint32_t>(state.range(2)));
+}
+
+// A whole begin/update/finish sequence, as keystore2 does it for a small encryption.
+void BM_BeginUpdateFinish(benchmark::State& state) {
+    // Every thread has a device of its own, so they do not compete for operation slots.
+    auto device = makeDevice(state);
+    auto params = makeBeginParams();
+    std::vector<uint8_t> payload(state.range(0), 0xa5);
+    std::vector<uint8_t> output;
+    for (auto _ : state) {
+        BeginResult beginResult;
+        if (!device->begin(KeyPurpose::ENCRYPT, kFakeKeyBlob, params, std::nullopt, &beginResult)
+                 .isOk()) {
+            state.SkipWithError("begin failed");
+            break;
+        }
+        if (!beginResult.operation->update(payload, std::nullopt, std::nullopt, &output).isOk() ||
+            !beginResult.operation
+                 ->finish(std::nullopt, std::nullopt, std::nullopt, std::nullopt, std::nullopt,
+                          &output)
+                 .isOk()) {
+            state.SkipWithError("update or finish failed");
+            break;
+        }
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BeginUpdateFinish)->Apply(benchmarkArgs);
+
+// Updates on one long-running operation, which is where streaming clients spend their time.
+void BM_Update(benchmark::State& state) {
+    auto device = makeDevice(state);
+    BeginResult beginResult;
+    if (!device->begin(KeyPurpose::ENCRYPT, kFakeKeyBlob, makeBeginParams(), std::nullopt,
+                       &beginResult)
+             .isOk()) {
+        state.SkipWithError("begin failed");
+        return;
+    }
+    std::vector<uint8_t> payload(state.range(0), 0xa5);
+    std::vector<uint8_t> output;
+    for (auto _ : state) {
+        if (!beginResult.operation->update(payload, std::nullopt, std::nullopt, &output).isOk()) {
+            state.SkipWithError("update failed");
+            break;
+        }
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Update)->Apply(benchmarkArgs);
+
+// Entropy fed in 64 byte pieces, as keystore2's feeder does. Arguments: the entropy flush
+// delay in milliseconds (0 forwards every piece) and the fake latency in microseconds.
+void BM_AddRngEntropy(benchmark::State& state) {
+    auto device = makeDevice(std::chrono::microseconds(state.range(1)), 0);
+    device->setEntropyFlushDelay(std::chrono::milliseconds(state.range(0)));
+    std::vector<uint8_t> entropy(64, 0x3c);
+    for (auto _ : state) {
+        if (!device->addRngEntropy(entropy).isOk()) {
+            state.SkipWithError("addRngEntropy failed");
+            break;
+        }
+    }
+    // Forwards what is still collected, so it counts as a HAL call too.
+    device->setEntropyFlushDelay(std::chrono::milliseconds::zero());
+    state.counters["hal_calls_per_feed"] =
+        static_cast<double>(device->getNumEntropyCalls()) / state.iterations();
+}
+BENCHMARK(BM_AddRngEntropy)->Args({0, 0})->Args({0, 100})->Args({1000, 0})->Args({1000, 100});
+
+}  // namespace
+
+BENCHMARK_MAIN();
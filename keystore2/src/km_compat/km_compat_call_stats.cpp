@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "km_compat_call_stats.h"
+
+#include <aidl/android/hardware/security/keymint/ErrorCode.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+
+using ::aidl::android::hardware::security::keymint::ErrorCode;
+using ::android::base::StringAppendF;
+
+static const char* kCallStatsProperty = "ro.keystore.km_compat.call_stats";
+
+static const char* callName(CompatCall compatCall) {
+    switch (compatCall) {
+    case CompatCall::BEGIN:
+        return "begin";
+    case CompatCall::UPDATE:
+        return "update";
+    case CompatCall::FINISH:
+        return "finish";
+    case CompatCall::GENERATE_KEY:
+        return "generateKey";
+    case CompatCall::IMPORT_KEY:
+        return "importKey";
+    case CompatCall::GENERATE_TIMESTAMP:
+        return "generateTimeStamp";
+    case CompatCall::GET_SHARED_SECRET_PARAMETERS:
+        return "getSharedSecretParameters";
+    case CompatCall::COMPUTE_SHARED_SECRET:
+        return "computeSharedSecret";
+    case CompatCall::NUM_CALLS:
+        break;
+    }
+    return "unknown";
+}
+
+CompatCallStats& CompatCallStats::getInstance() {
+    static CompatCallStats instance;
+    return instance;
+}
+
+CompatCallStats::CompatCallStats()
+    : mEnabled(android::base::GetBoolProperty(kCallStatsProperty, false)) {}
+
+void CompatCallStats::record(CompatCall compatCall, std::chrono::steady_clock::duration duration,
+                             const ::ndk::ScopedAStatus& status) {
+    auto index = static_cast<size_t>(compatCall);
+    auto& stats = mStats[index];
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    size_t bucket = std::upper_bound(kBucketBoundsUs.begin(), kBucketBoundsUs.end(), us) -
+                    kBucketBoundsUs.begin();
+    stats.numCalls.fetch_add(1, std::memory_order_relaxed);
+    stats.totalTimeUs.fetch_add(us, std::memory_order_relaxed);
+    stats.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (!status.isOk()) {
+        // Anything but a service specific error means the call did not get through at all.
+        int32_t error = status.getExceptionCode() == EX_SERVICE_SPECIFIC
+                            ? status.getServiceSpecificError()
+                            : static_cast<int32_t>(ErrorCode::UNKNOWN_ERROR);
+        std::lock_guard<std::mutex> lock(mErrorsMutex);
+        mErrors[index][error]++;
+    }
+}
+
+std::string CompatCallStats::toString() {
+    if (!mEnabled) {
+        return android::base::StringPrintf("km_compat call stats are disabled (set %s=true).\n",
+                                           kCallStatsProperty);
+    }
+    std::string result = "km_compat call stats (latency buckets in us):\n";
+    std::lock_guard<std::mutex> lock(mErrorsMutex);
+    for (size_t i = 0; i < kNumCalls; i++) {
+        const auto& stats = mStats[i];
+        uint64_t numCalls = stats.numCalls.load(std::memory_order_relaxed);
+        uint64_t totalTimeUs = stats.totalTimeUs.load(std::memory_order_relaxed);
+        StringAppendF(&result, "  %s: calls=%" PRIu64 " in_flight=%d mean_us=%" PRIu64 "\n",
+                      callName(static_cast<CompatCall>(i)), numCalls,
+                      stats.inFlight.load(std::memory_order_relaxed),
+                      numCalls ? totalTimeUs / numCalls : 0);
+        result += "    latency:";
+        for (size_t b = 0; b < stats.buckets.size(); b++) {
+            if (b < kBucketBoundsUs.size()) {
+                StringAppendF(&result, " <%" PRId64 ":", kBucketBoundsUs[b]);
+            } else {
+                StringAppendF(&result, " >=%" PRId64 ":", kBucketBoundsUs.back());
+            }
+            StringAppendF(&result, "%" PRIu64, stats.buckets[b].load(std::memory_order_relaxed));
+        }
+        result += "\n";
+        if (!mErrors[i].empty()) {
+            result += "    errors:";
+            for (const auto& [error, count] : mErrors[i]) {
+                // The member toString() hides the AIDL one, so it has to be named.
+                StringAppendF(&result, " %s:%" PRIu64,
+                              ::aidl::android::hardware::security::keymint::toString(
+                                  static_cast<ErrorCode>(error))
+                                  .c_str(),
+                              count);
+            }
+            result += "\n";
+        }
+    }
+    return result;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/binder_auto_utils.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// The calls whose latency and outcome CompatCallStats tracks.
+enum class CompatCall : size_t {
+    BEGIN,
+    UPDATE,
+    FINISH,
+    GENERATE_KEY,
+    IMPORT_KEY,
+    GENERATE_TIMESTAMP,
+    GET_SHARED_SECRET_PARAMETERS,
+    COMPUTE_SHARED_SECRET,
+    NUM_CALLS,
+};
+
+// Latency histograms, error counters and in-flight gauges for the calls that km_compat forwards
+// to the legacy Keymaster HAL. Tracking is off unless ro.keystore.km_compat.call_stats is set,
+// in which case it costs a clock read and a few relaxed atomic operations per call. The numbers
+// are reported by dumpsys android.security.compat.
+class CompatCallStats {
+  public:
+    static CompatCallStats& getInstance();
+
+    // Runs call and records how long it took and what it returned.
+    template <typename F> ::ndk::ScopedAStatus track(CompatCall compatCall, F&& call) {
+        if (!mEnabled) {
+            return call();
+        }
+        auto& stats = mStats[static_cast<size_t>(compatCall)];
+        stats.inFlight.fetch_add(1, std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        ::ndk::ScopedAStatus status = call();
+        record(compatCall, std::chrono::steady_clock::now() - start, status);
+        stats.inFlight.fetch_sub(1, std::memory_order_relaxed);
+        return status;
+    }
+
+    // Returns a human readable summary of all calls, for dumpsys.
+    std::string toString();
+
+  private:
+    // Upper bounds of the latency histogram buckets, in microseconds. The last bucket is
+    // unbounded.
+    static constexpr std::array<int64_t, 9> kBucketBoundsUs = {
+        100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+    };
+    static constexpr size_t kNumCalls = static_cast<size_t>(CompatCall::NUM_CALLS);
+
+    struct Stats {
+        std::atomic<int32_t> inFlight = 0;
+        std::atomic<uint64_t> numCalls = 0;
+        std::atomic<uint64_t> totalTimeUs = 0;
+        std::array<std::atomic<uint64_t>, kBucketBoundsUs.size() + 1> buckets = {};
+    };
+
+    CompatCallStats();
+    void record(CompatCall compatCall, std::chrono::steady_clock::duration duration,
+                const ::ndk::ScopedAStatus& status);
+
+    const bool mEnabled;
+    std::array<Stats, kNumCalls> mStats;
+
+    // Errors are rare, so a map under a lock is good enough for counting them.
+    std::mutex mErrorsMutex;
+    std::array<std::map<int32_t, uint64_t>, kNumCalls> mErrors;
+};
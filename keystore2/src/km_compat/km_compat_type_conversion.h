@@ -1065,3 +1065,42 @@ static KMV1::KeyParameter convertKeyParameterFromLegacy(const V4_0::KeyParameter
 
     return KMV1::makeKeyParameter(KMV1::TAG_INVALID);
 }
+
+// Converts kps to their legacy equivalents and drops the ones that have none. The result is what
+// the HAL takes, so it can be passed on without another conversion.
+static ::android::hardware::hidl_vec<V4_0::KeyParameter>
+convertKeyParametersToLegacy(const std::vector<KMV1::KeyParameter>& kps) {
+    ::android::hardware::hidl_vec<V4_0::KeyParameter> legacyKps(kps.size());
+    size_t count = 0;
+    for (const auto& kp : kps) {
+        auto p = convertKeyParameterToLegacy(kp);
+        if (p.tag != V4_0::Tag::INVALID) {
+            legacyKps[count++] = std::move(p);
+        }
+    }
+    if (count == legacyKps.size()) {
+        return legacyKps;
+    }
+    // hidl_vec::resize copies the elements, so move them over by hand.
+    ::android::hardware::hidl_vec<V4_0::KeyParameter> trimmed(count);
+    std::move(legacyKps.begin(), legacyKps.begin() + count, trimmed.begin());
+    return trimmed;
+}
+
+// Appends the converted legacyKps to kps. Callers which know everything kps will hold can
+// reserve it up front, so that building it allocates only once.
+static void
+appendKeyParametersFromLegacy(const ::android::hardware::hidl_vec<V4_0::KeyParameter>& legacyKps,
+                              std::vector<KMV1::KeyParameter>* kps) {
+    for (const auto& legacyKp : legacyKps) {
+        kps->push_back(convertKeyParameterFromLegacy(legacyKp));
+    }
+}
+
+static std::vector<KMV1::KeyParameter>
+convertKeyParametersFromLegacy(const ::android::hardware::hidl_vec<V4_0::KeyParameter>& legacyKps) {
+    std::vector<KMV1::KeyParameter> kps;
+    kps.reserve(legacyKps.size());
+    appendKeyParametersFromLegacy(legacyKps, &kps);
+    return kps;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2021, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "km_compat_type_conversion.h"
+
+using ::android::hardware::hidl_vec;
+
+// A typical generateKey parameter list, including tags that KM 4 does not know.
+static std::vector<KMV1::KeyParameter> makeGenerateKeyParams() {
+    return {
+        KMV1::makeKeyParameter(KMV1::TAG_ALGORITHM, KMV1::Algorithm::RSA),
+        KMV1::makeKeyParameter(KMV1::TAG_KEY_SIZE, 2048),
+        KMV1::makeKeyParameter(KMV1::TAG_RSA_PUBLIC_EXPONENT, 65537),
+        KMV1::makeKeyParameter(KMV1::TAG_DIGEST, KMV1::Digest::SHA_2_256),
+        KMV1::makeKeyParameter(KMV1::TAG_DIGEST, KMV1::Digest::SHA_2_512),
+        KMV1::makeKeyParameter(KMV1::TAG_PADDING, KMV1::PaddingMode::RSA_PSS),
+        KMV1::makeKeyParameter(KMV1::TAG_PURPOSE, KMV1::KeyPurpose::SIGN),
+        KMV1::makeKeyParameter(KMV1::TAG_PURPOSE, KMV1::KeyPurpose::VERIFY),
+        KMV1::makeKeyParameter(KMV1::TAG_NO_AUTH_REQUIRED, true),
+        KMV1::makeKeyParameter(KMV1::TAG_APPLICATION_ID, std::vector<uint8_t>(32, 0xab)),
+        KMV1::makeKeyParameter(KMV1::TAG_CERTIFICATE_NOT_BEFORE, 0),
+        KMV1::makeKeyParameter(KMV1::TAG_CERTIFICATE_NOT_AFTER, 253402300799000),
+    };
+}
+
+// What km_compat used to do: build a std::vector, which the HIDL call then copies into a
+// hidl_vec.
+static hidl_vec<V4_0::KeyParameter>
+convertKeyParametersToLegacyViaVector(const std::vector<KMV1::KeyParameter>& kps) {
+    std::vector<V4_0::KeyParameter> legacyKps;
+    legacyKps.reserve(kps.size());
+    for (const auto& kp : kps) {
+        auto p = convertKeyParameterToLegacy(kp);
+        if (p.tag != V4_0::Tag::INVALID) {
+            legacyKps.push_back(std::move(p));
+        }
+    }
+    return legacyKps;
+}
+
+static void BM_ConvertToLegacyViaVector(benchmark::State& state) {
+    auto kps = makeGenerateKeyParams();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(convertKeyParametersToLegacyViaVector(kps));
+    }
+}
+BENCHMARK(BM_ConvertToLegacyViaVector);
+
+static void BM_ConvertToLegacy(benchmark::State& state) {
+    auto kps = makeGenerateKeyParams();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(convertKeyParametersToLegacy(kps));
+    }
+}
+BENCHMARK(BM_ConvertToLegacy);
+
+static void BM_ConvertFromLegacy(benchmark::State& state) {
+    auto legacyKps = convertKeyParametersToLegacy(makeGenerateKeyParams());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(convertKeyParametersFromLegacy(legacyKps));
+    }
+}
+BENCHMARK(BM_ConvertFromLegacy);
+
+BENCHMARK_MAIN();
@@ -151,6 +151,37 @@ TEST(KmCompatTypeConversionTest, testKeyParameterConversion) {
     TEST_KEY_PARAMETER_CONVERSION_V4_0(TAG_VENDOR_PATCHLEVEL);
 }
 
+TEST(KmCompatTypeConversionTest, testKeyParametersConversion) {
+    std::vector<KMV1::KeyParameter> kmv1_params = {
+        KMV1::makeKeyParameter(KMV1::TAG_ALGORITHM, KMV1::Algorithm::EC),
+        KMV1::makeKeyParameter(KMV1::TAG_CERTIFICATE_NOT_BEFORE, 0),
+        KMV1::makeKeyParameter(KMV1::TAG_APPLICATION_ID, std::vector<uint8_t>{1, 2, 3}),
+        KMV1::makeKeyParameter(KMV1::TAG_CERTIFICATE_NOT_AFTER, 1),
+        KMV1::makeKeyParameter(KMV1::TAG_NO_AUTH_REQUIRED, true),
+    };
+    std::vector<V4_0::KeyParameter> legacy_params = {
+        V4_0::makeKeyParameter(V4_0::TAG_ALGORITHM, V4_0::Algorithm::EC),
+        V4_0::makeKeyParameter(V4_0::TAG_APPLICATION_ID,
+                               ::android::hardware::hidl_vec<uint8_t>({1, 2, 3})),
+        V4_0::makeKeyParameter(V4_0::TAG_NO_AUTH_REQUIRED, true),
+    };
+
+    // Parameters that do not exist in KM 4 are dropped without disturbing the order.
+    auto converted = convertKeyParametersToLegacy(kmv1_params);
+    ASSERT_EQ(legacy_params, std::vector<V4_0::KeyParameter>(converted));
+
+    auto roundTrip = convertKeyParametersFromLegacy(converted);
+    ASSERT_EQ(3u, roundTrip.size());
+    ASSERT_EQ(kmv1_params[0], roundTrip[0]);
+    ASSERT_EQ(kmv1_params[2], roundTrip[1]);
+    ASSERT_EQ(kmv1_params[4], roundTrip[2]);
+
+    // Nothing to drop.
+    converted = convertKeyParametersToLegacy({kmv1_params[0], kmv1_params[4]});
+    ASSERT_EQ(2u, converted.size());
+    ASSERT_TRUE(convertKeyParametersToLegacy({}).size() == 0);
+}
+
 #define TEST_ERROR_CODE_CONVERSION(variant)                                                        \
     ASSERT_EQ(KMV1::ErrorCode::variant, convert(V4_0::ErrorCode::variant))
 
@@ -22,6 +22,10 @@
 #include <aidl/android/hardware/security/keymint/ErrorCode.h>
 #include <aidl/android/hardware/security/keymint/IKeyMintOperation.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 using ::aidl::android::hardware::security::keymint::Algorithm;
 using ::aidl::android::hardware::security::keymint::BlockMode;
 using ::aidl::android::hardware::security::keymint::Certificate;
@@ -165,3 +169,101 @@ TEST(SlotTest, TestSlots) {
     result = begin(device, true);
     ASSERT_TRUE(std::holds_alternative<BeginResult>(result));
 }
+
+TEST(SlotTest, TestConcurrentClaimAndFree) {
+    static const int kNumThreads = 16;
+    static const int kIterations = 10000;
+
+    OperationSlots slots;
+    slots.setNumFreeSlots(NUM_SLOTS);
+
+    std::atomic<int> inUse = 0;
+    std::atomic<int> maxInUse = 0;
+    std::atomic<int> numClaimed = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kNumThreads; i++) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < kIterations; j++) {
+                if (!slots.claimSlot()) continue;
+                numClaimed++;
+                int current = ++inUse;
+                int max = maxInUse;
+                while (current > max && !maxInUse.compare_exchange_weak(max, current)) {
+                }
+                --inUse;
+                slots.freeSlot();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // We can never have handed out more slots than there are.
+    ASSERT_LE(maxInUse, NUM_SLOTS);
+    ASSERT_GT(numClaimed, 0);
+
+    // All slots were returned, so exactly NUM_SLOTS can be claimed now.
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        ASSERT_TRUE(slots.claimSlot());
+    }
+    ASSERT_FALSE(slots.claimSlot());
+}
+
+TEST(SlotTest, TestWaitForSlot) {
+    OperationSlots slots;
+    slots.setNumFreeSlots(1);
+    slots.setMaxWaitTime(std::chrono::milliseconds(100));
+    ASSERT_TRUE(slots.claimSlot());
+
+    // Nobody frees the slot, so waiting for it times out.
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_FALSE(slots.claimSlot());
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+
+    // A slot that is freed while waiting is handed to the waiter.
+    slots.setMaxWaitTime(std::chrono::milliseconds(5000));
+    std::thread freer([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        slots.freeSlot();
+    });
+    ASSERT_TRUE(slots.claimSlot());
+    freer.join();
+
+    auto stats = slots.getWaitStats();
+    ASSERT_EQ(stats.numWaiting, 0u);
+    ASSERT_EQ(stats.maxNumWaiting, 1u);
+    ASSERT_EQ(stats.numWaits, 2u);
+    ASSERT_EQ(stats.numTimeouts, 1u);
+}
+
+TEST(SlotTest, TestOperationActivity) {
+    static std::shared_ptr<KeyMintDevice> device =
+        KeyMintDevice::createKeyMintDevice(SecurityLevel::TRUSTED_ENVIRONMENT);
+    device->setNumFreeSlots(NUM_SLOTS);
+
+    auto result = begin(device, true);
+    ASSERT_TRUE(std::holds_alternative<BeginResult>(result));
+    auto beginResult = std::move(std::get<BeginResult>(result));
+
+    auto activities = device->getOperationActivity();
+    ASSERT_EQ(activities.size(), 1u);
+    EXPECT_EQ(activities[0].challenge, beginResult.challenge);
+    EXPECT_EQ(activities[0].bytesProcessed, 0);
+    EXPECT_FALSE(activities[0].busy);
+
+    // Updates count their input and keep the operation from going idle.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::vector<uint8_t> input(32), output;
+    auto status = beginResult.operation->update(input, std::nullopt /* authToken */,
+                                                std::nullopt /* timestampToken */, &output);
+    ASSERT_TRUE(status.isOk());
+    activities = device->getOperationActivity();
+    ASSERT_EQ(activities.size(), 1u);
+    EXPECT_EQ(activities[0].bytesProcessed, 32);
+    EXPECT_LT(activities[0].idleMillis, 50);
+
+    // Operations which are gone are not reported.
+    beginResult.operation.reset();
+    EXPECT_TRUE(device->getOperationActivity().empty());
+}
@@ -130,6 +130,10 @@ impl Maintenance {
             .context("In clear_namespace: Trying to delete legacy keys.")?;
         DB.with(|db| db.borrow_mut().unbind_keys_for_namespace(domain, nspace))
             .context("In clear_namespace: Trying to delete keys from db.")?;
+        // The app namespace is cleared when the app is removed. A new app may get the same uid.
+        if domain == Domain::APP {
+            keystore2_aaid::invalidate_aaid(nspace as u32);
+        }
         self.delete_listener
             .delete_namespace(domain, nspace)
             .context("In clear_namespace: While invoking the delete listener.")
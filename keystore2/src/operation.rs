@@ -134,6 +134,7 @@ use android_hardware_security_keymint::aidl::android::hardware::security::keymin
     SecurityLevel::SecurityLevel,
 };
 use android_hardware_security_keymint::binder::BinderFeatures;
+use android_security_compat::aidl::android::security::compat::OperationActivity::OperationActivity;
 use android_system_keystore2::aidl::android::system::keystore2::{
     IKeystoreOperation::BnKeystoreOperation, IKeystoreOperation::IKeystoreOperation,
 };
@@ -171,6 +172,8 @@ pub struct Operation {
     // The index of this operation in the OperationDb.
     index: usize,
     km_op: Asp,
+    // The challenge returned by begin, which identifies the operation to the legacy wrapper.
+    challenge: i64,
     last_usage: Mutex<Instant>,
     outcome: Mutex<Outcome>,
     owner: u32, // Uid of the operation's owner.
@@ -201,6 +204,7 @@ impl LoggingInfo {
 }
 
 struct PruningInfo {
+    challenge: i64,
     last_usage: Instant,
     owner: u32,
     index: usize,
@@ -215,6 +219,7 @@ impl Operation {
     pub fn new(
         index: usize,
         km_op: binder::Strong<dyn IKeyMintOperation>,
+        challenge: i64,
         owner: u32,
         auth_info: AuthInfo,
         forced: bool,
@@ -223,6 +228,7 @@ impl Operation {
         Self {
             index,
             km_op: Asp::new(km_op.as_binder()),
+            challenge,
             last_usage: Mutex::new(Instant::now()),
             outcome: Mutex::new(Outcome::Unknown),
             owner,
@@ -248,6 +254,7 @@ impl Operation {
         //       transitioned to a final state, we will notice when we attempt to prune, and
         //       a subsequent attempt to create a new operation will succeed.
         Some(PruningInfo {
+            challenge: self.challenge,
             // Expect safety:
             // `last_usage` is locked only for primitive single line statements.
             // There is no chance to panic and poison the mutex.
@@ -509,11 +516,12 @@ impl OperationDb {
     }
 
     /// Creates a new operation.
-    /// This function takes a KeyMint operation and an associated
-    /// owner uid and returns a new Operation wrapped in a `std::sync::Arc`.
+    /// This function takes a KeyMint operation, the challenge that begin returned with it,
+    /// and an associated owner uid and returns a new Operation wrapped in a `std::sync::Arc`.
     pub fn create_operation(
         &self,
         km_op: binder::public_api::Strong<dyn IKeyMintOperation>,
+        challenge: i64,
         owner: u32,
         auth_info: AuthInfo,
         forced: bool,
@@ -533,6 +541,7 @@ impl OperationDb {
                 let new_op = Arc::new(Operation::new(
                     index - 1,
                     km_op,
+                    challenge,
                     owner,
                     auth_info,
                     forced,
@@ -545,6 +554,7 @@ impl OperationDb {
                 let new_op = Arc::new(Operation::new(
                     operations.len(),
                     km_op,
+                    challenge,
                     owner,
                     auth_info,
                     forced,
@@ -633,6 +643,22 @@ impl OperationDb {
     /// We also allow callers to cannibalize their own sibling operations if no other
     /// slot can be found. In this case the least recently used sibling is pruned.
     pub fn prune(&self, caller: u32, forced: bool) -> Result<(), Error> {
+        self.prune_with_activity(caller, forced, &HashMap::new())
+    }
+
+    /// Like `prune`, but also takes into account what the legacy wrapper reports about
+    /// its operations, keyed by their challenge. For an operation with a report:
+    /// * The age is the time since the operation last called into the legacy HAL.
+    /// * An operation with a call in progress, or waiting to call into the HAL, is not pruned.
+    /// * Streaming operations gain resistance with the input they have taken, which
+    ///   lowers their malus by floor(log16(<input in KiB> / 4 + 1)). So the malus
+    ///   decreases stepwise after 60KiB, 1020KiB, ...
+    pub fn prune_with_activity(
+        &self,
+        caller: u32,
+        forced: bool,
+        activity: &HashMap<i64, OperationActivity>,
+    ) -> Result<(), Error> {
         loop {
             // Maps the uid of the owner to the number of operations that owner has
             // (running_siblings). More operations per owner lowers the pruning
@@ -672,11 +698,25 @@ impl OperationDb {
             let mut oldest_caller_op: Option<CandidateInfo> = None;
             let candidate = pruning_info.iter().fold(
                 None,
-                |acc: Option<CandidateInfo>, &PruningInfo { last_usage, owner, index, forced }| {
+                |acc: Option<CandidateInfo>,
+                 &PruningInfo { challenge, last_usage, owner, index, forced }| {
+                    let op_activity = activity.get(&challenge);
+                    // An operation with a call in progress would not be pruned by abort anyway.
+                    if op_activity.map_or(false, |a| a.busy) {
+                        return acc;
+                    }
+
                     // Compute the age of the current operation.
-                    let age = now
-                        .checked_duration_since(last_usage)
-                        .unwrap_or_else(|| Duration::new(0, 0));
+                    let age = match op_activity {
+                        Some(a) => Duration::from_millis(a.idleMillis.max(0) as u64),
+                        None => now
+                            .checked_duration_since(last_usage)
+                            .unwrap_or_else(|| Duration::new(0, 0)),
+                    };
+                    let streaming_bonus = op_activity.map_or(0, |a| {
+                        ((a.bytesProcessed.max(0) as u64 / 4096 + 1) as f64).log(16.0).floor()
+                            as u64
+                    });
 
                     // Find the least recently used sibling as an alternative pruning candidate.
                     if owner == caller {
@@ -699,9 +739,10 @@ impl OperationDb {
                     } else {
                         // Expect safety: Every owner in pruning_info was counted in
                         // the owners map. So this unwrap cannot panic.
-                        *owners.get(&owner).expect(
+                        (*owners.get(&owner).expect(
                             "This is odd. We should have counted every owner in pruning_info.",
-                        ) + ((age.as_secs() + 1) as f64).log(6.0).floor() as u64
+                        ) + ((age.as_secs() + 1) as f64).log(6.0).floor() as u64)
+                            .saturating_sub(streaming_bonus)
                     };
 
                     // Now check if the current operation is a viable/better candidate
@@ -19,7 +19,9 @@ use crate::audit_log::{
     log_key_deleted, log_key_generated, log_key_imported, log_key_integrity_violation,
 };
 use crate::database::{CertificateInfo, KeyIdGuard};
-use crate::error::{self, map_km_error, map_or_log_err, Error, ErrorCode};
+use crate::error::{
+    self, map_binder_status, map_binder_status_code, map_km_error, map_or_log_err, Error, ErrorCode,
+};
 use crate::globals::{DB, ENFORCEMENTS, LEGACY_MIGRATOR, SUPER_KEY};
 use crate::key_parameter::KeyParameter as KsKeyParam;
 use crate::key_parameter::KeyParameterValue as KsKeyParamValue;
@@ -49,6 +51,9 @@ use android_hardware_security_keymint::aidl::android::hardware::security::keymin
     KeyParameterValue::KeyParameterValue, SecurityLevel::SecurityLevel, Tag::Tag,
 };
 use android_hardware_security_keymint::binder::{BinderFeatures, Strong, ThreadState};
+use android_security_compat::aidl::android::security::compat::{
+    IKeystoreCompatService::IKeystoreCompatService, OperationActivity::OperationActivity,
+};
 use android_system_keystore2::aidl::android::system::keystore2::{
     AuthenticatorSpec::AuthenticatorSpec, CreateOperationResponse::CreateOperationResponse,
     Domain::Domain, EphemeralStorageKeyResponse::EphemeralStorageKeyResponse,
@@ -57,6 +62,7 @@ use android_system_keystore2::aidl::android::system::keystore2::{
     KeyMetadata::KeyMetadata, KeyParameters::KeyParameters,
 };
 use anyhow::{anyhow, Context, Result};
+use std::collections::HashMap;
 
 /// Implementation of the IKeystoreSecurityLevel Interface.
 pub struct KeystoreSecurityLevel {
@@ -107,6 +113,28 @@ impl KeystoreSecurityLevel {
         wd::watch_millis_with(id, millis, move || format!("SecurityLevel {:?}", sec_level))
     }
 
+    /// Returns what the legacy wrapper knows about the activity of its operations, keyed by
+    /// their challenge. This is empty for genuine KeyMint devices, which do not report it,
+    /// and if the legacy wrapper cannot be asked.
+    fn get_compat_operation_activity(&self) -> HashMap<i64, OperationActivity> {
+        // The legacy wrapper reports the version of the underlying Keymaster HAL, see
+        // `globals::connect_keymint`.
+        if self.hw_info.versionNumber >= 100 {
+            return HashMap::new();
+        }
+        let activity = map_binder_status_code(binder::get_interface::<dyn IKeystoreCompatService>(
+            "android.security.compat",
+        ))
+        .and_then(|compat| map_binder_status(compat.getOperationActivity(self.security_level)));
+        match activity {
+            Ok(activity) => activity.into_iter().map(|a| (a.challenge, a)).collect(),
+            Err(e) => {
+                log::error!("Failed to get the operation activity of the legacy wrapper: {:?}", e);
+                HashMap::new()
+            }
+        }
+    }
+
     fn store_new_key(
         &self,
         key: KeyDescriptor,
@@ -325,7 +353,11 @@ impl KeystoreSecurityLevel {
                         km_dev.begin(purpose, blob, &operation_parameters, immediate_hat.as_ref())
                     }) {
                         Err(Error::Km(ErrorCode::TOO_MANY_OPERATIONS)) => {
-                            self.operation_db.prune(caller_uid, forced)?;
+                            self.operation_db.prune_with_activity(
+                                caller_uid,
+                                forced,
+                                &self.get_compat_operation_activity(),
+                            )?;
                             continue;
                         }
                         v @ Err(Error::Km(ErrorCode::INVALID_KEY_BLOB)) => {
@@ -353,6 +385,7 @@ impl KeystoreSecurityLevel {
         let operation = match begin_result.operation {
             Some(km_op) => self.operation_db.create_operation(
                 km_op,
+                begin_result.challenge,
                 caller_uid,
                 auth_info,
                 forced,
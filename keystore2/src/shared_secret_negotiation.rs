@@ -22,9 +22,10 @@ use android_hardware_security_sharedsecret::aidl::android::hardware::security::s
 };
 use android_security_compat::aidl::android::security::compat::IKeystoreCompatService::IKeystoreCompatService;
 use anyhow::{Context, Result};
-use keystore2_vintf::{get_aidl_instances, get_hidl_instances};
+use keystore2_vintf::{get_cached_aidl_instances, get_cached_hidl_instances};
 use std::fmt::{self, Display, Formatter};
-use std::time::Duration;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
 /// This function initiates the shared secret negotiation. It starts a thread and then returns
 /// immediately. The thread consults the vintf manifest to enumerate expected negotiation
@@ -117,7 +118,7 @@ fn list_participants() -> Result<Vec<SharedSecretParticipant>> {
     Ok([(4, 1), (4, 0)]
         .iter()
         .map(|(ma, mi)| {
-            get_hidl_instances(KEYMASTER_PACKAGE_NAME, *ma, *mi, KEYMASTER_INTERFACE_NAME)
+            get_cached_hidl_instances(KEYMASTER_PACKAGE_NAME, *ma, *mi, KEYMASTER_INTERFACE_NAME)
                 .as_vec()
                 .with_context(|| format!("Trying to convert KM{}.{} names to vector.", *ma, *mi))
                 .map(|instances| {
@@ -149,13 +150,16 @@ fn list_participants() -> Result<Vec<SharedSecretParticipant>> {
         .collect::<Result<Vec<_>>>()
         .map(|v| v.into_iter().flatten())
         .and_then(|i| {
-            let participants_aidl: Vec<SharedSecretParticipant> =
-                get_aidl_instances(SHARED_SECRET_PACKAGE_NAME, 1, SHARED_SECRET_INTERFACE_NAME)
-                    .as_vec()
-                    .context("In list_participants: Trying to convert KM1.0 names to vector.")?
-                    .into_iter()
-                    .map(|name| SharedSecretParticipant::Aidl(name.to_string()))
-                    .collect();
+            let participants_aidl: Vec<SharedSecretParticipant> = get_cached_aidl_instances(
+                SHARED_SECRET_PACKAGE_NAME,
+                1,
+                SHARED_SECRET_INTERFACE_NAME,
+            )
+            .as_vec()
+            .context("In list_participants: Trying to convert KM1.0 names to vector.")?
+            .into_iter()
+            .map(|name| SharedSecretParticipant::Aidl(name.to_string()))
+            .collect();
             Ok(i.chain(participants_aidl.into_iter()))
         })
         .context("In list_participants.")?
@@ -242,17 +246,58 @@ fn connect_participants(
     connected_participants
 }
 
+/// Calls `f` for every participant on a thread of its own and returns the results in the order
+/// of `participants`. The participants are independent of each other, so this way a slow one,
+/// typically StrongBox, does not hold up the rest, and a negotiation phase takes as long as its
+/// slowest participant rather than the sum of all of them.
+fn for_each_participant<T, F>(
+    participants: &[(Strong<dyn ISharedSecret>, SharedSecretParticipant)],
+    phase: &'static str,
+    f: F,
+) -> Vec<T>
+where
+    T: Send + 'static,
+    F: Fn(&dyn ISharedSecret, SharedSecretParticipant) -> T + Send + Sync + 'static,
+{
+    let f = Arc::new(f);
+    let start = Instant::now();
+    let handles: Vec<_> = participants
+        .iter()
+        .map(|(s, p)| {
+            let (s, p, f) = (s.clone(), p.clone(), f.clone());
+            std::thread::spawn(move || {
+                let participant_start = Instant::now();
+                let participant = p.to_string();
+                let result = f(&*s, p);
+                log::info!(
+                    "Shared secret negotiation: {} on {} took {:?}.",
+                    phase,
+                    participant,
+                    participant_start.elapsed()
+                );
+                result
+            })
+        })
+        .collect();
+    let results = handles
+        .into_iter()
+        .map(|h| h.join().expect("In for_each_participant: Participant thread panicked."))
+        .collect();
+    log::info!("Shared secret negotiation: {} took {:?} in total.", phase, start.elapsed());
+    results
+}
+
 fn negotiate_shared_secret(
     participants: Vec<(Strong<dyn ISharedSecret>, SharedSecretParticipant)>,
 ) {
     // Phase 1: Get the sharing parameters from all participants.
     let mut params = loop {
-        let result: Result<Vec<SharedSecretParameters>, SharedSecretError> = participants
-            .iter()
-            .map(|(s, p)| {
+        let result: Result<Vec<SharedSecretParameters>, SharedSecretError> =
+            for_each_participant(&participants, "getSharedSecretParameters", |s, p| {
                 map_binder_status(s.getSharedSecretParameters())
-                    .map_err(|e| SharedSecretError::ParameterRetrieval { e, p: (*p).clone() })
+                    .map_err(|e| SharedSecretError::ParameterRetrieval { e, p })
             })
+            .into_iter()
             .collect();
 
         match result {
@@ -268,18 +313,20 @@ fn negotiate_shared_secret(
     params.sort_unstable();
 
     // Phase 2: Send the sorted sharing parameters to all participants.
-    let negotiation_result = participants.into_iter().try_fold(None, |acc, (s, p)| {
-        match (acc, map_binder_status(s.computeSharedSecret(&params))) {
-            (None, Ok(new_sum)) => Ok(Some(new_sum)),
-            (Some(old_sum), Ok(new_sum)) => {
-                if old_sum == new_sum {
-                    Ok(Some(old_sum))
-                } else {
-                    Err(SharedSecretError::Checksum(p))
-                }
+    let params = Arc::new(params);
+    let sums = for_each_participant(&participants, "computeSharedSecret", move |s, p| {
+        (map_binder_status(s.computeSharedSecret(&params)), p)
+    });
+    let negotiation_result = sums.into_iter().try_fold(None, |acc, (sum, p)| match (acc, sum) {
+        (None, Ok(new_sum)) => Ok(Some(new_sum)),
+        (Some(old_sum), Ok(new_sum)) => {
+            if old_sum == new_sum {
+                Ok(Some(old_sum))
+            } else {
+                Err(SharedSecretError::Checksum(p))
             }
-            (_, Err(e)) => Err(SharedSecretError::Computation { e, p }),
         }
+        (_, Err(e)) => Err(SharedSecretError::Computation { e, p }),
     });
 
     if let Err(e) = negotiation_result {
@@ -43,7 +43,7 @@ use android_system_keystore2::aidl::android::system::keystore2::{
 };
 use anyhow::{Context, Result};
 use keystore2_crypto::{
-    aes_gcm_decrypt, aes_gcm_encrypt, generate_aes256_key, generate_salt, Password, ZVec,
+    aes_gcm_decrypt, aes_gcm_encrypt, generate_aes256_key, generate_salt, AesGcm, Password, ZVec,
     AES_256_KEY_LENGTH,
 };
 use keystore2_system_property::PropertyWatcher;
@@ -155,19 +155,52 @@ pub struct SuperKey {
     /// reencrypt_with field to point at the corresponding AES key, and the
     /// keys will be re-encrypted with AES on first use.
     reencrypt_with: Option<Arc<SuperKey>>,
+    /// AES super keys keep their expanded key schedule around, so that the many blobs
+    /// encrypted with the same super key do not each pay for the key setup.
+    aes_gcm: Option<AesGcm>,
 }
 
 impl SuperKey {
+    fn new(
+        algorithm: SuperEncryptionAlgorithm,
+        key: ZVec,
+        id: SuperKeyIdentifier,
+        reencrypt_with: Option<Arc<SuperKey>>,
+    ) -> Self {
+        let aes_gcm = match algorithm {
+            SuperEncryptionAlgorithm::Aes256Gcm => AesGcm::new(&key)
+                .map_err(|e| log::warn!("In SuperKey::new: AesGcm::new failed: {:?}", e))
+                .ok(),
+            _ => None,
+        };
+        SuperKey { algorithm, key, id, reencrypt_with, aes_gcm }
+    }
+
     /// For most purposes `unwrap_key` handles decryption,
     /// but legacy handling and some tests need to assume AES and decrypt directly.
     pub fn aes_gcm_decrypt(&self, data: &[u8], iv: &[u8], tag: &[u8]) -> Result<ZVec> {
         if self.algorithm == SuperEncryptionAlgorithm::Aes256Gcm {
-            aes_gcm_decrypt(data, iv, tag, &self.key)
-                .context("In aes_gcm_decrypt: decryption failed")
+            match &self.aes_gcm {
+                Some(aes_gcm) => aes_gcm.decrypt(data, iv, tag),
+                None => aes_gcm_decrypt(data, iv, tag, &self.key),
+            }
+            .context("In aes_gcm_decrypt: decryption failed")
         } else {
             Err(Error::sys()).context("In aes_gcm_decrypt: Key is not an AES key")
         }
     }
+
+    fn aes_gcm_encrypt(&self, plaintext: &[u8]) -> Result<(Vec<u8>, Vec<u8>, Vec<u8>)> {
+        if self.algorithm == SuperEncryptionAlgorithm::Aes256Gcm {
+            match &self.aes_gcm {
+                Some(aes_gcm) => aes_gcm.encrypt(plaintext),
+                None => aes_gcm_encrypt(plaintext, &self.key),
+            }
+            .context("In aes_gcm_encrypt: encryption failed")
+        } else {
+            Err(Error::sys()).context("In aes_gcm_encrypt: Key is not an AES key")
+        }
+    }
 }
 
 /// A SuperKey that has been encrypted with an AES-GCM key. For
@@ -219,7 +252,7 @@ impl LockedKey {
             Some(auth_token),
             &self.ciphertext,
         )?)?;
-        Ok(Arc::new(SuperKey { algorithm: self.algorithm, key, id: self.id, reencrypt_with }))
+        Ok(Arc::new(SuperKey::new(self.algorithm, key, self.id, reencrypt_with)))
     }
 }
 
@@ -368,12 +401,7 @@ impl SuperKeyManager {
                 .context("In lookup_key: aes_key failed")?
                 .flatten()
                 .map(|key| {
-                    Arc::new(SuperKey {
-                        algorithm: SuperEncryptionAlgorithm::Aes256Gcm,
-                        key,
-                        id: *key_id,
-                        reencrypt_with: None,
-                    })
+                    Arc::new(SuperKey::new(SuperEncryptionAlgorithm::Aes256Gcm, key, *key_id, None))
                 }),
         })
     }
@@ -644,12 +672,12 @@ impl SuperKeyManager {
                     ));
                 }
             };
-            Ok(Arc::new(SuperKey {
+            Ok(Arc::new(SuperKey::new(
                 algorithm,
                 key,
-                id: SuperKeyIdentifier::DatabaseId(entry.id()),
+                SuperKeyIdentifier::DatabaseId(entry.id()),
                 reencrypt_with,
-            }))
+            )))
         } else {
             Err(Error::Rc(ResponseCode::VALUE_CORRUPTED))
                 .context("In extract_super_key_from_key_entry: No key blob info.")
@@ -713,7 +741,8 @@ impl SuperKeyManager {
                 .context("In encrypt_with_aes_super_key: unexpected algorithm");
         }
         let mut metadata = BlobMetaData::new();
-        let (encrypted_key, iv, tag) = aes_gcm_encrypt(key_blob, &(super_key.key))
+        let (encrypted_key, iv, tag) = super_key
+            .aes_gcm_encrypt(key_blob)
             .context("In encrypt_with_aes_super_key: Failed to encrypt new super key.")?;
         metadata.add(BlobMetaEntry::Iv(iv));
         metadata.add(BlobMetaEntry::AeadTag(tag));
@@ -867,12 +896,12 @@ impl SuperKeyManager {
                     &key_metadata,
                 )
                 .context("In get_or_create_super_key. Failed to store super key.")?;
-            Ok(Arc::new(SuperKey {
-                algorithm: key_type.algorithm,
-                key: super_key,
-                id: SuperKeyIdentifier::DatabaseId(key_entry.id()),
+            Ok(Arc::new(SuperKey::new(
+                key_type.algorithm,
+                super_key,
+                SuperKeyIdentifier::DatabaseId(key_entry.id()),
                 reencrypt_with,
-            }))
+            )))
         }
     }
 
@@ -15,7 +15,9 @@
 //! Bindings for getting the list of HALs.
 
 use keystore2_vintf_bindgen::{
-    freeNames, getAidlInstances, getHalNames, getHalNamesAndVersions, getHidlInstances,
+    freeNames, getAidlInstances, getCachedAidlInstances, getCachedHalNames,
+    getCachedHalNamesAndVersions, getCachedHidlInstances, getHalNames, getHalNamesAndVersions,
+    getHidlInstances,
 };
 use std::ffi::{CStr, CString};
 use std::os::raw::c_char;
@@ -105,6 +107,82 @@ pub fn get_aidl_instances(package: &str, version: usize, interface_name: &str) -
     HalNames { data: raw_strs, len }
 }
 
+/// A list of HALs (optionally with version numbers) owned by the process-wide cache of our C
+/// shim. It is never freed, so the strings can be borrowed for the 'static lifetime.
+#[derive(Clone, Copy)]
+pub struct CachedHalNames {
+    data: *const *const c_char,
+    len: usize,
+}
+
+impl CachedHalNames {
+    /// Get a Vec view of the list of HALs without copying the strings.
+    pub fn as_vec(&self) -> Result<Vec<&'static str>, Utf8Error> {
+        // Safety: self.data contains self.len C strings, which the cache keeps alive until the
+        // process exits.
+        unsafe { (0..self.len).map(|i| CStr::from_ptr(*self.data.add(i)).to_str()) }.collect()
+    }
+}
+
+/// Like get_hal_names, but the manifest is only queried on the first call.
+pub fn get_cached_hal_names() -> CachedHalNames {
+    let mut len: usize = 0;
+    // Safety: The returned array belongs to the cache. It stores its size in len.
+    let data = unsafe { getCachedHalNames(&mut len) };
+    CachedHalNames { data, len }
+}
+
+/// Like get_hal_names_and_versions, but the manifest is only queried on the first call.
+pub fn get_cached_hal_names_and_versions() -> CachedHalNames {
+    let mut len: usize = 0;
+    // Safety: The returned array belongs to the cache. It stores its size in len.
+    let data = unsafe { getCachedHalNamesAndVersions(&mut len) };
+    CachedHalNames { data, len }
+}
+
+/// Like get_hidl_instances, but the manifest is only queried on the first call with the given
+/// arguments.
+pub fn get_cached_hidl_instances(
+    package: &str,
+    major_version: usize,
+    minor_version: usize,
+    interface_name: &str,
+) -> CachedHalNames {
+    let mut len: usize = 0;
+    let packages = CString::new(package).expect("Failed to make CString from package.");
+    let interface_name =
+        CString::new(interface_name).expect("Failed to make CString from interface_name.");
+    // Safety: The returned array belongs to the cache. It stores its size in len.
+    let data = unsafe {
+        getCachedHidlInstances(
+            &mut len,
+            packages.as_ptr(),
+            major_version,
+            minor_version,
+            interface_name.as_ptr(),
+        )
+    };
+    CachedHalNames { data, len }
+}
+
+/// Like get_aidl_instances, but the manifest is only queried on the first call with the given
+/// arguments.
+pub fn get_cached_aidl_instances(
+    package: &str,
+    version: usize,
+    interface_name: &str,
+) -> CachedHalNames {
+    let mut len: usize = 0;
+    let packages = CString::new(package).expect("Failed to make CString from package.");
+    let interface_name =
+        CString::new(interface_name).expect("Failed to make CString from interface_name.");
+    // Safety: The returned array belongs to the cache. It stores its size in len.
+    let data = unsafe {
+        getCachedAidlInstances(&mut len, packages.as_ptr(), version, interface_name.as_ptr())
+    };
+    CachedHalNames { data, len }
+}
+
 #[cfg(test)]
 mod tests {
 
@@ -124,4 +202,45 @@ mod tests {
 
         Ok(())
     }
+
+    #[test]
+    fn test_cached() -> Result<(), Utf8Error> {
+        assert_eq!(get_cached_hal_names().as_vec()?, get_hal_names().as_vec()?);
+        assert_eq!(
+            get_cached_hal_names_and_versions().as_vec()?,
+            get_hal_names_and_versions().as_vec()?
+        );
+        let package = "android.hardware.security.keymint";
+        assert_eq!(
+            get_cached_aidl_instances(package, 1, "IKeyMintDevice").as_vec()?,
+            get_aidl_instances(package, 1, "IKeyMintDevice").as_vec()?
+        );
+        let package = "android.hardware.keymaster";
+        assert_eq!(
+            get_cached_hidl_instances(package, 4, 1, "IKeymasterDevice").as_vec()?,
+            get_hidl_instances(package, 4, 1, "IKeymasterDevice").as_vec()?
+        );
+        Ok(())
+    }
+
+    // The queries keystore2 makes while starting up are answered from the cache after the first
+    // call, with the same result as straight from the manifest.
+    #[test]
+    fn test_cached_startup_queries() -> Result<(), Utf8Error> {
+        let queries = [
+            ("android.hardware.security.keymint", "IKeyMintDevice"),
+            ("android.hardware.security.keymint", "IRemotelyProvisionedComponent"),
+            ("android.hardware.security.secureclock", "ISecureClock"),
+            ("android.hardware.security.sharedsecret", "ISharedSecret"),
+        ];
+        for (package, interface_name) in queries.iter() {
+            let first = get_cached_aidl_instances(package, 1, interface_name);
+            let second = get_cached_aidl_instances(package, 1, interface_name);
+            // The second call must not have built a new array.
+            assert_eq!(first.data, second.data);
+            assert_eq!(first.len, second.len);
+            assert_eq!(first.as_vec()?, get_aidl_instances(package, 1, interface_name).as_vec()?);
+        }
+        Ok(())
+    }
 }
@@ -16,6 +16,13 @@
 
 #include "vintf.hpp"
 
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include <vintf/HalManifest.h>
 #include <vintf/VintfObject.h>
 
@@ -66,3 +73,81 @@ void freeNames(char** names, size_t len) {
     }
     delete[] names;
 }
+
+namespace {
+
+// The result of one query, with the C strings pointing into |names|.
+struct CachedNames {
+    explicit CachedNames(std::set<std::string> result) : names(std::move(result)) {
+        for (const auto& name : names) {
+            cStrings.push_back(name.c_str());
+        }
+    }
+    const std::set<std::string> names;
+    std::vector<const char*> cStrings;
+};
+
+// Returns the cached result of the query identified by |key|, running |query| the first time.
+// Entries are never removed, so the returned array stays valid.
+const char* const* getCached(const std::string& key,
+                             const std::function<std::set<std::string>()>& query, size_t* len) {
+    static std::mutex* cacheMutex = new std::mutex();
+    static auto* cache = new std::map<std::string, std::unique_ptr<CachedNames>>();
+
+    std::lock_guard<std::mutex> lock(*cacheMutex);
+    auto& entry = (*cache)[key];
+    if (!entry) {
+        entry = std::make_unique<CachedNames>(query());
+    }
+    *len = entry->cStrings.size();
+    return entry->cStrings.data();
+}
+
+}  // namespace
+
+const char* const* getCachedHalNames(size_t* len) {
+    return getCached(
+        "names",
+        [] {
+            auto manifest = android::vintf::VintfObject::GetDeviceHalManifest();
+            return manifest->getHalNames();
+        },
+        len);
+}
+
+const char* const* getCachedHalNamesAndVersions(size_t* len) {
+    return getCached(
+        "names_and_versions",
+        [] {
+            auto manifest = android::vintf::VintfObject::GetDeviceHalManifest();
+            return manifest->getHalNamesAndVersions();
+        },
+        len);
+}
+
+const char* const* getCachedHidlInstances(size_t* len, const char* package, size_t major_version,
+                                          size_t minor_version, const char* interfaceName) {
+    android::vintf::Version version(major_version, minor_version);
+    std::string key = std::string("hidl/") + package + "@" + std::to_string(major_version) +
+                      "." + std::to_string(minor_version) + "::" + interfaceName;
+    return getCached(
+        key,
+        [&] {
+            auto manifest = android::vintf::VintfObject::GetDeviceHalManifest();
+            return manifest->getHidlInstances(package, version, interfaceName);
+        },
+        len);
+}
+
+const char* const* getCachedAidlInstances(size_t* len, const char* package, size_t version,
+                                          const char* interfaceName) {
+    std::string key = std::string("aidl/") + package + "@" + std::to_string(version) + "::" +
+                      interfaceName;
+    return getCached(
+        key,
+        [&] {
+            auto manifest = android::vintf::VintfObject::GetDeviceHalManifest();
+            return manifest->getAidlInstances(package, version, interfaceName);
+        },
+        len);
+}
@@ -28,6 +28,16 @@ char** getHidlInstances(size_t* len, const char* package, size_t major_version,
 char** getAidlInstances(size_t* len, const char* package, size_t version,
                         const char* interfaceName);
 void freeNames(char** names, size_t len);
+
+// Like the functions above, but the result of each distinct query is computed once and kept
+// for the lifetime of the process. The returned arrays point into that cache and must not be
+// freed.
+const char* const* getCachedHalNames(size_t* len);
+const char* const* getCachedHalNamesAndVersions(size_t* len);
+const char* const* getCachedHidlInstances(size_t* len, const char* package, size_t major_version,
+                                          size_t minor_version, const char* interfaceName);
+const char* const* getCachedAidlInstances(size_t* len, const char* package, size_t version,
+                                          const char* interfaceName);
 }
 
 #endif  //  __VINTF_H__
@@ -18,7 +18,9 @@
 #include <android-base/result.h>
 
 #include <openssl/bn.h>
+#include <openssl/bytestring.h>
 #include <openssl/crypto.h>
+#include <openssl/mem.h>
 #include <openssl/pkcs7.h>
 #include <openssl/rsa.h>
 #include <openssl/x509v3.h>
@@ -26,6 +28,7 @@
 #include <fcntl.h>
 #include <vector>
 
+#include "CertUtils.h"
 #include "KeyConstants.h"
 
 const char kBasicConstraints[] = "CA:TRUE";
@@ -67,14 +70,13 @@ Result<bssl::UniquePtr<RSA>> getRsa(const std::vector<uint8_t>& publicKey) {
 }
 
 Result<void> verifySignature(const std::string& message, const std::string& signature,
-                             const std::vector<uint8_t>& publicKey) {
-    auto rsaKey = getRsa(publicKey);
+                             const RSA& publicKey) {
     uint8_t hashBuf[SHA256_DIGEST_LENGTH];
     SHA256(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(message.c_str())),
            message.length(), hashBuf);
 
     bool success = RSA_verify(NID_sha256, hashBuf, sizeof(hashBuf),
-                              (const uint8_t*)signature.c_str(), signature.length(), rsaKey->get());
+                              (const uint8_t*)signature.c_str(), signature.length(), &publicKey);
 
     if (!success) {
         return Error() << "Failed to verify signature.";
@@ -82,6 +84,15 @@ Result<void> verifySignature(const std::string& message, const std::string& sign
     return {};
 }
 
+Result<void> verifySignature(const std::string& message, const std::string& signature,
+                             const std::vector<uint8_t>& publicKey) {
+    auto rsaKey = getRsa(publicKey);
+    if (!rsaKey.ok()) {
+        return rsaKey.error();
+    }
+    return verifySignature(message, signature, **rsaKey);
+}
+
 Result<void> createSelfSignedCertificate(
     const std::vector<uint8_t>& publicKey,
     const std::function<Result<std::string>(const std::string&)>& signFunction,
@@ -214,58 +225,102 @@ Result<std::vector<uint8_t>> extractPublicKeyFromX509(const std::string& path) {
     return extractPublicKey(X509_get_pubkey(cert));
 }
 
-Result<std::vector<uint8_t>> createPkcs7(const std::vector<uint8_t>& signed_digest) {
-    CBB out, outer_seq, wrapped_seq, seq, digest_algos_set, digest_algo, null;
-    CBB content_info, issuer_and_serial, signer_infos, signer_info, sign_algo, signature;
-    uint8_t *pkcs7_data, *name_der;
-    size_t pkcs7_data_len, name_der_len;
-    BIGNUM* serial = BN_new();
-    int sig_nid = NID_rsaEncryption;
-
-    X509_NAME* name = X509_NAME_new();
+// Upper bound on what build() adds to the pre-encoded parts: six ASN.1 headers of up to 6 bytes
+// each, and the content type OID.
+constexpr size_t kPkcs7Overhead = 6 * 6 + 16;
+
+Result<Pkcs7Builder> Pkcs7Builder::create() {
+    bssl::UniquePtr<X509_NAME> name(X509_NAME_new());
     if (!name) {
         return Error() << "Unable to get x509 subject name";
     }
-    X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC,
+    X509_NAME_add_entry_by_txt(name.get(), "C", MBSTRING_ASC,
                                reinterpret_cast<const unsigned char*>("US"), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+    X509_NAME_add_entry_by_txt(name.get(), "O", MBSTRING_ASC,
                                reinterpret_cast<const unsigned char*>("Android"), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+    X509_NAME_add_entry_by_txt(name.get(), "CN", MBSTRING_ASC,
                                reinterpret_cast<const unsigned char*>("ODS"), -1, -1, 0);
+    uint8_t* name_der = nullptr;
+    int name_der_len = i2d_X509_NAME(name.get(), &name_der);
+    if (name_der_len < 0) {
+        return Error() << "Unable to encode x509 subject name";
+    }
+    bssl::UniquePtr<uint8_t> name_der_deleter(name_der);
+    bssl::UniquePtr<BIGNUM> serial(BN_new());
+    if (!serial || !BN_set_word(serial.get(), 1)) {
+        return Error() << "Unable to create serial number";
+    }
 
-    BN_set_word(serial, 1);
-    name_der_len = i2d_X509_NAME(name, &name_der);
-    CBB_init(&out, 1024);
+    // See https://tools.ietf.org/html/rfc2315#section-9.1
+    // The SignedData fields before signerInfos.
+    bssl::ScopedCBB signed_data;
+    CBB digest_algos_set, digest_algo, null, content_info;
+    if (!CBB_init(signed_data.get(), 64) ||
+        !CBB_add_asn1_uint64(signed_data.get(), 1 /* version */) ||
+        !CBB_add_asn1(signed_data.get(), &digest_algos_set, CBS_ASN1_SET) ||
+        !CBB_add_asn1(&digest_algos_set, &digest_algo, CBS_ASN1_SEQUENCE) ||
+        !OBJ_nid2cbb(&digest_algo, NID_sha256) ||
+        !CBB_add_asn1(&digest_algo, &null, CBS_ASN1_NULL) ||
+        !CBB_add_asn1(signed_data.get(), &content_info, CBS_ASN1_SEQUENCE) ||
+        !OBJ_nid2cbb(&content_info, NID_pkcs7_data) || !CBB_flush(signed_data.get())) {
+        return Error() << "Failed to create PKCS7 certificate.";
+    }
+
+    // The SignerInfo fields before encryptedDigest.
+    bssl::ScopedCBB signer_info;
+    CBB issuer_and_serial, sign_algo;
+    if (!CBB_init(signer_info.get(), 128) ||
+        !CBB_add_asn1_uint64(signer_info.get(), 1 /* version */) ||
+        !CBB_add_asn1(signer_info.get(), &issuer_and_serial, CBS_ASN1_SEQUENCE) ||
+        !CBB_add_bytes(&issuer_and_serial, name_der, name_der_len) ||
+        !BN_marshal_asn1(&issuer_and_serial, serial.get()) ||
+        !CBB_add_asn1(signer_info.get(), &digest_algo, CBS_ASN1_SEQUENCE) ||
+        !OBJ_nid2cbb(&digest_algo, NID_sha256) ||
+        !CBB_add_asn1(&digest_algo, &null, CBS_ASN1_NULL) ||
+        !CBB_add_asn1(signer_info.get(), &sign_algo, CBS_ASN1_SEQUENCE) ||
+        !OBJ_nid2cbb(&sign_algo, NID_rsaEncryption) ||
+        !CBB_add_asn1(&sign_algo, &null, CBS_ASN1_NULL) || !CBB_flush(signer_info.get())) {
+        return Error() << "Failed to create PKCS7 certificate.";
+    }
+
+    Pkcs7Builder builder;
+    builder.mSignedDataHeader.assign(CBB_data(signed_data.get()),
+                                     CBB_data(signed_data.get()) + CBB_len(signed_data.get()));
+    builder.mSignerInfoHeader.assign(CBB_data(signer_info.get()),
+                                     CBB_data(signer_info.get()) + CBB_len(signer_info.get()));
+    return builder;
+}
 
-    if (!CBB_add_asn1(&out, &outer_seq, CBS_ASN1_SEQUENCE) ||
+Result<std::vector<uint8_t>> Pkcs7Builder::build(const std::vector<uint8_t>& signed_digest) const {
+    // Encode straight into the result, which is then only trimmed to the actual length.
+    std::vector<uint8_t> pkcs7(kPkcs7Overhead + mSignedDataHeader.size() +
+                               mSignerInfoHeader.size() + signed_digest.size());
+    CBB out, outer_seq, wrapped_seq, seq, signer_infos, signer_info, signature;
+    size_t pkcs7_len;
+    if (!CBB_init_fixed(&out, pkcs7.data(), pkcs7.size()) ||
+        !CBB_add_asn1(&out, &outer_seq, CBS_ASN1_SEQUENCE) ||
         !OBJ_nid2cbb(&outer_seq, NID_pkcs7_signed) ||
         !CBB_add_asn1(&outer_seq, &wrapped_seq,
                       CBS_ASN1_CONTEXT_SPECIFIC | CBS_ASN1_CONSTRUCTED | 0) ||
-        // See https://tools.ietf.org/html/rfc2315#section-9.1
         !CBB_add_asn1(&wrapped_seq, &seq, CBS_ASN1_SEQUENCE) ||
-        !CBB_add_asn1_uint64(&seq, 1 /* version */) ||
-        !CBB_add_asn1(&seq, &digest_algos_set, CBS_ASN1_SET) ||
-        !CBB_add_asn1(&digest_algos_set, &digest_algo, CBS_ASN1_SEQUENCE) ||
-        !OBJ_nid2cbb(&digest_algo, NID_sha256) ||
-        !CBB_add_asn1(&digest_algo, &null, CBS_ASN1_NULL) ||
-        !CBB_add_asn1(&seq, &content_info, CBS_ASN1_SEQUENCE) ||
-        !OBJ_nid2cbb(&content_info, NID_pkcs7_data) ||
+        !CBB_add_bytes(&seq, mSignedDataHeader.data(), mSignedDataHeader.size()) ||
         !CBB_add_asn1(&seq, &signer_infos, CBS_ASN1_SET) ||
         !CBB_add_asn1(&signer_infos, &signer_info, CBS_ASN1_SEQUENCE) ||
-        !CBB_add_asn1_uint64(&signer_info, 1 /* version */) ||
-        !CBB_add_asn1(&signer_info, &issuer_and_serial, CBS_ASN1_SEQUENCE) ||
-        !CBB_add_bytes(&issuer_and_serial, name_der, name_der_len) ||
-        !BN_marshal_asn1(&issuer_and_serial, serial) ||
-        !CBB_add_asn1(&signer_info, &digest_algo, CBS_ASN1_SEQUENCE) ||
-        !OBJ_nid2cbb(&digest_algo, NID_sha256) ||
-        !CBB_add_asn1(&digest_algo, &null, CBS_ASN1_NULL) ||
-        !CBB_add_asn1(&signer_info, &sign_algo, CBS_ASN1_SEQUENCE) ||
-        !OBJ_nid2cbb(&sign_algo, sig_nid) || !CBB_add_asn1(&sign_algo, &null, CBS_ASN1_NULL) ||
+        !CBB_add_bytes(&signer_info, mSignerInfoHeader.data(), mSignerInfoHeader.size()) ||
         !CBB_add_asn1(&signer_info, &signature, CBS_ASN1_OCTETSTRING) ||
         !CBB_add_bytes(&signature, signed_digest.data(), signed_digest.size()) ||
-        !CBB_finish(&out, &pkcs7_data, &pkcs7_data_len)) {
+        !CBB_finish(&out, nullptr, &pkcs7_len)) {
+        CBB_cleanup(&out);
         return Error() << "Failed to create PKCS7 certificate.";
     }
+    pkcs7.resize(pkcs7_len);
+    return pkcs7;
+}
 
-    return std::vector<uint8_t>(&pkcs7_data[0], &pkcs7_data[pkcs7_data_len]);
+Result<std::vector<uint8_t>> createPkcs7(const std::vector<uint8_t>& signed_digest) {
+    static const auto* builder = new Result<Pkcs7Builder>(Pkcs7Builder::create());
+    if (!builder->ok()) {
+        return builder->error();
+    }
+    return (*builder)->build(signed_digest);
 }
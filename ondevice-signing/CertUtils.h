@@ -16,12 +16,34 @@
 
 #pragma once
 
+#include <functional>
+#include <string>
+#include <vector>
+
 #include <android-base/result.h>
+#include <openssl/rsa.h>
+
+// Builds the PKCS#7 SignedData that fs-verity expects for a file signature. Everything but the
+// signature itself is the same for all files, so that is encoded once by create().
+class Pkcs7Builder {
+  public:
+    static android::base::Result<Pkcs7Builder> create();
+
+    android::base::Result<std::vector<uint8_t>>
+    build(const std::vector<uint8_t>& signedDigest) const;
+
+  private:
+    Pkcs7Builder() = default;
+
+    std::vector<uint8_t> mSignedDataHeader;  // The SignedData fields before signerInfos.
+    std::vector<uint8_t> mSignerInfoHeader;  // The SignerInfo fields before encryptedDigest.
+};
 
 android::base::Result<void> createSelfSignedCertificate(
     const std::vector<uint8_t>& publicKey,
     const std::function<android::base::Result<std::string>(const std::string&)>& signFunction,
     const std::string& path);
+// Like Pkcs7Builder::build(), with a builder which is created on first use.
 android::base::Result<std::vector<uint8_t>> createPkcs7(const std::vector<uint8_t>& signedData);
 
 android::base::Result<std::vector<uint8_t>>
@@ -30,6 +52,12 @@ android::base::Result<std::vector<uint8_t>>
 extractPublicKeyFromSubjectPublicKeyInfo(const std::vector<uint8_t>& subjectKeyInfo);
 android::base::Result<std::vector<uint8_t>> extractPublicKeyFromX509(const std::string& path);
 
+// Returns the RSA public key with the given modulus and the exponent odsign's keys use.
+android::base::Result<bssl::UniquePtr<RSA>> getRsa(const std::vector<uint8_t>& publicKey);
+
 android::base::Result<void> verifySignature(const std::string& message,
                                             const std::string& signature,
                                             const std::vector<uint8_t>& publicKey);
+// Like the above, for a public key which has already been parsed.
+android::base::Result<void> verifySignature(const std::string& message,
+                                            const std::string& signature, const RSA& publicKey);
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <array>
+
+#include "HexUtils.h"
+
+using android::base::Error;
+using android::base::Result;
+
+namespace {
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+// Maps every byte value to the two hex characters encoding it.
+constexpr std::array<std::array<char, 2>, 256> makeEncodeTable() {
+    std::array<std::array<char, 2>, 256> table{};
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = {kHexDigits[i >> 4], kHexDigits[i & 0xf]};
+    }
+    return table;
+}
+
+// Maps every character to its value as a hex digit, or to 0xff if it isn't one.
+constexpr std::array<uint8_t, 256> makeDecodeTable() {
+    std::array<uint8_t, 256> table{};
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = 0xff;
+    }
+    for (uint8_t i = 0; i < 10; i++) {
+        table['0' + i] = i;
+    }
+    for (uint8_t i = 0; i < 6; i++) {
+        table['a' + i] = 10 + i;
+        table['A' + i] = 10 + i;
+    }
+    return table;
+}
+
+constexpr auto kEncodeTable = makeEncodeTable();
+constexpr auto kDecodeTable = makeDecodeTable();
+}  // namespace
+
+std::string toHex(std::span<const uint8_t> data) {
+    std::string result(data.size() * 2, '\0');
+    char* out = result.data();
+    for (uint8_t byte : data) {
+        *out++ = kEncodeTable[byte][0];
+        *out++ = kEncodeTable[byte][1];
+    }
+    return result;
+}
+
+Result<std::vector<uint8_t>> fromHex(std::string_view hex) {
+    if (hex.size() % 2 != 0) {
+        return Error() << "Hex string has odd length: " << hex.size();
+    }
+    std::vector<uint8_t> result(hex.size() / 2);
+    for (size_t i = 0; i < result.size(); i++) {
+        uint8_t high = kDecodeTable[static_cast<uint8_t>(hex[2 * i])];
+        uint8_t low = kDecodeTable[static_cast<uint8_t>(hex[2 * i + 1])];
+        if (high > 0xf || low > 0xf) {
+            return Error() << "Invalid hex character at offset " << 2 * i;
+        }
+        result[i] = (high << 4) | low;
+    }
+    return result;
+}
@@ -27,6 +27,7 @@
 #include "CertUtils.h"
 #include "KeyConstants.h"
 #include "KeystoreHmacKey.h"
+#include "KeystoreUtils.h"
 
 using android::sp;
 using android::String16;
@@ -38,7 +39,6 @@ using android::hardware::security::keymint::KeyParameterValue;
 using android::hardware::security::keymint::KeyPurpose;
 using android::hardware::security::keymint::Tag;
 
-using android::system::keystore2::CreateOperationResponse;
 using android::system::keystore2::Domain;
 using android::system::keystore2::KeyDescriptor;
 using android::system::keystore2::KeyEntryResponse;
@@ -203,60 +203,37 @@ static std::vector<KeyParameter> getSignOpParameters() {
     return opParameters;
 }
 
-Result<std::string> KeystoreHmacKey::sign(const std::string& message) const {
-    CreateOperationResponse opResponse;
-    static auto params = getSignOpParameters();
-
-    auto status = mSecurityLevel->createOperation(mDescriptor, params, false, &opResponse);
-    if (!status.isOk()) {
-        return Error() << "Failed to create keystore signing operation: "
-                       << status.serviceSpecificErrorCode();
-    }
-    auto operation = opResponse.iOperation;
-
-    std::optional<std::vector<uint8_t>> out;
-    status = operation->update({message.begin(), message.end()}, &out);
-    if (!status.isOk()) {
-        return Error() << "Failed to call keystore update operation.";
-    }
+// The parameters are the same for every operation, so they are only built once.
+static const std::vector<KeyParameter>& signOpParameters() {
+    static const auto* params = new std::vector<KeyParameter>(getSignOpParameters());
+    return *params;
+}
 
-    std::optional<std::vector<uint8_t>> signature;
-    status = operation->finish({}, {}, &signature);
-    if (!status.isOk()) {
-        return Error() << "Failed to call keystore finish operation.";
-    }
+static const std::vector<KeyParameter>& verifyOpParameters() {
+    static const auto* params = new std::vector<KeyParameter>(getVerifyOpParameters());
+    return *params;
+}
 
-    if (!signature.has_value()) {
-        return Error() << "Didn't receive a signature from keystore finish operation.";
+Result<std::string> KeystoreHmacKey::sign(const std::string& message) const {
+    auto signatures = signBatch({message});
+    if (!signatures.ok()) {
+        return signatures.error();
     }
+    return std::move((*signatures)[0]);
+}
 
-    return std::string{signature.value().begin(), signature.value().end()};
+Result<std::vector<std::string>>
+KeystoreHmacKey::signBatch(const std::vector<std::string>& messages) const {
+    return signBatchWithKeystore(mSecurityLevel, mDescriptor, signOpParameters(), messages);
 }
 
 Result<void> KeystoreHmacKey::verify(const std::string& message,
                                      const std::string& signature) const {
-    CreateOperationResponse opResponse;
-    static auto params = getVerifyOpParameters();
-
-    auto status = mSecurityLevel->createOperation(mDescriptor, params, false, &opResponse);
-    if (!status.isOk()) {
-        return Error() << "Failed to create keystore verification operation: "
-                       << status.serviceSpecificErrorCode();
-    }
-    auto operation = opResponse.iOperation;
-
-    std::optional<std::vector<uint8_t>> out;
-    status = operation->update({message.begin(), message.end()}, &out);
-    if (!status.isOk()) {
-        return Error() << "Failed to call keystore update operation.";
-    }
-
-    std::optional<std::vector<uint8_t>> out_signature;
-    std::vector<uint8_t> in_signature{signature.begin(), signature.end()};
-    status = operation->finish({}, in_signature, &out_signature);
-    if (!status.isOk()) {
-        return Error() << "Failed to call keystore finish operation.";
-    }
+    return verifyBatch({message}, {signature});
+}
 
-    return {};
+Result<void> KeystoreHmacKey::verifyBatch(const std::vector<std::string>& messages,
+                                          const std::vector<std::string>& signatures) const {
+    return verifyBatchWithKeystore(mSecurityLevel, mDescriptor, verifyOpParameters(), messages,
+                                   signatures);
 }
@@ -35,8 +35,14 @@ class KeystoreHmacKey {
     android::base::Result<void> initialize(android::sp<IKeystoreService> service,
                                            android::sp<IKeystoreSecurityLevel> securityLevel);
     android::base::Result<std::string> sign(const std::string& message) const;
+    android::base::Result<std::vector<std::string>>
+    signBatch(const std::vector<std::string>& messages) const;
     android::base::Result<void> verify(const std::string& message,
                                        const std::string& signature) const;
+    // Verifies each message against the signature at the same index, with as few
+    // Keystore round-trips as possible. Fails if any of them doesn't verify.
+    android::base::Result<void> verifyBatch(const std::vector<std::string>& messages,
+                                            const std::vector<std::string>& signatures) const;
 
   private:
     android::base::Result<void> createKey();
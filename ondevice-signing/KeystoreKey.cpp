@@ -27,6 +27,7 @@
 #include "CertUtils.h"
 #include "KeyConstants.h"
 #include "KeystoreKey.h"
+#include "KeystoreUtils.h"
 
 using android::defaultServiceManager;
 using android::IServiceManager;
@@ -176,6 +177,12 @@ bool KeystoreKey::initialize() {
         return false;
     }
     mPublicKey = *key;
+    auto rsaPublicKey = getRsa(mPublicKey);
+    if (!rsaPublicKey.ok()) {
+        LOG(ERROR) << rsaPublicKey.error().message();
+        return false;
+    }
+    mRsaPublicKey = std::move(*rsaPublicKey);
     LOG(ERROR) << "Initialized Keystore key.";
     return true;
 }
@@ -321,6 +328,16 @@ Result<std::string> KeystoreKey::sign(const std::string& message) const {
     return std::string{signature.value().begin(), signature.value().end()};
 }
 
+Result<std::vector<std::string>>
+KeystoreKey::signBatch(const std::vector<std::string>& messages) const {
+    static auto opParameters = getSignOpParameters();
+    return signBatchWithKeystore(mSecurityLevel, mDescriptor, opParameters, messages);
+}
+
 Result<std::vector<uint8_t>> KeystoreKey::getPublicKey() const {
     return mPublicKey;
 }
+
+Result<void> KeystoreKey::verify(const std::string& message, const std::string& signature) const {
+    return verifySignature(message, signature, *mRsaPublicKey);
+}
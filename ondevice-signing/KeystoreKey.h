@@ -22,6 +22,7 @@
 #include <android-base/result.h>
 #include <android-base/unique_fd.h>
 
+#include <openssl/rsa.h>
 #include <utils/StrongPointer.h>
 
 #include <android/system/keystore2/IKeystoreService.h>
@@ -40,7 +41,11 @@ class KeystoreKey : public SigningKey {
     static android::base::Result<SigningKey*> getInstance();
 
     virtual android::base::Result<std::string> sign(const std::string& message) const;
+    virtual android::base::Result<std::vector<std::string>>
+    signBatch(const std::vector<std::string>& messages) const;
     virtual android::base::Result<std::vector<uint8_t>> getPublicKey() const;
+    virtual android::base::Result<void> verify(const std::string& message,
+                                               const std::string& signature) const;
 
   private:
     KeystoreKey();
@@ -54,4 +59,6 @@ class KeystoreKey : public SigningKey {
     android::sp<IKeystoreService> mService;
     android::sp<IKeystoreSecurityLevel> mSecurityLevel;
     std::vector<uint8_t> mPublicKey;
+    // |mPublicKey|, parsed once so that verifying doesn't have to.
+    bssl::UniquePtr<RSA> mRsaPublicKey;
 };
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "KeystoreUtils.h"
+
+using android::sp;
+
+using android::hardware::security::keymint::KeyParameter;
+
+using android::system::keystore2::CreateOperationResponse;
+using android::system::keystore2::IKeystoreSecurityLevel;
+using android::system::keystore2::KeyDescriptor;
+
+using android::base::Error;
+using android::base::Result;
+
+// Maximum number of signing operations we keep open at the same time. This is
+// deliberately small: KeyMint implementations typically only have a handful of
+// operation slots, and keystore2 starts pruning operations once they run out.
+static constexpr size_t kMaxConcurrentSignOperations = 4;
+
+static Result<std::string> signWithNewOperation(const sp<IKeystoreSecurityLevel>& securityLevel,
+                                                const KeyDescriptor& descriptor,
+                                                const std::vector<KeyParameter>& opParameters,
+                                                const std::string& message) {
+    CreateOperationResponse opResponse;
+
+    auto status = securityLevel->createOperation(descriptor, opParameters, false, &opResponse);
+    if (!status.isOk()) {
+        return Error() << "Failed to create keystore signing operation: "
+                       << status.serviceSpecificErrorCode();
+    }
+    auto operation = opResponse.iOperation;
+
+    std::optional<std::vector<uint8_t>> signature;
+    status = operation->finish(std::vector<uint8_t>{message.begin(), message.end()}, {}, &signature);
+    if (!status.isOk()) {
+        return Error() << "Failed to call keystore finish operation.";
+    }
+
+    if (!signature.has_value()) {
+        return Error() << "Didn't receive a signature from keystore finish operation.";
+    }
+
+    return std::string{signature.value().begin(), signature.value().end()};
+}
+
+static Result<void> verifyWithNewOperation(const sp<IKeystoreSecurityLevel>& securityLevel,
+                                           const KeyDescriptor& descriptor,
+                                           const std::vector<KeyParameter>& opParameters,
+                                           const std::string& message,
+                                           const std::string& signature) {
+    CreateOperationResponse opResponse;
+
+    auto status = securityLevel->createOperation(descriptor, opParameters, false, &opResponse);
+    if (!status.isOk()) {
+        return Error() << "Failed to create keystore verification operation: "
+                       << status.serviceSpecificErrorCode();
+    }
+    auto operation = opResponse.iOperation;
+
+    std::optional<std::vector<uint8_t>> out_signature;
+    status = operation->finish(std::vector<uint8_t>{message.begin(), message.end()},
+                               std::vector<uint8_t>{signature.begin(), signature.end()},
+                               &out_signature);
+    if (!status.isOk()) {
+        return Error() << "Failed to call keystore finish operation.";
+    }
+
+    return {};
+}
+
+// Calls |operation| for every index below |count|, on up to kMaxConcurrentSignOperations
+// threads, and stops at the first failure.
+static Result<void> runConcurrently(size_t count,
+                                    const std::function<Result<void>(size_t)>& operation) {
+    std::atomic<size_t> nextIndex = 0;
+    std::atomic<bool> aborted = false;
+    std::mutex errorMutex;
+    std::optional<Result<void>> error;
+
+    auto loop = [&]() {
+        for (size_t index = nextIndex++; index < count && !aborted; index = nextIndex++) {
+            auto result = operation(index);
+            if (!result.ok()) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) {
+                    error = result.error();
+                }
+                aborted = true;
+                return;
+            }
+        }
+    };
+
+    const size_t numThreads = std::min(kMaxConcurrentSignOperations, count);
+    std::vector<std::thread> threads;
+    // The calling thread runs one of the loops itself.
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(loop);
+    }
+    loop();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        return error->error();
+    }
+    return {};
+}
+
+Result<std::vector<std::string>>
+signBatchWithKeystore(const sp<IKeystoreSecurityLevel>& securityLevel,
+                      const KeyDescriptor& descriptor,
+                      const std::vector<KeyParameter>& opParameters,
+                      const std::vector<std::string>& messages) {
+    std::vector<std::string> signatures(messages.size());
+    auto result = runConcurrently(messages.size(), [&](size_t index) -> Result<void> {
+        auto signature =
+            signWithNewOperation(securityLevel, descriptor, opParameters, messages[index]);
+        if (!signature.ok()) {
+            return signature.error();
+        }
+        signatures[index] = std::move(*signature);
+        return {};
+    });
+    if (!result.ok()) {
+        return result.error();
+    }
+    return signatures;
+}
+
+Result<void> verifyBatchWithKeystore(const sp<IKeystoreSecurityLevel>& securityLevel,
+                                     const KeyDescriptor& descriptor,
+                                     const std::vector<KeyParameter>& opParameters,
+                                     const std::vector<std::string>& messages,
+                                     const std::vector<std::string>& signatures) {
+    if (messages.size() != signatures.size()) {
+        return Error() << "Got " << messages.size() << " messages but " << signatures.size()
+                       << " signatures.";
+    }
+    return runConcurrently(messages.size(), [&](size_t index) {
+        return verifyWithNewOperation(securityLevel, descriptor, opParameters, messages[index],
+                                      signatures[index]);
+    });
+}
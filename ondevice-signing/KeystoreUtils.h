@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+#include <utils/StrongPointer.h>
+
+#include <android/system/keystore2/IKeystoreSecurityLevel.h>
+
+/*
+ * Signs each of the messages with a separate Keystore operation on the given key,
+ * running up to a small number of operations concurrently. The message is passed
+ * directly to finish(), which saves the update() round-trip per message.
+ * Signatures are returned in the same order as the messages; if any of the
+ * operations fails, the whole batch fails.
+ */
+android::base::Result<std::vector<std::string>> signBatchWithKeystore(
+    const android::sp<android::system::keystore2::IKeystoreSecurityLevel>& securityLevel,
+    const android::system::keystore2::KeyDescriptor& descriptor,
+    const std::vector<android::hardware::security::keymint::KeyParameter>& opParameters,
+    const std::vector<std::string>& messages);
+
+/*
+ * Like signBatchWithKeystore(), but verifies each message against the signature at the
+ * same index. Fails if any of the signatures doesn't verify.
+ */
+android::base::Result<void> verifyBatchWithKeystore(
+    const android::sp<android::system::keystore2::IKeystoreSecurityLevel>& securityLevel,
+    const android::system::keystore2::KeyDescriptor& descriptor,
+    const std::vector<android::hardware::security::keymint::KeyParameter>& opParameters,
+    const std::vector<std::string>& messages, const std::vector<std::string>& signatures);
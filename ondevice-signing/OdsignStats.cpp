@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_DALVIK
+
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <utils/Trace.h>
+
+#include "OdsignStats.h"
+
+namespace {
+struct PhaseTiming {
+    const char* name;
+    std::chrono::milliseconds duration;
+};
+
+std::mutex gPhaseTimingsMutex;
+std::vector<PhaseTiming> gPhaseTimings;
+std::atomic<uint64_t> gFilesHashed = 0;
+std::atomic<uint64_t> gBytesHashed = 0;
+}  // namespace
+
+ScopedOdsignPhase::ScopedOdsignPhase(const char* name)
+    : mName(name), mStart(std::chrono::steady_clock::now()) {
+    ATRACE_BEGIN(name);
+}
+
+ScopedOdsignPhase::~ScopedOdsignPhase() {
+    ATRACE_END();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - mStart);
+    std::lock_guard<std::mutex> lock(gPhaseTimingsMutex);
+    gPhaseTimings.push_back({mName, duration});
+}
+
+void recordFileHashed(uint64_t size) {
+    gFilesHashed++;
+    gBytesHashed += size;
+}
+
+void logOdsignStats() {
+    // Keep this a single line of key=value pairs, so it's easy to pick up from logs.
+    std::stringstream ss;
+    std::lock_guard<std::mutex> lock(gPhaseTimingsMutex);
+    for (const auto& timing : gPhaseTimings) {
+        ss << timing.name << "_ms=" << timing.duration.count() << " ";
+    }
+    ss << "files_hashed=" << gFilesHashed << " bytes_hashed=" << gBytesHashed;
+    LOG(INFO) << "odsign stats: " << ss.str();
+}
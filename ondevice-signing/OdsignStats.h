@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <android-base/macros.h>
+
+/*
+ * Times a phase of odsign for the summary written by logOdsignStats(), and
+ * emits a matching trace section. Phases may be timed from any thread; ones
+ * that overlap are all reported, in the order they end.
+ */
+class ScopedOdsignPhase {
+  public:
+    explicit ScopedOdsignPhase(const char* name);
+    ~ScopedOdsignPhase();
+
+  private:
+    const char* mName;
+    std::chrono::steady_clock::time_point mStart;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedOdsignPhase);
+};
+
+/* Records that a file of the given size was hashed; safe to call from any thread */
+void recordFileHashed(uint64_t size);
+
+/* Logs a single line summarizing all phases timed so far, and the files hashed */
+void logOdsignStats();
@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
 #include <android-base/macros.h>
 #include <android-base/result.h>
 
@@ -24,6 +27,23 @@ class SigningKey {
     virtual ~SigningKey(){};
     /* Sign a message with an initialized signing key */
     virtual android::base::Result<std::string> sign(const std::string& message) const = 0;
+    /* Sign a list of messages; signatures are returned in the same order as the messages */
+    virtual android::base::Result<std::vector<std::string>>
+    signBatch(const std::vector<std::string>& messages) const {
+        std::vector<std::string> signatures;
+        signatures.reserve(messages.size());
+        for (const auto& message : messages) {
+            auto signature = sign(message);
+            if (!signature.ok()) {
+                return signature.error();
+            }
+            signatures.push_back(std::move(*signature));
+        }
+        return signatures;
+    }
     /* Retrieve the associated public key */
     virtual android::base::Result<std::vector<uint8_t>> getPublicKey() const = 0;
+    /* Verify a signature over a message made with this key */
+    virtual android::base::Result<void> verify(const std::string& message,
+                                               const std::string& signature) const = 0;
 };
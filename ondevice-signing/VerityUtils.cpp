@@ -14,13 +14,26 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <span>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -31,7 +44,9 @@
 #include <linux/fsverity.h>
 
 #include "CertUtils.h"
+#include "OdsignStats.h"
 #include "SigningKey.h"
+#include "VerityUtils.h"
 
 #define FS_VERITY_MAX_DIGEST_SIZE 64
 
@@ -57,28 +72,36 @@ struct fsverity_signed_digest {
     __u8 digest[];
 };
 
-static std::string toHex(std::span<uint8_t> data) {
-    std::stringstream ss;
-    for (auto it = data.begin(); it != data.end(); ++it) {
-        ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<unsigned>(*it);
-    }
-    return ss.str();
-}
-
 static int read_callback(void* file, void* buf, size_t count) {
     int* fd = (int*)file;
     if (TEMP_FAILURE_RETRY(read(*fd, buf, count)) < 0) return errno ? -errno : -EIO;
     return 0;
 }
 
-Result<std::vector<uint8_t>> createDigest(const std::string& path) {
+namespace {
+struct MappedFile {
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+};
+}  // namespace
+
+static int mmap_read_callback(void* file, void* buf, size_t count) {
+    MappedFile* mapped = (MappedFile*)file;
+    if (count > mapped->size - mapped->offset) return -EIO;
+    memcpy(buf, mapped->data + mapped->offset, count);
+    mapped->offset += count;
+    return 0;
+}
+
+Result<FsVerityDigest> createDigest(const std::string& path) {
     struct stat filestat;
     unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
     if (fd < 0) {
         return ErrnoError() << "Failed to open " << path;
     }
 
-    int ret = stat(path.c_str(), &filestat);
+    int ret = fstat(fd, &filestat);
     if (ret < 0) {
         return ErrnoError() << "Failed to stat " << path;
     }
@@ -89,19 +112,40 @@ Result<std::vector<uint8_t>> createDigest(const std::string& path) {
         .block_size = 4096,
     };
 
+    // Map the file if we can, so that libfsverity's reads are served straight
+    // from the page cache instead of costing a read() syscall per block.
+    // Otherwise (eg empty files, or files on a filesystem that doesn't support
+    // mmap), fall back to reading the file.
+    size_t size = static_cast<size_t>(filestat.st_size);
+    void* mapping = MAP_FAILED;
+    if (size > 0) {
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
     struct libfsverity_digest* digest;
-    ret = libfsverity_compute_digest(&fd, &read_callback, &params, &digest);
+    if (mapping != MAP_FAILED) {
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        madvise(mapping, size, MADV_WILLNEED);
+        MappedFile mapped = {.data = static_cast<const uint8_t*>(mapping), .size = size, .offset = 0};
+        ret = libfsverity_compute_digest(&mapped, &mmap_read_callback, &params, &digest);
+        munmap(mapping, size);
+    } else {
+        ret = libfsverity_compute_digest(&fd, &read_callback, &params, &digest);
+    }
     if (ret < 0) {
         return ErrnoError() << "Failed to compute fs-verity digest for " << path;
     }
-    int expected_digest_size = libfsverity_get_digest_size(FS_VERITY_HASH_ALG_SHA256);
-    if (digest->digest_size != expected_digest_size) {
-        return Error() << "Digest does not have expected size: " << expected_digest_size
-                       << " actual: " << digest->digest_size;
+    if (digest->digest_size != kFsVerityDigestSize) {
+        size_t actual_digest_size = digest->digest_size;
+        free(digest);
+        return Error() << "Digest does not have expected size: " << kFsVerityDigestSize
+                       << " actual: " << actual_digest_size;
     }
-    std::vector<uint8_t> digestVector(&digest->digest[0], &digest->digest[expected_digest_size]);
+    FsVerityDigest result;
+    std::copy_n(&digest->digest[0], kFsVerityDigestSize, result.begin());
     free(digest);
-    return digestVector;
+    recordFileHashed(size);
+    return result;
 }
 
 namespace {
@@ -124,8 +168,8 @@ static trailing_unique_ptr<T> makeUniqueWithTrailingData(size_t trailing_data_si
     return trailing_unique_ptr<T>{ptr};
 }
 
-static Result<std::vector<uint8_t>> signDigest(const SigningKey& key,
-                                               const std::vector<uint8_t>& digest) {
+// Returns the fsverity_signed_digest structure that needs to be signed for the given digest.
+static std::string toSignedDigestMessage(const FsVerityDigest& digest) {
     auto d = makeUniqueWithTrailingData<fsverity_signed_digest>(digest.size());
 
     memcpy(d->magic, "FSVerity", 8);
@@ -133,31 +177,15 @@ static Result<std::vector<uint8_t>> signDigest(const SigningKey& key,
     d->digest_size = cpu_to_le16(digest.size());
     memcpy(d->digest, digest.data(), digest.size());
 
-    auto signed_digest = key.sign(std::string((char*)d.get(), sizeof(*d) + digest.size()));
-    if (!signed_digest.ok()) {
-        return signed_digest.error();
-    }
-
-    return std::vector<uint8_t>(signed_digest->begin(), signed_digest->end());
+    return std::string((char*)d.get(), sizeof(*d) + digest.size());
 }
 
-Result<std::string> enableFsVerity(const std::string& path, const SigningKey& key) {
-    auto digest = createDigest(path);
-    if (!digest.ok()) {
-        return digest.error();
-    }
-
-    auto signed_digest = signDigest(key, digest.value());
-    if (!signed_digest.ok()) {
-        return signed_digest.error();
-    }
-
-    auto pkcs7_data = createPkcs7(signed_digest.value());
-
+static Result<void> enableFsVerity(const std::string& path,
+                                   const std::vector<uint8_t>& pkcs7_data) {
     struct fsverity_enable_arg arg = {.version = 1};
 
-    arg.sig_ptr = (uint64_t)pkcs7_data->data();
-    arg.sig_size = pkcs7_data->size();
+    arg.sig_ptr = (uint64_t)pkcs7_data.data();
+    arg.sig_size = pkcs7_data.size();
     arg.hash_algorithm = FS_VERITY_HASH_ALG_SHA256;
     arg.block_size = 4096;
 
@@ -168,13 +196,207 @@ Result<std::string> enableFsVerity(const std::string& path, const SigningKey& ke
         return ErrnoError() << "Failed to call FS_IOC_ENABLE_VERITY on " << path;
     }
 
-    // Return the root hash as a hex string
-    return toHex(digest.value());
+    return {};
 }
 
-Result<std::map<std::string, std::string>> addFilesToVerityRecursive(const std::string& path,
-                                                                     const SigningKey& key) {
-    std::map<std::string, std::string> digests;
+namespace {
+// Minimal blocking queue used to hand work from one pipeline stage to the next.
+template <typename T> class PipelineQueue {
+  public:
+    void push(T item) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mItems.push_back(std::move(item));
+        }
+        mCondition.notify_one();
+    }
+
+    // No more items will be pushed; wakes up any waiting consumer.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mClosed = true;
+        }
+        mCondition.notify_all();
+    }
+
+    // Blocks until an item is available, or returns nullopt once the queue is closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this] { return mClosed || !mItems.empty(); });
+        if (mItems.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(mItems.front());
+        mItems.pop_front();
+        return item;
+    }
+
+    // Like pop(), but returns all items that are queued up at that point, up to maxItems.
+    // Returns an empty vector once the queue is closed and drained.
+    std::vector<T> popBatch(size_t maxItems) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this] { return mClosed || !mItems.empty(); });
+        std::vector<T> items;
+        while (!mItems.empty() && items.size() < maxItems) {
+            items.push_back(std::move(mItems.front()));
+            mItems.pop_front();
+        }
+        return items;
+    }
+
+  private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<T> mItems;
+    bool mClosed = false;
+};
+
+struct DigestedFile {
+    std::string path;
+    Result<FsVerityDigest> digest;
+};
+
+struct SignedFile {
+    std::string path;
+    FsVerityDigest digest;
+    std::vector<uint8_t> pkcs7;
+};
+}  // namespace
+
+// Upper bound on the number of digests handed to SigningKey::signBatch() at once.
+static constexpr size_t kMaxSignBatchSize = 16;
+
+static size_t getDigestWorkerCount(size_t numFiles) {
+    size_t workers = std::thread::hardware_concurrency();
+    if (workers == 0) workers = 1;
+    return std::min(workers, std::max<size_t>(numFiles, 1));
+}
+
+// Enables fs-verity on all given files. This runs as a three stage pipeline:
+// Merkle tree digests are computed on a pool of worker threads, the calling thread
+// signs digests in batches as they become available, and a separate thread issues
+// FS_IOC_ENABLE_VERITY for every signed file, so that the ioctl (which makes the
+// kernel read and hash the file once more) overlaps with hashing and signing
+// of the remaining files.
+//
+// Files that |presigner| has already signed skip the first two stages.
+static Result<DigestMap> enableFsVerityPipelined(const std::vector<std::string>& allFiles,
+                                                 const SigningKey& key,
+                                                 VerityPresigner* presigner) {
+    DigestMap digests;
+    digests.reserve(allFiles.size());
+    std::vector<std::string> files;
+    std::vector<SignedFile> presignedFiles;
+    for (const auto& file : allFiles) {
+        auto presigned = presigner != nullptr ? presigner->take(file) : std::nullopt;
+        if (presigned) {
+            presignedFiles.push_back({file, presigned->digest, std::move(presigned->pkcs7)});
+        } else {
+            files.push_back(file);
+        }
+    }
+    if (!presignedFiles.empty()) {
+        LOG(INFO) << "Reusing signatures of " << presignedFiles.size() << " artifacts.";
+    }
+
+    std::atomic<bool> aborted = false;
+    std::atomic<size_t> nextFile = 0;
+    const size_t numWorkers = getDigestWorkerCount(files.size());
+    std::atomic<size_t> activeWorkers = numWorkers;
+    PipelineQueue<DigestedFile> digestQueue;
+    PipelineQueue<SignedFile> enableQueue;
+
+    std::vector<std::thread> digestWorkers;
+    for (size_t i = 0; i < numWorkers; i++) {
+        digestWorkers.emplace_back([&]() {
+            for (size_t index = nextFile++; index < files.size() && !aborted; index = nextFile++) {
+                digestQueue.push({files[index], createDigest(files[index])});
+            }
+            if (--activeWorkers == 0) {
+                digestQueue.close();
+            }
+        });
+    }
+
+    Result<void> enableStatus;
+    std::thread enableThread([&]() {
+        while (auto file = enableQueue.pop()) {
+            if (!enableStatus.ok()) {
+                // Keep draining, so the signing stage never blocks on us.
+                continue;
+            }
+            LOG(INFO) << "Adding " << file->path << " to fs-verity...";
+            auto result = enableFsVerity(file->path, file->pkcs7);
+            if (!result.ok()) {
+                enableStatus = result.error();
+                aborted = true;
+                continue;
+            }
+            digests[file->path] = file->digest;
+        }
+    });
+
+    for (auto& file : presignedFiles) {
+        enableQueue.push(std::move(file));
+    }
+
+    Result<void> signStatus;
+    for (auto batch = digestQueue.popBatch(kMaxSignBatchSize); !batch.empty();
+         batch = digestQueue.popBatch(kMaxSignBatchSize)) {
+        if (aborted) {
+            continue;
+        }
+        std::vector<std::string> messages;
+        messages.reserve(batch.size());
+        for (const auto& file : batch) {
+            if (!file.digest.ok()) {
+                signStatus = file.digest.error();
+                aborted = true;
+                break;
+            }
+            messages.push_back(toSignedDigestMessage(*file.digest));
+        }
+        if (aborted) {
+            continue;
+        }
+        auto signed_digests = key.signBatch(messages);
+        if (!signed_digests.ok()) {
+            signStatus = signed_digests.error();
+            aborted = true;
+            continue;
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            const auto& signed_digest = (*signed_digests)[i];
+            auto pkcs7_data = createPkcs7({signed_digest.begin(), signed_digest.end()});
+            if (!pkcs7_data.ok()) {
+                signStatus = pkcs7_data.error();
+                aborted = true;
+                break;
+            }
+            enableQueue.push({std::move(batch[i].path), std::move(*batch[i].digest),
+                              std::move(*pkcs7_data)});
+        }
+    }
+    enableQueue.close();
+
+    for (auto& worker : digestWorkers) {
+        worker.join();
+    }
+    enableThread.join();
+
+    if (!signStatus.ok()) {
+        return signStatus.error();
+    }
+    if (!enableStatus.ok()) {
+        return enableStatus.error();
+    }
+    return digests;
+}
+
+Result<DigestMap> addFilesToVerityRecursive(const std::string& path, const SigningKey& key,
+                                            VerityPresigner* presigner) {
+    std::vector<std::string> files;
     std::error_code ec;
 
     auto it = std::filesystem::recursive_directory_iterator(path, ec);
@@ -182,12 +404,7 @@ Result<std::map<std::string, std::string>> addFilesToVerityRecursive(const std::
 
     while (!ec && it != end) {
         if (it->is_regular_file()) {
-            LOG(INFO) << "Adding " << it->path() << " to fs-verity...";
-            auto result = enableFsVerity(it->path(), key);
-            if (!result.ok()) {
-                return result.error();
-            }
-            digests[it->path()] = *result;
+            files.push_back(it->path());
         }
         ++it;
     }
@@ -195,17 +412,192 @@ Result<std::map<std::string, std::string>> addFilesToVerityRecursive(const std::
         return Error() << "Failed to iterate " << path << ": " << ec;
     }
 
-    return digests;
+    return enableFsVerityPipelined(files, key, presigner);
 }
 
-Result<std::string> isFileInVerity(const std::string& path) {
-    unsigned int flags;
+static bool isSameFile(const struct stat& lhs, const struct stat& rhs) {
+    return lhs.st_dev == rhs.st_dev && lhs.st_ino == rhs.st_ino && lhs.st_size == rhs.st_size &&
+           lhs.st_mtim.tv_sec == rhs.st_mtim.tv_sec && lhs.st_mtim.tv_nsec == rhs.st_mtim.tv_nsec &&
+           lhs.st_ctim.tv_sec == rhs.st_ctim.tv_sec && lhs.st_ctim.tv_nsec == rhs.st_ctim.tv_nsec;
+}
 
-    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
-    if (fd < 0) {
-        return ErrnoError() << "Failed to open " << path;
+static constexpr uint32_t kPresignerWatchMask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+VerityPresigner::VerityPresigner(const std::string& path, const SigningKey& key)
+    : mPath(path), mKey(key) {}
+
+VerityPresigner::~VerityPresigner() {
+    stop();
+}
+
+Result<void> VerityPresigner::start() {
+    mInotifyFd.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (mInotifyFd < 0) {
+        return ErrnoError() << "Failed to create inotify instance";
+    }
+    mStopFd.reset(eventfd(0, EFD_CLOEXEC));
+    if (mStopFd < 0) {
+        return ErrnoError() << "Failed to create eventfd";
+    }
+    // The parent tells us when |mPath| is (re)created.
+    std::string parent = std::filesystem::path(mPath).parent_path();
+    mParentWatch =
+        inotify_add_watch(mInotifyFd, parent.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if (mParentWatch < 0) {
+        return ErrnoError() << "Failed to watch " << parent;
+    }
+    mWatches[mParentWatch] = parent;
+    // Files which are already there are left alone; in the common case they are valid, and
+    // are going to be verified rather than signed.
+    if (access(mPath.c_str(), F_OK) == 0) {
+        addWatches(mPath, nullptr);
+    }
+    mThread = std::thread([this]() { run(); });
+    return {};
+}
+
+void VerityPresigner::stop() {
+    if (!mThread.joinable()) {
+        return;
+    }
+    mStopping = true;
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(mStopFd, &one, sizeof(one)));
+    mThread.join();
+}
+
+std::optional<VerityPresigner::PresignedFile> VerityPresigner::take(const std::string& file) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mPresigned.find(file);
+    if (it == mPresigned.end()) {
+        return std::nullopt;
+    }
+    PresignedFile presigned = std::move(it->second);
+    mPresigned.erase(it);
+    struct stat st;
+    if (lstat(file.c_str(), &st) < 0 || !isSameFile(st, presigned.fileStat)) {
+        return std::nullopt;
     }
+    return presigned;
+}
 
+// Watches |dir| and the directories below it, and adds the files found in them to |files|
+// unless that is null.
+void VerityPresigner::addWatches(const std::string& dir, std::vector<std::string>* files) {
+    int wd = inotify_add_watch(mInotifyFd, dir.c_str(), kPresignerWatchMask);
+    if (wd < 0) {
+        PLOG(WARNING) << "Failed to watch " << dir;
+        return;
+    }
+    mWatches[wd] = dir;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_symlink()) {
+            continue;
+        } else if (entry.is_directory()) {
+            addWatches(entry.path(), files);
+        } else if (entry.is_regular_file() && files != nullptr) {
+            files->push_back(entry.path());
+        }
+    }
+}
+
+void VerityPresigner::run() {
+    const std::string artifactsDirName = std::filesystem::path(mPath).filename();
+    alignas(struct inotify_event) char buffer[4096];
+    struct pollfd fds[] = {{.fd = mInotifyFd, .events = POLLIN}, {.fd = mStopFd, .events = POLLIN}};
+    while (true) {
+        if (TEMP_FAILURE_RETRY(poll(fds, arraysize(fds), -1)) < 0) {
+            PLOG(ERROR) << "Failed to poll inotify events";
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+        std::vector<std::string> files;
+        ssize_t len;
+        while ((len = TEMP_FAILURE_RETRY(read(mInotifyFd, buffer, sizeof(buffer)))) > 0) {
+            for (char* p = buffer; p < buffer + len;) {
+                const auto* event = reinterpret_cast<const struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_IGNORED) {
+                    mWatches.erase(event->wd);
+                    continue;
+                }
+                auto dir = mWatches.find(event->wd);
+                if (dir == mWatches.end() || event->len == 0) {
+                    continue;
+                }
+                if (event->wd == mParentWatch &&
+                    (!(event->mask & IN_ISDIR) || event->name != artifactsDirName)) {
+                    // Only |mPath| itself is of interest in the parent directory.
+                    continue;
+                }
+                std::string path = dir->second + "/" + event->name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        addWatches(path, &files);
+                    }
+                } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    files.push_back(path);
+                }
+            }
+        }
+        presign(files);
+    }
+}
+
+void VerityPresigner::presign(const std::vector<std::string>& files) {
+    for (size_t start = 0; start < files.size(); start += kMaxSignBatchSize) {
+        std::vector<std::pair<std::string, PresignedFile>> batch;
+        std::vector<std::string> messages;
+        for (size_t i = start; i < std::min(files.size(), start + kMaxSignBatchSize); i++) {
+            if (mStopping) {
+                return;
+            }
+            PresignedFile presigned;
+            if (lstat(files[i].c_str(), &presigned.fileStat) < 0 ||
+                !S_ISREG(presigned.fileStat.st_mode)) {
+                continue;
+            }
+            auto digest = createDigest(files[i]);
+            struct stat st;
+            if (!digest.ok() || lstat(files[i].c_str(), &st) < 0 ||
+                !isSameFile(st, presigned.fileStat)) {
+                // Still being written; it will come up again once it is closed.
+                continue;
+            }
+            presigned.digest = *digest;
+            messages.push_back(toSignedDigestMessage(*digest));
+            batch.emplace_back(files[i], std::move(presigned));
+        }
+        if (batch.empty()) {
+            continue;
+        }
+        auto signatures = mKey.signBatch(messages);
+        if (!signatures.ok()) {
+            LOG(WARNING) << "Failed to presign artifacts: " << signatures.error().message();
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (size_t i = 0; i < batch.size(); i++) {
+            const auto& signature = (*signatures)[i];
+            auto pkcs7 = createPkcs7({signature.begin(), signature.end()});
+            if (!pkcs7.ok()) {
+                continue;
+            }
+            batch[i].second.pkcs7 = std::move(*pkcs7);
+            mPresigned[batch[i].first] = std::move(batch[i].second);
+        }
+    }
+}
+
+// Measures the fs-verity digest of the open file |fd|, using |buffer| (which must have room for
+// FS_VERITY_MAX_DIGEST_SIZE bytes of digest) for the ioctl.
+static Result<FsVerityDigest> measureFsVerity(int fd, const std::string& path,
+                                              fsverity_digest* buffer) {
+    unsigned int flags;
     int ret = ioctl(fd, FS_IOC_GETFLAGS, &flags);
     if (ret < 0) {
         return ErrnoError() << "Failed to FS_IOC_GETFLAGS for " << path;
@@ -214,46 +606,188 @@ Result<std::string> isFileInVerity(const std::string& path) {
         return Error() << "File is not in fs-verity: " << path;
     }
 
-    auto d = makeUniqueWithTrailingData<fsverity_digest>(FS_VERITY_MAX_DIGEST_SIZE);
-    d->digest_size = FS_VERITY_MAX_DIGEST_SIZE;
-    ret = ioctl(fd, FS_IOC_MEASURE_VERITY, d.get());
+    buffer->digest_size = FS_VERITY_MAX_DIGEST_SIZE;
+    ret = ioctl(fd, FS_IOC_MEASURE_VERITY, buffer);
     if (ret < 0) {
         return ErrnoError() << "Failed to FS_IOC_MEASURE_VERITY for " << path;
     }
-    return toHex({&d->digest[0], &d->digest[d->digest_size]});
+    if (buffer->digest_algorithm != FS_VERITY_HASH_ALG_SHA256 ||
+        buffer->digest_size != kFsVerityDigestSize) {
+        return Error() << "Unexpected fs-verity digest for " << path;
+    }
+    FsVerityDigest result;
+    std::copy_n(&buffer->digest[0], kFsVerityDigestSize, result.begin());
+    return result;
 }
 
-Result<std::map<std::string, std::string>> verifyAllFilesInVerity(const std::string& path) {
-    std::map<std::string, std::string> digests;
-    std::error_code ec;
+Result<FsVerityDigest> isFileInVerity(const std::string& path) {
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd < 0) {
+        return ErrnoError() << "Failed to open " << path;
+    }
+
+    auto d = makeUniqueWithTrailingData<fsverity_digest>(FS_VERITY_MAX_DIGEST_SIZE);
+    return measureFsVerity(fd, path, d.get());
+}
+
+// Measuring is cheap for the kernel, so a few threads are enough to hide the latencies.
+static constexpr size_t kMaxMeasureWorkers = 4;
+
+namespace {
+// A file found by measureAllFilesInVerity(), to be opened relative to |dirFd|.
+struct VerityFile {
+    std::string path;
+    int dirFd;
+    std::string name;
+};
+}  // namespace
 
+// Walks |path| and measures the fs-verity digest of every file in it, calling |onDigest| with
+// each. Files are measured on a few worker threads while the walk goes on, so |onDigest| must
+// be thread-safe. Stops at the first error, either from measuring or from |onDigest|.
+//
+// Directories are opened once, relative to their parent, and files relative to their
+// directory, so that the kernel doesn't resolve every path from the root.
+using DigestCallback = std::function<Result<void>(const std::string&, const FsVerityDigest&)>;
+
+static Result<void> measureAllFilesInVerity(const std::string& path,
+                                            const DigestCallback& onDigest) {
+    std::error_code ec;
     auto it = std::filesystem::recursive_directory_iterator(path, ec);
     auto end = std::filesystem::recursive_directory_iterator();
+    if (ec) {
+        return Error() << "Failed to iterate " << path << ": " << ec;
+    }
 
-    while (!ec && it != end) {
-        if (it->is_regular_file()) {
-            // Verify the file is in fs-verity
-            auto result = isFileInVerity(it->path());
-            if (!result.ok()) {
-                return result.error();
+    // A deque, so that the fds handed to the workers stay put while more are added.
+    std::deque<unique_fd> dirFds;
+    dirFds.emplace_back(open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (dirFds.back() < 0) {
+        return ErrnoError() << "Failed to open " << path;
+    }
+    // The fds of the directories on the way to the current entry, by depth.
+    std::vector<int> dirStack = {dirFds.back()};
+
+    std::mutex statusMutex;
+    Result<void> status;
+    std::atomic<bool> aborted = false;
+    auto fail = [&](Result<void> error) {
+        std::lock_guard<std::mutex> lock(statusMutex);
+        if (status.ok()) {
+            status = std::move(error);
+        }
+        aborted = true;
+    };
+
+    PipelineQueue<VerityFile> queue;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < kMaxMeasureWorkers; i++) {
+        workers.emplace_back([&]() {
+            // Each worker reuses one digest buffer for all of its files.
+            auto d = makeUniqueWithTrailingData<fsverity_digest>(FS_VERITY_MAX_DIGEST_SIZE);
+            while (auto file = queue.pop()) {
+                if (aborted) {
+                    // Keep draining, so the walk never blocks on us.
+                    continue;
+                }
+                unique_fd fd(TEMP_FAILURE_RETRY(openat(file->dirFd, file->name.c_str(),
+                                                       O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+                if (fd < 0) {
+                    fail(ErrnoError() << "Failed to open " << file->path);
+                    continue;
+                }
+                auto digest = measureFsVerity(fd, file->path, d.get());
+                if (!digest.ok()) {
+                    fail(digest.error());
+                    continue;
+                }
+                auto result = onDigest(file->path, *digest);
+                if (!result.ok()) {
+                    fail(result.error());
+                }
             }
-            digests[it->path()] = *result;
+        });
+    }
+
+    while (!ec && it != end && !aborted) {
+        const int parentFd = dirStack[it.depth()];
+        if (it->is_regular_file()) {
+            queue.push({it->path(), parentFd, it->path().filename()});
         } else if (it->is_directory()) {
-            // These are fine to ignore
+            // Only opened, so that the files in it can be measured relative to it.
+            dirFds.emplace_back(openat(parentFd, it->path().filename().c_str(),
+                                       O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+            if (dirFds.back() < 0) {
+                fail(ErrnoError() << "Failed to open " << it->path());
+                break;
+            }
+            dirStack.resize(it.depth() + 1);
+            dirStack.push_back(dirFds.back());
         } else if (it->is_symlink()) {
-            return Error() << "Rejecting artifacts, symlink at " << it->path();
+            fail(Error() << "Rejecting artifacts, symlink at " << it->path());
+            break;
         } else {
-            return Error() << "Rejecting artifacts, unexpected file type for " << it->path();
+            fail(Error() << "Rejecting artifacts, unexpected file type for " << it->path());
+            break;
         }
-        ++it;
+        it.increment(ec);
     }
     if (ec) {
-        return Error() << "Failed to iterate " << path << ": " << ec;
+        fail(Error() << "Failed to iterate " << path << ": " << ec);
     }
+    queue.close();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return status;
+}
 
+Result<DigestMap> verifyAllFilesInVerity(const std::string& path) {
+    std::mutex digestsMutex;
+    DigestMap digests;
+    auto result = measureAllFilesInVerity(path, [&](const std::string& file,
+                                                    const FsVerityDigest& digest) {
+        std::lock_guard<std::mutex> lock(digestsMutex);
+        digests[file] = digest;
+        return Result<void>{};
+    });
+    if (!result.ok()) {
+        return result.error();
+    }
     return digests;
 }
 
+Result<void> verifyAllFilesInVerity(const std::string& path, const DigestMap& trusted_digests) {
+    std::atomic<size_t> numMatched = 0;
+    auto result = measureAllFilesInVerity(path, [&](const std::string& file,
+                                                    const FsVerityDigest& digest) -> Result<void> {
+        auto trusted_digest = trusted_digests.find(file);
+        if (trusted_digest == trusted_digests.end()) {
+            return Error() << "Couldn't find digest for " << file;
+        }
+        if (trusted_digest->second != digest) {
+            return Error() << "Digest mismatch for " << file;
+        }
+        numMatched++;
+        return {};
+    });
+    if (!result.ok()) {
+        return result.error();
+    }
+    // Every file that was found had a trusted digest, and the walk visits each file once, so
+    // any trusted digest left over belongs to a file which is missing.
+    if (numMatched != trusted_digests.size()) {
+        for (const auto& [file, digest] : trusted_digests) {
+            if (access(file.c_str(), F_OK) != 0) {
+                return Error() << "Missing artifact " << file;
+            }
+        }
+        return Error() << "Missing " << (trusted_digests.size() - numMatched) << " artifacts";
+    }
+    return {};
+}
+
 Result<void> addCertToFsVerityKeyring(const std::string& path) {
     const char* const argv[] = {kFsVerityInitPath, "--load-extra-key", "fsv_ods"};
 
@@ -16,13 +16,80 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
 #include <android-base/result.h>
+#include <android-base/unique_fd.h>
 
 #include "SigningKey.h"
 
+// odsign only uses SHA-256 fs-verity digests
+constexpr size_t kFsVerityDigestSize = 32;
+using FsVerityDigest = std::array<uint8_t, kFsVerityDigestSize>;
+// Map of file paths to their fs-verity digest
+using DigestMap = std::unordered_map<std::string, FsVerityDigest>;
+
 android::base::Result<void> addCertToFsVerityKeyring(const std::string& path);
-android::base::Result<std::vector<uint8_t>> createDigest(const std::string& path);
-android::base::Result<std::map<std::string, std::string>>
-verifyAllFilesInVerity(const std::string& path);
-android::base::Result<std::map<std::string, std::string>>
-addFilesToVerityRecursive(const std::string& path, const SigningKey& key);
+android::base::Result<FsVerityDigest> createDigest(const std::string& path);
+android::base::Result<DigestMap> verifyAllFilesInVerity(const std::string& path);
+// Like the above, but checks each digest against |trusted_digests| as soon as it is measured,
+// and stops at the first file that doesn't match. Also fails if any file in |trusted_digests|
+// is missing.
+android::base::Result<void> verifyAllFilesInVerity(const std::string& path,
+                                                   const DigestMap& trusted_digests);
+
+// Computes and signs the fs-verity digests of files while they are still being written
+// into a directory, so that addFilesToVerityRecursive() only has to enable fs-verity on
+// them. It watches the directory with inotify, and handles each file once it has been
+// closed after writing or moved in. Files that changed after they were handled are
+// ignored by take(), so the normal path covers them.
+class VerityPresigner {
+  public:
+    VerityPresigner(const std::string& path, const SigningKey& key);
+    ~VerityPresigner();
+
+    // Starts watching; |path| or its parent directory must exist.
+    android::base::Result<void> start();
+    // Stops watching, and waits for the file being digested, if any.
+    void stop();
+
+    struct PresignedFile {
+        struct stat fileStat;
+        FsVerityDigest digest;
+        std::vector<uint8_t> pkcs7;
+    };
+    // Returns what was computed for |file|, if it hasn't changed since.
+    std::optional<PresignedFile> take(const std::string& file);
+
+  private:
+    void run();
+    void addWatches(const std::string& dir, std::vector<std::string>* files);
+    void presign(const std::vector<std::string>& files);
+
+    const std::string mPath;
+    const SigningKey& mKey;
+    android::base::unique_fd mInotifyFd;
+    android::base::unique_fd mStopFd;
+    std::thread mThread;
+    std::atomic<bool> mStopping = false;
+    int mParentWatch = -1;
+    std::unordered_map<int, std::string> mWatches;  // Watched directories, by descriptor.
+
+    std::mutex mMutex;
+    std::unordered_map<std::string, PresignedFile> mPresigned;
+};
+
+// Enables fs-verity on all files in |path|, reusing what |presigner| (which must have been
+// stopped) computed for them.
+android::base::Result<DigestMap> addFilesToVerityRecursive(const std::string& path,
+                                                           const SigningKey& key,
+                                                           VerityPresigner* presigner = nullptr);
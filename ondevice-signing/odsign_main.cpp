@@ -14,15 +14,20 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <filesystem>
-#include <fstream>
-#include <iomanip>
+#include <future>
 #include <iostream>
-#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -32,7 +37,9 @@
 #include <odrefresh/odrefresh.h>
 
 #include "CertUtils.h"
+#include "HexUtils.h"
 #include "KeystoreKey.h"
+#include "OdsignStats.h"
 #include "VerityUtils.h"
 
 #include "odsign_info.pb.h"
@@ -66,6 +73,15 @@ static const char* kOdsignVerificationStatusError = "0";
 
 static const char* kStopServiceProp = "ctl.stop";
 
+// Number of threads used to compute artifact digests on devices without fs-verity;
+// defaults to the number of CPUs. Either way it is at most kMaxDigestThreads.
+static const char* kOdsignDigestThreadsProp = "ro.odsign.digest_threads";
+static constexpr size_t kMaxDigestThreads = 16;
+
+// If set on a device without fs-verity, artifacts are hashed while the signing key is
+// being initialized, instead of after odrefresh has run.
+static const char* kOdsignPrescanProp = "ro.odsign.prescan_artifacts";
+
 Result<void> verifyExistingCert(const SigningKey& key) {
     if (access(kSigningKeyCert.c_str(), F_OK) < 0) {
         return ErrnoError() << "Key certificate not found: " << kSigningKeyCert;
@@ -107,28 +123,33 @@ art::odrefresh::ExitCode compileArtifacts(bool force) {
     return static_cast<art::odrefresh::ExitCode>(exit_code);
 }
 
-static std::string toHex(const std::vector<uint8_t>& digest) {
-    std::stringstream ss;
-    for (auto it = digest.begin(); it != digest.end(); ++it) {
-        ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<unsigned>(*it);
-    }
-    return ss.str();
+static size_t getDigestThreadCount(size_t numFiles) {
+    unsigned int defaultThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Larger values are clamped to the cap, rather than falling back to the default as
+    // GetUintProperty() would do with the cap as its maximum.
+    size_t threads = android::base::GetUintProperty<size_t>(kOdsignDigestThreadsProp,
+                                                            defaultThreads);
+    threads = std::min(threads, kMaxDigestThreads);
+    return std::clamp<size_t>(threads, 1, std::max<size_t>(numFiles, 1));
 }
 
-Result<std::map<std::string, std::string>> computeDigests(const std::string& path) {
+// Computes the digests of all files in path, spread over a number of worker
+// threads.
+//
+// Without fs-verity, hashing the contents is the only integrity check the
+// artifacts get, so every file is always hashed in full. Stat information such as
+// inode, size and timestamps is no proof that the contents are unchanged: anyone
+// with root or offline access to /data can rewrite a file and restore it.
+Result<DigestMap> computeDigests(const std::string& path) {
     std::error_code ec;
-    std::map<std::string, std::string> digests;
+    std::vector<std::string> files;
 
     auto it = std::filesystem::recursive_directory_iterator(path, ec);
     auto end = std::filesystem::recursive_directory_iterator();
 
     while (!ec && it != end) {
         if (it->is_regular_file()) {
-            auto digest = createDigest(it->path());
-            if (!digest.ok()) {
-                return Error() << "Failed to compute digest for " << it->path();
-            }
-            digests[it->path()] = toHex(*digest);
+            files.push_back(it->path());
         }
         ++it;
     }
@@ -136,18 +157,51 @@ Result<std::map<std::string, std::string>> computeDigests(const std::string& pat
         return Error() << "Failed to iterate " << path << ": " << ec;
     }
 
+    std::vector<std::optional<Result<FsVerityDigest>>> results(files.size());
+    std::atomic<size_t> nextFile = 0;
+    std::atomic<bool> aborted = false;
+    auto digestLoop = [&]() {
+        for (size_t index = nextFile++; index < files.size() && !aborted; index = nextFile++) {
+            results[index] = createDigest(files[index]);
+            if (!results[index]->ok()) {
+                aborted = true;
+            }
+        }
+    };
+
+    // The calling thread runs one of the digest loops itself.
+    const size_t numThreads = getDigestThreadCount(files.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++) {
+        threads.emplace_back(digestLoop);
+    }
+    digestLoop();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        if (results[i] && !results[i]->ok()) {
+            return Error() << "Failed to compute digest for " << files[i];
+        }
+    }
+
+    DigestMap digests;
+    digests.reserve(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        digests[files[i]] = results[i]->value();
+    }
+
     return digests;
 }
 
-Result<void> verifyDigests(const std::map<std::string, std::string>& digests,
-                           const std::map<std::string, std::string>& trusted_digests) {
-    for (const auto& path_digest : digests) {
-        auto path = path_digest.first;
-        auto digest = path_digest.second;
-        if ((trusted_digests.count(path) == 0)) {
+Result<void> verifyDigests(const DigestMap& digests, const DigestMap& trusted_digests) {
+    for (const auto& [path, digest] : digests) {
+        auto trusted_digest = trusted_digests.find(path);
+        if (trusted_digest == trusted_digests.end()) {
             return Error() << "Couldn't find digest for " << path;
         }
-        if (trusted_digests.at(path) != digest) {
+        if (trusted_digest->second != digest) {
             return Error() << "Digest mismatch for " << path;
         }
     }
@@ -159,18 +213,36 @@ Result<void> verifyDigests(const std::map<std::string, std::string>& digests,
     return {};
 }
 
-Result<void> verifyIntegrityFsVerity(const std::map<std::string, std::string>& trusted_digests) {
-    // Just verify that the files are in verity, and get their digests
-    auto result = verifyAllFilesInVerity(kArtArtifactsDir);
+Result<void> verifyIntegrityFsVerity(const DigestMap& trusted_digests) {
+    // Verify that the files are in verity, checking each digest as soon as it is measured
+    auto result = verifyAllFilesInVerity(kArtArtifactsDir, trusted_digests);
     if (!result.ok()) {
         return result.error();
     }
 
-    return verifyDigests(*result, trusted_digests);
+    if (trusted_digests.size() > 0) {
+        LOG(INFO) << "All root hashes match.";
+    }
+    return {};
 }
 
-Result<void> verifyIntegrityNoFsVerity(const std::map<std::string, std::string>& trusted_digests) {
-    // On these devices, just compute the digests, and verify they match the ones we trust
+namespace {
+// The state of the artifacts, taken before the signing key was available.
+struct ArtifactPrescan {
+    // The contents of kOdsignInfo, read before the scan.
+    std::string odsignInfo;
+    DigestMap digests;
+};
+}  // namespace
+
+Result<void> verifyIntegrityNoFsVerity(const DigestMap& trusted_digests,
+                                       const ArtifactPrescan* prescan) {
+    // On these devices, just compute the digests, and verify they match the ones we trust.
+    // A prescan already hashed every file in full during this boot, so its digests are used
+    // as they are.
+    if (prescan != nullptr) {
+        return verifyDigests(prescan->digests, trusted_digests);
+    }
     auto result = computeDigests(kArtArtifactsDir);
     if (!result.ok()) {
         return result.error();
@@ -179,7 +251,9 @@ Result<void> verifyIntegrityNoFsVerity(const std::map<std::string, std::string>&
     return verifyDigests(*result, trusted_digests);
 }
 
-Result<OdsignInfo> getOdsignInfo(const SigningKey& key) {
+// If preloadedInfo is set, it is used as the contents of kOdsignInfo instead of
+// reading the file again.
+Result<OdsignInfo> getOdsignInfo(const SigningKey& key, const std::string* preloadedInfo) {
     std::string persistedSignature;
     OdsignInfo odsignInfo;
 
@@ -187,25 +261,23 @@ Result<OdsignInfo> getOdsignInfo(const SigningKey& key) {
         return ErrnoError() << "Failed to read " << kOdsignInfoSignature;
     }
 
-    std::fstream odsign_info(kOdsignInfo, std::ios::in | std::ios::binary);
-    if (!odsign_info) {
-        return Error() << "Failed to open " << kOdsignInfo;
+    // Read the file just once; the signature is verified over, and the
+    // protobuf parsed from, the same buffer
+    std::string odsign_info_str;
+    if (preloadedInfo != nullptr) {
+        odsign_info_str = *preloadedInfo;
+    } else if (!android::base::ReadFileToString(kOdsignInfo, &odsign_info_str)) {
+        return ErrnoError() << "Failed to read " << kOdsignInfo;
     }
-    odsign_info.seekg(0);
-    // Verify the hash
-    std::string odsign_info_str((std::istreambuf_iterator<char>(odsign_info)),
-                                std::istreambuf_iterator<char>());
 
-    auto publicKey = key.getPublicKey();
-    auto signResult = verifySignature(odsign_info_str, persistedSignature, *publicKey);
+    auto signResult = key.verify(odsign_info_str, persistedSignature);
     if (!signResult.ok()) {
         return Error() << kOdsignInfoSignature << " does not match.";
     } else {
         LOG(INFO) << kOdsignInfoSignature << " matches.";
     }
 
-    odsign_info.seekg(0);
-    if (!odsignInfo.ParseFromIstream(&odsign_info)) {
+    if (!odsignInfo.ParseFromString(odsign_info_str)) {
         return Error() << "Failed to parse " << kOdsignInfo;
     }
 
@@ -213,23 +285,37 @@ Result<OdsignInfo> getOdsignInfo(const SigningKey& key) {
     return odsignInfo;
 }
 
-Result<void> persistDigests(const std::map<std::string, std::string>& digests,
-                            const SigningKey& key) {
+// Loads the hex digests of a verified OdsignInfo into a DigestMap.
+static Result<DigestMap> getTrustedDigests(const OdsignInfo& odsignInfo) {
+    DigestMap digests;
+    digests.reserve(odsignInfo.file_hashes().size());
+    for (const auto& [path, hexDigest] : odsignInfo.file_hashes()) {
+        auto digest = fromHex(hexDigest);
+        if (!digest.ok() || digest->size() != kFsVerityDigestSize) {
+            return Error() << "Invalid digest for " << path << " in " << kOdsignInfo;
+        }
+        std::copy(digest->begin(), digest->end(), digests[path].begin());
+    }
+    return digests;
+}
+
+Result<void> persistDigests(const DigestMap& digests, const SigningKey& key) {
     OdsignInfo signInfo;
-    google::protobuf::Map<std::string, std::string> proto_hashes(digests.begin(), digests.end());
+    // The digests are persisted as hex strings, for compatibility with earlier versions
     auto map = signInfo.mutable_file_hashes();
-    *map = proto_hashes;
+    for (const auto& [path, digest] : digests) {
+        (*map)[path] = toHex(digest);
+    }
 
-    std::fstream odsign_info(kOdsignInfo,
-                             std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
-    if (!signInfo.SerializeToOstream(&odsign_info)) {
-        return Error() << "Failed to persist root hashes in " << kOdsignInfo;
+    std::string odsign_info_str;
+    if (!signInfo.SerializeToString(&odsign_info_str)) {
+        return Error() << "Failed to serialize root hashes for " << kOdsignInfo;
+    }
+    if (!android::base::WriteStringToFile(odsign_info_str, kOdsignInfo)) {
+        return ErrnoError() << "Failed to persist root hashes in " << kOdsignInfo;
     }
 
     // Sign the signatures with our key itself, and write that to storage
-    odsign_info.seekg(0, std::ios::beg);
-    std::string odsign_info_str((std::istreambuf_iterator<char>(odsign_info)),
-                                std::istreambuf_iterator<char>());
     auto signResult = key.sign(odsign_info_str);
     if (!signResult.ok()) {
         return Error() << "Failed to sign " << kOdsignInfo;
@@ -238,6 +324,25 @@ Result<void> persistDigests(const std::map<std::string, std::string>& digests,
     return {};
 }
 
+// Hashes the artifacts without the signing key, so that the I/O can overlap key
+// initialization. Every file is hashed in full, and nothing here is trusted yet: the
+// scan only counts once verifyArtifacts() has checked the signature over the very
+// kOdsignInfo bytes read here.
+static Result<ArtifactPrescan> prescanArtifacts() {
+    ScopedOdsignPhase phase("prescan");
+    ArtifactPrescan prescan;
+    if (!android::base::ReadFileToString(kOdsignInfo, &prescan.odsignInfo)) {
+        return ErrnoError() << "Failed to read " << kOdsignInfo;
+    }
+
+    auto digests = computeDigests(kArtArtifactsDir);
+    if (!digests.ok()) {
+        return digests.error();
+    }
+    prescan.digests = std::move(*digests);
+    return prescan;
+}
+
 static int removeArtifacts() {
     std::error_code ec;
     auto num_removed = std::filesystem::remove_all(kArtArtifactsDir, ec);
@@ -252,8 +357,9 @@ static int removeArtifacts() {
     }
 }
 
-static Result<void> verifyArtifacts(const SigningKey& key, bool supportsFsVerity) {
-    auto signInfo = getOdsignInfo(key);
+static Result<void> verifyArtifacts(const SigningKey& key, bool supportsFsVerity,
+                                    const ArtifactPrescan* prescan) {
+    auto signInfo = getOdsignInfo(key, prescan != nullptr ? &prescan->odsignInfo : nullptr);
     // Tell init we're done with the key; this is a boot time optimization
     // in particular for the no fs-verity case, where we need to do a
     // costly verification. If the files haven't been tampered with, which
@@ -267,14 +373,16 @@ static Result<void> verifyArtifacts(const SigningKey& key, bool supportsFsVerity
     if (!signInfo.ok()) {
         return Error() << signInfo.error().message();
     }
-    std::map<std::string, std::string> trusted_digests(signInfo->file_hashes().begin(),
-                                                       signInfo->file_hashes().end());
+    auto trusted_digests = getTrustedDigests(*signInfo);
+    if (!trusted_digests.ok()) {
+        return Error() << trusted_digests.error().message();
+    }
     Result<void> integrityStatus;
 
     if (supportsFsVerity) {
-        integrityStatus = verifyIntegrityFsVerity(trusted_digests);
+        integrityStatus = verifyIntegrityFsVerity(*trusted_digests);
     } else {
-        integrityStatus = verifyIntegrityNoFsVerity(trusted_digests);
+        integrityStatus = verifyIntegrityNoFsVerity(*trusted_digests, prescan);
     }
     if (!integrityStatus.ok()) {
         return Error() << integrityStatus.error().message();
@@ -284,6 +392,8 @@ static Result<void> verifyArtifacts(const SigningKey& key, bool supportsFsVerity
 }
 
 int main(int /* argc */, char** /* argv */) {
+    // Declared first, so the summary is logged after everything else on the way out
+    auto stats_guard = android::base::make_scope_guard([]() { logOdsignStats(); });
     auto errorScopeGuard = []() {
         // In case we hit any error, remove the artifacts and tell Zygote not to use anything
         removeArtifacts();
@@ -302,19 +412,32 @@ int main(int /* argc */, char** /* argv */) {
         return 0;
     }
 
-    auto keystoreResult = KeystoreKey::getInstance();
+    bool supportsFsVerity = access(kFsVerityProcPath, F_OK) == 0;
+    if (!supportsFsVerity) {
+        LOG(INFO) << "Device doesn't support fsverity. Falling back to full verification.";
+    }
+
+    // Key initialization waits on keystore and the TEE, while verification without fs-verity
+    // waits on storage; optionally let the two overlap. Declared after scope_guard, so any
+    // early return waits for the scan before the artifacts are removed.
+    std::future<Result<ArtifactPrescan>> prescan;
+    if (!supportsFsVerity && android::base::GetBoolProperty(kOdsignPrescanProp, false)) {
+        prescan = std::async(std::launch::async, prescanArtifacts);
+    }
+
+    Result<SigningKey*> keystoreResult;
+    {
+        ScopedOdsignPhase phase("key_init");
+        keystoreResult = KeystoreKey::getInstance();
+    }
     if (!keystoreResult.ok()) {
         LOG(ERROR) << "Could not create keystore key: " << keystoreResult.error().message();
         return -1;
     }
     SigningKey* key = keystoreResult.value();
 
-    bool supportsFsVerity = access(kFsVerityProcPath, F_OK) == 0;
-    if (!supportsFsVerity) {
-        LOG(INFO) << "Device doesn't support fsverity. Falling back to full verification.";
-    }
-
     if (supportsFsVerity) {
+        ScopedOdsignPhase phase("verify_cert");
         auto existing_cert = verifyExistingCert(*key);
         if (!existing_cert.ok()) {
             LOG(WARNING) << existing_cert.error().message();
@@ -337,7 +460,25 @@ int main(int /* argc */, char** /* argv */) {
         }
     }
 
-    art::odrefresh::ExitCode odrefresh_status = compileArtifacts(kForceCompilation);
+    // Artifacts that odrefresh writes are digested and signed while it compiles the rest.
+    std::unique_ptr<VerityPresigner> presigner;
+    if (supportsFsVerity) {
+        presigner = std::make_unique<VerityPresigner>(kArtArtifactsDir, *key);
+        auto presignerStatus = presigner->start();
+        if (!presignerStatus.ok()) {
+            LOG(WARNING) << "Not presigning artifacts: " << presignerStatus.error().message();
+            presigner.reset();
+        }
+    }
+
+    art::odrefresh::ExitCode odrefresh_status;
+    {
+        ScopedOdsignPhase phase("compile");
+        odrefresh_status = compileArtifacts(kForceCompilation);
+    }
+    if (presigner) {
+        presigner->stop();
+    }
     if (odrefresh_status == art::odrefresh::ExitCode::kOkay) {
         LOG(INFO) << "odrefresh said artifacts are VALID";
         // A post-condition of validating artifacts is that if the ones on /system
@@ -347,7 +488,19 @@ int main(int /* argc */, char** /* argv */) {
         // If we receive any error other than ENOENT, be suspicious
         bool artifactsPresent = (err == 0) || (err < 0 && errno != ENOENT);
         if (artifactsPresent) {
-            auto verificationResult = verifyArtifacts(*key, supportsFsVerity);
+            ScopedOdsignPhase phase("verify");
+            std::optional<Result<ArtifactPrescan>> prescanResult;
+            const ArtifactPrescan* prescanned = nullptr;
+            if (prescan.valid()) {
+                prescanResult = prescan.get();
+                if (prescanResult->ok()) {
+                    prescanned = &prescanResult->value();
+                } else {
+                    LOG(WARNING) << "Not using artifact prescan: "
+                                 << prescanResult->error().message();
+                }
+            }
+            auto verificationResult = verifyArtifacts(*key, supportsFsVerity, prescanned);
             if (!verificationResult.ok()) {
                 LOG(ERROR) << verificationResult.error().message();
                 return -1;
@@ -358,10 +511,12 @@ int main(int /* argc */, char** /* argv */) {
         const bool compiled_all = odrefresh_status == art::odrefresh::ExitCode::kCompilationSuccess;
         LOG(INFO) << "odrefresh compiled " << (compiled_all ? "all" : "partial")
                   << " artifacts, returned " << odrefresh_status;
-        Result<std::map<std::string, std::string>> digests;
+        Result<DigestMap> digests;
         if (supportsFsVerity) {
-            digests = addFilesToVerityRecursive(kArtArtifactsDir, *key);
+            ScopedOdsignPhase phase("enable_verity");
+            digests = addFilesToVerityRecursive(kArtArtifactsDir, *key, presigner.get());
         } else {
+            ScopedOdsignPhase phase("compute_digests");
             // If we can't use verity, just compute the root hashes and store
             // those, so we can reverify them at the next boot.
             digests = computeDigests(kArtArtifactsDir);
@@ -370,7 +525,11 @@ int main(int /* argc */, char** /* argv */) {
             LOG(ERROR) << digests.error().message();
             return -1;
         }
-        auto persistStatus = persistDigests(*digests, *key);
+        Result<void> persistStatus;
+        {
+            ScopedOdsignPhase phase("persist");
+            persistStatus = persistDigests(*digests, *key);
+        }
         if (!persistStatus.ok()) {
             LOG(ERROR) << persistStatus.error().message();
             return -1;
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "HexUtils.h"
+
+// The stringstream based implementation odsign used before HexUtils.
+static std::string toHexStringstream(const std::vector<uint8_t>& digest) {
+    std::stringstream ss;
+    for (auto it = digest.begin(); it != digest.end(); ++it) {
+        ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<unsigned>(*it);
+    }
+    return ss.str();
+}
+
+static std::vector<uint8_t> makeDigest(size_t size) {
+    std::vector<uint8_t> digest(size);
+    for (size_t i = 0; i < size; i++) {
+        digest[i] = static_cast<uint8_t>(i * 37 + 11);
+    }
+    return digest;
+}
+
+static void BM_ToHexStringstream(benchmark::State& state) {
+    auto digest = makeDigest(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(toHexStringstream(digest));
+    }
+}
+BENCHMARK(BM_ToHexStringstream)->Arg(32)->Arg(64);
+
+static void BM_ToHex(benchmark::State& state) {
+    auto digest = makeDigest(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(toHex(digest));
+    }
+}
+BENCHMARK(BM_ToHex)->Arg(32)->Arg(64);
+
+static void BM_FromHex(benchmark::State& state) {
+    auto hex = toHex(makeDigest(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fromHex(hex));
+    }
+}
+BENCHMARK(BM_FromHex)->Arg(32)->Arg(64);
+
+BENCHMARK_MAIN();
@@ -14,7 +14,12 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <aidl/android/hardware/security/keymint/IRemotelyProvisionedComponent.h>
@@ -22,6 +27,7 @@
 #include <cppbor.h>
 #include <gflags/gflags.h>
 #include <keymaster/cppcose/cppcose.h>
+#include <openssl/base64.h>
 #include <remote_prov/remote_prov_utils.h>
 #include <sys/random.h>
 
@@ -40,6 +46,13 @@ DEFINE_bool(test_mode, false, "If enabled, a fake EEK key/cert are used.");
 
 DEFINE_string(output_format, "csr", "How to format the output. Defaults to 'csr'.");
 
+DEFINE_bool(print_timing, false, "If enabled, the time taken by each phase is printed to stderr.");
+
+DEFINE_int32(csrs_per_instance, 1,
+             "Number of CSRs to generate per instance, each with its own challenge. If more than "
+             "one, each CSR is written as soon as it is generated, as one line: base64 for 'csr' "
+             "output, JSON for 'build+csr' output.");
+
 namespace {
 
 // Various supported --output_format values.
@@ -103,6 +116,36 @@ std::vector<uint8_t> getEekChain() {
     return getProdEekChain();
 }
 
+void exitWithInvalidOutputFormat() {
+    std::cerr << "Unexpected output_format '" << FLAGS_output_format << "'" << std::endl;
+    std::cerr << "Valid formats:" << std::endl;
+    std::cerr << "  " << kBinaryCsrOutput << std::endl;
+    std::cerr << "  " << kBuildPlusCsr << std::endl;
+    exit(1);
+}
+
+// Writes |csr| as one line of batch output. main() has already checked the output format.
+void writeBatchRecord(const Array& csr) {
+    if (FLAGS_output_format == kBinaryCsrOutput) {
+        auto bytes = csr.encode();
+        std::string base64(4 * ((bytes.size() + 2) / 3) + 1, '\0');
+        size_t len = EVP_EncodeBlock(reinterpret_cast<uint8_t*>(base64.data()), bytes.data(),
+                                     bytes.size());
+        base64.resize(len);
+        std::cout << base64 << '\n';
+    } else {
+        auto [json, error] = jsonEncodeCsrWithBuild(csr);
+        if (!error.empty()) {
+            std::cerr << "Error JSON encoding the output: " << error;
+            exit(1);
+        }
+        // Line breaks can only be whitespace between JSON tokens.
+        json.erase(std::remove(json.begin(), json.end(), '\n'), json.end());
+        std::cout << json << '\n';
+    }
+    std::cout.flush();
+}
+
 void writeOutput(const Array& csr) {
     if (FLAGS_output_format == kBinaryCsrOutput) {
         auto bytes = csr.encode();
@@ -115,20 +158,36 @@ void writeOutput(const Array& csr) {
         }
         std::cout << json << std::endl;
     } else {
-        std::cerr << "Unexpected output_format '" << FLAGS_output_format << "'" << std::endl;
-        std::cerr << "Valid formats:" << std::endl;
-        std::cerr << "  " << kBinaryCsrOutput << std::endl;
-        std::cerr << "  " << kBuildPlusCsr << std::endl;
-        exit(1);
+        exitWithInvalidOutputFormat();
     }
 }
 
-// Callback for AServiceManager_forEachDeclaredInstance that writes out a CSR
-// for every IRemotelyProvisionedComponent.
-void getCsrForInstance(const char* name, void* /*context*/) {
-    const std::vector<uint8_t> challenge = generateChallenge();
+using Clock = std::chrono::steady_clock;
+
+double elapsedMs(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+struct InstanceCsr {
+    std::string name;
+    std::vector<Array> csrs;  // Unless they are written as they are generated.
+    size_t numCsrs = 0;
+    bool failed = false;
+    double halMs = 0;
+    double composeMs = 0;
+};
+
+// Callback for AServiceManager_forEachDeclaredInstance that collects the
+// names of all IRemotelyProvisionedComponent instances.
+void addInstanceName(const char* name, void* context) {
+    static_cast<std::vector<std::string>*>(context)->push_back(name);
+}
 
-    auto fullName = std::string(IRemotelyProvisionedComponent::descriptor) + "/" + name;
+// Gets |count| CSRs from the given IRemotelyProvisionedComponent instance, over one connection.
+// Each is passed to |onCsr| if set, or kept in |result| otherwise.
+void getCsrsForInstance(const std::vector<uint8_t>& eekChain, int count,
+                        const std::function<void(const Array&)>& onCsr, InstanceCsr* result) {
+    auto fullName = std::string(IRemotelyProvisionedComponent::descriptor) + "/" + result->name;
     AIBinder* rkpAiBinder = AServiceManager_getService(fullName.c_str());
     ::ndk::SpAIBinder rkp_binder(rkpAiBinder);
     auto rkp_service = IRemotelyProvisionedComponent::fromBinder(rkp_binder);
@@ -137,30 +196,99 @@ void getCsrForInstance(const char* name, void* /*context*/) {
         return;
     }
 
-    std::vector<uint8_t> keysToSignMac;
     std::vector<MacedPublicKey> emptyKeys;
-    DeviceInfo verifiedDeviceInfo;
-    ProtectedData protectedData;
-    ::ndk::ScopedAStatus status = rkp_service->generateCertificateRequest(
-        FLAGS_test_mode, emptyKeys, getEekChain(), challenge, &verifiedDeviceInfo, &protectedData,
-        &keysToSignMac);
-    if (!status.isOk()) {
-        std::cerr << "Bundle extraction failed for '" << fullName
-                  << "'. Error code: " << status.getServiceSpecificError() << "." << std::endl;
-        exit(-1);
+    for (int i = 0; i < count; i++) {
+        const std::vector<uint8_t> challenge = generateChallenge();
+        std::vector<uint8_t> keysToSignMac;
+        DeviceInfo verifiedDeviceInfo;
+        ProtectedData protectedData;
+        auto halStart = Clock::now();
+        ::ndk::ScopedAStatus status = rkp_service->generateCertificateRequest(
+            FLAGS_test_mode, emptyKeys, eekChain, challenge, &verifiedDeviceInfo, &protectedData,
+            &keysToSignMac);
+        auto halEnd = Clock::now();
+        result->halMs += elapsedMs(halStart, halEnd);
+        if (!status.isOk()) {
+            std::cerr << "Bundle extraction failed for '" << fullName
+                      << "'. Error code: " << status.getServiceSpecificError() << "." << std::endl;
+            result->failed = true;
+            return;
+        }
+        auto csr =
+            composeCertificateRequest(protectedData, verifiedDeviceInfo, challenge, keysToSignMac);
+        result->composeMs += elapsedMs(halEnd, Clock::now());
+        if (onCsr) {
+            onCsr(csr);
+        } else {
+            result->csrs.push_back(std::move(csr));
+        }
+        result->numCsrs++;
     }
-    auto request =
-        composeCertificateRequest(protectedData, verifiedDeviceInfo, challenge, keysToSignMac);
-    writeOutput(request);
 }
 
 }  // namespace
 
 int main(int argc, char** argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
+    auto start = Clock::now();
+
+    std::vector<std::string> names;
+    AServiceManager_forEachDeclaredInstance(IRemotelyProvisionedComponent::descriptor, &names,
+                                            addInstanceName);
+
+    // The EEK chain is the same for all instances.
+    auto eekStart = Clock::now();
+    const std::vector<uint8_t> eekChain = getEekChain();
+    auto eekEnd = Clock::now();
+
+    if (FLAGS_csrs_per_instance < 1) {
+        std::cerr << "--csrs_per_instance must be at least 1" << std::endl;
+        exit(1);
+    }
+    if (FLAGS_output_format != kBinaryCsrOutput && FLAGS_output_format != kBuildPlusCsr) {
+        exitWithInvalidOutputFormat();
+    }
+    const bool batchMode = FLAGS_csrs_per_instance > 1;
+    std::mutex outputMutex;
+    std::function<void(const Array&)> writeRecord;
+    if (batchMode) {
+        writeRecord = [&](const Array& csr) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            writeBatchRecord(csr);
+        };
+    }
 
-    AServiceManager_forEachDeclaredInstance(IRemotelyProvisionedComponent::descriptor,
-                                            /*context=*/nullptr, getCsrForInstance);
+    // Each instance is typically backed by different hardware, so ask them all at once.
+    std::vector<InstanceCsr> results(names.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < names.size(); i++) {
+        results[i].name = names[i];
+        threads.emplace_back(getCsrsForInstance, std::cref(eekChain), FLAGS_csrs_per_instance,
+                             std::cref(writeRecord), &results[i]);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Output in instance order, as before.
+    for (const auto& result : results) {
+        if (result.failed) {
+            exit(-1);
+        }
+        for (const auto& csr : result.csrs) {
+            writeOutput(csr);
+        }
+    }
+
+    if (FLAGS_print_timing) {
+        std::cerr << "EEK chain: " << elapsedMs(eekStart, eekEnd) << " ms" << std::endl;
+        for (const auto& result : results) {
+            std::cerr << result.name << ": " << result.numCsrs
+                      << " CSRs, generateCertificateRequest " << result.halMs << " ms, compose "
+                      << result.composeMs << " ms" << std::endl;
+        }
+        std::cerr << "Total: " << elapsedMs(start, Clock::now()) << " ms" << std::endl;
+    }
 
     return 0;
 }